@@ -1,13 +1,30 @@
 /**
  * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
  *
- * Description: A client appiication that can add, retrieve
- * records from a remote database server.
+ * Description: A client appiication that can add, retrieve and
+ * change records in a remote database server.
  *
- * Usage: tcp-project1 hostname port
+ * Usage: tcp-project1 [-d ms] [-R host:port ...] [-H percentile]
+ *                     [-b percent] [-z] hostname port
+ *        tcp-project1 [-d ms] [-R host:port ...] [-z] -U path
+ *        tcp-project1 -r [-z] -U path
  *
  * Where 'hostname' is the name of the remote host on which
  * the server is running and 'port' is the port number it is using.
+ * A server on this host may be reached through its unix socket at
+ * 'path' instead, and with -r the client then talks to it through
+ * shared memory, see ring.h.
+ *
+ * With -d no add or retrieve waits more than 'ms' milliseconds for its
+ * answer. Each -R names a replica holding the same records, and a
+ * retrieve the server is slow to answer is then hedged: once it has
+ * waited longer than the given percentile of recent retrieves took, a
+ * copy goes to a replica and whichever answers first is taken. Hedges
+ * are held to the given percent of retrieves, plus a short burst.
+ *
+ * With -z the server is asked to pack the records following batch
+ * headers, see pack.h, for less to cross the network on batches,
+ * queries and subscriptions.
  */
 
 // Stream stdout/stderr IO
@@ -20,6 +37,9 @@
 	using std::string;
 #include <string>
   using std::string;
+#include <vector>
+  using std::vector;
+#include <algorithm>
 
 // Utilities, IO and Error checking
 #include <stdio.h>
@@ -28,15 +48,82 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> // for bzero(..)
+#include <time.h>
 
 // Networking and sockets
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <fcntl.h>
 
 // Project specific header
 #include "common.h"
+#include "pack.h"
+#include "ring.h"
+
+// The shared memory channel requests go through, NULL for the socket
+channel_t* channel = NULL;
+
+// Retrieves hedged by default, the percentile of recent latencies
+// waited for before hedging and the percent of extra requests allowed
+#define DEFAULT_HEDGE_PERCENTILE 95
+#define DEFAULT_HEDGE_BUDGET 5
+
+// Microseconds waited before hedging until enough retrieves are timed
+#define DEFAULT_HEDGE_DELAY 10000
+
+// Recent latencies kept, and how many are needed to trust them
+#define HEDGE_SAMPLES 128
+#define HEDGE_WARMUP 16
+
+// Hedges which may be made at once on credit saved up beforehand
+#define HEDGE_BURST 10
+
+/**
+ * A server requests may be sent to, reconnected to as needed.
+ */
+typedef struct
+{
+  char* hostname;   // NULL for a server reached through its unix socket
+  char* path;
+  int port;
+  int sock;         // -1 while there is no connection
+  bool packed;      // Whether the connection's batches are packed
+} server_t;
+
+// The server the menu talks to, followed by any replicas
+vector< server_t > servers;
+
+// Milliseconds an add or retrieve waits for its answer, 0 for ever
+int deadline = 0;
+
+// Whether to ask servers to pack batches
+bool packing = false;
+
+/**
+ * What hedging retrieves has cost and bought.
+ */
+typedef struct
+{
+  int percentile;
+  int budget;
+  int credit;           // Hundredths of a hedge, earned by each retrieve
+  size_t nextReplica;
+  long samples[ HEDGE_SAMPLES ];
+  unsigned long sampled;
+
+  unsigned long retrieves;
+  unsigned long hedged;
+  unsigned long won;          // Hedges answered before the first copy
+  unsigned long abandoned;    // Requests given up on, late or beaten
+  unsigned long timedOut;
+} hedging_t;
+
+hedging_t hedging;
 
 /**
  * Setup the connection to the server and return the sockets file descriptor.
@@ -44,7 +131,8 @@
  * @param[in] hostname - The hostname to use when connecting.
  * @param[in] port - The port number to use when connecting.
  *
- * @return A file descriptor to the setup and connected socket.
+ * @return A file descriptor to the setup and connected socket, or -1
+ * if it could not be connected.
  */
 int setupSocket( char* hostname, int port )
 {
@@ -53,7 +141,7 @@ int setupSocket( char* hostname, int port )
   if ( sock < 0 )
   {
     cerr << "socket: " << strerror( errno ) << endl;
-    exit( EXIT_FAILURE );
+    return -1;
   }
 
   // Resolve the host-name to an address
@@ -61,7 +149,8 @@ int setupSocket( char* hostname, int port )
   if ( NULL == hostent )
   {
     cerr << "gethostbyname: error code " << h_errno << endl;
-    exit( EXIT_FAILURE );
+    close( sock );
+    return -1;
   }
 
   // Setup socket address struct
@@ -75,176 +164,1375 @@ int setupSocket( char* hostname, int port )
   if ( connect( sock, (struct sockaddr*)&address, sizeof( address ) ) < 0 )
   {
     cerr << "connect: " << strerror( errno ) << endl;
-    exit( EXIT_FAILURE );
+    close( sock );
+    return -1;
   }
 
   return sock;
 }
 
 /**
- * Print the usage statement for the client application.
+ * Connect to a server through its unix socket.
  *
- * @param[in] binary - The name of the binary being executed.
+ * @param[in] path - Where the server's socket lives.
+ *
+ * @return A file descriptor to the connected socket, or -1 if it could
+ * not be connected.
  */
-void usage( char* binary )
+int setupLocalSocket( char* path )
 {
-  cerr << "Usage: " << binary << " hostname port " << endl;
+  int sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( sock < 0 )
+  {
+    cerr << "socket: " << strerror( errno ) << endl;
+    return -1;
+  }
+
+  struct sockaddr_un address;
+  bzero( &address, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  strncpy( address.sun_path, path, sizeof( address.sun_path ) - 1 );
+
+  if ( connect( sock, (struct sockaddr*)&address, sizeof( address ) ) < 0 )
+  {
+    cerr << "connect: " << strerror( errno ) << endl;
+    close( sock );
+    return -1;
+  }
+
+  return sock;
 }
 
 /**
- * Attempt to get an integer input from the user.
+ * Send bytes to the server, through the channel if there is one.
  *
- * @param[in] msg - The error message to display on bad input
- * @return the actual value we have received.
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] data - The bytes to send.
+ * @param[in] len - The number of bytes.
  */
-int obtainInt( string msg )
+void transmit( int sock, const char* data, int len )
 {
-  int value = 0;
-  bool valid = false;
-  while ( not valid )
+  if ( NULL != channel )
   {
-    int ret = scanf( "%d", &value );
-    if ( ret == EOF || value == 0 )
-    {
-      cerr << msg;
-    } 
-    else
-    {
-      valid = true;
-    }
+    ringWrite( &channel->requests, data, len, sock );
+  }
+  else
+  {
+    write( sock, data, len );
   }
-  return value; 
 }
 
 /**
- * Attempt to add a new record to the remote database.
+ * Receive whatever bytes the server has sent, waiting for some.
  *
  * @param[in] sock - The socket's file descriptor
+ * @param[out] buffer - Where to place the bytes.
+ * @param[in] len - The most bytes to receive.
+ *
+ * @return The number of bytes received, 0 if the server went away.
  */
-void addRecord( int sock )
+int receive( int sock, char* buffer, int len )
 {
-  record_t newRecord;
-  newRecord.command = add_t;
+  if ( NULL != channel )
+  {
+    return ringRead( &channel->responses, buffer, len, sock );
+  }
+  return read( sock, buffer, len );
+}
 
-  cout << "Enter id (interger):";
-  newRecord.id = obtainInt( "ID should be a non-zero integer):" );
+/**
+ * Read exactly 'len' bytes from the socket.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[out] buffer - Where to place the bytes read.
+ * @param[in] len - The number of bytes to read.
+ *
+ * @return True on success, false if the server went away.
+ */
+bool readFully( int sock, char* buffer, int len )
+{
+  while ( len > 0 )
+  {
+    int got = receive( sock, buffer, len );
+    if ( got <= 0 )
+    {
+      return false;
+    }
+    buffer += got;
+    len -= got;
+  }
+  return true;
+}
 
-  cout << "Enter name (up to 32 char):";
-  scanf( "%32s", newRecord.name );
+/**
+ * Set up a shared memory channel and ask the server to use it, staying
+ * on the socket if it will not.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void attachChannel( int sock )
+{
+  record_t request;
+  bzero( &request, sizeof( request ) );
+  request.command = attach_t;
+  snprintf( request.name, MAX_LEN, "/record-channel-%d", (int)getpid() );
 
-  cout << "Enter age (integer):";
-  newRecord.age = obtainInt( "Age should be a non-zero integer):" );
+  int fd = shm_open( request.name, O_RDWR | O_CREAT | O_EXCL, 0600 );
+  if ( fd < 0 )
+  {
+    cerr << "shm_open: " << strerror( errno ) << endl;
+    return;
+  }
 
-  // Now do the actual writing of the data out to the socket.
-  write( sock, (char*) &newRecord, sizeof(newRecord) );
+  void* mapped = MAP_FAILED;
+  if ( ftruncate( fd, sizeof( channel_t ) ) == 0 )
+  {
+    mapped = mmap( NULL, sizeof( channel_t ), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0 );
+  }
+  close( fd );
 
   record_t resultRec;
   bzero( &resultRec, sizeof( resultRec ) );
+  resultRec.command = RET_FAILURE;
+  if ( MAP_FAILED != mapped )
+  {
+    write( sock, (char*) &request, sizeof(request) );
+    read( sock, (char*) &resultRec, sizeof(resultRec) );
+  }
 
-  read( sock, (char*) &resultRec, sizeof(resultRec.command) );
+  // Once the server has it mapped, or has refused it, no one needs the name
+  shm_unlink( request.name );
 
-  string response;
-  if ( ADD_SUCCESS == resultRec.command )
+  if ( resultRec.command == RET_SUCCESS )
   {
-    response = " added successfully";
+    channel = static_cast<channel_t*>( mapped );
+    cout << "Talking to the server through shared memory" << endl;
   }
   else
   {
-    response = " already exists";
+    if ( MAP_FAILED != mapped )
+    {
+      munmap( mapped, sizeof( channel_t ) );
+    }
+    cout << "Server refused shared memory, using the socket" << endl;
   }
+}
 
-  cout << "ID " << newRecord.id << response << endl;
+/**
+ * @return Microseconds on a clock which never goes back.
+ */
+long nowMicros()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+/**
+ * Connect to a server unless already connected.
+ *
+ * @param[in] server - The server.
+ *
+ * @return The connection's file descriptor, or -1 if there is none.
+ */
+int connectServer( server_t& server )
+{
+  if ( server.sock < 0 )
+  {
+    server.sock = NULL == server.hostname
+                  ? setupLocalSocket( server.path )
+                  : setupSocket( server.hostname, server.port );
+    server.packed = false;
+
+    header_t request;
+    request.command = compress_t;
+    request.length = PACK_LZ;
+
+    header_t response;
+    if ( server.sock >= 0 && packing )
+    {
+      transmit( server.sock, (char*) &request, sizeof(request) );
+      if ( not readFully( server.sock, (char*) &response, sizeof(response) ) )
+      {
+        cerr << "Server would not pack batches" << endl;
+        close( server.sock );
+        server.sock = -1;
+      }
+      else
+      {
+        server.packed = response.command == RET_SUCCESS
+                        and ( response.length & PACK_LZ );
+      }
+    }
+  }
+  return server.sock;
 }
 
+/**
+ * @return True if batches are packed on the connection.
+ */
+bool packedConnection( int sock )
+{
+  for ( size_t i = 0; i < servers.size(); i++ )
+  {
+    if ( servers[i].sock == sock )
+    {
+      return servers[i].packed;
+    }
+  }
+  return false;
+}
 
 /**
- * Attempt to retrieve a record from the remote database.
+ * Read the items following a batch header, unpacking them if the
+ * connection's batches are packed.
  *
  * @param[in] sock - The socket's file descriptor
+ * @param[in] kind - What the items are, see pack.h.
+ * @param[in] count - The number of items, at most MAX_BATCH.
+ * @param[out] items - Room for the items.
+ *
+ * @return True on success, false if the server went away or sent a
+ * block which would not unpack.
  */
-void retrieveRecord( int sock )
+bool readItems( int sock, int kind, int count, void* items )
 {
-  record_t findRecord;
-  bzero( &findRecord, sizeof( findRecord ) );
+  static unsigned char block[ PACK_BOUND( MAX_BATCH * sizeof(change_t) ) ];
+  static unsigned char scratch[ PACK_SCRATCH( MAX_BATCH * sizeof(change_t) ) ];
 
-  findRecord.command = retrieve_t;
-  findRecord.id = 0;
+  size_t bytes = count * packItemSize( kind );
+  if ( not packedConnection( sock ) or 0 == count )
+  {
+    return readFully( sock, (char*) items, bytes );
+  }
 
-  cout << "Enter id (interger):";
-  findRecord.id = obtainInt( "ID should be a non-zero integer):" );
+  int packed = 0;
+  return readFully( sock, (char*) &packed, sizeof(packed) )
+         and packed > 0 and packed <= (int)PACK_BOUND( bytes )
+         and readFully( sock, (char*) block, packed )
+         and unpackBlock( kind, block, packed, items, count, scratch );
+}
 
-  // Now do the actual writing of the data out to the socket.
-  write( sock, (char*) &findRecord, sizeof(findRecord.command) + sizeof(findRecord.id) );
+/**
+ * Give up on the request a server is answering. Without request ids
+ * a late answer would be taken for the next request's, so the
+ * connection goes with it, and is made again when next needed.
+ *
+ * @param[in] server - The server.
+ */
+void abandon( server_t& server )
+{
+  close( server.sock );
+  server.sock = -1;
+  hedging.abandoned++;
+}
 
-  record_t resultRec;
-  bzero( &resultRec, sizeof( resultRec ) );
+/**
+ * @return Microseconds a retrieve waits for its first copy's answer
+ * before hedging, the chosen percentile of recent retrieves.
+ */
+long hedgeDelay()
+{
+  if ( hedging.sampled < HEDGE_WARMUP )
+  {
+    return DEFAULT_HEDGE_DELAY;
+  }
 
-  // Get the result back from the server
-  read( sock, (char*) &resultRec, sizeof(resultRec) );
+  int count = hedging.sampled < HEDGE_SAMPLES ? hedging.sampled
+                                              : HEDGE_SAMPLES;
+  long recent[ HEDGE_SAMPLES ];
+  memcpy( recent, hedging.samples, count * sizeof( long ) );
 
-  // Display our results
-  if ( resultRec.command == RET_SUCCESS )
+  int rank = ( count - 1 ) * hedging.percentile / 100;
+  std::nth_element( recent, recent + rank, recent + count );
+  return recent[ rank ];
+}
+
+/**
+ * Find a replica to hedge with, taking each in turn.
+ *
+ * @return The replica, or NULL if none can be reached.
+ */
+server_t* pickReplica()
+{
+  for ( size_t tried = 1; tried < servers.size(); tried++ )
   {
-    cout << "ID: " << resultRec.id << endl;
-    cout << "Name: " << resultRec.name << endl;
-    cout << "Age: " << resultRec.age << endl;
+    hedging.nextReplica = hedging.nextReplica % ( servers.size() - 1 ) + 1;
+    server_t& replica = servers[ hedging.nextReplica ];
+    if ( connectServer( replica ) >= 0 )
+    {
+      return &replica;
+    }
   }
-  else
+  return NULL;
+}
+
+/**
+ * A copy of a request out on a server.
+ */
+typedef struct
+{
+  server_t* server;
+  record_t result;
+  int received;     // Bytes of the result read so far
+  bool live;        // Still waiting on the answer
+  bool hedge;       // Sent while another copy was still waiting
+} attempt_t;
+
+/**
+ * Send a copy of a request to a server.
+ *
+ * @return True if the server was reached and sent the request.
+ */
+bool sendAttempt( attempt_t& attempt, server_t& server, const char* frame,
+                  int len )
+{
+  if ( connectServer( server ) < 0 )
   {
-    cout << "ID " << findRecord.id << " does not exist" << endl;
+    return false;
+  }
+  if ( write( server.sock, frame, len ) != len )
+  {
+    abandon( server );
+    return false;
   }
-}
 
+  attempt.server = &server;
+  attempt.received = 0;
+  attempt.live = true;
+  attempt.hedge = false;
+  bzero( &attempt.result, sizeof( attempt.result ) );
+  return true;
+}
 
 /**
- * Client main function
+ * Send a request answered by a single record to the server and wait
+ * for the answer, no longer than the deadline. A request which may be
+ * repeated is hedged when there are replicas: if the server has not
+ * answered after the hedging delay, or cannot be reached, a copy goes
+ * to a replica and the first answer wins. The request still waiting
+ * is abandoned.
  *
- * @param[in] argc - The number of arguments passed to the program.
- * @param[in] argv - The arguments passed to the program.
+ * @param[in] frame - The request.
+ * @param[in] len - The bytes of the request.
+ * @param[in] repeatable - Whether the request may be hedged.
+ * @param[out] result - The answer.
+ *
+ * @return True if answered, false if no answer came in time.
  */
-int main( int argc, char** argv )
+bool exchange( const char* frame, int len, bool repeatable,
+               record_t& result )
 {
+  bzero( &result, sizeof( result ) );
+  if ( NULL != channel )
+  {
+    transmit( servers[0].sock, frame, len );
+    return readFully( servers[0].sock, (char*) &result, sizeof(result) );
+  }
 
-  if ( argc != 3 )
-  {	
-    usage( argv[0] );
-    return EXIT_FAILURE;
+  long start = nowMicros();
+  long giveUp = deadline > 0 ? start + deadline * 1000L : 0;
+
+  // Hedge at the percentile, or at once if the server cannot be reached
+  bool hedge = repeatable && servers.size() > 1;
+  if ( hedge )
+  {
+    hedging.retrieves++;
+    hedging.credit += hedging.budget;
+    if ( hedging.credit > HEDGE_BURST * 100 )
+    {
+      hedging.credit = HEDGE_BURST * 100;
+    }
   }
-  else
+
+  attempt_t attempts[ 2 ];
+  int count = 0;
+  int live = 0;
+  if ( sendAttempt( attempts[ count ], servers[0], frame, len ) )
+  {
+    count++;
+    live++;
+  }
+  long hedgeAt = hedge ? start + ( live ? hedgeDelay() : 0 ) : 0;
+
+  bool busy = false;
+  while ( true )
   {
-    char* hostname = argv[HOSTNAME];
-    int port = atoi( argv[PORTNUM] );
+    long now = nowMicros();
 
-    // Validate the given port number
-    if ( port < PORT_MIN or port > PORT_MAX )
+    // A hedge is only paid for when it is not standing in for a failure
+    if ( hedgeAt > 0 && now >= hedgeAt )
     {
-      cerr << port << ": invalid port number" << endl;
-      exit( EXIT_FAILURE );
+      hedgeAt = 0;
+      server_t* replica = 0 == live || hedging.credit >= 100
+                          ? pickReplica() : NULL;
+      if ( NULL != replica
+           && sendAttempt( attempts[ count ], *replica, frame, len ) )
+      {
+        if ( live > 0 )
+        {
+          attempts[ count ].hedge = true;
+          hedging.credit -= 100;
+          hedging.hedged++;
+        }
+        count++;
+        live++;
+      }
     }
-    
-    int sock = setupSocket( hostname, port );
 
-    while ( true )	
+    if ( 0 == live )
+    {
+      break;
+    }
+    if ( giveUp > 0 && now >= giveUp )
     {
+      hedging.timedOut++;
+      for ( int i = 0; i < count; i++ )
+      {
+        if ( attempts[i].live )
+        {
+          abandon( *attempts[i].server );
+        }
+      }
+      return false;
+    }
 
-      cout << "Enter command (" << add_t << " for Add, " << retrieve_t 
-           << " for retrieve, " << quit_t << " to quit):"; 
+    // Wait for an answer, the hedge or the deadline, whichever is first
+    long wakeAt = hedgeAt;
+    if ( giveUp > 0 && ( 0 == wakeAt || giveUp < wakeAt ) )
+    {
+      wakeAt = giveUp;
+    }
 
-      int cmd = 100; 
-      scanf( "%d", &cmd );
-      
-      if ( cmd == add_t )
+    fd_set readable;
+    FD_ZERO( &readable );
+    int highest = -1;
+    for ( int i = 0; i < count; i++ )
+    {
+      if ( attempts[i].live )
       {
-        addRecord( sock );
+        FD_SET( attempts[i].server->sock, &readable );
+        highest = std::max( highest, attempts[i].server->sock );
       }
-      else if ( cmd == retrieve_t )
+    }
+
+    struct timeval wait;
+    wait.tv_sec = ( wakeAt - now ) / 1000000L;
+    wait.tv_usec = ( wakeAt - now ) % 1000000L;
+    if ( select( highest + 1, &readable, NULL, NULL,
+                 0 == wakeAt ? NULL : &wait ) < 0 && errno != EINTR )
+    {
+      cerr << "select: " << strerror( errno ) << endl;
+      break;
+    }
+
+    for ( int i = 0; i < count; i++ )
+    {
+      attempt_t& attempt = attempts[i];
+      if ( not attempt.live
+           || not FD_ISSET( attempt.server->sock, &readable ) )
       {
-        retrieveRecord( sock );
+        continue;
       }
-      else if ( cmd == quit_t )
+
+      int got = read( attempt.server->sock,
+                      (char*) &attempt.result + attempt.received,
+                      sizeof( attempt.result ) - attempt.received );
+      if ( got <= 0 )
       {
-        shutdown( sock, SHUT_RDWR );
-        close( sock );
+        // Gone, so try a replica now rather than at the hedge
+        attempt.live = false;
+        live--;
+        close( attempt.server->sock );
+        attempt.server->sock = -1;
+        if ( hedge && hedgeAt > 0 )
+        {
+          hedgeAt = nowMicros();
+        }
+        continue;
+      }
+
+      attempt.received += got;
+      if ( attempt.received < (int)sizeof( attempt.result ) )
+      {
+        continue;
+      }
+
+      attempt.live = false;
+      live--;
+      result = attempt.result;
+
+      // A busy server's answer only stands if no other is coming
+      if ( SRV_BUSY == result.command && ( live > 0 || hedgeAt > 0 ) )
+      {
+        busy = true;
+        hedgeAt = hedgeAt > 0 ? nowMicros() : 0;
+        continue;
+      }
+
+      if ( hedge )
+      {
+        hedging.samples[ hedging.sampled++ % HEDGE_SAMPLES ]
+          = nowMicros() - start;
+        if ( attempt.hedge )
+        {
+          hedging.won++;
+        }
+      }
+
+      for ( int j = 0; j < count; j++ )
+      {
+        if ( attempts[j].live )
+        {
+          abandon( *attempts[j].server );
+        }
+      }
+      return true;
+    }
+  }
+
+  return busy;
+}
+
+/**
+ * Display what hedging and deadlines have done.
+ */
+void reportHedging()
+{
+  if ( servers.size() > 1 )
+  {
+    cout << "Retrieves " << hedging.retrieves
+         << ", hedged " << hedging.hedged
+         << ", hedges first to answer " << hedging.won
+         << ", hedging after " << hedgeDelay() / 1000.0 << "ms" << endl;
+  }
+  if ( servers.size() > 1 || deadline > 0 )
+  {
+    cout << "Requests abandoned " << hedging.abandoned
+         << ", out of time " << hedging.timedOut << endl;
+  }
+}
+
+/**
+ * Print the usage statement for the client application.
+ *
+ * @param[in] binary - The name of the binary being executed.
+ */
+void usage( char* binary )
+{
+  cerr << "Usage: " << binary << " [-d ms] [-R host:port ...]"
+       << " [-H percentile] [-b percent] [-z] hostname port " << endl;
+  cerr << "       " << binary << " [-d ms] [-R host:port ...] [-z] -U path "
+       << endl;
+  cerr << "       " << binary << " -r [-z] -U path " << endl;
+}
+
+/**
+ * Attempt to get an integer input from the user.
+ *
+ * @param[in] msg - The error message to display on bad input
+ * @return the actual value we have received.
+ */
+int obtainInt( string msg )
+{
+  int value = 0;
+  bool valid = false;
+  while ( not valid )
+  {
+    int ret = scanf( "%d", &value );
+    if ( ret == EOF || value == 0 )
+    {
+      cerr << msg;
+    } 
+    else
+    {
+      valid = true;
+    }
+  }
+  return value; 
+}
+
+/**
+ * Attempt to add a new record to the remote database.
+ *
+ * @param[in] timed - Whether to ask for the record's time to live.
+ */
+void addRecord( bool timed )
+{
+  record_t newRecord;
+  newRecord.command = timed ? addttl_t : add_t;
+
+  cout << "Enter id (interger):";
+  newRecord.id = obtainInt( "ID should be a non-zero integer):" );
+
+  cout << "Enter name (up to 32 char):";
+  scanf( "%32s", newRecord.name );
+
+  cout << "Enter age (integer):";
+  newRecord.age = obtainInt( "Age should be a non-zero integer):" );
+
+  // Now do the actual writing of the data out to the socket.
+  int ttl = 0;
+  if ( timed )
+  {
+    cout << "Enter seconds to live (integer):";
+    ttl = obtainInt( "Seconds should be a non-zero integer):" );
+  }
+
+  char frame[ sizeof(newRecord) + sizeof(ttl) ];
+  memcpy( frame, &newRecord, sizeof(newRecord) );
+  memcpy( frame + sizeof(newRecord), &ttl, sizeof(ttl) );
+
+  // Adding twice is not the same as adding once, so adds are not hedged
+  record_t resultRec;
+  if ( not exchange( frame, timed ? sizeof(frame) : sizeof(newRecord),
+                     false, resultRec ) )
+  {
+    cout << "ID " << newRecord.id << " not known to be added, no answer"
+         << endl;
+    return;
+  }
+
+  string response;
+  if ( ADD_SUCCESS == resultRec.command )
+  {
+    response = " added successfully";
+  }
+  else if ( SRV_BUSY == resultRec.command )
+  {
+    response = " not added, server busy";
+  }
+  else
+  {
+    response = " already exists";
+  }
+
+  cout << "ID " << newRecord.id << response << endl;
+}
+
+
+/**
+ * Attempt to retrieve a record from the remote database, or from a
+ * replica if the server is slow to answer.
+ */
+void retrieveRecord()
+{
+  record_t findRecord;
+  bzero( &findRecord, sizeof( findRecord ) );
+
+  findRecord.command = retrieve_t;
+  findRecord.id = 0;
+
+  cout << "Enter id (interger):";
+  findRecord.id = obtainInt( "ID should be a non-zero integer):" );
+
+  // Send it and get the result back from the server
+  record_t resultRec;
+  if ( not exchange( (char*) &findRecord,
+                     sizeof(findRecord.command) + sizeof(findRecord.id),
+                     true, resultRec ) )
+  {
+    cout << "ID " << findRecord.id << " not retrieved, no answer" << endl;
+    return;
+  }
+
+  // Display our results
+  if ( resultRec.command == RET_SUCCESS )
+  {
+    cout << "ID: " << resultRec.id << endl;
+    cout << "Name: " << resultRec.name << endl;
+    cout << "Age: " << resultRec.age << endl;
+  }
+  else if ( resultRec.command == SRV_BUSY )
+  {
+    cout << "ID " << findRecord.id << " not retrieved, server busy" << endl;
+  }
+  else
+  {
+    cout << "ID " << findRecord.id << " does not exist" << endl;
+  }
+}
+
+/**
+ * Send a request answered with text, and display the text.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] request - The request, a header alone.
+ * @param[in] what - What the text is, for when the server is busy.
+ */
+void showText( int sock, header_t request, const char* what )
+{
+  transmit( sock, (char*) &request, sizeof(request) );
+
+  header_t header;
+  bzero( &header, sizeof( header ) );
+  if ( not readFully( sock, (char*) &header, sizeof(header) ) )
+  {
+    cerr << "Server closed the connection" << endl;
+    return;
+  }
+
+  if ( header.command == SRV_BUSY )
+  {
+    cout << what << " not retrieved, server busy" << endl;
+    return;
+  }
+
+  string text( header.length, '\0' );
+  if ( header.length > 0 and readFully( sock, &text[0], header.length ) )
+  {
+    cout << text;
+  }
+}
+
+/**
+ * Fetch and display the server's statistics.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void showStats( int sock )
+{
+  header_t request;
+  request.command = stats_t;
+  request.length = 0;
+
+  showText( sock, request, "Statistics" );
+}
+
+/**
+ * Fetch and display the ids the server has seen most of lately.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void showHotKeys( int sock )
+{
+  header_t request;
+  request.command = hot_t;
+  request.length = 0;
+
+  cout << "How many ids of each kind (0 for all tracked)? ";
+  scanf( "%d", &request.length );
+
+  showText( sock, request, "Hot ids" );
+}
+
+/**
+ * Ask the user how many items a batch should carry.
+ *
+ * @return The batch size, between 1 and MAX_BATCH.
+ */
+int obtainBatchSize()
+{
+  int count = 0;
+  while ( count < 1 or count > MAX_BATCH )
+  {
+    cout << "Enter number of records (1 to " << MAX_BATCH << "):";
+    count = obtainInt( "Count should be a non-zero integer):" );
+  }
+  return count;
+}
+
+/**
+ * Read a batch response and return its header, the records
+ * themselves are placed in 'results'.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[out] results - Room for MAX_BATCH records.
+ *
+ * @return The response header, its command RET_FAILURE if the
+ * server went away.
+ */
+header_t readBatch( int sock, record_t* results )
+{
+  header_t header;
+  bzero( &header, sizeof( header ) );
+
+  if ( not readFully( sock, (char*) &header, sizeof(header) )
+       or header.length < 0 or header.length > MAX_BATCH
+       or not readItems( sock, PACK_RECORDS, header.length, results ) )
+  {
+    cerr << "Server closed the connection" << endl;
+    header.command = RET_FAILURE;
+    header.length = 0;
+  }
+  return header;
+}
+
+/**
+ * Attempt to add several records to the remote database at once.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void addRecords( int sock )
+{
+  static char frame[ sizeof(header_t) + MAX_BATCH * sizeof(record_t) ];
+  static record_t results[ MAX_BATCH ];
+
+  header_t header;
+  header.command = madd_t;
+  header.length = obtainBatchSize();
+
+  record_t* newRecords = (record_t*)( frame + sizeof(header) );
+  for ( int i = 0; i < header.length; i++ )
+  {
+    bzero( &newRecords[i], sizeof( record_t ) );
+    newRecords[i].command = add_t;
+
+    cout << "Enter id (interger):";
+    newRecords[i].id = obtainInt( "ID should be a non-zero integer):" );
+
+    cout << "Enter name (up to 32 char):";
+    scanf( "%31s", newRecords[i].name );
+
+    cout << "Enter age (integer):";
+    newRecords[i].age = obtainInt( "Age should be a non-zero integer):" );
+  }
+
+  memcpy( frame, &header, sizeof(header) );
+  transmit( sock, frame, sizeof(header) + header.length * sizeof(record_t) );
+
+  header_t response = readBatch( sock, results );
+  if ( response.command == SRV_BUSY )
+  {
+    cout << "Records not added, server busy" << endl;
+    return;
+  }
+
+  for ( int i = 0; i < response.length; i++ )
+  {
+    if ( ADD_SUCCESS == results[i].command )
+    {
+      cout << "ID " << results[i].id << " added successfully" << endl;
+    }
+    else
+    {
+      cout << "ID " << results[i].id << " already exists" << endl;
+    }
+  }
+}
+
+/**
+ * Attempt to retrieve several records from the remote database at once.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void retrieveRecords( int sock )
+{
+  static char frame[ sizeof(header_t) + MAX_BATCH * sizeof(int) ];
+  static record_t results[ MAX_BATCH ];
+
+  header_t header;
+  header.command = mget_t;
+  header.length = obtainBatchSize();
+
+  int* ids = (int*)( frame + sizeof(header) );
+  for ( int i = 0; i < header.length; i++ )
+  {
+    cout << "Enter id (interger):";
+    ids[i] = obtainInt( "ID should be a non-zero integer):" );
+  }
+
+  memcpy( frame, &header, sizeof(header) );
+  transmit( sock, frame, sizeof(header) + header.length * sizeof(int) );
+
+  header_t response = readBatch( sock, results );
+  if ( response.command == SRV_BUSY )
+  {
+    cout << "Records not retrieved, server busy" << endl;
+    return;
+  }
+
+  for ( int i = 0; i < response.length; i++ )
+  {
+    if ( results[i].command == RET_SUCCESS )
+    {
+      cout << "ID: " << results[i].id << endl;
+      cout << "Name: " << results[i].name << endl;
+      cout << "Age: " << results[i].age << endl;
+    }
+    else
+    {
+      cout << "ID " << results[i].id << " does not exist" << endl;
+    }
+  }
+}
+
+/**
+ * Find records by name, name prefix or range of ages, printing them
+ * as the server streams them back.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] command - The kind of query, qname_t, qprefix_t or qage_t.
+ */
+void queryRecords( int sock, int command )
+{
+  static record_t results[ MAX_BATCH ];
+
+  query_t query;
+  bzero( &query, sizeof( query ) );
+  query.command = command;
+
+  if ( command == qage_t )
+  {
+    cout << "Enter youngest age (integer):";
+    query.low = obtainInt( "Age should be a non-zero integer):" );
+
+    cout << "Enter oldest age (integer):";
+    query.high = obtainInt( "Age should be a non-zero integer):" );
+  }
+  else
+  {
+    cout << ( command == qprefix_t ? "Enter name prefix (up to 32 char):"
+                                   : "Enter name (up to 32 char):" );
+    scanf( "%31s", query.name );
+  }
+
+  transmit( sock, (char*) &query, sizeof(query) );
+
+  int total = 0;
+  while ( true )
+  {
+    header_t response = readBatch( sock, results );
+    if ( response.command == SRV_BUSY )
+    {
+      cout << "Query not run, server busy" << endl;
+      return;
+    }
+    if ( response.command != RET_SUCCESS )
+    {
+      cout << "Query not run, server does not index records" << endl;
+      return;
+    }
+    if ( response.length == 0 )
+    {
+      break;
+    }
+
+    for ( int i = 0; i < response.length; i++ )
+    {
+      cout << "ID: " << results[i].id << endl;
+      cout << "Name: " << results[i].name << endl;
+      cout << "Age: " << results[i].age << endl;
+    }
+    total += response.length;
+  }
+
+  cout << total << " records matched" << endl;
+}
+
+/**
+ * Subscribe to records as they are added, and display them until the
+ * server ends the stream. The connection is only good for this after.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void followChanges( int sock )
+{
+  static change_t changes[ MAX_BATCH ];
+
+  subscription_t subscription;
+  bzero( &subscription, sizeof( subscription ) );
+  subscription.command = subscribe_t;
+
+  cout << "Only ids in a range (1 for yes, 0 for all ids):";
+  scanf( "%d", &subscription.ranged );
+  if ( subscription.ranged )
+  {
+    cout << "Enter lowest id (integer):";
+    scanf( "%d", &subscription.low );
+    cout << "Enter highest id (integer):";
+    scanf( "%d", &subscription.high );
+  }
+
+  unsigned long since = 0;
+  cout << "Resume after change (0 for new changes only):";
+  scanf( "%lu", &since );
+  subscription.since = since;
+
+  transmit( sock, (char*) &subscription, sizeof(subscription) );
+
+  header_t header;
+  if ( not readFully( sock, (char*) &header, sizeof(header) ) )
+  {
+    cerr << "Server closed the connection" << endl;
+    return;
+  }
+  if ( header.command == SRV_BUSY )
+  {
+    cout << "Not subscribed, server busy" << endl;
+    return;
+  }
+  if ( header.command != RET_SUCCESS )
+  {
+    cout << "Some changes since " << since << " are no longer kept" << endl;
+  }
+
+  cout << "Following changes, interrupt to stop" << endl;
+  while ( readFully( sock, (char*) &header, sizeof(header) ) )
+  {
+    if ( header.command != RET_SUCCESS or header.length < 0
+         or header.length > MAX_BATCH
+         or not readItems( sock, PACK_CHANGES, header.length, changes ) )
+    {
+      break;
+    }
+
+    for ( int i = 0; i < header.length; i++ )
+    {
+      int done = changes[i].record.command;
+      cout << "Change " << (unsigned long)changes[i].seq << ": "
+           << ( done == add_t ? "added"
+              : done == delete_t ? "deleted"
+              : done == incr_t ? "incremented" : "updated" ) << endl;
+      cout << "ID: " << changes[i].record.id << endl;
+      cout << "Name: " << changes[i].record.name << endl;
+      cout << "Age: " << changes[i].record.age << endl;
+    }
+  }
+
+  cout << ( header.command == SRV_BUSY ? "Fell too far behind, stopped"
+                                       : "Server ended the stream" ) << endl;
+}
+
+/**
+ * Change a record on the server, which makes the change under its own
+ * locking, so no other client's change can come between our reading
+ * the record and writing it.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] command - update_t, delete_t, cas_t or incr_t.
+ */
+void changeRecord( int sock, int command )
+{
+  mutation_t request;
+  bzero( &request, sizeof( request ) );
+  request.command = command;
+
+  cout << "Enter id (interger):";
+  request.id = obtainInt( "ID should be a non-zero integer):" );
+
+  if ( command == cas_t )
+  {
+    cout << "Enter version expected (0 to read the version):";
+    scanf( "%u", &request.version );
+  }
+  if ( command == update_t or command == cas_t )
+  {
+    cout << "Enter name (up to 32 char):";
+    scanf( "%32s", request.name );
+
+    cout << "Enter age (integer):";
+    request.age = obtainInt( "Age should be a non-zero integer):" );
+  }
+  else if ( command == incr_t )
+  {
+    cout << "Enter amount to add to age (integer):";
+    request.age = obtainInt( "Amount should be a non-zero integer):" );
+  }
+
+  transmit( sock, (char*) &request, sizeof(request) );
+
+  mutation_t result;
+  bzero( &result, sizeof( result ) );
+  if ( not readFully( sock, (char*) &result, sizeof(result) ) )
+  {
+    cerr << "Server closed the connection" << endl;
+    return;
+  }
+
+  if ( result.command == RET_SUCCESS or result.command == RET_CONFLICT )
+  {
+    if ( result.command == RET_SUCCESS )
+    {
+      cout << "ID " << request.id
+           << ( command == delete_t ? " deleted" : " changed" ) << endl;
+    }
+    else
+    {
+      cout << "ID " << request.id << " not changed, "
+           << ( command == cas_t ? "its version differs"
+                                 : "its age would overflow" ) << endl;
+    }
+    cout << "ID: " << result.id << endl;
+    cout << "Name: " << result.name << endl;
+    cout << "Age: " << result.age << endl;
+    cout << "Version: " << result.version << endl;
+  }
+  else if ( result.command == SRV_BUSY )
+  {
+    cout << "ID " << request.id << " not changed, server busy" << endl;
+  }
+  else
+  {
+    cout << "ID " << request.id << " does not exist" << endl;
+  }
+}
+
+/**
+ * Change how often the server traces requests.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void setTracing( int sock )
+{
+  record_t request;
+  bzero( &request, sizeof( request ) );
+  request.command = trace_t;
+
+  cout << "Trace one request in (0 to stop tracing):";
+  scanf( "%d", &request.id );
+
+  transmit( sock, (char*) &request, sizeof(request.command) + sizeof(request.id) );
+
+  record_t resultRec;
+  bzero( &resultRec, sizeof( resultRec ) );
+  if ( not readFully( sock, (char*) &resultRec, sizeof(resultRec) ) )
+  {
+    cerr << "Server closed the connection" << endl;
+    return;
+  }
+
+  if ( resultRec.command == RET_SUCCESS )
+  {
+    cout << "Tracing changed, previously one request in " << resultRec.id
+         << endl;
+  }
+  else if ( resultRec.command == SRV_BUSY )
+  {
+    cout << "Tracing not changed, server busy" << endl;
+  }
+  else
+  {
+    cout << "Tracing not changed, server could not open its trace file"
+         << endl;
+  }
+}
+
+/**
+ * Ask the server to write a snapshot of its records in the background.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void takeSnapshot( int sock )
+{
+  header_t request;
+  request.command = snapshot_t;
+  request.length = 0;
+
+  transmit( sock, (char*) &request, sizeof(request) );
+
+  record_t resultRec;
+  bzero( &resultRec, sizeof( resultRec ) );
+  if ( not readFully( sock, (char*) &resultRec, sizeof(resultRec) ) )
+  {
+    cerr << "Server closed the connection" << endl;
+    return;
+  }
+
+  if ( resultRec.command == RET_SUCCESS )
+  {
+    cout << "Snapshot started by server process " << resultRec.id << endl;
+  }
+  else if ( resultRec.command == SRV_BUSY )
+  {
+    cout << "Snapshot not started, server busy" << endl;
+  }
+  else
+  {
+    cout << "Snapshot not started, one may already be running" << endl;
+  }
+}
+
+/**
+ * Client main function
+ *
+ * @param[in] argc - The number of arguments passed to the program.
+ * @param[in] argv - The arguments passed to the program.
+ */
+int main( int argc, char** argv )
+{
+  char* localPath = NULL;
+  bool shared = false;
+
+  server_t server;
+  bzero( &server, sizeof( server ) );
+  server.sock = -1;
+  servers.push_back( server );
+
+  bzero( &hedging, sizeof( hedging ) );
+  hedging.percentile = DEFAULT_HEDGE_PERCENTILE;
+  hedging.budget = DEFAULT_HEDGE_BUDGET;
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "U:rd:R:H:b:z" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'U':
+        localPath = optarg;
+        break;
+      case 'r':
+        shared = true;
+        break;
+      case 'd':
+        deadline = atoi( optarg );
+        break;
+      case 'R':
+      {
+        char* colon = strrchr( optarg, ':' );
+        server.hostname = optarg;
+        server.port = NULL == colon ? 0 : atoi( colon + 1 );
+        if ( server.port < PORT_MIN or server.port > PORT_MAX )
+        {
+          cerr << optarg << ": invalid replica, expected host:port" << endl;
+          exit( EXIT_FAILURE );
+        }
+        *colon = '\0';
+        servers.push_back( server );
+        break;
+      }
+      case 'H':
+        hedging.percentile = atoi( optarg );
+        break;
+      case 'b':
+        hedging.budget = atoi( optarg );
+        break;
+      case 'z':
+        packing = true;
+        break;
+      default:
+        usage( argv[0] );
+        return EXIT_FAILURE;
+    }
+  }
+
+  // Deadlines and hedging wait on sockets, which a channel is not
+  if ( ( NULL == localPath ? argc - optind != 2 || shared : argc != optind )
+       or ( shared and ( deadline > 0 or servers.size() > 1 ) )
+       or deadline < 0 or hedging.percentile < 1 or hedging.percentile > 99
+       or hedging.budget < 0 or hedging.budget > 100 )
+  {	
+    usage( argv[0] );
+    return EXIT_FAILURE;
+  }
+  else
+  {
+    if ( NULL != localPath )
+    {
+      servers[0].path = localPath;
+    }
+    else
+    {
+      servers[0].hostname = argv[ optind + HOSTNAME - 1 ];
+      servers[0].port = atoi( argv[ optind + PORTNUM - 1 ] );
+
+      // Validate the given port number
+      if ( servers[0].port < PORT_MIN or servers[0].port > PORT_MAX )
+      {
+        cerr << servers[0].port << ": invalid port number" << endl;
+        exit( EXIT_FAILURE );
+      }
+    }
+
+    if ( connectServer( servers[0] ) < 0 )
+    {
+      exit( EXIT_FAILURE );
+    }
+    if ( shared )
+    {
+      attachChannel( servers[0].sock );
+    }
+
+    while ( true )	
+    {
+
+      cout << "Enter command (" << add_t << " for Add, " << addttl_t
+           << " for Add with expiry, " << retrieve_t 
+           << " for retrieve, " << madd_t << " for multi-add, " << mget_t
+           << " for multi-retrieve, " << qname_t << " to find by name, "
+           << qprefix_t << " to find by name prefix, " << qage_t
+           << " to find by age, " << stats_t << " for stats, " << hot_t
+           << " for hot ids, " << subscribe_t << " to follow changes, "
+           << update_t << " to update, " << delete_t << " to delete, "
+           << cas_t << " to compare and swap, " << incr_t
+           << " to increment age, " << trace_t << " for tracing, " << snapshot_t << " for snapshot, "
+           << quit_t << " to quit):"; 
+
+      int cmd = 100; 
+      scanf( "%d", &cmd );
+
+      // Reconnect if a request on the connection was abandoned. Adds and
+      // retrieves reconnect for themselves, a retrieve going to a replica
+      // if it must.
+      int sock = servers[0].sock;
+      if ( cmd == add_t )
+      {
+        addRecord( false );
+      }
+      else if ( cmd == addttl_t )
+      {
+        addRecord( true );
+      }
+      else if ( cmd == retrieve_t )
+      {
+        retrieveRecord();
+      }
+      else if ( cmd != quit_t and ( sock = connectServer( servers[0] ) ) < 0 )
+      {
+        cout << "Not connected to the server" << endl;
+      }
+      else if ( cmd == madd_t )
+      {
+        addRecords( sock );
+      }
+      else if ( cmd == mget_t )
+      {
+        retrieveRecords( sock );
+      }
+      else if ( cmd == qname_t or cmd == qprefix_t or cmd == qage_t )
+      {
+        queryRecords( sock, cmd );
+      }
+      else if ( cmd == stats_t )
+      {
+        showStats( sock );
+      }
+      else if ( cmd == subscribe_t )
+      {
+        followChanges( sock );
+        close( sock );
+        reportHedging();
+        break;
+      }
+      else if ( cmd == hot_t )
+      {
+        showHotKeys( sock );
+      }
+      else if ( cmd == update_t or cmd == delete_t or cmd == cas_t
+                or cmd == incr_t )
+      {
+        changeRecord( sock, cmd );
+      }
+      else if ( cmd == trace_t )
+      {
+        setTracing( sock );
+      }
+      else if ( cmd == snapshot_t )
+      {
+        takeSnapshot( sock );
+      }
+      else if ( cmd == quit_t )
+      {
+        for ( size_t i = 0; i < servers.size(); i++ )
+        {
+          if ( servers[i].sock >= 0 )
+          {
+            shutdown( servers[i].sock, SHUT_RDWR );
+            close( servers[i].sock );
+          }
+        }
+        reportHedging();
         break;
       }
       else
@@ -8,6 +8,8 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <stdint.h>
+
 #define	PORT_MIN 1024
 #define	PORT_MAX 65535
 
@@ -20,8 +22,17 @@
 #define RET_SUCCESS 0
 #define RET_FAILURE 1
 
+// Returned in place of any of the above when the server sheds load
+#define SRV_BUSY 2
+
+// Returned when a record exists but a change's condition on it failed
+#define RET_CONFLICT 3
+
 #define MAX_LEN 32
 
+// Most ids or records carried by a single batch request
+#define MAX_BATCH 256
+
 /**
  * A struct defining the data storage
  * and nework communcation data format 
@@ -34,12 +45,139 @@ typedef struct
   int age;
 } record_t;
 
+/**
+ * Header preceding variable length messages. A stats response
+ * is followed by 'length' bytes of text. A multi-get request is
+ * followed by 'length' ids, a multi-add request by 'length'
+ * records, and the response to either by 'length' records, each
+ * carrying its own status in 'command'.
+ *
+ * A timed add request is a record followed by an int holding the
+ * number of seconds the record lives for, and is answered as an add.
+ *
+ * A query is answered by a stream of headers, each followed by
+ * 'length' records, or 'length' ids if only ids were asked for, and
+ * ending with a header whose 'length' is 0. A server without indexes
+ * answers with that final header alone, its 'command' RET_FAILURE.
+ *
+ * A snapshot request is a header alone, answered by a record whose
+ * 'command' says whether a snapshot was started.
+ *
+ * An attach request is a record whose 'name' is the shared memory
+ * object holding a channel_t, see ring.h, and is only honoured on a
+ * local socket. It is answered on the socket by a record whose
+ * 'command' says whether every later request and response goes
+ * through the channel instead.
+ *
+ * A hot ids request is a header whose 'length' is the most ids wanted
+ * of each kind, 0 for all tracked, answered like a stats request.
+ *
+ * A subscribe request is a subscription_t, and turns the connection
+ * into a stream of changes for as long as it stays open. It is first
+ * answered by a header whose 'command' is RET_FAILURE if changes the
+ * subscriber asked to resume from are no longer kept, then by headers
+ * each followed by 'length' change_t. A header whose 'command' is
+ * SRV_BUSY ends the stream when the subscriber falls too far behind.
+ *
+ * An update, delete, compare and swap or increment request is a
+ * mutation_t, answered by a mutation_t holding the record as it now
+ * is, or for a delete as it was, along with its version. Its 'command'
+ * is RET_FAILURE if no record has the id, and RET_CONFLICT if a compare
+ * and swap expected another version, or an increment would take the
+ * age out of the range of an int, the record being left as it is.
+ *
+ * A compress request is a header whose 'length' holds the codecs the
+ * client can unpack, see pack.h, answered by a header whose 'length'
+ * is the codec the server picked, 0 for none. Once one is picked every
+ * header the connection is sent which would be followed by 'length'
+ * records, ids or changes, as answers to batches, queries and
+ * subscriptions are, is instead followed by an int holding the bytes
+ * of a block, then the block those items are packed into.
+ */
+typedef struct
+{
+  int command;
+  int length;
+} header_t;
+
+/**
+ * A change made to a record in place, by the server under its own
+ * locking, and the answer to one. Every change gives the record a new
+ * version, the first being 1 as it is added, so a client may change a
+ * record only if nothing else has since it saw it. No record has
+ * version 0, so a compare and swap expecting it reads the version.
+ * Versions are 16 bits, wrapping round past 0, and start again from 1
+ * when the server restarts.
+ */
+typedef struct
+{
+  int command;
+  int id;
+  char name[MAX_LEN];   // The new name, for update_t and cas_t
+  int age;              // The new age, or for incr_t the amount added
+  uint32_t version;     // The version a cas_t expects, and in an answer
+                        // the record's
+} mutation_t;
+
+/**
+ * A query for records by name, name prefix or range of ages.
+ */
+typedef struct
+{
+  int command;
+  int limit;            // Most results wanted, 0 for all
+  char name[MAX_LEN];   // The name or prefix looked for
+  int low;              // The youngest age looked for
+  int high;             // The oldest age looked for
+  int idsOnly;          // Nonzero to be sent ids rather than records
+} query_t;
+
+/**
+ * A subscription to the changes made to records. Changes are numbered
+ * from 1 as the server makes them, starting again when it restarts.
+ */
+typedef struct
+{
+  int command;
+  int ranged;           // Nonzero to only be sent ids from low to high
+  int low;              // The lowest id wanted
+  int high;             // The highest id wanted
+  uint64_t since;       // The last change already seen, 0 for none
+} subscription_t;
+
+/**
+ * A change streamed to a subscriber, the record as it now is, or as
+ * it was if deleted, with 'command' saying what was done to it.
+ */
+typedef struct
+{
+  uint64_t seq;
+  record_t record;
+} change_t;
+
 
 /* Enum defining all actions the user can initiate */
 typedef enum {
   add_t = 0,
   retrieve_t = 1,
-  quit_t = 2
+  quit_t = 2,
+  stats_t = 3,
+  trace_t = 4,
+  mget_t = 5,
+  madd_t = 6,
+  addttl_t = 7,
+  qname_t = 8,
+  qprefix_t = 9,
+  qage_t = 10,
+  snapshot_t = 11,
+  attach_t = 12,
+  hot_t = 13,
+  subscribe_t = 14,
+  update_t = 15,
+  delete_t = 16,
+  cas_t = 17,
+  incr_t = 18,
+  compress_t = 19
 } actions_t;
 
 #endif // _COMMON_H
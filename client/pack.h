@@ -0,0 +1,512 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Packing of the items following a batch header, for
+ * connections which have asked for it, see compress_t in common.h.
+ * Records on the wire are mostly zero padding, zero statuses and ids
+ * and ages close to their neighbours', so items are first encoded
+ * field by field: ids and ages as the varint of their difference from
+ * the item before, names without their trailing zeros. What is left
+ * is then compressed with a small LZ77 codec, whose sequences are laid
+ * out as LZ4's, to fold the names and repeated runs away.
+ *
+ * A packed block is a method byte followed by its data. The packer
+ * falls back to sending the items as they are whenever packing would
+ * not make them smaller, so a block is never larger than the items
+ * plus that byte. The unpacker checks every length and offset against
+ * the buffers it was given, so a corrupt block is refused rather than
+ * read or written out of bounds.
+ */
+
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+
+// Codecs a client may ask for, as bits of a compress_t request
+#define PACK_LZ 0x01
+
+// Methods a packed block may be in, its first byte
+#define PACK_STORED 0   // The items as they are
+#define PACK_ENCODED 1  // Encoded field by field, then compressed
+
+// Kinds of items a batch carries
+#define PACK_RECORDS 0  // record_t
+#define PACK_IDS 1      // int
+#define PACK_CHANGES 2  // change_t
+
+// Bytes a block of 'bytes' of items may take
+#define PACK_BOUND( bytes ) ( ( bytes ) + 1 )
+
+// Bytes of scratch space packing or unpacking 'bytes' of items needs,
+// the most their field by field encoding takes
+#define PACK_SCRATCH( bytes ) ( ( bytes ) + ( bytes ) / 4 + 16 )
+
+// Shortest match worth a sequence, and the farthest one may reach
+#define PACK_MIN_MATCH 4
+#define PACK_WINDOW 65535
+
+// Log2 of the entries in the compressor's table of recent positions
+#define PACK_HASH_BITS 11
+
+/**
+ * @return The bytes of one item of a kind.
+ */
+inline size_t packItemSize( int kind )
+{
+  return kind == PACK_IDS ? sizeof( int )
+       : kind == PACK_CHANGES ? sizeof( change_t ) : sizeof( record_t );
+}
+
+inline unsigned char* packVarint( unsigned char* out, uint64_t value )
+{
+  while ( value >= 0x80 )
+  {
+    *out++ = (unsigned char)( value | 0x80 );
+    value >>= 7;
+  }
+  *out++ = (unsigned char)value;
+  return out;
+}
+
+/**
+ * @return The value read, advancing 'in', or false through 'ok' if
+ * the varint runs past 'end'.
+ */
+inline uint64_t unpackVarint( const unsigned char*& in,
+                              const unsigned char* end, bool& ok )
+{
+  uint64_t value = 0;
+  for ( int shift = 0; shift < 64; shift += 7 )
+  {
+    if ( in == end )
+    {
+      ok = false;
+      return 0;
+    }
+    unsigned char byte = *in++;
+    value |= (uint64_t)( byte & 0x7f ) << shift;
+    if ( not ( byte & 0x80 ) )
+    {
+      return value;
+    }
+  }
+  ok = false;
+  return 0;
+}
+
+// Differences of either sign as small unsigned numbers, wrapping
+inline uint32_t zigzag( uint32_t difference )
+{
+  return ( difference << 1 ) ^ ( 0u - ( difference >> 31 ) );
+}
+
+inline uint32_t unzigzag( uint32_t value )
+{
+  return ( value >> 1 ) ^ ( 0u - ( value & 1 ) );
+}
+
+/**
+ * Encode a record's fields against the record before it.
+ */
+inline unsigned char* encodeRecord( unsigned char* out, const record_t& rec,
+                                    record_t& previous )
+{
+  out = packVarint( out, zigzag( (uint32_t)rec.command ) );
+  out = packVarint( out, zigzag( (uint32_t)rec.id - (uint32_t)previous.id ) );
+  out = packVarint( out, zigzag( (uint32_t)rec.age - (uint32_t)previous.age ) );
+
+  // Whatever follows the last nonzero byte is padding
+  int length = MAX_LEN;
+  while ( length > 0 && rec.name[ length - 1 ] == '\0' )
+  {
+    length--;
+  }
+  *out++ = (unsigned char)length;
+  memcpy( out, rec.name, length );
+
+  previous = rec;
+  return out + length;
+}
+
+inline bool decodeRecord( const unsigned char*& in, const unsigned char* end,
+                          record_t& rec, record_t& previous )
+{
+  bool ok = true;
+  memset( &rec, 0, sizeof( rec ) );
+  rec.command = (int)unzigzag( (uint32_t)unpackVarint( in, end, ok ) );
+  rec.id = (int)( (uint32_t)previous.id
+                  + unzigzag( (uint32_t)unpackVarint( in, end, ok ) ) );
+  rec.age = (int)( (uint32_t)previous.age
+                   + unzigzag( (uint32_t)unpackVarint( in, end, ok ) ) );
+  if ( not ok || in == end || *in > MAX_LEN || end - in - 1 < *in )
+  {
+    return false;
+  }
+  int length = *in++;
+  memcpy( rec.name, in, length );
+  in += length;
+
+  previous = rec;
+  return true;
+}
+
+/**
+ * Encode items field by field.
+ *
+ * @return The bytes written, at most PACK_SCRATCH() of the items'.
+ */
+inline size_t encodeItems( int kind, const void* items, int count,
+                           unsigned char* out )
+{
+  unsigned char* start = out;
+  record_t previous;
+  memset( &previous, 0, sizeof( previous ) );
+  uint64_t seq = 0;
+  uint32_t id = 0;
+
+  for ( int i = 0; i < count; i++ )
+  {
+    if ( kind == PACK_IDS )
+    {
+      int next;
+      memcpy( &next, (const char*)items + i * sizeof( int ), sizeof( next ) );
+      out = packVarint( out, zigzag( (uint32_t)next - id ) );
+      id = (uint32_t)next;
+    }
+    else if ( kind == PACK_CHANGES )
+    {
+      change_t change;
+      memcpy( &change, (const char*)items + i * sizeof( change_t ),
+              sizeof( change ) );
+      out = packVarint( out, change.seq - seq );
+      seq = change.seq;
+      out = encodeRecord( out, change.record, previous );
+    }
+    else
+    {
+      record_t rec;
+      memcpy( &rec, (const char*)items + i * sizeof( record_t ),
+              sizeof( rec ) );
+      out = encodeRecord( out, rec, previous );
+    }
+  }
+  return out - start;
+}
+
+/**
+ * Decode exactly 'count' items from exactly 'bytes' of encoding.
+ *
+ * @return False if the encoding is corrupt.
+ */
+inline bool decodeItems( int kind, const unsigned char* in, size_t bytes,
+                         void* items, int count )
+{
+  const unsigned char* end = in + bytes;
+  record_t previous;
+  memset( &previous, 0, sizeof( previous ) );
+  uint64_t seq = 0;
+  uint32_t id = 0;
+  bool ok = true;
+
+  for ( int i = 0; ok && i < count; i++ )
+  {
+    if ( kind == PACK_IDS )
+    {
+      id += unzigzag( (uint32_t)unpackVarint( in, end, ok ) );
+      int next = (int)id;
+      memcpy( (char*)items + i * sizeof( int ), &next, sizeof( next ) );
+    }
+    else if ( kind == PACK_CHANGES )
+    {
+      change_t change;
+      memset( &change, 0, sizeof( change ) );
+      seq += unpackVarint( in, end, ok );
+      change.seq = seq;
+      ok = ok && decodeRecord( in, end, change.record, previous );
+      memcpy( (char*)items + i * sizeof( change_t ), &change,
+              sizeof( change ) );
+    }
+    else
+    {
+      record_t rec;
+      ok = decodeRecord( in, end, rec, previous );
+      memcpy( (char*)items + i * sizeof( record_t ), &rec, sizeof( rec ) );
+    }
+  }
+  return ok && in == end;
+}
+
+inline uint32_t packRead32( const unsigned char* at )
+{
+  uint32_t value;
+  memcpy( &value, at, sizeof( value ) );
+  return value;
+}
+
+/**
+ * Write a sequence's length, the part of it over what its token holds.
+ */
+inline unsigned char* packLength( unsigned char* out, size_t length )
+{
+  for ( ; length >= 255; length -= 255 )
+  {
+    *out++ = 255;
+  }
+  *out++ = (unsigned char)length;
+  return out;
+}
+
+/**
+ * Compress bytes into at most 'most' bytes.
+ *
+ * @return The bytes written, or 0 if they would not fit in 'most'.
+ */
+inline size_t compressBytes( const unsigned char* in, size_t bytes,
+                             unsigned char* out, size_t most )
+{
+  // Positions plus one, so 0 is an empty entry
+  uint32_t table[ 1 << PACK_HASH_BITS ];
+  memset( table, 0, sizeof( table ) );
+
+  unsigned char* start = out;
+  unsigned char* limit = out + most;
+  size_t anchor = 0;
+  size_t at = 0;
+
+  while ( at + PACK_MIN_MATCH <= bytes )
+  {
+    uint32_t word = packRead32( in + at );
+    uint32_t slot = ( word * 2654435761u ) >> ( 32 - PACK_HASH_BITS );
+    size_t candidate = table[ slot ];
+    table[ slot ] = at + 1;
+
+    if ( 0 == candidate || at - ( candidate - 1 ) > PACK_WINDOW
+         || packRead32( in + candidate - 1 ) != word )
+    {
+      // Step faster through bytes which keep failing to match
+      at += 1 + ( ( at - anchor ) >> 6 );
+      continue;
+    }
+
+    size_t from = candidate - 1;
+    size_t length = PACK_MIN_MATCH;
+    while ( at + length < bytes && in[ from + length ] == in[ at + length ] )
+    {
+      length++;
+    }
+
+    // Token, literals, offset and both lengths at their longest
+    size_t literals = at - anchor;
+    if ( (size_t)( limit - out ) < 1 + literals + literals / 255 + 2
+                                   + length / 255 + 2 )
+    {
+      return 0;
+    }
+
+    unsigned char* token = out++;
+    *token = (unsigned char)( ( literals < 15 ? literals : 15 ) << 4 );
+    if ( literals >= 15 )
+    {
+      out = packLength( out, literals - 15 );
+    }
+    memcpy( out, in + anchor, literals );
+    out += literals;
+
+    size_t offset = at - from;
+    *out++ = (unsigned char)offset;
+    *out++ = (unsigned char)( offset >> 8 );
+
+    size_t extra = length - PACK_MIN_MATCH;
+    *token |= (unsigned char)( extra < 15 ? extra : 15 );
+    if ( extra >= 15 )
+    {
+      out = packLength( out, extra - 15 );
+    }
+
+    at += length;
+    anchor = at;
+  }
+
+  // The last sequence is literals alone, ending the block
+  size_t literals = bytes - anchor;
+  if ( (size_t)( limit - out ) < 1 + literals + literals / 255 + 1 )
+  {
+    return 0;
+  }
+  *out++ = (unsigned char)( ( literals < 15 ? literals : 15 ) << 4 );
+  if ( literals >= 15 )
+  {
+    out = packLength( out, literals - 15 );
+  }
+  memcpy( out, in + anchor, literals );
+  out += literals;
+
+  return out - start;
+}
+
+/**
+ * Read a sequence's length past what its token holds.
+ */
+inline bool unpackLength( const unsigned char*& in, const unsigned char* end,
+                          size_t& length )
+{
+  unsigned char byte;
+  do
+  {
+    if ( in == end )
+    {
+      return false;
+    }
+    byte = *in++;
+    length += byte;
+  }
+  while ( byte == 255 );
+  return true;
+}
+
+/**
+ * Decompress a block into at most 'most' bytes.
+ *
+ * @return The bytes written, or -1 if the block is corrupt.
+ */
+inline long decompressBytes( const unsigned char* in, size_t bytes,
+                             unsigned char* out, size_t most )
+{
+  const unsigned char* end = in + bytes;
+  size_t written = 0;
+
+  while ( in < end )
+  {
+    unsigned char token = *in++;
+
+    size_t literals = token >> 4;
+    if ( literals == 15 && not unpackLength( in, end, literals ) )
+    {
+      return -1;
+    }
+    if ( (size_t)( end - in ) < literals || most - written < literals )
+    {
+      return -1;
+    }
+    memcpy( out + written, in, literals );
+    in += literals;
+    written += literals;
+
+    if ( in == end )
+    {
+      break;
+    }
+
+    if ( end - in < 2 )
+    {
+      return -1;
+    }
+    size_t offset = in[0] | ( in[1] << 8 );
+    in += 2;
+
+    size_t length = token & 0x0f;
+    if ( length == 15 && not unpackLength( in, end, length ) )
+    {
+      return -1;
+    }
+    length += PACK_MIN_MATCH;
+
+    if ( 0 == offset || offset > written || most - written < length )
+    {
+      return -1;
+    }
+
+    // Byte by byte where a match overlaps what it copies
+    unsigned char* to = out + written;
+    const unsigned char* from = to - offset;
+    if ( offset >= length )
+    {
+      memcpy( to, from, length );
+    }
+    else
+    {
+      for ( size_t i = 0; i < length; i++ )
+      {
+        to[i] = from[i];
+      }
+    }
+    written += length;
+  }
+  return written;
+}
+
+/**
+ * Pack items into a block.
+ *
+ * @param[in] kind - What the items are, such as PACK_RECORDS.
+ * @param[in] items - The items.
+ * @param[in] count - The number of items.
+ * @param[out] scratch - Room for PACK_SCRATCH() of the items' bytes.
+ * @param[out] block - Room for PACK_BOUND() of the items' bytes.
+ *
+ * @return The bytes of the block.
+ */
+inline size_t packBlock( int kind, const void* items, int count,
+                         unsigned char* scratch, unsigned char* block )
+{
+  size_t raw = count * packItemSize( kind );
+  size_t encoded = encodeItems( kind, items, count, scratch );
+
+  size_t compressed = compressBytes( scratch, encoded, block + 1, raw );
+  if ( compressed > 0 && compressed < raw )
+  {
+    block[0] = PACK_ENCODED;
+    return 1 + compressed;
+  }
+
+  block[0] = PACK_STORED;
+  memcpy( block + 1, items, raw );
+  return 1 + raw;
+}
+
+/**
+ * Unpack a block into the items it was packed from.
+ *
+ * @param[in] kind - What the items are.
+ * @param[in] block - The block.
+ * @param[in] bytes - The bytes of the block.
+ * @param[out] items - Room for 'count' items.
+ * @param[in] count - The number of items the block holds.
+ * @param[out] scratch - Room for PACK_SCRATCH() of the items' bytes.
+ *
+ * @return False if the block is corrupt.
+ */
+inline bool unpackBlock( int kind, const unsigned char* block, size_t bytes,
+                         void* items, int count, unsigned char* scratch )
+{
+  size_t raw = count * packItemSize( kind );
+  if ( bytes < 1 )
+  {
+    return false;
+  }
+
+  if ( block[0] == PACK_STORED )
+  {
+    if ( bytes - 1 != raw )
+    {
+      return false;
+    }
+    memcpy( items, block + 1, raw );
+    return true;
+  }
+
+  if ( block[0] != PACK_ENCODED )
+  {
+    return false;
+  }
+  long encoded = decompressBytes( block + 1, bytes - 1, scratch,
+                                  PACK_SCRATCH( raw ) );
+  return encoded >= 0 && decodeItems( kind, scratch, encoded, items, count );
+}
+
+#endif // _PACK_H_
@@ -0,0 +1,145 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Time the codec of pack.h on a full batch of each kind
+ * of item, on one core, so its speed and how well it packs can be
+ * checked on any machine without a server or a network.
+ *
+ * Usage: packbench [-n rounds]
+ *
+ * Where 'rounds' is the number of times each batch is packed and
+ * unpacked. Records are made like typical ones, ids rising, short
+ * names from a few dozen and ages from a small range, and changes
+ * wrap them with rising numbers. Every batch is unpacked and compared
+ * before it is timed. For each kind one line gives the batch's bytes
+ * before and after packing, and the bytes of items packed and
+ * unpacked each second, counted before packing.
+ */
+
+#include <iostream>
+  using std::cout;
+  using std::cerr;
+  using std::endl;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "pack.h"
+
+// Rounds run by default
+#define DEFAULT_ROUNDS 20000
+
+/**
+ * @return The time in seconds on a clock which never goes back.
+ */
+double seconds()
+{
+  struct timespec clock;
+  clock_gettime( CLOCK_MONOTONIC, &clock );
+  return clock.tv_sec + clock.tv_nsec / 1e9;
+}
+
+/**
+ * Pack and unpack a batch, checking it comes back whole, then time
+ * both and print a line of results.
+ *
+ * @param[in] label - The kind's name.
+ * @param[in] kind - The kind of item, see pack.h.
+ * @param[in] items - The items.
+ * @param[in] count - The number of items.
+ * @param[in] rounds - Times to pack and unpack the batch.
+ *
+ * @return False if the batch did not come back as it was packed.
+ */
+bool bench( const char* label, int kind, const void* items, int count,
+            int rounds )
+{
+  static unsigned char scratch[ PACK_SCRATCH( MAX_BATCH * sizeof( change_t ) ) ];
+  static unsigned char block[ PACK_BOUND( MAX_BATCH * sizeof( change_t ) ) ];
+  static unsigned char out[ MAX_BATCH * sizeof( change_t ) ];
+
+  size_t bytes = count * packItemSize( kind );
+  size_t packed = packBlock( kind, items, count, scratch, block );
+  if ( not unpackBlock( kind, block, packed, out, count, scratch )
+       || memcmp( items, out, bytes ) != 0 )
+  {
+    cerr << label << ": unpacked batch differs" << endl;
+    return false;
+  }
+
+  double start = seconds();
+  for ( int i = 0; i < rounds; i++ )
+  {
+    packed = packBlock( kind, items, count, scratch, block );
+  }
+  double packing = seconds() - start;
+
+  start = seconds();
+  for ( int i = 0; i < rounds; i++ )
+  {
+    unpackBlock( kind, block, packed, out, count, scratch );
+  }
+  double unpacking = seconds() - start;
+
+  double total = (double)bytes * rounds;
+  char line[ 256 ];
+  snprintf( line, sizeof( line ),
+            "%-8s %6lu bytes -> %5lu  %5.2fx  pack %5.2f GB/s"
+            "  unpack %5.2f GB/s",
+            label, (unsigned long)bytes, (unsigned long)packed,
+            (double)bytes / packed, total / packing / 1e9,
+            total / unpacking / 1e9 );
+  cout << line << endl;
+  return true;
+}
+
+/**
+ * Program entry point.
+ *
+ * @param[in] argc - The number of command line arguments.
+ * @param[in] argv - The actual command line arguments.
+ *
+ * @return EXIT_SUCCESS if every batch came back whole.
+ */
+int main( int argc, char** argv )
+{
+  int rounds = DEFAULT_ROUNDS;
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "n:" ) ) != -1 )
+  {
+    if ( opt != 'n' || ( rounds = atoi( optarg ) ) < 1 )
+    {
+      cerr << "Usage: " << argv[0] << " [-n rounds]" << endl;
+      exit( EXIT_FAILURE );
+    }
+  }
+
+  static record_t recs[ MAX_BATCH ];
+  static int ids[ MAX_BATCH ];
+  static change_t changes[ MAX_BATCH ];
+  memset( recs, 0, sizeof( recs ) );
+  memset( changes, 0, sizeof( changes ) );
+
+  for ( int i = 0; i < MAX_BATCH; i++ )
+  {
+    recs[i].id = 100000 + i;
+    recs[i].age = 18 + ( i * 7 ) % 60;
+    snprintf( recs[i].name, MAX_LEN, "name-%d", i % 40 );
+
+    ids[i] = 100000 + i * 2;
+
+    changes[i].seq = 5000 + i;
+    changes[i].record = recs[i];
+  }
+
+  bool ok = bench( "records", PACK_RECORDS, recs, MAX_BATCH, rounds );
+  ok = bench( "ids", PACK_IDS, ids, MAX_BATCH, rounds ) && ok;
+  ok = bench( "changes", PACK_CHANGES, changes, MAX_BATCH, rounds ) && ok;
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,250 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: A shared memory channel for clients on the same host
+ * as the server. The channel is a pair of single producer, single
+ * consumer byte rings, one carrying requests and one responses, in
+ * exactly the format they would take on the socket.
+ *
+ * A waiting side spins for a while before sleeping on a futex, and
+ * the other side only makes the system call to wake it when it has
+ * said it is asleep. A sleeper wakes now and then to check the socket
+ * the channel was set up over, which is closed when its peer leaves.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#if defined( __linux__ )
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Bytes each ring holds, a power of two holding the largest batch
+#define RING_BYTES 65536
+
+// Bytes between the fields the two sides write
+#define RING_LINE 64
+
+// Times a waiting side checks its ring before going to sleep
+#define RING_SPIN 4000
+
+// Milliseconds a sleeper waits before checking its peer is still there
+#define RING_PATIENCE 100
+
+/**
+ * One direction of a channel. 'head' and 'tail' count the bytes ever
+ * written and read, so they may wrap around freely.
+ */
+typedef struct
+{
+  uint32_t head;
+  char headPad[ RING_LINE - sizeof( uint32_t ) ];
+  uint32_t tail;
+  char tailPad[ RING_LINE - sizeof( uint32_t ) ];
+  uint32_t readerAsleep;
+  uint32_t writerAsleep;
+  char sleepPad[ RING_LINE - 2 * sizeof( uint32_t ) ];
+  char data[ RING_BYTES ];
+} ring_t;
+
+/**
+ * The shared memory a client and the server talk through.
+ */
+typedef struct
+{
+  ring_t requests;
+  ring_t responses;
+} channel_t;
+
+/**
+ * @return How many times to spin before sleeping, none when there is
+ * only one processor for the other side to run on.
+ */
+inline int ringSpins()
+{
+  static int spins = sysconf( _SC_NPROCESSORS_ONLN ) > 1 ? RING_SPIN : 0;
+  return spins;
+}
+
+/**
+ * Tell the processor we are spinning.
+ */
+inline void ringRelax()
+{
+#if defined( __i386__ ) || defined( __x86_64__ )
+  __asm__ __volatile__ ( "pause" );
+#endif
+}
+
+/**
+ * Sleep while 'word' holds 'value', for at most RING_PATIENCE.
+ */
+inline void ringSleep( uint32_t* word, uint32_t value )
+{
+#if defined( __linux__ )
+  struct timespec patience;
+  patience.tv_sec = 0;
+  patience.tv_nsec = RING_PATIENCE * 1000000L;
+  syscall( SYS_futex, word, FUTEX_WAIT, value, &patience, NULL, 0 );
+#else
+  (void)word;
+  (void)value;
+  usleep( 50 );
+#endif
+}
+
+/**
+ * Wake whoever sleeps on 'word'.
+ */
+inline void ringWake( uint32_t* word )
+{
+#if defined( __linux__ )
+  syscall( SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0 );
+#else
+  (void)word;
+#endif
+}
+
+/**
+ * @param[in] peer - The socket the channel was set up over.
+ *
+ * @return True if the other side has closed it.
+ */
+inline bool ringPeerGone( int peer )
+{
+  char byte;
+  ssize_t got = recv( peer, &byte, 1, MSG_PEEK | MSG_DONTWAIT );
+  return got == 0
+         || ( got < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+              && errno != EINTR );
+}
+
+/**
+ * Wait until the word another side moves, 'head' or 'tail', is no
+ * longer 'stuck', spinning first and then sleeping.
+ *
+ * @param[in] word - The word the other side moves.
+ * @param[in] asleep - Where to say we are sleeping.
+ * @param[in] stuck - The value to wait for 'word' to leave.
+ * @param[in] peer - The socket the channel was set up over.
+ *
+ * @return The word's new value, or 'stuck' if the peer has gone.
+ */
+inline uint32_t ringAwait( uint32_t* word, uint32_t* asleep, uint32_t stuck,
+                           int peer )
+{
+  uint32_t value = __atomic_load_n( word, __ATOMIC_ACQUIRE );
+  for ( int i = 0; value == stuck && i < ringSpins(); i++ )
+  {
+    ringRelax();
+    value = __atomic_load_n( word, __ATOMIC_ACQUIRE );
+  }
+
+  while ( value == stuck )
+  {
+    // Said before looking again, so the other side cannot miss it
+    __atomic_store_n( asleep, 1, __ATOMIC_SEQ_CST );
+    value = __atomic_load_n( word, __ATOMIC_SEQ_CST );
+    if ( value == stuck )
+    {
+      ringSleep( word, stuck );
+      value = __atomic_load_n( word, __ATOMIC_ACQUIRE );
+    }
+    __atomic_store_n( asleep, 0, __ATOMIC_RELAXED );
+
+    if ( value == stuck && ringPeerGone( peer ) )
+    {
+      break;
+    }
+  }
+  return value;
+}
+
+/**
+ * Read whatever bytes are waiting in a ring, waiting for at least one.
+ *
+ * @param[in] ring - The ring, which only this thread reads.
+ * @param[out] buffer - Where to copy the bytes.
+ * @param[in] len - The most bytes to copy.
+ * @param[in] peer - The socket the channel was set up over.
+ *
+ * @return The number of bytes read, or 0 once the peer has gone.
+ */
+inline int ringRead( ring_t* ring, char* buffer, int len, int peer )
+{
+  uint32_t tail = ring->tail;
+  uint32_t head = ringAwait( &ring->head, &ring->readerAsleep, tail, peer );
+  if ( head == tail )
+  {
+    return 0;
+  }
+
+  uint32_t count = head - tail < (uint32_t)len ? head - tail : len;
+  uint32_t start = tail % RING_BYTES;
+  uint32_t first = count < RING_BYTES - start ? count : RING_BYTES - start;
+  memcpy( buffer, ring->data + start, first );
+  memcpy( buffer + first, ring->data, count - first );
+
+  __atomic_store_n( &ring->tail, tail + count, __ATOMIC_SEQ_CST );
+  if ( __atomic_load_n( &ring->writerAsleep, __ATOMIC_SEQ_CST ) )
+  {
+    ringWake( &ring->tail );
+  }
+  return count;
+}
+
+/**
+ * Write all of a buffer to a ring, waiting for room as needed.
+ *
+ * @param[in] ring - The ring, which only this thread writes.
+ * @param[in] data - The bytes to write.
+ * @param[in] len - The number of bytes.
+ * @param[in] peer - The socket the channel was set up over.
+ *
+ * @return False if the peer went away before it was all written.
+ */
+inline bool ringWrite( ring_t* ring, const char* data, int len, int peer )
+{
+  while ( len > 0 )
+  {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE );
+    if ( head - tail == RING_BYTES )
+    {
+      tail = ringAwait( &ring->tail, &ring->writerAsleep, tail, peer );
+      if ( head - tail == RING_BYTES )
+      {
+        return false;
+      }
+    }
+
+    uint32_t room = RING_BYTES - ( head - tail );
+    uint32_t count = (uint32_t)len < room ? len : room;
+    uint32_t start = head % RING_BYTES;
+    uint32_t first = count < RING_BYTES - start ? count : RING_BYTES - start;
+    memcpy( ring->data + start, data, first );
+    memcpy( ring->data, data + first, count - first );
+
+    __atomic_store_n( &ring->head, head + count, __ATOMIC_SEQ_CST );
+    if ( __atomic_load_n( &ring->readerAsleep, __ATOMIC_SEQ_CST ) )
+    {
+      ringWake( &ring->head );
+    }
+
+    data += count;
+    len -= count;
+  }
+  return true;
+}
+
+#endif // _RING_H_
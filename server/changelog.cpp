@@ -0,0 +1,244 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the change log, see changelog.h for
+ * more details.
+ */
+
+#include "changelog.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+
+ChangeLog::ChangeLog( size_t capacity )
+  : entries( new change_t[ capacity ] ),
+    capacity( capacity ),
+    head( 0 ),
+    gap( 0 ),
+    stamped( 0 ),
+    subscribers( 0 ),
+    missed( false ),
+    dropped( 0 )
+{
+  memset( entries, 0, capacity * sizeof( change_t ) );
+  pthread_mutex_init( &mutex, NULL );
+  pthread_cond_init( &appended, NULL );
+}
+
+ChangeLog::~ChangeLog()
+{
+  pthread_cond_destroy( &appended );
+  pthread_mutex_destroy( &mutex );
+  delete[] entries;
+}
+
+/**
+ * @return True if anyone subscribes, and changes must be logged.
+ * Otherwise the log notes that changes went unlogged.
+ */
+bool ChangeLog::listening()
+{
+  if ( __atomic_load_n( &subscribers, __ATOMIC_RELAXED ) > 0 )
+  {
+    return true;
+  }
+
+  //
+  // Noted before looking again, so a subscriber arriving meanwhile
+  // either sees the note or is seen, see subscribed()
+  //
+  if ( not __atomic_load_n( &missed, __ATOMIC_RELAXED ) )
+  {
+    __atomic_store_n( &missed, true, __ATOMIC_RELAXED );
+  }
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  return __atomic_load_n( &subscribers, __ATOMIC_RELAXED ) > 0;
+}
+
+uint64_t ChangeLog::stamp( int count )
+{
+  if ( count <= 0 || not listening() )
+  {
+    return 0;
+  }
+  return __atomic_fetch_add( &stamped, count, __ATOMIC_RELAXED ) + 1;
+}
+
+void ChangeLog::publish( uint64_t first, int command, const record_t* recs,
+                         int count, const bool* made )
+{
+  pthread_mutex_lock( &mutex );
+  uint64_t seq = first;
+  for ( int i = 0; i < count; i++ )
+  {
+    if ( NULL != made && not made[i] )
+    {
+      continue;
+    }
+
+    // Unless a change a lap on, published first, already took its place
+    change_t& entry = entries[ seq % capacity ];
+    if ( entry.seq < seq )
+    {
+      entry.seq = seq;
+      entry.record = recs[i];
+      entry.record.command = command;
+    }
+    seq++;
+  }
+
+  //
+  // Move the head over every change now written. A place holding one
+  // a lap on counts too, its subscribers being lapped in any case.
+  //
+  uint64_t before = head;
+  while ( entries[ ( head + 1 ) % capacity ].seq > head )
+  {
+    head++;
+  }
+
+  if ( head != before )
+  {
+    pthread_cond_broadcast( &appended );
+  }
+  pthread_mutex_unlock( &mutex );
+}
+
+bool ChangeLog::resume( uint64_t since, uint64_t& next )
+{
+  pthread_mutex_lock( &mutex );
+  uint64_t oldest = head >= capacity ? head - capacity + 1 : 1;
+
+  bool complete = true;
+  if ( 0 == since )
+  {
+    next = head + 1;
+  }
+  else if ( since > head )
+  {
+    // From before a restart, whatever was missed is gone
+    next = head + 1;
+    complete = false;
+  }
+  else if ( since < gap )
+  {
+    // Changes went unlogged since, while nobody subscribed
+    next = gap + 1 > oldest ? gap + 1 : oldest;
+    complete = false;
+  }
+  else if ( since + 1 < oldest )
+  {
+    next = oldest;
+    complete = false;
+  }
+  else
+  {
+    next = since + 1;
+  }
+  pthread_mutex_unlock( &mutex );
+
+  return complete;
+}
+
+int ChangeLog::read( uint64_t& next, const subscription_t& subscription,
+                     change_t* changes, int max, int milliseconds )
+{
+  pthread_mutex_lock( &mutex );
+
+  if ( next > head )
+  {
+    struct timeval now;
+    gettimeofday( &now, NULL );
+
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + milliseconds / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000L
+                       + ( milliseconds % 1000 ) * 1000000L;
+    if ( deadline.tv_nsec >= 1000000000L )
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    while ( next > head )
+    {
+      if ( pthread_cond_timedwait( &appended, &mutex, &deadline ) == ETIMEDOUT )
+      {
+        break;
+      }
+    }
+  }
+
+  if ( head >= capacity && next <= head - capacity )
+  {
+    pthread_mutex_unlock( &mutex );
+    return -1;
+  }
+
+  int count = 0;
+  for ( ; next <= head && count < max; next++ )
+  {
+    const change_t& entry = entries[ next % capacity ];
+    if ( entry.seq != next )
+    {
+      // Written over by a change a lap on before the head got here
+      pthread_mutex_unlock( &mutex );
+      return -1;
+    }
+    if ( entry.record.command == CHANGE_GAP )
+    {
+      continue;
+    }
+    if ( not subscription.ranged
+         || ( entry.record.id >= subscription.low
+              && entry.record.id <= subscription.high ) )
+    {
+      changes[ count++ ] = entry;
+    }
+  }
+  pthread_mutex_unlock( &mutex );
+
+  return count;
+}
+
+void ChangeLog::subscribed()
+{
+  pthread_mutex_lock( &mutex );
+  __atomic_store_n( &subscribers, subscribers + 1, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+
+  // Number the changes which went unlogged, see listening()
+  if ( __atomic_load_n( &missed, __ATOMIC_RELAXED ) )
+  {
+    __atomic_store_n( &missed, false, __ATOMIC_RELAXED );
+    record_t none;
+    memset( &none, 0, sizeof( none ) );
+    gap = __atomic_fetch_add( &stamped, 1, __ATOMIC_RELAXED ) + 1;
+    pthread_mutex_unlock( &mutex );
+    publish( gap, CHANGE_GAP, &none, 1 );
+    return;
+  }
+  pthread_mutex_unlock( &mutex );
+}
+
+void ChangeLog::unsubscribed( bool wasDropped )
+{
+  pthread_mutex_lock( &mutex );
+  __atomic_store_n( &subscribers, subscribers - 1, __ATOMIC_RELAXED );
+  if ( wasDropped )
+  {
+    dropped++;
+  }
+  pthread_mutex_unlock( &mutex );
+}
+
+void ChangeLog::report( std::ostream& out )
+{
+  pthread_mutex_lock( &mutex );
+  out << "changes logged " << head
+      << " kept " << ( head < capacity ? head : capacity ) << "/" << capacity
+      << " subscribers " << subscribers
+      << " dropped " << dropped << "\n";
+  pthread_mutex_unlock( &mutex );
+}
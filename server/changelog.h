@@ -0,0 +1,147 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: The most recent changes made to records, numbered in
+ * the order they were made, so subscribers can be streamed changes as
+ * they happen instead of polling for them. The log is a fixed ring,
+ * the oldest change making way for the newest, and a subscriber the
+ * newest change laps has fallen too far behind to be kept.
+ *
+ * A change is numbered while the record it changed is still locked,
+ * see stamp(), so changes to a record are numbered in the order they
+ * were made, and written to the log after that lock is let go, see
+ * publish(). Subscribers only see changes up to the first number not
+ * yet written.
+ *
+ * While nobody subscribes nothing is logged, changes costing no more
+ * than a look at the subscriber count. The first subscriber to arrive
+ * after changes went unlogged takes a number standing for them, so
+ * one resuming from before it is told what it missed is gone.
+ */
+
+#ifndef _CHANGELOG_H_
+#define _CHANGELOG_H_
+
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "common.h"
+
+// Changes kept by default
+#define DEFAULT_CHANGE_LOG 65536
+
+// The command of an entry standing for changes which went unlogged
+#define CHANGE_GAP -1
+
+/**
+ * A thread safe log of changes, any number of threads appending and
+ * reading at once.
+ */
+class ChangeLog
+{
+public:
+
+  /**
+   * @param[in] capacity - The most changes kept.
+   */
+  ChangeLog( size_t capacity = DEFAULT_CHANGE_LOG );
+  ~ChangeLog();
+
+  /**
+   * Number a batch of changes, without taking the log's lock, while
+   * the records changed are still locked.
+   *
+   * @param[in] count - The number of changes.
+   *
+   * @return The number of the first change, or 0 if nobody subscribes
+   * and the changes are not to be logged.
+   */
+  uint64_t stamp( int count );
+
+  /**
+   * Log a batch of changes numbered by stamp(), waking every waiting
+   * subscriber.
+   *
+   * @param[in] first - The number stamp() gave the first change.
+   * @param[in] command - What was done, such as add_t.
+   * @param[in] recs - The records as they now are.
+   * @param[in] count - The number of records.
+   * @param[in] made - Which of the records were changed, NULL for all,
+   * as many as were stamped.
+   */
+  void publish( uint64_t first, int command, const record_t* recs,
+                int count, const bool* made = NULL );
+
+  /**
+   * Find where a subscriber starts reading.
+   *
+   * @param[in] since - The last change the subscriber has seen, 0 to
+   * only see changes made from now on.
+   * @param[out] next - The first change to read.
+   *
+   * @return False if changes after 'since' have already been dropped,
+   * in which case reading starts at the oldest kept.
+   */
+  bool resume( uint64_t since, uint64_t& next );
+
+  /**
+   * Copy out the changes from 'next' on which a subscription wants,
+   * waiting for some to be made if there are none.
+   *
+   * @param[in,out] next - The first change to read, moved past those
+   * read or passed over.
+   * @param[in] subscription - The ids wanted.
+   * @param[out] changes - Where to copy the changes.
+   * @param[in] max - The most changes to copy.
+   * @param[in] milliseconds - The longest to wait.
+   *
+   * @return The number of changes copied, or -1 if the subscriber was
+   * lapped and changes it had yet to read were dropped.
+   */
+  int read( uint64_t& next, const subscription_t& subscription,
+            change_t* changes, int max, int milliseconds );
+
+  /**
+   * Count a subscriber arriving or leaving. A subscriber arrives
+   * before it resumes, so it learns of changes which went unlogged.
+   *
+   * @param[in] dropped - True if it was dropped for falling behind.
+   */
+  void subscribed();
+  void unsubscribed( bool dropped );
+
+  /**
+   * Write a line of statistics about the log to the stream.
+   *
+   * @param[in] out - The stream to write to.
+   */
+  void report( std::ostream& out );
+
+private:
+
+  bool listening();
+
+  pthread_mutex_t mutex;
+  pthread_cond_t appended;
+
+  change_t* entries;
+  size_t capacity;
+  uint64_t head;      // The newest change before any still unwritten
+  uint64_t gap;       // The newest number standing for unlogged changes
+  uint64_t stamped;   // The newest change numbered, see stamp()
+
+  // Read without the mutex by every change, and only written with it
+  // held, but for 'missed' which changes set once nobody subscribes
+  int subscribers;
+  bool missed;
+  unsigned long dropped;
+
+  // Not copyable
+  ChangeLog( const ChangeLog& );
+  ChangeLog& operator=( const ChangeLog& );
+};
+
+#endif // _CHANGELOG_H_
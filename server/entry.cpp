@@ -0,0 +1,307 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the compact record form and name
+ * storage, see entry.h for more details.
+ */
+
+#include "entry.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A long name, chained into its pool's index when interned.
+ */
+struct NameBlock
+{
+  NameBlock* next;
+  unsigned int hash;
+  unsigned int refs;
+  char text[ MAX_LEN ];
+};
+
+/**
+ * @param[in] text - The name.
+ * @param[in] length - The bytes in the name.
+ *
+ * @return The name's FNV-1a hash.
+ */
+static unsigned int hashName( const char* text, size_t length )
+{
+  unsigned int hash = 2166136261u;
+  for ( size_t i = 0; i < length; i++ )
+  {
+    hash = ( hash ^ (unsigned char)text[i] ) * 16777619u;
+  }
+  return hash;
+}
+
+NamePool::NamePool()
+  : blocks( "name", sizeof( NameBlock ) ),
+    buckets( NULL ),
+    mask( 0 ),
+    count( 0 ),
+    held( 0 ),
+    interning( false ),
+    wires( "wire", sizeof( WireRecord ) ),
+    epochs( NULL ),
+    oldest( NULL ),
+    newest( NULL ),
+    retiring( 0 ),
+    reclaimAt( WIRE_RECLAIM ),
+    wireHeld( 0 )
+{
+}
+
+NamePool::~NamePool()
+{
+  free( buckets );
+}
+
+void NamePool::intern( bool enabled )
+{
+  interning = enabled;
+}
+
+void NamePool::wire( WireEpochs* with )
+{
+  epochs = with;
+}
+
+const char* NamePool::text( const NameBlock* block )
+{
+  return block->text;
+}
+
+NameBlock* NamePool::acquire( const char* text, size_t length )
+{
+  unsigned int hash = 0;
+  if ( interning )
+  {
+    hash = hashName( text, length );
+    if ( NULL != buckets )
+    {
+      for ( NameBlock* block = buckets[ hash & mask ]; block != NULL;
+            block = block->next )
+      {
+        if ( block->hash == hash && memcmp( block->text, text, length ) == 0
+             && ( length == MAX_LEN || block->text[ length ] == '\0' ) )
+        {
+          block->refs++;
+          return block;
+        }
+      }
+    }
+  }
+
+  NameBlock* block = static_cast<NameBlock*>( blocks.allocate() );
+  if ( NULL == block )
+  {
+    throw std::bad_alloc();
+  }
+  memset( block->text, 0, sizeof( block->text ) );
+  memcpy( block->text, text, length );
+  block->hash = hash;
+  block->refs = 1;
+  block->next = NULL;
+  held++;
+
+  if ( interning )
+  {
+    if ( count + 1 > mask )
+    {
+      resize( mask > 0 ? ( mask + 1 ) * 2 : 64 );
+    }
+    NameBlock** bucket = &buckets[ hash & mask ];
+    block->next = *bucket;
+    *bucket = block;
+    count++;
+  }
+  return block;
+}
+
+void NamePool::release( NameBlock* block )
+{
+  if ( --block->refs > 0 )
+  {
+    return;
+  }
+
+  if ( interning )
+  {
+    for ( NameBlock** link = &buckets[ block->hash & mask ]; *link != NULL;
+          link = &(*link)->next )
+    {
+      if ( *link == block )
+      {
+        *link = block->next;
+        count--;
+        break;
+      }
+    }
+  }
+  blocks.release( block );
+  held--;
+}
+
+WireRecord* NamePool::acquireWire( const record_t& rec )
+{
+  WireRecord* wire = static_cast<WireRecord*>( wires.allocate() );
+  if ( NULL == wire )
+  {
+    throw std::bad_alloc();
+  }
+  wire->image = rec;
+  wire->image.command = RET_SUCCESS;
+  wire->next = NULL;
+  wireHeld++;
+  return wire;
+}
+
+void NamePool::retireWire( WireRecord* wire )
+{
+  wire->retired = epochs->current();
+  if ( NULL == newest )
+  {
+    oldest = wire;
+  }
+  else
+  {
+    newest->next = wire;
+  }
+  newest = wire;
+
+  if ( ++retiring >= reclaimAt )
+  {
+    reclaimWire();
+  }
+}
+
+/**
+ * Free every retired block no reader can still be sending. While a
+ * reader holds many back, wait for twice as many before trying again,
+ * so retiring stays cheap however long it takes.
+ */
+void NamePool::reclaimWire()
+{
+  uint64_t safe = epochs->oldest();
+  while ( NULL != oldest && oldest->retired < safe )
+  {
+    WireRecord* wire = oldest;
+    oldest = wire->next;
+    wires.release( wire );
+    retiring--;
+    wireHeld--;
+  }
+  if ( NULL == oldest )
+  {
+    newest = NULL;
+  }
+  reclaimAt = retiring < WIRE_RECLAIM ? WIRE_RECLAIM : 2 * retiring;
+}
+
+size_t NamePool::bytes() const
+{
+  size_t index = NULL != buckets ? ( mask + 1 ) * sizeof( NameBlock* ) : 0;
+  return index + held * blocks.blockSize() + wireHeld * wires.blockSize();
+}
+
+/**
+ * Rehash every interned name into a bucket array of the given size.
+ *
+ * @param[in] size - The new number of buckets, a power of two.
+ */
+void NamePool::resize( size_t size )
+{
+  NameBlock** grown =
+    static_cast<NameBlock**>( calloc( size, sizeof( NameBlock* ) ) );
+  if ( NULL == grown )
+  {
+    throw std::bad_alloc();
+  }
+
+  if ( NULL != buckets )
+  {
+    for ( size_t i = 0; i <= mask; i++ )
+    {
+      NameBlock* block = buckets[i];
+      while ( block != NULL )
+      {
+        NameBlock* next = block->next;
+        NameBlock** bucket = &grown[ block->hash & ( size - 1 ) ];
+        block->next = *bucket;
+        *bucket = block;
+        block = next;
+      }
+    }
+    free( buckets );
+  }
+
+  buckets = grown;
+  mask = size - 1;
+}
+
+void packEntry( entry_t& entry, const record_t& rec, NamePool& names )
+{
+  // Names are at most MAX_LEN bytes and need not be terminated
+  const char* end =
+    static_cast<const char*>( memchr( rec.name, '\0', MAX_LEN ) );
+  size_t length = NULL != end ? end - rec.name : MAX_LEN;
+
+  if ( names.wired() )
+  {
+    // Sent as unpackEntry() would copy it out
+    record_t image;
+    memset( &image, 0, sizeof( image ) );
+    image.id = entry.id;
+    image.age = rec.age;
+    memcpy( image.name, rec.name, length );
+    entry.name.wire = names.acquireWire( image );
+    entry.flags |= ENTRY_WIRE;
+  }
+  else if ( length > INLINE_NAME )
+  {
+    entry.name.block = names.acquire( rec.name, length );
+  }
+  else
+  {
+    memset( entry.name.text, 0, INLINE_NAME );
+    memcpy( entry.name.text, rec.name, length );
+  }
+  entry.length = length;
+  entry.age = rec.age;
+}
+
+void unpackEntry( const entry_t& entry, record_t& rec )
+{
+  if ( entry.flags & ENTRY_WIRE )
+  {
+    rec = entry.name.wire->image;
+    rec.command = 0;
+    return;
+  }
+
+  const char* text = entry.length > INLINE_NAME
+                   ? NamePool::text( entry.name.block )
+                   : entry.name.text;
+
+  memset( &rec, 0, sizeof( rec ) );
+  rec.id = entry.id;
+  rec.age = entry.age;
+  memcpy( rec.name, text, entry.length );
+}
+
+void releaseEntry( entry_t& entry, NamePool& names )
+{
+  if ( entry.flags & ENTRY_WIRE )
+  {
+    names.retireWire( entry.name.wire );
+    entry.flags &= ~ENTRY_WIRE;
+  }
+  else if ( entry.length > INLINE_NAME )
+  {
+    names.release( entry.name.block );
+  }
+  entry.length = 0;
+}
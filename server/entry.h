@@ -0,0 +1,202 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: The compact form records are kept in by the store.
+ * Fields which only matter on the wire are dropped, short names are
+ * kept inline and longer ones out of line in a per-shard NamePool,
+ * which may intern repeated names. Records are only packed into and
+ * unpacked from this form by the store, never sent as is. A store may
+ * also keep every record whole in wire form, see wire.h, in which case
+ * the entry points at that instead of holding its name.
+ */
+
+#ifndef _ENTRY_H_
+#define _ENTRY_H_
+
+#include <stddef.h>
+
+#include "common.h"
+#include "slab.h"
+#include "wire.h"
+
+// Longest name kept inside the entry itself
+#define INLINE_NAME 16
+
+// Bits of entry_t::flags
+#define ENTRY_REFERENCED 0x01  // Set on access, cleared by the CLOCK hand
+#define ENTRY_USED 0x02        // Free for tables to mark occupied slots
+#define ENTRY_WIRE 0x04        // Kept in wire form, see NamePool::wire()
+
+struct NameBlock;
+
+/**
+ * A stored record, 32 bytes however long its name.
+ */
+typedef struct
+{
+  union
+  {
+    char text[ INLINE_NAME ];  // Names of up to INLINE_NAME bytes
+    NameBlock* block;          // Longer names
+    WireRecord* wire;          // The whole record, with ENTRY_WIRE
+  } name;
+  int id;
+  int age;
+  unsigned int expires;        // Store clock second it expires, 0 never
+  unsigned char length;        // Bytes in the name
+  unsigned char flags;
+  unsigned short version;      // Bumped by every change, see mutation_t
+} entry_t;
+
+/**
+ * Out of line storage for names too long to keep inline, owned by
+ * one shard and only used with that shard's lock held.
+ */
+class NamePool
+{
+public:
+
+  NamePool();
+  ~NamePool();
+
+  /**
+   * Choose whether the pool keeps a single, counted copy of a name
+   * shared by many records. Must be called before the pool is used.
+   *
+   * @param[in] enabled - True to intern names.
+   */
+  void intern( bool enabled );
+
+  /**
+   * Keep every record whole in wire form, see wire.h, rather than
+   * only long names, interning none. Must be called before the pool
+   * is used.
+   *
+   * @param[in] epochs - The store's epochs, which tell when a retired
+   * record may be freed.
+   */
+  void wire( WireEpochs* epochs );
+
+  /**
+   * @return True if records are kept in wire form.
+   */
+  bool wired() const { return NULL != epochs; }
+
+  /**
+   * @param[in] shared - False if only one thread ever uses the pool,
+   * see Slab::share().
+   */
+  void share( bool shared )
+  {
+    blocks.share( shared );
+    wires.share( shared );
+  }
+
+  /**
+   * @param[in] text - The name, which need not be terminated.
+   * @param[in] length - The bytes in the name, more than INLINE_NAME.
+   *
+   * @return Storage holding a copy of the name.
+   */
+  NameBlock* acquire( const char* text, size_t length );
+
+  /**
+   * @param[in] block - Storage returned by acquire(), no longer used.
+   */
+  void release( NameBlock* block );
+
+  /**
+   * @param[in] block - Storage returned by acquire().
+   *
+   * @return The name it holds.
+   */
+  static const char* text( const NameBlock* block );
+
+  /**
+   * @param[in] rec - The record, whose name is zero padded.
+   *
+   * @return A block holding the record in wire form.
+   */
+  WireRecord* acquireWire( const record_t& rec );
+
+  /**
+   * Retire a block returned by acquireWire() which is no longer
+   * used, freeing it once no reader can still be sending it.
+   *
+   * @param[in] wire - The block.
+   */
+  void retireWire( WireRecord* wire );
+
+  /**
+   * @return The blocks retired but not yet freed.
+   */
+  size_t retired() const { return retiring; }
+
+  /**
+   * @return The bytes held for names, index and all.
+   */
+  size_t bytes() const;
+
+private:
+
+  void resize( size_t size );
+  void reclaimWire();
+
+  Slab blocks;
+  NameBlock** buckets;
+  size_t mask;
+  size_t count;   // Names indexed for interning
+  size_t held;    // Blocks allocated
+  bool interning;
+
+  Slab wires;
+  WireEpochs* epochs;   // NULL unless records are kept in wire form
+  WireRecord* oldest;   // Retired blocks, in the order retired
+  WireRecord* newest;
+  size_t retiring;      // Retired blocks not yet freed
+  size_t reclaimAt;     // How many there may be before freeing some
+  size_t wireHeld;      // Blocks allocated, retired ones included
+
+  // Not copyable
+  NamePool( const NamePool& );
+  NamePool& operator=( const NamePool& );
+};
+
+/**
+ * Fill an entry from a record, taking a copy of a long name.
+ *
+ * @param[out] entry - The entry, whose id must already be set.
+ * @param[in] rec - The record to store.
+ * @param[in] names - The shard's name storage.
+ */
+void packEntry( entry_t& entry, const record_t& rec, NamePool& names );
+
+/**
+ * @param[in] entry - A stored entry, kept in wire form.
+ *
+ * @return The record exactly as sent, until the entry is next changed
+ * and the block is then retired, see wire.h.
+ */
+inline const record_t* wireImage( const entry_t& entry )
+{
+  return &entry.name.wire->image;
+}
+
+/**
+ * Copy a stored record back out, in the form sent on the wire.
+ *
+ * @param[in] entry - The stored entry.
+ * @param[out] rec - The record, its name zero padded.
+ */
+void unpackEntry( const entry_t& entry, record_t& rec );
+
+/**
+ * Give up any name storage held by an entry about to be removed
+ * or overwritten.
+ *
+ * @param[in] entry - The entry.
+ * @param[in] names - The shard's name storage.
+ */
+void releaseEntry( entry_t& entry, NamePool& names );
+
+#endif // _ENTRY_H_
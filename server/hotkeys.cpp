@@ -0,0 +1,369 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of hot id detection, see hotkeys.h
+ * for more details.
+ */
+
+#include "hotkeys.h"
+
+#include <algorithm>
+#include <vector>
+#include <unistd.h>
+
+/**
+ * An id and what it was done with, as one sketch key.
+ */
+static inline uint64_t hotKey( HotKeys::Kind kind, int id )
+{
+  return ( (uint64_t)(uint32_t)id << 1 ) | kind;
+}
+
+// The golden ratio in 64 bits, for Fibonacci hashing as in tables.h
+static const uint64_t HOT_GOLDEN = ( (uint64_t)0x9e3779b9u << 32 ) | 0x7f4a7c15u;
+
+/**
+ * Hash a key, each row taking its column from a different stretch of
+ * the top of the product, where every bit of the key has a say.
+ */
+static inline uint64_t hotHash( uint64_t key )
+{
+  return key * HOT_GOLDEN;
+}
+
+static inline uint32_t hotColumn( uint64_t hash, int row )
+{
+  return ( hash >> ( 54 - 10 * row ) ) & ( HOT_WIDTH - 1 );
+}
+
+struct HotCounter
+{
+  // Written only by the holder, read by the merger
+  uint32_t cells[ HOT_DEPTH ][ HOT_WIDTH ];
+  uint64_t keys[ HOT_TRACKED ];
+  uint32_t counts[ HOT_TRACKED ];
+
+  // The holder's own
+  uint32_t floor;     // Lowest count in the summary
+  uint32_t epoch;     // Merge the summary was last cleared for
+
+  // The merger's own, what it has folded in so far
+  uint32_t seen[ HOT_DEPTH ][ HOT_WIDTH ];
+
+  HotCounter* next;       // Every counter ever made, never freed
+  HotCounter* nextFree;   // Counters no thread holds
+};
+
+/**
+ * An id ranked by the last merge.
+ */
+struct HotEntry
+{
+  uint64_t key;
+  uint32_t estimate;
+};
+
+static bool hotter( const HotEntry& one, const HotEntry& other )
+{
+  return one.estimate > other.estimate;
+}
+
+__thread HotCounter* HotKeys::local = NULL;
+
+// Bumped by each merge, telling holders to clear their summaries
+static uint32_t hotEpoch = 0;
+
+// Every counter, and those waiting for a thread, guarded by hotMutex
+static pthread_mutex_t hotMutex = PTHREAD_MUTEX_INITIALIZER;
+static HotCounter* hotCounters = NULL;
+static HotCounter* hotFree = NULL;
+
+// Releases a thread's counter when it exits
+static pthread_key_t hotHolder;
+static pthread_once_t hotOnce = PTHREAD_ONCE_INIT;
+
+// The decayed sum of every thread's counts, the merger's own
+static uint32_t hotGlobal[ HOT_DEPTH ][ HOT_WIDTH ];
+
+// The last merge's ranking, guarded by rankMutex
+static pthread_mutex_t rankMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector< HotEntry > hotRanked[ 2 ];
+static unsigned long hotMerges = 0;
+
+void HotKeys::createHolder()
+{
+  pthread_key_create( &hotHolder, release );
+}
+
+HotCounter* HotKeys::acquire()
+{
+  pthread_once( &hotOnce, createHolder );
+
+  pthread_mutex_lock( &hotMutex );
+  HotCounter* counter = hotFree;
+  if ( NULL != counter )
+  {
+    hotFree = counter->nextFree;
+  }
+  else
+  {
+    counter = new HotCounter();
+    counter->next = hotCounters;
+    hotCounters = counter;
+  }
+  pthread_mutex_unlock( &hotMutex );
+
+  pthread_setspecific( hotHolder, counter );
+  local = counter;
+  return counter;
+}
+
+void HotKeys::release( void* counter )
+{
+  // The merger folds in whatever it has not yet seen, as for any other
+  HotCounter* released = (HotCounter*)counter;
+
+  pthread_mutex_lock( &hotMutex );
+  released->nextFree = hotFree;
+  hotFree = released;
+  pthread_mutex_unlock( &hotMutex );
+}
+
+void HotKeys::count( Kind kind, int id )
+{
+  HotCounter* counter = local;
+  if ( NULL == counter )
+  {
+    counter = acquire();
+  }
+
+  uint64_t key = hotKey( kind, id );
+  uint64_t hash = hotHash( key );
+
+  uint32_t* cells[ HOT_DEPTH ];
+  uint32_t least = UINT32_MAX;
+  for ( int row = 0; row < HOT_DEPTH; row++ )
+  {
+    cells[ row ] = &counter->cells[ row ][ hotColumn( hash, row ) ];
+    least = *cells[ row ] < least ? *cells[ row ] : least;
+  }
+
+  //
+  // Conservative update, only the counters holding the estimate grow.
+  // Written as a maximum so the compiler need not branch on each row.
+  //
+  uint32_t estimate = least + 1;
+  for ( int row = 0; row < HOT_DEPTH; row++ )
+  {
+    uint32_t cell = *cells[ row ];
+    __atomic_store_n( cells[ row ], cell > least ? cell : estimate,
+                      __ATOMIC_RELAXED );
+  }
+
+  uint32_t epoch = __atomic_load_n( &hotEpoch, __ATOMIC_RELAXED );
+  if ( counter->epoch != epoch )
+  {
+    // Renominate from scratch, keeping the ids until they are beaten
+    counter->epoch = epoch;
+    counter->floor = 0;
+    for ( int i = 0; i < HOT_TRACKED; i++ )
+    {
+      __atomic_store_n( &counter->counts[i], 0, __ATOMIC_RELAXED );
+    }
+  }
+
+  if ( estimate <= counter->floor )
+  {
+    return;
+  }
+
+  // Space-saving, a newcomer takes the place of the lowest count
+  int lowest = 0;
+  int slot = -1;
+  for ( int i = 0; i < HOT_TRACKED; i++ )
+  {
+    if ( counter->keys[i] == key )
+    {
+      slot = i;
+      break;
+    }
+    if ( counter->counts[i] < counter->counts[ lowest ] )
+    {
+      lowest = i;
+    }
+  }
+
+  uint32_t displaced;
+  if ( slot >= 0 )
+  {
+    displaced = counter->counts[ slot ];
+  }
+  else
+  {
+    slot = lowest;
+    displaced = counter->floor;
+    __atomic_store_n( &counter->keys[ slot ], key, __ATOMIC_RELAXED );
+  }
+  __atomic_store_n( &counter->counts[ slot ], estimate, __ATOMIC_RELAXED );
+
+  // Only raising the lowest count can raise the floor
+  if ( displaced == counter->floor )
+  {
+    uint32_t floor = UINT32_MAX;
+    for ( int i = 0; i < HOT_TRACKED; i++ )
+    {
+      floor = counter->counts[i] < floor ? counter->counts[i] : floor;
+    }
+    counter->floor = floor;
+  }
+}
+
+/**
+ * @return The global estimate for a key.
+ */
+static uint32_t estimate( uint64_t key )
+{
+  uint64_t hash = hotHash( key );
+  uint32_t least = UINT32_MAX;
+  for ( int row = 0; row < HOT_DEPTH; row++ )
+  {
+    uint32_t cell = hotGlobal[ row ][ hotColumn( hash, row ) ];
+    least = cell < least ? cell : least;
+  }
+  return least;
+}
+
+void HotKeys::mergeOnce()
+{
+  // Old counts fade, so an id cooling off drops out of the ranking
+  for ( int row = 0; row < HOT_DEPTH; row++ )
+  {
+    for ( int column = 0; column < HOT_WIDTH; column++ )
+    {
+      hotGlobal[ row ][ column ] >>= 1;
+    }
+  }
+
+  // Counters are only ever added at the head, so the list is stable
+  pthread_mutex_lock( &hotMutex );
+  HotCounter* counters = hotCounters;
+  pthread_mutex_unlock( &hotMutex );
+
+  std::vector< uint64_t > candidates;
+  for ( HotCounter* counter = counters; NULL != counter;
+        counter = counter->next )
+  {
+    for ( int row = 0; row < HOT_DEPTH; row++ )
+    {
+      for ( int column = 0; column < HOT_WIDTH; column++ )
+      {
+        uint32_t cell = __atomic_load_n( &counter->cells[ row ][ column ],
+                                         __ATOMIC_RELAXED );
+        hotGlobal[ row ][ column ] += cell - counter->seen[ row ][ column ];
+        counter->seen[ row ][ column ] = cell;
+      }
+    }
+
+    for ( int i = 0; i < HOT_TRACKED; i++ )
+    {
+      if ( __atomic_load_n( &counter->counts[i], __ATOMIC_RELAXED ) > 0 )
+      {
+        candidates.push_back( __atomic_load_n( &counter->keys[i],
+                                               __ATOMIC_RELAXED ) );
+      }
+    }
+  }
+
+  // Ids ranked last time stay in the running even if nobody nominated
+  // them this time round, since each thread renominates from scratch
+  pthread_mutex_lock( &rankMutex );
+  for ( int kind = 0; kind < 2; kind++ )
+  {
+    for ( size_t i = 0; i < hotRanked[ kind ].size(); i++ )
+    {
+      candidates.push_back( hotRanked[ kind ][i].key );
+    }
+  }
+  pthread_mutex_unlock( &rankMutex );
+
+  std::sort( candidates.begin(), candidates.end() );
+  candidates.erase( std::unique( candidates.begin(), candidates.end() ),
+                    candidates.end() );
+
+  std::vector< HotEntry > ranked[ 2 ];
+  for ( size_t i = 0; i < candidates.size(); i++ )
+  {
+    HotEntry entry;
+    entry.key = candidates[i];
+    entry.estimate = estimate( entry.key );
+    if ( entry.estimate > 0 )
+    {
+      ranked[ entry.key & 1 ].push_back( entry );
+    }
+  }
+
+  for ( int kind = 0; kind < 2; kind++ )
+  {
+    std::sort( ranked[ kind ].begin(), ranked[ kind ].end(), hotter );
+    if ( ranked[ kind ].size() > HOT_TRACKED )
+    {
+      ranked[ kind ].resize( HOT_TRACKED );
+    }
+  }
+
+  pthread_mutex_lock( &rankMutex );
+  hotRanked[ GET ].swap( ranked[ GET ] );
+  hotRanked[ ADD ].swap( ranked[ ADD ] );
+  hotMerges++;
+  pthread_mutex_unlock( &rankMutex );
+
+  __atomic_add_fetch( &hotEpoch, 1, __ATOMIC_RELAXED );
+}
+
+void* HotKeys::merge( void* arg )
+{
+  (void)arg;
+  while ( true )
+  {
+    usleep( HOT_MERGE_MS * 1000 );
+    mergeOnce();
+  }
+  return NULL;
+}
+
+void HotKeys::start()
+{
+  pthread_once( &hotOnce, createHolder );
+
+  pthread_t merger;
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes );
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+  pthread_create( &merger, &attributes, merge, NULL );
+  pthread_attr_destroy( &attributes );
+}
+
+void HotKeys::report( std::ostream& out, int most )
+{
+  static const char* names[ 2 ] = { "hot_get", "hot_add" };
+
+  pthread_mutex_lock( &rankMutex );
+  out << "hot_merges " << hotMerges << "\n";
+  for ( int kind = 0; kind < 2; kind++ )
+  {
+    const std::vector< HotEntry >& ranked = hotRanked[ kind ];
+    for ( size_t i = 0; i < ranked.size(); i++ )
+    {
+      if ( most > 0 && (int)i == most )
+      {
+        break;
+      }
+
+      // Halving each merge, a steady rate settles at twice itself
+      uint64_t perSecond = (uint64_t)ranked[i].estimate * 500 / HOT_MERGE_MS;
+      out << names[ kind ] << " " << (int)(uint32_t)( ranked[i].key >> 1 )
+          << " " << perSecond << "\n";
+    }
+  }
+  pthread_mutex_unlock( &rankMutex );
+}
@@ -0,0 +1,84 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Always on detection of the ids most often asked for
+ * and added. Each thread counts the ids it serves in a count-min
+ * sketch of its own and keeps the few highest counted in a
+ * space-saving summary, touching nothing shared. A merger thread
+ * folds what every thread counted since its last visit into a
+ * global sketch once a second, halving the old counts first so the
+ * report follows the current load, and ranks the ids the threads
+ * nominated against it.
+ *
+ * A request which is counted pays for a hash, four counter updates
+ * and, only when its id may be among the thread's highest, a scan of
+ * the summary.
+ */
+
+#ifndef _HOTKEYS_H_
+#define _HOTKEYS_H_
+
+#include <ostream>
+#include <stdint.h>
+
+#include <pthread.h>
+
+// Rows and counters per row of each sketch, the width a power of two
+// no more than 1024, as each row takes its column from ten bits
+#define HOT_DEPTH 4
+#define HOT_WIDTH 1024
+
+// Ids each thread nominates, and the most the report ranks per kind
+#define HOT_TRACKED 32
+
+// Milliseconds between merges
+#define HOT_MERGE_MS 1000
+
+/**
+ * The counts one thread keeps. It is only written by the thread
+ * holding it, and passes to another thread once its holder exits.
+ */
+struct HotCounter;
+
+class HotKeys
+{
+public:
+
+  // What was done with an id
+  enum Kind { GET = 0, ADD = 1 };
+
+  /**
+   * Start the merger thread. Ids counted before this are kept for
+   * the first merge.
+   */
+  static void start();
+
+  /**
+   * Count an id against the calling thread.
+   *
+   * @param[in] kind - Whether the id was asked for or added.
+   * @param[in] id - The id.
+   */
+  static void count( Kind kind, int id );
+
+  /**
+   * Write one line per hot id, highest first, giving the requests a
+   * second it has seen lately.
+   *
+   * @param[in] out - The stream to write to.
+   * @param[in] most - The most ids reported per kind, 0 for all.
+   */
+  static void report( std::ostream& out, int most );
+
+private:
+
+  static void createHolder();
+  static HotCounter* acquire();
+  static void release( void* counter );
+  static void* merge( void* arg );
+  static void mergeOnce();
+
+  static __thread HotCounter* local;
+};
+
+#endif // _HOTKEYS_H_
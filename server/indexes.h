@@ -0,0 +1,87 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Secondary indexes a Store may keep over record names
+ * and ages. Both are ordered sets of keys ending in the record id,
+ * so equal names or ages never collide, a name index answers exact
+ * and prefix queries alike, and a query can resume from the last key
+ * it returned. Like the tables, they rely on the Store for locking.
+ */
+
+#ifndef _INDEXES_H_
+#define _INDEXES_H_
+
+#include <limits.h>
+#include <set>
+#include <string.h>
+#include <utility>
+
+#include "common.h"
+#include "slab.h"
+
+/**
+ * A name index key, the name zero padded so keys compare bytewise.
+ */
+typedef struct
+{
+  char name[ MAX_LEN ];
+  int id;
+} name_key_t;
+
+inline bool operator<( const name_key_t& left, const name_key_t& right )
+{
+  int order = memcmp( left.name, right.name, MAX_LEN );
+  return order < 0 || ( order == 0 && left.id < right.id );
+}
+
+// An age index key, the age then the id
+typedef std::pair<int, int> age_key_t;
+
+typedef std::set<name_key_t, std::less<name_key_t>,
+                 SlabAllocator<name_key_t> > name_index_t;
+
+typedef std::set<age_key_t, std::less<age_key_t>,
+                 SlabAllocator<age_key_t> > age_index_t;
+
+/**
+ * @param[in] rec - A record.
+ *
+ * @return The record's name index key.
+ */
+inline name_key_t nameKey( const record_t& rec )
+{
+  name_key_t key;
+  memset( key.name, 0, MAX_LEN );
+  memcpy( key.name, rec.name, strnlen( rec.name, MAX_LEN ) );
+  key.id = rec.id;
+  return key;
+}
+
+/**
+ * @return The bytes indexing one record costs, a tree node with its
+ * four word header in each index.
+ */
+inline size_t indexCost()
+{
+  return sizeof( name_key_t ) + sizeof( age_key_t ) + 8 * sizeof( void* );
+}
+
+/**
+ * Where a query resumes, shard by shard. A default constructed
+ * cursor starts a query from the beginning.
+ */
+struct QueryCursor
+{
+  QueryCursor()
+    : shard( 0 ),
+      started( false )
+  {
+  }
+
+  int shard;          // The shard being searched
+  bool started;       // Whether a key has been returned from it
+  name_key_t name;    // The last key returned, for name queries
+  age_key_t age;      // The last key returned, for age queries
+};
+
+#endif // _INDEXES_H_
@@ -0,0 +1,398 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the record store library, see
+ * recordstore.h for more details.
+ */
+
+#include "recordstore.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "entry.h"
+#include "snapshot.h"
+#include "store.h"
+#include "wire.h"
+
+// How often, in microseconds, the store is swept for expired
+// records, and how many entries per shard each sweep examines.
+#define SWEEP_INTERVAL 100000
+#define SWEEP_BUDGET 256
+
+// How often, in microseconds, the cold tier is written out and merged
+#define TIER_INTERVAL 50000
+
+//
+// The storage engine the library is built with, see the Makefile.
+//
+#if defined( STORE_MAP )
+typedef Store<MapTable, 1> database_t;
+#elif defined( STORE_FLAT )
+typedef Store<FlatTable, 16> database_t;
+#else
+typedef Store<HashTable, 16> database_t;
+#endif
+
+struct RecordStore::Engine
+{
+  database_t database;
+};
+
+/**
+ * What a snapshot's reaper needs to know.
+ */
+struct Reaping
+{
+  RecordStore* owner;
+  pid_t pid;
+};
+
+StoreOptions::StoreOptions()
+  : bytes( 0 ),
+    ttl( 0 ),
+    intern( false ),
+    index( false ),
+    snapshot( DEFAULT_SNAPSHOT_FILE ),
+    tier( NULL ),
+    shared( true ),
+    wire( false )
+{
+}
+
+RecordStore::RecordStore( const StoreOptions& options )
+  : store( new Engine ),
+    epochs( options.wire ? new WireEpochs : NULL ),
+    ttl( options.ttl ),
+    path( options.snapshot ),
+    shared( options.shared ),
+    tiered( NULL != options.tier && not options.index && options.shared ),
+    stopping( false ),
+    nextSweep( 0 ),
+    mutex( "snapshot" ),
+    running( false ),
+    taken( 0 ),
+    failed( 0 ),
+    lastMillis( 0 )
+{
+  store->database.configure( options.bytes );
+  store->database.intern( options.intern );
+  store->database.index( options.index );
+  store->database.share( shared );
+  if ( NULL != epochs )
+  {
+    store->database.wire( epochs );
+  }
+  if ( tiered )
+  {
+    store->database.tier( options.tier );
+  }
+
+  if ( shared )
+  {
+    pthread_create( &sweeper, NULL, sweep, this );
+  }
+  if ( tiered )
+  {
+    pthread_create( &maintainer, NULL, maintain, this );
+  }
+}
+
+RecordStore::~RecordStore()
+{
+  stopping = true;
+  if ( shared )
+  {
+    pthread_join( sweeper, NULL );
+  }
+  if ( tiered )
+  {
+    pthread_join( maintainer, NULL );
+  }
+
+  // The reaper still needs the counters
+  while ( true )
+  {
+    mutex.lock();
+    bool waiting = running;
+    mutex.unlock();
+    if ( not waiting )
+    {
+      break;
+    }
+    usleep( SWEEP_INTERVAL );
+  }
+
+  delete store;
+  delete epochs;
+}
+
+const char* RecordStore::engine()
+{
+  return database_t::name();
+}
+
+bool RecordStore::ownable()
+{
+  return database_t::ownable();
+}
+
+long RecordStore::restore()
+{
+  return loadSnapshot( store->database, path );
+}
+
+void RecordStore::log( ChangeLog* changes )
+{
+  store->database.log( changes );
+}
+
+bool RecordStore::add( const record_t& rec, unsigned int ttl )
+{
+  return store->database.insert( rec, ttl );
+}
+
+bool RecordStore::get( int id, record_t& rec )
+{
+  return store->database.lookup( id, rec );
+}
+
+int RecordStore::mutate( const mutation_t& request, mutation_t& result )
+{
+  return store->database.mutate( request, result );
+}
+
+int RecordStore::addBatch( const record_t* recs, int count,
+                           const unsigned int* ttls, bool* added )
+{
+  unsigned int defaults[ MAX_BATCH ];
+  if ( NULL == ttls )
+  {
+    for ( int i = 0; i < count && i < MAX_BATCH; i++ )
+    {
+      defaults[i] = ttl;
+    }
+    ttls = defaults;
+  }
+  return store->database.insertBatch( recs, count, ttls, added );
+}
+
+int RecordStore::getBatch( const int* ids, int count, record_t* recs,
+                           bool* found )
+{
+  return store->database.lookupBatch( ids, count, recs, found );
+}
+
+int RecordStore::joinWire()
+{
+  return NULL != epochs ? epochs->join() : -1;
+}
+
+void RecordStore::leaveWire( int reader )
+{
+  if ( reader >= 0 )
+  {
+    epochs->leave( reader );
+  }
+}
+
+void RecordStore::unpinWire( int reader )
+{
+  epochs->unpin( reader );
+}
+
+int RecordStore::getBatch( int reader, const int* ids, int count,
+                           const record_t** images )
+{
+  epochs->pin( reader );
+  return store->database.lookupBatch( ids, count, images );
+}
+
+bool RecordStore::indexed()
+{
+  return store->database.indexed();
+}
+
+int RecordStore::findByName( const char* name, bool prefix,
+                             QueryCursor& cursor, record_t* recs, int max )
+{
+  return store->database.findByName( name, prefix, cursor, recs, max );
+}
+
+int RecordStore::findByAge( int low, int high, QueryCursor& cursor,
+                            record_t* recs, int max )
+{
+  return store->database.findByAge( low, high, cursor, recs, max );
+}
+
+int RecordStore::findByName( int reader, const char* name, bool prefix,
+                             QueryCursor& cursor, const record_t** images,
+                             int max )
+{
+  epochs->pin( reader );
+  return store->database.findByName( name, prefix, cursor, images, max );
+}
+
+int RecordStore::findByAge( int reader, int low, int high,
+                            QueryCursor& cursor, const record_t** images,
+                            int max )
+{
+  epochs->pin( reader );
+  return store->database.findByAge( low, high, cursor, images, max );
+}
+
+size_t RecordStore::size()
+{
+  return store->database.size();
+}
+
+int RecordStore::expire()
+{
+  struct timespec clock;
+  clock_gettime( CLOCK_MONOTONIC, &clock );
+  long millis = clock.tv_sec * 1000 + clock.tv_nsec / 1000000;
+
+  if ( millis >= nextSweep )
+  {
+    store->database.sweep( SWEEP_BUDGET );
+    nextSweep = millis + SWEEP_INTERVAL / 1000;
+  }
+  return nextSweep - millis;
+}
+
+/**
+ * Threading function which periodically sweeps expired records out
+ * of the store, a little at a time, until the store is destroyed.
+ *
+ * @param[in] arg - The RecordStore.
+ */
+void* RecordStore::sweep( void* arg )
+{
+  RecordStore* owner = static_cast<RecordStore*>( arg );
+
+  while ( not owner->stopping )
+  {
+    usleep( SWEEP_INTERVAL );
+    owner->store->database.sweep( SWEEP_BUDGET );
+  }
+  return NULL;
+}
+
+/**
+ * Threading function which writes out and merges the cold tier's
+ * segments, away from the sweep as it spends its time on disk.
+ *
+ * @param[in] arg - The RecordStore.
+ */
+void* RecordStore::maintain( void* arg )
+{
+  RecordStore* owner = static_cast<RecordStore*>( arg );
+
+  while ( not owner->stopping )
+  {
+    usleep( TIER_INTERVAL );
+    owner->store->database.maintain();
+  }
+  return NULL;
+}
+
+/**
+ * Wait for a snapshot child to finish and record how it went.
+ *
+ * @param[in] arg - The snapshot's Reaping, which is freed here.
+ */
+void* RecordStore::reap( void* arg )
+{
+  Reaping* reaping = static_cast<Reaping*>( arg );
+  RecordStore* owner = reaping->owner;
+  pid_t pid = reaping->pid;
+  delete reaping;
+
+  struct timespec begin, end;
+  clock_gettime( CLOCK_MONOTONIC, &begin );
+
+  int status = 0;
+  while ( waitpid( pid, &status, 0 ) < 0 && errno == EINTR )
+  {
+  }
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  bool written = WIFEXITED( status ) && WEXITSTATUS( status ) == EXIT_SUCCESS;
+
+  owner->mutex.lock();
+  owner->running = false;
+  owner->taken += written;
+  owner->failed += not written;
+  owner->lastMillis = ( end.tv_sec - begin.tv_sec ) * 1000
+                      + ( end.tv_nsec - begin.tv_nsec ) / 1000000;
+  owner->mutex.unlock();
+  return NULL;
+}
+
+pid_t RecordStore::snapshot()
+{
+  mutex.lock();
+  bool busy = running;
+  running = true;
+  mutex.unlock();
+
+  if ( busy )
+  {
+    return -1;
+  }
+
+  pid_t pid = store->database.fork();
+  if ( pid == 0 )
+  {
+    _exit( writeSnapshot( store->database, path ) ? EXIT_SUCCESS
+                                                  : EXIT_FAILURE );
+  }
+
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes );
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+
+  Reaping* reaping = pid > 0 ? new Reaping : NULL;
+  if ( NULL != reaping )
+  {
+    reaping->owner = this;
+    reaping->pid = pid;
+  }
+
+  pthread_t reaper;
+  bool started = NULL != reaping
+                 && pthread_create( &reaper, &attributes, reap, reaping ) == 0;
+  pthread_attr_destroy( &attributes );
+
+  if ( not started )
+  {
+    delete reaping;
+    if ( pid > 0 )
+    {
+      waitpid( pid, NULL, 0 );
+    }
+    mutex.lock();
+    running = false;
+    failed++;
+    mutex.unlock();
+    return -1;
+  }
+  return pid;
+}
+
+void RecordStore::report( std::ostream& out )
+{
+  mutex.lock();
+  out << "snapshots " << taken
+      << " failed " << failed
+      << " running " << running
+      << " last_ms " << lastMillis << "\n";
+  mutex.unlock();
+
+  store->database.report( out );
+}
@@ -0,0 +1,281 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: The record store as a library, for programs which want
+ * the server's add, retrieve and change semantics without a network
+ * hop. The server itself is a frontend over this class, so both
+ * behave alike.
+ *
+ * The storage engine is picked when the library is built, exactly as
+ * for the server, see the Makefile. Every method may be called from
+ * any number of threads at once, unless the store is not 'shared'.
+ */
+
+#ifndef _RECORDSTORE_H_
+#define _RECORDSTORE_H_
+
+#include <ostream>
+#include <stddef.h>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "indexes.h"
+#include "trace.h"
+
+class ChangeLog;
+class WireEpochs;
+
+// Where snapshots go unless told otherwise.
+#define DEFAULT_SNAPSHOT_FILE "server-snapshot.bin"
+
+/**
+ * How a RecordStore is set up, the defaults being those of a server
+ * started without any options.
+ */
+struct StoreOptions
+{
+  size_t bytes;          // Memory the store is kept within, 0 for any
+  unsigned int ttl;      // Seconds records added without one last, 0 for ever
+  bool intern;           // Store repeated long names once per shard
+  bool index;            // Index records by name and age for queries
+  const char* snapshot;  // Where snapshots are written
+  const char* tier;      // Where records evicted for 'bytes' go, NULL to
+                         // drop them, unused with 'index' or unshared
+  bool shared;           // False if only the thread which made the store
+                         // uses it, taking no locks and calling expire()
+  bool wire;             // Keep records in wire form as well, see wire.h
+
+  StoreOptions();
+};
+
+/**
+ * A thread safe store of records, which sweeps out its own expired
+ * records, and keeps its cold tier, in the background for as long as
+ * it exists. A store which is not shared starts no threads, its owner
+ * sweeping it with expire().
+ */
+class RecordStore
+{
+public:
+
+  /**
+   * @param[in] options - How to set up the store.
+   */
+  RecordStore( const StoreOptions& options = StoreOptions() );
+  ~RecordStore();
+
+  /**
+   * @return The name of the storage engine the library was built with.
+   */
+  static const char* engine();
+
+  /**
+   * @return True if a store one thread owns, see StoreOptions::shared,
+   * takes no lock at all, which the map engine's shared slab does.
+   */
+  static bool ownable();
+
+  /**
+   * Load the records in the snapshot file.
+   *
+   * @return The number of records loaded, or -1 if the file could not
+   * be read or is corrupt, with errno describing why.
+   */
+  long restore();
+
+  /**
+   * Log every record added or changed from now on, see changelog.h,
+   * in the order the changes to each record were made. Must be called
+   * before the store is used by more than one thread.
+   *
+   * @param[in] changes - Where to log them, NULL to stop logging.
+   */
+  void log( ChangeLog* changes );
+
+  /**
+   * Add a record, unless its id is taken.
+   *
+   * @param[in] rec - The record.
+   * @param[in] ttl - Seconds it lives for, 0 for ever.
+   *
+   * @return True if the record was added.
+   */
+  bool add( const record_t& rec, unsigned int ttl );
+
+  /**
+   * Add a record which lives for the store's default time to live.
+   */
+  bool add( const record_t& rec ) { return add( rec, ttl ); }
+
+  /**
+   * @param[in] id - The id to look for.
+   * @param[out] rec - The record, if found.
+   *
+   * @return True if the record was found.
+   */
+  bool get( int id, record_t& rec );
+
+  /**
+   * Change a record in place, see Store::mutate().
+   *
+   * @param[in] request - The change.
+   * @param[out] result - The record and its version after the change.
+   *
+   * @return RET_SUCCESS, RET_FAILURE or RET_CONFLICT, see common.h.
+   */
+  int mutate( const mutation_t& request, mutation_t& result );
+
+  /**
+   * Add a batch of records, see Store::insertBatch().
+   *
+   * @param[in] ttls - Seconds each record lives for, NULL for the
+   * store's default.
+   *
+   * @return The number of records added.
+   */
+  int addBatch( const record_t* recs, int count, const unsigned int* ttls,
+                bool* added );
+
+  /**
+   * Look up a batch of ids, see Store::lookupBatch().
+   *
+   * @return The number of records found.
+   */
+  int getBatch( const int* ids, int count, record_t* recs, bool* found );
+
+  /**
+   * @return True if records are kept in wire form, see
+   * StoreOptions::wire, and may be looked up without a copy.
+   */
+  bool wired() const { return NULL != epochs; }
+
+  /**
+   * Become a reader of records in wire form, see WireEpochs::join().
+   *
+   * @return The reader, or -1 if the store is not wired or has too
+   * many readers, when the thread must copy records out instead.
+   */
+  int joinWire();
+
+  /**
+   * @param[in] reader - A reader from joinWire(), unpinned, or -1.
+   */
+  void leaveWire( int reader );
+
+  /**
+   * Let records found by a reader be freed once changed, when nothing
+   * it found is still being sent.
+   *
+   * @param[in] reader - A reader from joinWire().
+   */
+  void unpinWire( int reader );
+
+  /**
+   * Look up a batch of ids without copying the records out, see
+   * Store::lookupBatch(). What is found stays as it is until the
+   * reader is unpinned.
+   *
+   * @param[in] reader - A reader from joinWire().
+   *
+   * @return The number of records found.
+   */
+  int getBatch( int reader, const int* ids, int count,
+                const record_t** images );
+
+  /**
+   * @return True if records are indexed and may be queried.
+   */
+  bool indexed();
+
+  /**
+   * Find records by name or name prefix, see Store::findByName().
+   */
+  int findByName( const char* name, bool prefix, QueryCursor& cursor,
+                  record_t* recs, int max );
+
+  /**
+   * Find records by age, see Store::findByAge().
+   */
+  int findByAge( int low, int high, QueryCursor& cursor, record_t* recs,
+                 int max );
+
+  /**
+   * Find records by name without copying them out, see getBatch().
+   */
+  int findByName( int reader, const char* name, bool prefix,
+                  QueryCursor& cursor, const record_t** images, int max );
+
+  /**
+   * Find records by age without copying them out, see getBatch().
+   */
+  int findByAge( int reader, int low, int high, QueryCursor& cursor,
+                 const record_t** images, int max );
+
+  /**
+   * Start writing a snapshot in the background, by forking a child
+   * which writes the file and exits, unless one is being written.
+   *
+   * @return The child's process id, or -1 if none was started.
+   */
+  pid_t snapshot();
+
+  /**
+   * Sweep part of a store which is not shared for expired records, if
+   * a sweep is due, and refresh the clock records expire by.
+   *
+   * @return Milliseconds until the next sweep is due.
+   */
+  int expire();
+
+  /**
+   * @return The seconds records added without a time to live last.
+   */
+  unsigned int defaultTtl() const { return ttl; }
+
+  /**
+   * @return The number of records held.
+   */
+  size_t size();
+
+  /**
+   * Write lines of statistics about the store and its snapshots.
+   *
+   * @param[in] out - The stream to write to.
+   */
+  void report( std::ostream& out );
+
+private:
+
+  struct Engine;
+
+  static void* sweep( void* arg );
+  static void* maintain( void* arg );
+  static void* reap( void* arg );
+
+  Engine* store;
+  WireEpochs* epochs;  // NULL unless records are kept in wire form
+  unsigned int ttl;
+  const char* path;
+
+  pthread_t sweeper;
+  pthread_t maintainer;
+  bool shared;
+  bool tiered;
+  volatile bool stopping;
+  long nextSweep;  // When expire() sweeps next, in milliseconds
+
+  // Snapshot progress
+  ProfiledMutex mutex;
+  bool running;
+  unsigned long taken;
+  unsigned long failed;
+  unsigned long lastMillis;
+
+  // Not copyable
+  RecordStore( const RecordStore& );
+  RecordStore& operator=( const RecordStore& );
+};
+
+#endif // _RECORDSTORE_H_
@@ -0,0 +1,259 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the datagram reply cache, see
+ * replycache.h for more details.
+ */
+
+#include "replycache.h"
+
+#include <string.h>
+
+/**
+ * @return The key a peer's session is filed under.
+ */
+static uint64_t peerKey( const sockaddr_in& peer )
+{
+  return ( (uint64_t)peer.sin_addr.s_addr << 16 ) | peer.sin_port;
+}
+
+/**
+ * Compare sequence numbers, allowing for them wrapping around.
+ *
+ * @return True if 'seq' comes before 'other'.
+ */
+static bool before( unsigned int seq, unsigned int other )
+{
+  return (int)( seq - other ) < 0;
+}
+
+ReplyCache::ReplyCache( size_t sessions )
+  : mutex( "replies" ),
+    slab( "reply", sizeof( Session ) ),
+    limit( sessions > 0 ? sessions : 1 ),
+    clock( 0 ),
+    cached( 0 ),
+    hits( 0 ),
+    stale( 0 ),
+    piggybacked( 0 ),
+    evicted( 0 )
+{
+}
+
+/**
+ * Find a peer's session, noting that it was used. Called with the
+ * mutex held.
+ *
+ * @return The session, or NULL if the peer has none.
+ */
+ReplyCache::Session* ReplyCache::findLocked( const sockaddr_in& peer )
+{
+  sessions_t::iterator found = sessions.find( peerKey( peer ) );
+  if ( found == sessions.end() )
+  {
+    return NULL;
+  }
+  found->second->used = ++clock;
+  return found->second;
+}
+
+/**
+ * Start a session for a peer, forgetting the least recently used
+ * session if there are too many. Called with the mutex held.
+ *
+ * @param[in] peer - The peer's address.
+ * @param[in] floor - The first sequence number which is not stale.
+ *
+ * @return The new session.
+ */
+ReplyCache::Session* ReplyCache::createLocked( const sockaddr_in& peer,
+                                               unsigned int floor )
+{
+  sessions_t::iterator existing = sessions.find( peerKey( peer ) );
+  if ( existing != sessions.end() )
+  {
+    closeLocked( existing );
+  }
+
+  if ( sessions.size() >= limit )
+  {
+    sessions_t::iterator oldest = sessions.begin();
+    for ( sessions_t::iterator it = sessions.begin(); it != sessions.end();
+          ++it )
+    {
+      if ( it->second->used < oldest->second->used )
+      {
+        oldest = it;
+      }
+    }
+    closeLocked( oldest );
+    evicted++;
+  }
+
+  Session* session = static_cast<Session*>( slab.allocate() );
+  if ( NULL == session )
+  {
+    throw std::bad_alloc();
+  }
+  memset( session, 0, sizeof( Session ) );
+  session->floor = floor;
+  session->used = ++clock;
+
+  sessions[ peerKey( peer ) ] = session;
+  return session;
+}
+
+/**
+ * Forget a session and the replies it holds. Called with the mutex
+ * held.
+ */
+void ReplyCache::closeLocked( sessions_t::iterator session )
+{
+  for ( int i = 0; i < REPLY_WINDOW; i++ )
+  {
+    cached -= session->second->replies[i].valid;
+  }
+  slab.release( session->second );
+  sessions.erase( session );
+}
+
+/**
+ * Forget the replies to every request up to and including 'seq'.
+ * Called with the mutex held.
+ *
+ * @return The number of replies forgotten.
+ */
+unsigned long ReplyCache::acknowledgeLocked( Session* session,
+                                             unsigned int seq )
+{
+  unsigned long dropped = 0;
+  for ( int i = 0; i < REPLY_WINDOW; i++ )
+  {
+    Reply& slot = session->replies[i];
+    if ( slot.valid && not before( seq, slot.seq ) )
+    {
+      slot.valid = false;
+      dropped++;
+    }
+  }
+  cached -= dropped;
+
+  if ( before( session->floor, seq + 1 ) )
+  {
+    session->floor = seq + 1;
+  }
+  return dropped;
+}
+
+void ReplyCache::open( const sockaddr_in& peer, unsigned int seq,
+                       bool piggyback )
+{
+  mutex.lock();
+  createLocked( peer, seq )->piggyback = piggyback;
+  mutex.unlock();
+}
+
+ReplyCache::Outcome ReplyCache::lookup( const sockaddr_in& peer,
+                                        unsigned int seq, record_t& reply,
+                                        bool& piggyback )
+{
+  Outcome outcome = FRESH;
+  piggyback = false;
+
+  mutex.lock();
+  Session* session = findLocked( peer );
+  if ( NULL != session )
+  {
+    const Reply& slot = session->replies[ seq % REPLY_WINDOW ];
+    piggyback = session->piggyback;
+    if ( before( seq, session->floor ) )
+    {
+      outcome = STALE;
+      stale++;
+    }
+    else
+    {
+      //
+      // A client only moves on to a request once it has the replies to
+      // those before it, so the request is their acknowledgement.
+      //
+      if ( piggyback )
+      {
+        piggybacked += acknowledgeLocked( session, seq - 1 );
+      }
+      if ( slot.valid && slot.seq == seq )
+      {
+        reply = slot.reply;
+        outcome = CACHED;
+        hits++;
+      }
+    }
+  }
+  mutex.unlock();
+
+  return outcome;
+}
+
+void ReplyCache::remember( const sockaddr_in& peer, unsigned int seq,
+                           const record_t& reply )
+{
+  mutex.lock();
+
+  // A peer which never said hello starts its session here
+  Session* session = findLocked( peer );
+  if ( NULL == session )
+  {
+    session = createLocked( peer, seq );
+  }
+
+  //
+  // Requests which fall out of the window can no longer be answered
+  // from the cache, so they must never be carried out again either.
+  //
+  if ( before( session->floor, seq - ( REPLY_WINDOW - 1 ) ) )
+  {
+    session->floor = seq - ( REPLY_WINDOW - 1 );
+  }
+
+  Reply& slot = session->replies[ seq % REPLY_WINDOW ];
+  cached += not slot.valid;
+  slot.seq = seq;
+  slot.valid = true;
+  slot.reply = reply;
+
+  mutex.unlock();
+}
+
+void ReplyCache::acknowledge( const sockaddr_in& peer, unsigned int seq )
+{
+  mutex.lock();
+  Session* session = findLocked( peer );
+  if ( NULL != session )
+  {
+    acknowledgeLocked( session, seq );
+  }
+  mutex.unlock();
+}
+
+void ReplyCache::close( const sockaddr_in& peer )
+{
+  mutex.lock();
+  sessions_t::iterator found = sessions.find( peerKey( peer ) );
+  if ( found != sessions.end() )
+  {
+    closeLocked( found );
+  }
+  mutex.unlock();
+}
+
+void ReplyCache::report( std::ostream& out )
+{
+  mutex.lock();
+  out << "replies sessions " << sessions.size() << "/" << limit
+      << " cached " << cached
+      << " hits " << hits
+      << " stale " << stale
+      << " piggybacked " << piggybacked
+      << " evicted " << evicted << "\n";
+  mutex.unlock();
+}
@@ -0,0 +1,155 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Replies already sent to datagram clients, so that a
+ * retransmitted request is answered again without being carried out
+ * twice. Each peer is a session holding the replies to its last few
+ * sequence numbers, dropped once the client acknowledges them.
+ */
+
+#ifndef _REPLYCACHE_H_
+#define _REPLYCACHE_H_
+
+#include <map>
+#include <ostream>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "common.h"
+#include "slab.h"
+#include "trace.h"
+
+// Replies remembered per peer, the most requests it may have
+// unacknowledged before older ones are refused rather than redone.
+// Large enough for a client's congestion window to fill a slow path,
+// see udp-client/congestion.h.
+#define REPLY_WINDOW 128
+
+// Peers remembered at once by default
+#define DEFAULT_REPLY_SESSIONS 1024
+
+/**
+ * A thread safe cache of replies to datagram requests.
+ */
+class ReplyCache
+{
+public:
+
+  // What has become of a request
+  enum Outcome
+  {
+    FRESH,    // Never seen, carry it out
+    CACHED,   // Already answered, the reply has been copied out
+    STALE     // Acknowledged or too old to answer, ignore it
+  };
+
+  /**
+   * @param[in] sessions - The most peers to remember at once, the
+   * least recently heard from being forgotten first.
+   */
+  ReplyCache( size_t sessions = DEFAULT_REPLY_SESSIONS );
+
+  /**
+   * Start a fresh session for a peer, forgetting any earlier one.
+   *
+   * @param[in] peer - The peer's address.
+   * @param[in] seq - The first sequence number the peer will use.
+   * @param[in] piggyback - True if the peer's requests acknowledge
+   * every reply before them, rather than each reply being acknowledged
+   * on its own.
+   */
+  void open( const sockaddr_in& peer, unsigned int seq,
+             bool piggyback = false );
+
+  /**
+   * Look for the reply to a request, which acknowledges every earlier
+   * reply if the peer's session piggybacks acknowledgements.
+   *
+   * @param[in] peer - The peer's address.
+   * @param[in] seq - The request's sequence number.
+   * @param[out] reply - The reply already sent, if CACHED.
+   * @param[out] piggyback - Whether the peer's session piggybacks
+   * acknowledgements, false if it has none.
+   *
+   * @return Whether the request is new, answered or stale.
+   */
+  Outcome lookup( const sockaddr_in& peer, unsigned int seq, record_t& reply,
+                  bool& piggyback );
+
+  /**
+   * Remember the reply to a request which has been carried out.
+   *
+   * @param[in] peer - The peer's address.
+   * @param[in] seq - The request's sequence number.
+   * @param[in] reply - The reply sent.
+   */
+  void remember( const sockaddr_in& peer, unsigned int seq,
+                 const record_t& reply );
+
+  /**
+   * Forget the replies to every request up to and including one the
+   * peer has acknowledged.
+   *
+   * @param[in] peer - The peer's address.
+   * @param[in] seq - The sequence number acknowledged.
+   */
+  void acknowledge( const sockaddr_in& peer, unsigned int seq );
+
+  /**
+   * Forget a peer which has finished.
+   *
+   * @param[in] peer - The peer's address.
+   */
+  void close( const sockaddr_in& peer );
+
+  /**
+   * Write a line of statistics about the cache to the stream.
+   *
+   * @param[in] out - The stream to write to.
+   */
+  void report( std::ostream& out );
+
+private:
+
+  struct Reply
+  {
+    unsigned int seq;
+    bool valid;
+    record_t reply;
+  };
+
+  struct Session
+  {
+    unsigned int floor;     // Every request before this is stale
+    unsigned long used;     // When the session was last used
+    bool piggyback;         // Requests acknowledge earlier replies
+    Reply replies[ REPLY_WINDOW ];
+  };
+
+  typedef std::map<uint64_t, Session*, std::less<uint64_t>,
+                   SlabAllocator<std::pair<const uint64_t, Session*> > >
+          sessions_t;
+
+  Session* findLocked( const sockaddr_in& peer );
+  Session* createLocked( const sockaddr_in& peer, unsigned int floor );
+  void closeLocked( sessions_t::iterator session );
+  unsigned long acknowledgeLocked( Session* session, unsigned int seq );
+
+  ProfiledMutex mutex;
+  Slab slab;
+  sessions_t sessions;
+  size_t limit;
+  unsigned long clock;
+  unsigned long cached;    // Replies held across all sessions
+  unsigned long hits;
+  unsigned long stale;
+  unsigned long piggybacked;   // Replies acknowledged by a later request
+  unsigned long evicted;
+
+  // Not copyable
+  ReplyCache( const ReplyCache& );
+  ReplyCache& operator=( const ReplyCache& );
+};
+
+#endif // _REPLYCACHE_H_
@@ -2,11 +2,65 @@
  * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
  *
  * Description: A server appiication that takes remote commands
- * to add, retrieve records from a "database". 
+ * to add, retrieve and change records in a "database". 
  *
- * Usage: tcp-project2 port
+ * Usage: tcp-project2 [-c connections] [-i inflight] [-q queue]
+ *                     [-T tracefile] [-s every] [-m megabytes]
+ *                     [-e seconds] [-n] [-x] [-S snapshot]
+ *                     [-D directory] [-u] [-U path] [-P cores]
+ *                     [-I seconds] [-k seconds] [-p milliseconds]
+ *                     [-Z] [-W] port
  *
- * Where 'port' is the port number the server is listening on.
+ * Where 'port' is the port number the server is listening on,
+ * 'connections' is the maximum number of concurrent clients,
+ * 'inflight' is the maximum number of requests read ahead from a
+ * single client and 'queue' is the maximum number of requests
+ * admitted across all clients before the server answers busy.
+ * One request in 'every' is traced to 'tracefile', see trace.h.
+ * The store is kept within 'megabytes' by evicting records, and
+ * records added without a time to live expire after 'seconds'.
+ * With -D evicted records move to files in 'directory' instead of
+ * being dropped, and come back when next asked for, see tier.h.
+ * With -n repeated long names are stored once, and with -x records
+ * are indexed by name and age so they can be queried on either.
+ * Snapshots of the store are written to 'snapshot', which is loaded
+ * at startup when given, see snapshot.h. With -u requests are also
+ * taken as datagrams on the same port, in the protocol of udp-client,
+ * and a retransmitted request is answered again without being redone.
+ * A datagram client may ask for its replies to double as ACKs, see
+ * datagram.h, halving the datagrams each request takes. With -U
+ * clients on this host may also connect to the unix socket at 'path',
+ * and move their requests onto a shared memory channel, see ring.h.
+ * With -P the server runs one thread per core, each serving its own
+ * clients and its own partition of the records, which needs the hash
+ * or flat engine and leaves idle connections unparked. With -I connections
+ * idle for that many seconds are closed, and with -k TCP probes
+ * clients idle for that many seconds, dropping those which have gone.
+ * With -Z large batch responses are sent with MSG_ZEROCOPY, the kernel
+ * sending them from the connection's own buffers, see respondFrame().
+ * With -W records are also kept in the very form they are sent in,
+ * and records looked up or queried are sent straight from where they
+ * are stored rather than copied into a response, see respondParts().
+ * Each record is then a part of the write of its own, which for a
+ * large batch over loopback costs the kernel more than the copy saved.
+ *
+ * With -p a connection with nothing to serve for that many
+ * milliseconds hands its thread and buffers back, and waits with a
+ * few dozen bytes of state for its client to send something, see
+ * watchIdle().
+ *
+ * The store and its persistence are the library in recordstore.h,
+ * which this server is only a network frontend over.
+ *
+ * The ids most often asked for and added are tracked all the time at
+ * a few nanoseconds a request, and may be asked for, see hotkeys.h.
+ * Clients may subscribe to be streamed records as they are added and
+ * changed rather than polling for them, see changelog.h. Records are
+ * updated, deleted, swapped on their version and incremented by the
+ * server, each under the store's own lock, see mutation_t in common.h.
+ * A client may ask for the records, ids and changes following batch
+ * headers to be packed, see pack.h, while single records are always
+ * sent as they are.
  */
 
 #include <iostream>
@@ -14,11 +68,24 @@
   using std::cout;
   using std::endl;
 
-#include <map>
-  using std::map;
+#include <string>
+  using std::string;
+
+#include <sstream>
+  using std::ostringstream;
+
+#include <deque>
+  using std::deque;
+
+#include <vector>
+  using std::vector;
 
 // Utilities and Error checking
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -28,27 +95,150 @@
 // Networking and sockets
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#if defined( __linux__ )
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
+#endif
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 // POSIX compliant threading
 #include <pthread.h>
 
-// Project specific header
+// Project specific headers
+#include "changelog.h"
 #include "common.h"
+#include "datagram.h"
+#include "hotkeys.h"
+#include "pack.h"
+#include "recordstore.h"
+#include "replycache.h"
+#include "ring.h"
+#include "slab.h"
+#include "spsc.h"
+#include "timerwheel.h"
+#include "trace.h"
 
 /**
  * Data structure to use when passing different data
- * members to a new connection handler thread.
+ * members to a new connection handler thread. It lives at the
+ * start of the connection's arena, followed by its buffer.
  */
 typedef struct
 {
   int sock;
   int threadnum;
-  sockaddr_in* address;
+  bool local;             // Accepted on the unix socket
+  channel_t* channel;     // Shared memory used instead of the socket
+  sockaddr_in address;
   socklen_t addressLen;
+  char* buffer;
+  int buffered;
+  int capacity;
+  char* output;           // Where the next response is laid out
+  char* standby;          // The other output buffer, NULL without -Z
+  bool zeroCopy;          // Large responses go out with MSG_ZEROCOPY
+  uint32_t zeroCopySent;  // Zero copy sends made
+  uint32_t zeroCopyDone;  // Of those, the kernel has let go of
+  uint32_t outputBusy;    // 'zeroCopySent' after each buffer's last send
+  uint32_t standbyBusy;
+  int reader;             // Reader of records in wire form, see -W, or -1
+  bool pinned;            // Records found may still be being sent
+  uint32_t wireBusy;      // 'zeroCopySent' after the last send of them
+  bool packing;           // Batches are packed, see pack.h
+  int sampleCountdown;
+  uint64_t readBegin;
+  uint64_t readEnd;
 } sock_t;
 
+// Default admission limits, overridden from the command line.
+#define DEFAULT_MAX_CONNECTIONS 256
+#define DEFAULT_MAX_INFLIGHT 16
+#define DEFAULT_MAX_QUEUE 1024
+
+// Largest batch request or response on the wire.
+#define BATCH_FRAME ( sizeof( header_t ) + MAX_BATCH * sizeof( record_t ) )
+
+// Where sampled request traces go unless told otherwise.
+#define DEFAULT_TRACE_FILE "server-trace.json"
+
+// Bytes of a datagram before its data.
+#define DATAGRAM_HEADER offsetof( Datagram, data )
+
+// Largest batch frame once packed, with room for a header after it.
+#define PACKED_FRAME ( 2 * sizeof( header_t ) + sizeof( int ) \
+                       + PACK_BOUND( BATCH_FRAME ) )
+
+// Most changes streamed to a subscriber in one write.
+#define SUBSCRIBE_BATCH \
+  ( ( BATCH_FRAME - sizeof( header_t ) ) / sizeof( change_t ) )
+
+// Milliseconds a subscriber waits for changes before checking its
+// client is still there.
+#define SUBSCRIBE_PATIENCE 1000
+
+// Seconds a write to a subscriber may block before it is dropped.
+#define SUBSCRIBER_TIMEOUT 5
+
+// Most cores served shared nothing, see serveCores().
+#define MAX_CORES 64
+
+// Milliseconds between looks for connections idle too long.
+#define IDLE_TICK 1000
+
+// Keepalive probes a silent client is sent before it is dropped.
+#define KEEPALIVE_PROBES 3
+
+// Smallest response sent with MSG_ZEROCOPY, below which pinning its
+// pages costs more than copying it.
+#define ZEROCOPY_MIN 8192
+
+// Milliseconds a closing connection waits for the kernel to let go of
+// its buffers, before resetting the connection instead.
+#define ZEROCOPY_PATIENCE 5000
+
+// Most responses gathered into a single write by a core.
+#define FLUSH_IOVECS 64
+
+// Sends from memory the kernel pins rather than copies, Linux 4.14 on
+#if defined( __linux__ ) && defined( MSG_ZEROCOPY ) && defined( SO_ZEROCOPY )
+#define HAVE_ZEROCOPY 1
+#endif
+
+/**
+ * A connection with nothing to serve, waiting in watchIdle() without
+ * a thread or buffers of its own for its client to send something.
+ */
+typedef struct
+{
+  TimerWheel::Timer timer;    // Closes it once idle too long
+  int slot;                   // Where watchIdle() keeps it
+  int sock;
+  int threadnum;
+  bool local;
+  bool packing;
+  bool zeroCopy;
+  int sampleCountdown;
+  sockaddr_in address;
+  uint64_t closeAt;           // When it has been idle too long, or 0
+} idle_t;
+
+// What a connection's thread found waiting for its client
+enum awaited_t
+{
+  AWAIT_SENT,       // The client sent something, or the socket failed
+  AWAIT_PARK,       // Idle for a while, leave it to watchIdle()
+  AWAIT_EXPIRED     // Idle too long, close it
+};
+
 //
 // Global variables used to track program state across threads.
 //
@@ -60,30 +250,113 @@ int threadCount = 0;
 int runingThreads = 0;
 
 // Mutex for the concurrent modification of threadCount
-pthread_mutex_t counterMutex = PTHREAD_MUTEX_INITIALIZER;
+// and the admission counters below.
+ProfiledMutex counterMutex( "counter" );
+
+// Maximum number of clients served at once.
+int maxConnections = DEFAULT_MAX_CONNECTIONS;
+
+// Maximum number of requests read ahead from a single client, the
+// rest are left in the socket so TCP pushes back on the client.
+int maxInflight = DEFAULT_MAX_INFLIGHT;
 
-// Our "database" of records
-map<int,record_t> database;
+// Maximum number of requests admitted across all clients.
+int maxQueue = DEFAULT_MAX_QUEUE;
+
+// Number of requests currently admitted across all clients.
+int queuedRequests = 0;
+
+// Number of connections turned away at the connection limit.
+unsigned long connectionsShed = 0;
+
+// Number of requests answered busy at the queue limit.
+unsigned long requestsShed = 0;
+
+// Number of requests served since startup.
+unsigned long requestsServed = 0;
+
+// Batches packed, and their items' bytes before and after packing,
+// by threads serving connections, see countPacked().
+unsigned long framesPacked = 0;
+unsigned long bytesBeforePacking = 0;
+unsigned long bytesAfterPacking = 0;
+
+// Seconds a connection may sit idle before it is closed, 0 for ever.
+int idleTimeout = 0;
+
+// Seconds a client is silent before TCP probes it, 0 for never.
+int keepaliveIdle = 0;
+
+// Milliseconds a connection's thread waits for a request before
+// leaving the connection to watchIdle() and exiting, 0 for never.
+int parkDelay = 0;
+
+// Connections waiting in watchIdle(), counted with the running
+// threads against the connection limit.
+int parkedConnections = 0;
+
+// Connections left to watchIdle(), taken back up, closed for being
+// idle too long and closed for their client having gone.
+unsigned long connectionsParked = 0;
+unsigned long connectionsResumed = 0;
+unsigned long connectionsReaped = 0;
+unsigned long connectionsDropped = 0;
+
+// Bytes of stack each connection's thread is given.
+size_t threadStack = 0;
+
+// Whether large responses are sent with MSG_ZEROCOPY, see -Z.
+bool zeroCopyWanted = false;
+
+// Responses sent with MSG_ZEROCOPY and their bytes, those the kernel
+// copied after all, and buffers waited on before being reused.
+unsigned long zeroCopySends = 0;
+unsigned long zeroCopyBytes = 0;
+unsigned long zeroCopyCopied = 0;
+unsigned long zeroCopyWaits = 0;
+
+// Responses sent straight from records in wire form, see -W, and the
+// records in them.
+unsigned long wireSends = 0;
+unsigned long wireRecords = 0;
+
+// Our "database" of records, its engine is picked at build time
+RecordStore* records = NULL;
+
+// Slab of connection arenas, sized once the limits are known.
+Slab* connectionSlab = NULL;
+
+// Connections newly left to watchIdle(), and a pipe to wake it with.
+ProfiledMutex idleMutex( "idle" );
+vector< idle_t* > idleArrivals;
+int idleWakeup[2] = { -1, -1 };
+
+// Slab of idle connections' state.
+Slab idleSlab( "idle", sizeof( idle_t ) );
+
+// Replies to datagram requests, kept to answer retransmits.
+ReplyCache replyCache;
+
+// Recent changes, streamed to subscribers.
+ChangeLog changes;
 
-// Mutex for concurrent modification of the database.
-pthread_mutex_t databaseMutex = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * Try to add a given record to the database.
  *
  * @param[in] rec - The new record to add.
- * @param[in] sock - The client socket to use when responding.
+ * @param[in] ttl - Seconds the record lives for, 0 for ever.
  *
- * @return True on success, false on failure.
+ * @return The response to send, its command saying what happened.
  */
-bool addRecord( record_t rec, int sock )
+record_t applyAdd( const record_t& rec, unsigned int ttl )
 {
   record_t response;
   bzero( &response, sizeof( response ) );
+  HotKeys::count( HotKeys::ADD, rec.id );
 
-  pthread_mutex_lock( &databaseMutex );
-  bool exists = database.find( rec.id ) != database.end() ;
-  pthread_mutex_unlock( &databaseMutex );
+  // Insert the new record, unless the id is taken
+  bool exists = not records->add( rec, ttl );
 
   if ( exists )
   {
@@ -92,48 +365,34 @@ bool addRecord( record_t rec, int sock )
   }
   else
   {
-    // Insert the new record
-    pthread_mutex_lock( &databaseMutex );
-    database[rec.id] =  rec;
-    pthread_mutex_unlock( &databaseMutex );
-
     response.command = ADD_SUCCESS;
     response.id = rec.id;
     cout << "Adding record" << endl;
     cout << "ID: " << rec.id << endl;
     cout << "Name: " << rec.name << endl;
     cout << "Age: " << rec.age << endl;
-    cout << "Size of the database: " << database.size() << endl;
+    cout << "Size of the database: " << records->size() << endl;
   }
-
-  write( sock, &response, sizeof( response ) );
-  return not exists;
+  return response;
 }
 
 /**
  * Try to fetch an existing record from the database.
  *
  * @param[in] rec - The record to look for, using id field.
- * @param[in] sock - The socket to use when sending result.
  *
- * @return True on success, false on failure.
+ * @return The record found, or a response saying it was not.
  */
-bool getRecord( record_t rec, int sock )
+record_t applyGet( const record_t& rec )
 {
-
   record_t result;
   bzero( &result, sizeof( result ) );
+  HotKeys::count( HotKeys::GET, rec.id );
 
-  pthread_mutex_lock( &databaseMutex );
-  bool found = database.find( rec.id ) != database.end();
-  pthread_mutex_unlock( &databaseMutex );
+  bool found = records->get( rec.id, result );
 
   if ( found )
   {
-    pthread_mutex_lock( &databaseMutex );
-    result = database[rec.id];
-    pthread_mutex_unlock( &databaseMutex );
-
     result.command = RET_SUCCESS;
     cout << "Record ID " << rec.id << " found." << endl;
   }
@@ -143,209 +402,3992 @@ bool getRecord( record_t rec, int sock )
     result.id = rec.id;
     cout << "Record ID " << rec.id << " not found." << endl;
   }
-
-  write( sock, &result, sizeof( result ) );
-  return found;
+  return result;
 }
 
 /**
- * Threading function to respond to a incoming client request.
+ * Try to change a record in place.
  *
- * @param[in] arg - The socket information, casted to a void*
- * in order to work with the threading library.
+ * @param[in] request - The change, see mutation_t.
  *
- * @return EXIT_SUCCESS
+ * @return The response to send, its command saying what happened.
  */
-void* handleRequest( void* arg )
+mutation_t applyMutation( const mutation_t& request )
 {
+  mutation_t result;
+  result.command = records->mutate( request, result );
 
-  sock_t* incoming = (sock_t*)arg;
+  if ( result.command == RET_SUCCESS )
+  {
+    cout << "Record ID " << result.id
+         << ( request.command == delete_t ? " deleted" : " changed" )
+         << " at version " << result.version << "." << endl;
+  }
+  else
+  {
+    cout << "Record ID " << request.id
+         << ( result.command == RET_CONFLICT ? " not changed, conflict."
+                                             : " not found." ) << endl;
+  }
+  return result;
+}
 
-  cout << "Entering Thread # " << (int)incoming->threadnum
-       << " Client IP: " << inet_ntoa( incoming->address->sin_addr )
-       << ", Port: " <<  ntohs( incoming->address->sin_port ) << ":" << endl;
-  cout << "======================================================" << endl;
+/**
+ * Turn zero copy sends on for a connection, if they were asked for
+ * and the socket takes them.
+ *
+ * @param[in] incoming - The connection, not yet served.
+ */
+void enableZeroCopy( sock_t* incoming )
+{
+#if defined( HAVE_ZEROCOPY )
+  int on = 1;
+  incoming->zeroCopy = zeroCopyWanted && not incoming->local
+                       && setsockopt( incoming->sock, SOL_SOCKET, SO_ZEROCOPY,
+                                      &on, sizeof( on ) ) == 0;
+#else
+  incoming->zeroCopy = false;
+#endif
+}
 
-  int len;
-  record_t request;
-  while ( ( len = read( incoming->sock, &request, sizeof( request ) ) ) > 0 )
+/**
+ * Take note of every zero copy send the kernel has let go of, as told
+ * on the socket's error queue. A connection whose sends the kernel
+ * copied all the same, as it does for a client on this host, goes
+ * back to plain writes, which are cheaper than a deferred copy.
+ *
+ * @param[in] incoming - The connection.
+ *
+ * @return The number of sends let go of.
+ */
+uint32_t reapZeroCopy( sock_t* incoming )
+{
+  uint32_t reaped = 0;
+#if defined( HAVE_ZEROCOPY )
+  while ( true )
   {
-    cout << "Received " << len << " bytes from the socket " << endl;
-    cout << "Command: " << request.command << endl;
-    //
-    // Perform the actual action requested
-    //
-    switch ( request.command )
+    char control[ CMSG_SPACE( sizeof( struct sock_extended_err )
+                              + sizeof( struct sockaddr_in ) ) ];
+    struct msghdr message;
+    bzero( &message, sizeof( message ) );
+    message.msg_control = control;
+    message.msg_controllen = sizeof( control );
+    if ( recvmsg( incoming->sock, &message, MSG_ERRQUEUE ) < 0 )
     {
-      case add_t:
-        addRecord( request, incoming->sock );
-        break;
-      case retrieve_t:
-        getRecord( request, incoming->sock );
-        break;
-      default:
-        break;
+      break;
     }
 
-    bzero( &request, sizeof( request ) );
-  }
-
-  //
-  // Shutdown reads and writes to the socket
-  //
-  shutdown( incoming->sock, SHUT_RDWR );
-
-  //
-  // Close the socket and exit this thread
-  //
-  close( incoming->sock );
-
-
-  cout << "Exiting Thread # " << incoming->threadnum
-       << " Client IP: " << inet_ntoa( incoming->address->sin_addr )
-       << ", Port: " <<  ntohs( incoming->address->sin_port ) << ":"
-       << " ... client closed the socket" << endl;
-  cout << "======================================================" << endl;
-
-  pthread_mutex_lock( &counterMutex );
+    for ( struct cmsghdr* header = CMSG_FIRSTHDR( &message ); NULL != header;
+          header = CMSG_NXTHDR( &message, header ) )
+    {
+      struct sock_extended_err error;
+      memcpy( &error, CMSG_DATA( header ), sizeof( error ) );
+      if ( header->cmsg_level != SOL_IP || header->cmsg_type != IP_RECVERR
+           || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+      {
+        continue;
+      }
 
-  runingThreads--;
-  cout << "Total # of threads running at this time is " << runingThreads << endl;
+      // Each notice covers a run of sends, numbered from 0
+      uint32_t count = error.ee_data - error.ee_info + 1;
+      incoming->zeroCopyDone += count;
+      reaped += count;
+      if ( error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+      {
+        incoming->zeroCopy = false;
+        __atomic_add_fetch( &zeroCopyCopied, count, __ATOMIC_RELAXED );
+      }
+    }
+  }
+#else
+  (void)incoming;
+#endif
+  return reaped;
+}
 
-  pthread_mutex_unlock( &counterMutex );
+/**
+ * Wait until the kernel has let go of the zero copy sends made up to
+ * some point, so the buffers they were made from may be written again.
+ *
+ * @param[in] incoming - The connection.
+ * @param[in] until - 'zeroCopySent' just after the last send waited for.
+ * @param[in] patience - The most milliseconds to wait, -1 for as long
+ * as the connection lasts.
+ *
+ * @return False if the sends were not let go of in time.
+ */
+bool waitZeroCopy( sock_t* incoming, uint32_t until, int patience )
+{
+  uint64_t begin = TimerWheel::clock();
+  bool woken = false;
+  while ( (int32_t)( incoming->zeroCopyDone - until ) < 0 )
+  {
+    if ( reapZeroCopy( incoming ) > 0 )
+    {
+      continue;
+    }
 
-  delete incoming->address;
-  delete incoming;
+    int wait = -1;
+    if ( patience >= 0 )
+    {
+      uint64_t spent = TimerWheel::clock() - begin;
+      if ( spent >= (uint64_t)patience )
+      {
+        return false;
+      }
+      wait = patience - spent;
+    }
 
-  pthread_exit( static_cast<void*>( EXIT_SUCCESS ) );
+    //
+    // A failing socket reports its error before the sends it still
+    // holds are torn down and let go of, so give it a moment
+    //
+    if ( woken )
+    {
+      usleep( 1000 );
+    }
 
-  return EXIT_SUCCESS;
+    struct pollfd ready;
+    ready.fd = incoming->sock;
+    ready.events = 0;
+    ready.revents = 0;
+    int got = poll( &ready, 1, wait );
+    if ( got < 0 && errno != EINTR )
+    {
+      return false;
+    }
+    woken = got > 0;
+  }
+  return true;
 }
 
 /**
- * Setup a socket, bind it to the local address then
- * setup it up to listen for incoming connections.
+ * Get an output buffer to lay the next response out in. With zero copy
+ * sends the connection has two, used in turn, so the next response is
+ * put together while the kernel may still be sending the last, and is
+ * only held up if it is still sending the one before.
  *
- * @param[in] port - The port number to listen on.
+ * @param[in] incoming - The connection.
  *
- * @return The completely setup socket
+ * @return Room for BATCH_FRAME bytes, until the next call.
  */
-int setupSocket( int port )
+char* claimOutput( sock_t* incoming )
 {
-  //
-  // Create a TCP socket.
-  //
-  int sock = socket( AF_INET, SOCK_STREAM, 0 );
-  if ( sock < 0 )
+  if ( NULL == incoming->standby )
   {
-    cerr << "Socket: " << strerror( errno ) << endl;
-    exit( EXIT_FAILURE );
+    return incoming->output;
   }
 
-  //
-  // Fill in the struct with the port number given by the user.
-  //
-  struct sockaddr_in server;
-  bzero( &server, sizeof( server ) );
-  server.sin_family = AF_INET;
-  server.sin_port = htons( port );
+  char* output = incoming->standby;
+  incoming->standby = incoming->output;
+  incoming->output = output;
 
-  //
-  // Bind this port number to this socket so that other programs can
-  // connect to this socket by specifying the port number.
-  //
-  if ( bind( sock, (struct sockaddr *)&server, sizeof( server ) ) < 0 )
+  uint32_t busy = incoming->standbyBusy;
+  incoming->standbyBusy = incoming->outputBusy;
+  incoming->outputBusy = busy;
+
+  if ( (int32_t)( incoming->zeroCopyDone - busy ) < 0 )
   {
-    cerr << "Bind: " << strerror( errno ) << endl;
-    exit( EXIT_FAILURE );
+    __atomic_add_fetch( &zeroCopyWaits, 1, __ATOMIC_RELAXED );
+    waitZeroCopy( incoming, busy, -1 );
   }
+  return output;
+}
 
-  // Make this socket passive, that is, one that awaits connections
-  // rather than initiating them.
-  if ( listen( sock, 10 ) < 0 )
+/**
+ * Send a response to the client, through its shared memory channel
+ * if it has one.
+ *
+ * @param[in] incoming - The connection to respond on.
+ * @param[in] data - The response.
+ * @param[in] length - The bytes of the response.
+ *
+ * @return False if it could not all be sent.
+ */
+bool respond( sock_t* incoming, const void* data, size_t length )
+{
+  if ( NULL != incoming->channel )
   {
-    cerr << "Listen: " << strerror( errno ) << endl;
-    exit( EXIT_FAILURE );
+    return ringWrite( &incoming->channel->responses, (const char*)data,
+                      length, incoming->sock );
   }
-
-  return sock;
+  return write( incoming->sock, data, length ) == (ssize_t)length;
 }
 
-
 /**
- * Program entry point.
+ * Send a response laid out in the connection's output buffer, see
+ * claimOutput(). A large one goes out with MSG_ZEROCOPY when the
+ * connection has it, the kernel sending straight from the buffer
+ * rather than copying it, so the buffer is left alone until the
+ * kernel lets go of it.
  *
- * @param[in] argc - The number of command line arguments.
- * @param[in] argv - The actual command line arguments.
+ * @param[in] incoming - The connection to respond on.
+ * @param[in] frame - The response, in 'incoming->output'.
+ * @param[in] length - The bytes of the response.
  *
- * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ * @return False if it could not all be sent.
  */
-int main( int argc, char **argv )
+bool respondFrame( sock_t* incoming, const char* frame, size_t length )
 {
-  //
-  // Make sure that the port argument was given
-  //
-  if ( argc != 2 )
+#if defined( HAVE_ZEROCOPY )
+  if ( incoming->zeroCopy && NULL == incoming->channel
+       && length >= ZEROCOPY_MIN )
   {
-    cerr << "Usage: " << argv[0] << " port" << endl;
-    exit( EXIT_FAILURE );
+    ssize_t sent = send( incoming->sock, frame, length, MSG_ZEROCOPY );
+    if ( sent >= 0 )
+    {
+      incoming->outputBusy = ++incoming->zeroCopySent;
+      __atomic_add_fetch( &zeroCopySends, 1, __ATOMIC_RELAXED );
+      __atomic_add_fetch( &zeroCopyBytes, sent, __ATOMIC_RELAXED );
+
+      // Cut short by a signal, the rest is sent as usual
+      return sent == (ssize_t)length
+             || respond( incoming, frame + sent, length - sent );
+    }
+
+    // Out of memory to pin, it is copied this once
+    if ( errno != ENOBUFS )
+    {
+      return false;
+    }
   }
+#endif
+  return respond( incoming, frame, length );
+}
 
-  //
-  // Get the port number, and make sure that it is legitimate
-  //
-  int port = atoi( argv[ 1 ] );
-  if ( port < PORT_MIN || port > PORT_MAX )
+/**
+ * @return True if records found for a connection may be sent straight
+ * from where they are stored, see respondParts(), rather than copied.
+ */
+bool sendsWire( const sock_t* incoming )
+{
+  return incoming->reader >= 0 && NULL == incoming->channel
+         && not incoming->packing;
+}
+
+/**
+ * Add a part to a response gathered by respondParts(), extending the
+ * last part if it ends where this one starts.
+ *
+ * @param[in,out] parts - The parts so far.
+ * @param[in,out] count - The number of parts.
+ * @param[in] data - The part.
+ * @param[in] length - The bytes of the part.
+ */
+void addPart( struct iovec* parts, int& count, const void* data,
+              size_t length )
+{
+  if ( count > 0 && static_cast<const char*>( parts[ count - 1 ].iov_base )
+                    + parts[ count - 1 ].iov_len == data )
   {
-    cerr << port << ": invalid port number" << endl;
-    exit( EXIT_FAILURE );
+    parts[ count - 1 ].iov_len += length;
+    return;
   }
+  parts[ count ].iov_base = const_cast<void*>( data );
+  parts[ count ].iov_len = length;
+  count++;
+}
 
-  // Setup a TCP socket to listen for connections.
-  int sock = setupSocket( port );
-
-  cout << "MAIN THREAD - "
-       << "WAITING FOR THE FIRST CONNECTION FROM CLIENT ..."
-       << endl;
+/**
+ * Send a response gathered from the connection's output buffer and
+ * records in wire form, with a single write. A large one goes out
+ * with MSG_ZEROCOPY when the connection has it, as for respondFrame(),
+ * the records then staying pinned until the kernel lets go of them,
+ * see settleWire().
+ *
+ * @param[in] incoming - The connection to respond on, with no channel.
+ * @param[in,out] parts - Where each part of the response is, used up.
+ * @param[in] count - The number of parts, at most IOV_MAX.
+ * @param[in] length - The bytes of the response.
+ *
+ * @return False if it could not all be sent.
+ */
+bool respondParts( sock_t* incoming, struct iovec* parts, int count,
+                   size_t length )
+{
+  int flags = 0;
+#if defined( HAVE_ZEROCOPY )
+  if ( incoming->zeroCopy && length >= ZEROCOPY_MIN )
+  {
+    flags = MSG_ZEROCOPY;
+  }
+#endif
 
-  threadCount = 0;
-  runingThreads = 0;
+  struct msghdr message;
+  bzero( &message, sizeof( message ) );
+  message.msg_iov = parts;
+  message.msg_iovlen = count;
 
-  //
-  // Now start serving clients
-  //
+  __atomic_add_fetch( &wireSends, 1, __ATOMIC_RELAXED );
   while ( true )
   {
+    ssize_t sent = sendmsg( incoming->sock, &message, flags );
+    if ( sent < 0 )
+    {
+      // Out of memory to pin, it is copied this once
+      if ( errno == EINTR || ( 0 != flags && errno == ENOBUFS ) )
+      {
+        flags = errno == ENOBUFS ? 0 : flags;
+        continue;
+      }
+      return false;
+    }
 
-    sock_t* incoming = new sock_t;
-    incoming->address = new struct sockaddr_in;
-    incoming->addressLen = sizeof( struct sockaddr_in );
+#if defined( HAVE_ZEROCOPY )
+    if ( 0 != flags )
+    {
+      incoming->outputBusy = ++incoming->zeroCopySent;
+      incoming->wireBusy = incoming->zeroCopySent;
+      __atomic_add_fetch( &zeroCopySends, 1, __ATOMIC_RELAXED );
+      __atomic_add_fetch( &zeroCopyBytes, sent, __ATOMIC_RELAXED );
 
-    // Wait for any new connections.
-    incoming->sock = accept( sock, (struct sockaddr*)incoming->address,
-                             &(incoming->addressLen) );
+      // Cut short by a signal, the rest is sent as usual
+      flags = 0;
+    }
+#endif
 
-    if ( incoming->sock < 0 )
+    length -= sent;
+    if ( 0 == length )
     {
-      cerr << "Server: accept error" << endl;
-      exit( EXIT_FAILURE );
+      return true;
     }
 
-    pthread_mutex_lock( &counterMutex );
-    incoming->threadnum = ++threadCount;
-    runingThreads++;
-    pthread_mutex_unlock( &counterMutex );
+    while ( (size_t)sent >= message.msg_iov->iov_len )
+    {
+      sent -= message.msg_iov->iov_len;
+      message.msg_iov++;
+      message.msg_iovlen--;
+    }
+    message.msg_iov->iov_base =
+      static_cast<char*>( message.msg_iov->iov_base ) + sent;
+    message.msg_iov->iov_len -= sent;
+  }
+}
 
+/**
+ * Unpin the records a connection found once nothing sent from them is
+ * still held by the kernel, so changed records may be freed, see
+ * wire.h. Until then the connection's thread finds more records
+ * under the epoch it already has pinned.
+ *
+ * @param[in] incoming - The connection.
+ */
+void settleWire( sock_t* incoming )
+{
+  if ( incoming->pinned
+       && (int32_t)( incoming->zeroCopyDone - incoming->wireBusy ) >= 0 )
+  {
+    records->unpinWire( incoming->reader );
+    incoming->pinned = false;
+  }
+}
 
-    cout << "NEW THREAD CREATED: NO. " << threadCount  << endl;
+/**
+ * Pack the items of a batch frame, for a client which asked for it.
+ *
+ * @param[in] kind - What the items are, see pack.h.
+ * @param[in] frame - A header followed by 'length' items.
+ * @param[out] packed - Room for PACKED_FRAME bytes.
+ * @param[out] unpacked - The bytes of the items before packing.
+ *
+ * @return The bytes of the packed frame, a header followed by the
+ * bytes of the block and then the block.
+ */
+size_t packFrame( int kind, const char* frame, char* packed,
+                  size_t& unpacked )
+{
+  header_t header;
+  memcpy( &header, frame, sizeof( header ) );
+  memcpy( packed, &header, sizeof( header ) );
+  unpacked = 0;
+  if ( header.length <= 0 )
+  {
+    return sizeof( header );
+  }
 
-    // Create a thread to handle this connection.
-    pthread_t thread;
-    pthread_create( &thread, NULL, handleRequest, (void*)incoming );
+  unsigned char scratch[ PACK_SCRATCH( BATCH_FRAME ) ];
+  int bytes = packBlock( kind, frame + sizeof( header ), header.length,
+                         scratch, (unsigned char*)packed + sizeof( header )
+                                  + sizeof( bytes ) );
+  memcpy( packed + sizeof( header ), &bytes, sizeof( bytes ) );
 
-    cout << "MAIN THREAD - "
-         << "WAITING FOR THE NEXT CONNECTION FROM CLIENT ..."
+  unpacked = header.length * packItemSize( kind );
+  return sizeof( header ) + sizeof( bytes ) + bytes;
+}
+
+/**
+ * Pack a frame, see packFrame(), counting it in the totals shared by
+ * every thread serving connections.
+ */
+size_t countPacked( int kind, const char* frame, char* packed )
+{
+  size_t unpacked;
+  size_t length = packFrame( kind, frame, packed, unpacked );
+
+  __atomic_add_fetch( &framesPacked, 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &bytesBeforePacking, unpacked, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &bytesAfterPacking, length - sizeof( header_t ),
+                      __ATOMIC_RELAXED );
+  return length;
+}
+
+/**
+ * Send a batch frame, packing its items if the client asked for it.
+ *
+ * @param[in] incoming - The connection to respond on.
+ * @param[in] kind - What the items are, see pack.h.
+ * @param[in] frame - A header followed by 'length' items, in the
+ * connection's output buffer.
+ *
+ * @return False if it could not all be sent.
+ */
+bool respondBatch( sock_t* incoming, int kind, const char* frame )
+{
+  if ( incoming->packing )
+  {
+    char packed[ PACKED_FRAME ];
+    return respond( incoming, packed, countPacked( kind, frame, packed ) );
+  }
+
+  header_t header;
+  memcpy( &header, frame, sizeof( header ) );
+  return respondFrame( incoming, frame, sizeof( header )
+                       + header.length * packItemSize( kind ) );
+}
+
+/**
+ * Add a record and answer the client.
+ *
+ * @param[in] rec - The new record to add.
+ * @param[in] ttl - Seconds the record lives for, 0 for ever.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return True on success, false on failure.
+ */
+bool addRecord( record_t rec, unsigned int ttl, sock_t* incoming )
+{
+  record_t response = applyAdd( rec, ttl );
+
+  TraceStage stage( "write" );
+  respond( incoming, &response, sizeof( response ) );
+  return response.command == ADD_SUCCESS;
+}
+
+/**
+ * Fetch a record and answer the client, straight from where it is
+ * stored if it is kept in wire form.
+ *
+ * @param[in] rec - The record to look for, using id field.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return True on success, false on failure.
+ */
+bool getRecord( record_t rec, sock_t* incoming )
+{
+  if ( sendsWire( incoming ) )
+  {
+    HotKeys::count( HotKeys::GET, rec.id );
+
+    const record_t* image;
+    int found = records->getBatch( incoming->reader, &rec.id, 1, &image );
+    incoming->pinned = true;
+
+    record_t failure;
+    if ( found > 0 )
+    {
+      cout << "Record ID " << rec.id << " found." << endl;
+    }
+    else
+    {
+      bzero( &failure, sizeof( failure ) );
+      failure.command = RET_FAILURE;
+      failure.id = rec.id;
+      image = &failure;
+      cout << "Record ID " << rec.id << " not found." << endl;
+    }
+
+    {
+      TraceStage stage( "write" );
+      struct iovec part;
+      part.iov_base = const_cast<record_t*>( image );
+      part.iov_len = sizeof( record_t );
+      respondParts( incoming, &part, 1, sizeof( record_t ) );
+    }
+    __atomic_add_fetch( &wireRecords, found, __ATOMIC_RELAXED );
+    settleWire( incoming );
+    return found > 0;
+  }
+
+  record_t result = applyGet( rec );
+
+  TraceStage stage( "write" );
+  respond( incoming, &result, sizeof( result ) );
+  return result.command == RET_SUCCESS;
+}
+
+/**
+ * Change a record in place and answer the client.
+ *
+ * @param[in] frame - The request, a mutation_t.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return True on success, false on failure.
+ */
+bool mutateRecord( const char* frame, sock_t* incoming )
+{
+  mutation_t request;
+  memcpy( &request, frame, sizeof( request ) );
+  mutation_t result = applyMutation( request );
+
+  TraceStage stage( "write" );
+  respond( incoming, &result, sizeof( result ) );
+  return result.command == RET_SUCCESS;
+}
+
+/**
+ * Try to add a batch of records to the database, answering with the
+ * outcome for each record in the order they were sent.
+ *
+ * @param[in] frame - The request, a header followed by the records.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return The number of records added.
+ */
+int addRecords( const char* frame, sock_t* incoming )
+{
+  header_t header;
+  memcpy( &header, frame, sizeof( header ) );
+  const record_t* recs = (const record_t*)( frame + sizeof( header ) );
+  for ( int i = 0; i < header.length; i++ )
+  {
+    HotKeys::count( HotKeys::ADD, recs[i].id );
+  }
+
+  bool added[ MAX_BATCH ];
+  int total = records->addBatch( recs, header.length, NULL, added );
+
+  char* output = claimOutput( incoming );
+  record_t* results = (record_t*)( output + sizeof( header ) );
+  bzero( results, header.length * sizeof( record_t ) );
+  for ( int i = 0; i < header.length; i++ )
+  {
+    results[i].command = added[i] ? ADD_SUCCESS : ADD_FAILURE;
+    results[i].id = recs[i].id;
+  }
+
+  cout << "Added " << total << " of " << header.length << " records." << endl;
+
+  header.command = RET_SUCCESS;
+  memcpy( output, &header, sizeof( header ) );
+
+  TraceStage stage( "write" );
+  respondBatch( incoming, PACK_RECORDS, output );
+  return total;
+}
+
+/**
+ * Fetch a batch of records kept in wire form, see getRecords(), and
+ * send each straight from where it is stored. Failures are laid out
+ * after the header in the output buffer, so runs of them go out as one
+ * part.
+ *
+ * @param[in] ids - The ids asked for.
+ * @param[in] header - The request's header.
+ * @param[in] output - The connection's output buffer, just claimed.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return The number of records found.
+ */
+int sendRecords( const int* ids, header_t header, char* output,
+                 sock_t* incoming )
+{
+  const record_t* images[ MAX_BATCH ];
+  int total = records->getBatch( incoming->reader, ids, header.length,
+                                 images );
+  incoming->pinned = true;
+
+  header.command = RET_SUCCESS;
+  memcpy( output, &header, sizeof( header ) );
+
+  struct iovec parts[ MAX_BATCH + 1 ];
+  int count = 0;
+  addPart( parts, count, output, sizeof( header ) );
+
+  record_t* failure = (record_t*)( output + sizeof( header ) );
+  for ( int i = 0; i < header.length; i++ )
+  {
+    if ( NULL != images[i] )
+    {
+      addPart( parts, count, images[i], sizeof( record_t ) );
+      continue;
+    }
+    bzero( failure, sizeof( record_t ) );
+    failure->command = RET_FAILURE;
+    failure->id = ids[i];
+    addPart( parts, count, failure++, sizeof( record_t ) );
+  }
+
+  cout << "Found " << total << " of " << header.length << " records." << endl;
+
+  {
+    TraceStage stage( "write" );
+    respondParts( incoming, parts, count,
+                  sizeof( header ) + header.length * sizeof( record_t ) );
+  }
+  __atomic_add_fetch( &wireRecords, total, __ATOMIC_RELAXED );
+  settleWire( incoming );
+  return total;
+}
+
+/**
+ * Try to fetch a batch of records from the database, answering with
+ * one record or failure for each id in the order they were sent.
+ *
+ * @param[in] frame - The request, a header followed by the ids.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return The number of records found.
+ */
+int getRecords( const char* frame, sock_t* incoming )
+{
+  header_t header;
+  memcpy( &header, frame, sizeof( header ) );
+  const int* ids = (const int*)( frame + sizeof( header ) );
+  for ( int i = 0; i < header.length; i++ )
+  {
+    HotKeys::count( HotKeys::GET, ids[i] );
+  }
+
+  char* output = claimOutput( incoming );
+  if ( sendsWire( incoming ) )
+  {
+    return sendRecords( ids, header, output, incoming );
+  }
+
+  record_t* results = (record_t*)( output + sizeof( header ) );
+  bool found[ MAX_BATCH ];
+  int total = records->getBatch( ids, header.length, results, found );
+
+  for ( int i = 0; i < header.length; i++ )
+  {
+    if ( found[i] )
+    {
+      results[i].command = RET_SUCCESS;
+    }
+    else
+    {
+      bzero( &results[i], sizeof( record_t ) );
+      results[i].command = RET_FAILURE;
+      results[i].id = ids[i];
+    }
+  }
+
+  cout << "Found " << total << " of " << header.length << " records." << endl;
+
+  header.command = RET_SUCCESS;
+  memcpy( output, &header, sizeof( header ) );
+
+  TraceStage stage( "write" );
+  respondBatch( incoming, PACK_RECORDS, output );
+  return total;
+}
+
+/**
+ * Stream back every record matching a query, see runQuery(), each
+ * sent straight from where it is kept in wire form.
+ *
+ * @param[in] query - The query, for whole records.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return The number of records sent.
+ */
+int sendQuery( const query_t& query, sock_t* incoming )
+{
+  header_t header;
+  header.command = RET_SUCCESS;
+
+  int limit = query.limit > 0 ? query.limit : INT_MAX;
+  QueryCursor cursor;
+
+  int total = 0;
+  while ( true )
+  {
+    char* output = claimOutput( incoming );
+
+    const record_t* images[ MAX_BATCH ];
+    int wanted = limit - total < MAX_BATCH ? limit - total : MAX_BATCH;
+    int found = query.command == qage_t
+              ? records->findByAge( incoming->reader, query.low, query.high,
+                                    cursor, images, wanted )
+              : records->findByName( incoming->reader, query.name,
+                                     query.command == qprefix_t, cursor,
+                                     images, wanted );
+    incoming->pinned = true;
+    total += found;
+    bool finished = found < wanted || total == limit;
+
+    struct iovec parts[ MAX_BATCH + 2 ];
+    int count = 0;
+    size_t length = 0;
+    if ( found > 0 )
+    {
+      header.length = found;
+      memcpy( output, &header, sizeof( header ) );
+      addPart( parts, count, output, sizeof( header ) );
+      for ( int i = 0; i < found; i++ )
+      {
+        addPart( parts, count, images[i], sizeof( record_t ) );
+      }
+      length = sizeof( header ) + found * sizeof( record_t );
+    }
+
+    // The stream ends in the same write as the last batch
+    if ( finished )
+    {
+      header.length = 0;
+      memcpy( output + sizeof( header ), &header, sizeof( header ) );
+      addPart( parts, count, output + sizeof( header ), sizeof( header ) );
+      length += sizeof( header );
+    }
+
+    {
+      TraceStage stage( "write" );
+      respondParts( incoming, parts, count, length );
+    }
+    __atomic_add_fetch( &wireRecords, found, __ATOMIC_RELAXED );
+    settleWire( incoming );
+
+    if ( finished )
+    {
+      break;
+    }
+  }
+
+  cout << "Query matched " << total << " records." << endl;
+  return total;
+}
+
+/**
+ * Stream back every record matching a query, a batch at a time, so
+ * no shard stays locked while the client reads.
+ *
+ * @param[in] frame - The request, a query_t.
+ * @param[in] incoming - The connection to respond on.
+ *
+ * @return The number of records sent.
+ */
+int runQuery( const char* frame, sock_t* incoming )
+{
+  query_t query;
+  memcpy( &query, frame, sizeof( query ) );
+
+  header_t header;
+  header.command = RET_SUCCESS;
+  header.length = 0;
+
+  if ( not records->indexed() )
+  {
+    header.command = RET_FAILURE;
+    respond( incoming, &header, sizeof( header ) );
+    return 0;
+  }
+
+  if ( sendsWire( incoming ) && not query.idsOnly )
+  {
+    return sendQuery( query, incoming );
+  }
+
+  int limit = query.limit > 0 ? query.limit : INT_MAX;
+  QueryCursor cursor;
+
+  int total = 0;
+  while ( true )
+  {
+    // Laid out while the batch before may still be on its way out
+    char* output = claimOutput( incoming );
+    record_t* results = (record_t*)( output + sizeof( header ) );
+
+    int wanted = limit - total < MAX_BATCH ? limit - total : MAX_BATCH;
+    int found = query.command == qage_t
+              ? records->findByAge( query.low, query.high, cursor,
+                                    results, wanted )
+              : records->findByName( query.name, query.command == qprefix_t,
+                                     cursor, results, wanted );
+    total += found;
+    bool finished = found < wanted || total == limit;
+
+    size_t bytes = found * sizeof( record_t );
+    if ( query.idsOnly )
+    {
+      // Each id lands at or before the record it came from
+      int* ids = (int*)results;
+      for ( int i = 0; i < found; i++ )
+      {
+        ids[i] = results[i].id;
+      }
+      bytes = found * sizeof( int );
+    }
+    else
+    {
+      for ( int i = 0; i < found; i++ )
+      {
+        results[i].command = RET_SUCCESS;
+      }
+    }
+
+    char* frame = output;
+    size_t room = BATCH_FRAME;
+    size_t length = 0;
+    if ( found > 0 )
+    {
+      header.length = found;
+      memcpy( output, &header, sizeof( header ) );
+      length = sizeof( header ) + bytes;
+    }
+
+    char packed[ PACKED_FRAME ];
+    if ( found > 0 && incoming->packing )
+    {
+      length = countPacked( query.idsOnly ? PACK_IDS : PACK_RECORDS,
+                            output, packed );
+      frame = packed;
+      room = sizeof( packed );
+    }
+
+    //
+    // End the stream in the same write as the last batch when it fits,
+    // rather than leaving a lone header waiting on Nagle.
+    //
+    bool ended = finished && length + sizeof( header ) <= room;
+    if ( ended )
+    {
+      header.length = 0;
+      memcpy( frame + length, &header, sizeof( header ) );
+      length += sizeof( header );
+    }
+
+    {
+      TraceStage stage( "write" );
+      if ( frame == packed )
+      {
+        respond( incoming, frame, length );
+      }
+      else
+      {
+        respondFrame( incoming, frame, length );
+      }
+    }
+
+    if ( finished )
+    {
+      if ( not ended )
+      {
+        header.length = 0;
+        respond( incoming, &header, sizeof( header ) );
+      }
+      break;
+    }
+  }
+
+  cout << "Query matched " << total << " records." << endl;
+  return total;
+}
+
+/**
+ * Stream changes to a subscriber until it leaves, or is dropped for
+ * falling so far behind that changes it has yet to be sent are gone
+ * from the log, or for leaving a write blocked SUBSCRIBER_TIMEOUT.
+ *
+ * @param[in] frame - The request, a subscription_t.
+ * @param[in] incoming - The connection to stream on.
+ *
+ * @return The number of changes sent.
+ */
+unsigned long streamChanges( const char* frame, sock_t* incoming )
+{
+  subscription_t subscription;
+  memcpy( &subscription, frame, sizeof( subscription ) );
+
+  struct timeval timeout;
+  timeout.tv_sec = SUBSCRIBER_TIMEOUT;
+  timeout.tv_usec = 0;
+  setsockopt( incoming->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+              sizeof( timeout ) );
+
+  // A zero copy send would get round the timeout, so changes are copied
+  waitZeroCopy( incoming, incoming->zeroCopySent, -1 );
+  incoming->zeroCopy = false;
+  settleWire( incoming );
+
+  uint64_t next;
+  header_t header;
+  changes.subscribed();
+  header.command = changes.resume( subscription.since, next )
+                 ? RET_SUCCESS : RET_FAILURE;
+  header.length = 0;
+
+  cout << "Streaming changes from " << next << endl;
+
+  bool dropped = false;
+  unsigned long sent = 0;
+  change_t* batch = (change_t*)( incoming->output + sizeof( header ) );
+  bool open = respond( incoming, &header, sizeof( header ) );
+  while ( open )
+  {
+    int count = changes.read( next, subscription, batch, SUBSCRIBE_BATCH,
+                              SUBSCRIBE_PATIENCE );
+    if ( count < 0 )
+    {
+      header.command = SRV_BUSY;
+      header.length = 0;
+      respond( incoming, &header, sizeof( header ) );
+      dropped = true;
+      break;
+    }
+
+    if ( count == 0 )
+    {
+      open = not ringPeerGone( incoming->sock );
+      continue;
+    }
+
+    header.command = RET_SUCCESS;
+    header.length = count;
+    memcpy( incoming->output, &header, sizeof( header ) );
+    open = respondBatch( incoming, PACK_CHANGES, incoming->output );
+    sent += count;
+
+    // A client still there when a write fails is not keeping up
+    dropped = not open && NULL == incoming->channel
+              && not ringPeerGone( incoming->sock );
+  }
+
+  changes.unsubscribed( dropped );
+  cout << "Subscriber " << ( dropped ? "dropped" : "left" ) << " after "
+       << sent << " changes." << endl;
+  return sent;
+}
+
+/**
+ * Lay out the busy status answering a request, in the form the
+ * request is answered in.
+ *
+ * @param[in] rec - The request being shed.
+ * @param[out] response - Room for a mutation_t, the largest answer
+ * of a single record.
+ *
+ * @return The bytes of the response.
+ */
+size_t busyResponse( const record_t& rec, char* response )
+{
+  if ( rec.command == stats_t || rec.command == hot_t
+       || rec.command == mget_t || rec.command == madd_t
+       || rec.command == qname_t || rec.command == qprefix_t
+       || rec.command == qage_t || rec.command == subscribe_t
+       || rec.command == compress_t )
+  {
+    header_t header;
+    header.command = SRV_BUSY;
+    header.length = 0;
+    memcpy( response, &header, sizeof( header ) );
+    return sizeof( header );
+  }
+
+  if ( rec.command == update_t || rec.command == delete_t
+       || rec.command == cas_t || rec.command == incr_t )
+  {
+    mutation_t busy;
+    bzero( &busy, sizeof( busy ) );
+    busy.command = SRV_BUSY;
+    busy.id = rec.id;
+    memcpy( response, &busy, sizeof( busy ) );
+    return sizeof( busy );
+  }
+
+  record_t busy;
+  bzero( &busy, sizeof( busy ) );
+  busy.command = SRV_BUSY;
+  busy.id = rec.id;
+  memcpy( response, &busy, sizeof( busy ) );
+  return sizeof( busy );
+}
+
+/**
+ * Answer a request with a busy status, without touching the database.
+ *
+ * @param[in] rec - The request being shed.
+ * @param[in] incoming - The connection to respond on.
+ */
+void sendBusy( record_t rec, sock_t* incoming )
+{
+  char response[ sizeof( mutation_t ) ];
+  respond( incoming, response, busyResponse( rec, response ) );
+}
+
+/**
+ * Send the server's admission counters to the client as text.
+ *
+ * @param[in] incoming - The connection to respond on.
+ */
+void sendStats( sock_t* incoming )
+{
+  ostringstream out;
+
+  //
+  // An idle connection holds its state in the idle slab rather than a
+  // thread's stack and an arena, which is what parking it reclaimed
+  //
+  counterMutex.lock();
+  out << "connections " << runingThreads + parkedConnections << "/"
+      << maxConnections << "\n"
+      << "queued " << queuedRequests << "/" << maxQueue << "\n"
+      << "inflight_limit " << maxInflight << "\n"
+      << "served " << requestsServed << "\n"
+      << "shed_connections " << connectionsShed << "\n"
+      << "shed_requests " << requestsShed << "\n"
+      << "idle " << parkedConnections << " parked " << connectionsParked
+      << " resumed " << connectionsResumed
+      << " reaped " << connectionsReaped
+      << " dropped " << connectionsDropped
+      << " bytes_held " << parkedConnections * sizeof( idle_t )
+      << " bytes_reclaimed " << parkedConnections
+                                * ( threadStack + connectionSlab->blockSize() )
+      << "\n";
+  counterMutex.unlock();
+
+  out << "packed_frames " << __atomic_load_n( &framesPacked, __ATOMIC_RELAXED )
+      << " bytes_before " << __atomic_load_n( &bytesBeforePacking,
+                                              __ATOMIC_RELAXED )
+      << " bytes_after " << __atomic_load_n( &bytesAfterPacking,
+                                             __ATOMIC_RELAXED ) << "\n";
+
+  out << "zerocopy sends " << __atomic_load_n( &zeroCopySends, __ATOMIC_RELAXED )
+      << " bytes " << __atomic_load_n( &zeroCopyBytes, __ATOMIC_RELAXED )
+      << " copied " << __atomic_load_n( &zeroCopyCopied, __ATOMIC_RELAXED )
+      << " waits " << __atomic_load_n( &zeroCopyWaits, __ATOMIC_RELAXED )
+      << "\n";
+
+  if ( records->wired() )
+  {
+    out << "wire sends " << __atomic_load_n( &wireSends, __ATOMIC_RELAXED )
+        << " records " << __atomic_load_n( &wireRecords, __ATOMIC_RELAXED )
+        << "\n";
+  }
+
+  records->report( out );
+  replyCache.report( out );
+  changes.report( out );
+
+  Slab::report( out );
+  ProfiledMutex::report( out );
+
+  string text = out.str();
+
+  header_t header;
+  header.command = RET_SUCCESS;
+  header.length = text.size();
+
+  respond( incoming, &header, sizeof( header ) );
+  respond( incoming, text.data(), text.size() );
+}
+
+/**
+ * Change how often requests are traced, and report the old setting.
+ *
+ * @param[in] rec - The request, its id holding the new setting.
+ * @param[in] incoming - The connection to respond on.
+ */
+void setTracing( record_t rec, sock_t* incoming )
+{
+  record_t response;
+  bzero( &response, sizeof( response ) );
+
+  response.id = traceSampling( rec.id );
+  response.command = response.id < 0 ? RET_FAILURE : RET_SUCCESS;
+
+  cout << "Tracing one request in " << rec.id << endl;
+
+  respond( incoming, &response, sizeof( response ) );
+}
+
+/**
+ * Send the ids most often asked for and added lately to the client
+ * as text, see hotkeys.h.
+ *
+ * @param[in] rec - The request, its id field the most ids wanted of
+ * each kind, 0 for all tracked.
+ * @param[in] incoming - The connection to respond on.
+ */
+void sendHotKeys( record_t rec, sock_t* incoming )
+{
+  ostringstream out;
+  HotKeys::report( out, rec.id > 0 ? rec.id : 0 );
+  string text = out.str();
+
+  header_t header;
+  header.command = RET_SUCCESS;
+  header.length = text.size();
+
+  respond( incoming, &header, sizeof( header ) );
+  respond( incoming, text.data(), text.size() );
+}
+
+/**
+ * Start writing a snapshot of the store in the background, unless
+ * one is already being written.
+ *
+ * @param[in] incoming - The connection to respond on.
+ */
+void takeSnapshot( sock_t* incoming )
+{
+  record_t response;
+  bzero( &response, sizeof( response ) );
+  response.command = RET_FAILURE;
+
+  pid_t pid = records->snapshot();
+  if ( pid > 0 )
+  {
+    response.command = RET_SUCCESS;
+    response.id = pid;
+    cout << "Snapshot started by process " << pid << endl;
+  }
+  else
+  {
+    cerr << "Snapshot not started" << endl;
+  }
+
+  respond( incoming, &response, sizeof( response ) );
+}
+
+/**
+ * Map the shared memory channel a local client has set up, answering
+ * on the socket before every later response goes through it.
+ *
+ * @param[in] rec - The request, its name naming the shared memory.
+ * @param[in] incoming - The connection asking.
+ */
+void attachChannel( record_t rec, sock_t* incoming )
+{
+  record_t response;
+  bzero( &response, sizeof( response ) );
+  response.command = RET_FAILURE;
+
+  channel_t* channel = NULL;
+  rec.name[ MAX_LEN - 1 ] = '\0';
+
+  int fd = incoming->local && NULL == incoming->channel
+         ? shm_open( rec.name, O_RDWR, 0 ) : -1;
+  if ( fd >= 0 )
+  {
+    struct stat status;
+    if ( fstat( fd, &status ) == 0
+         && status.st_size == (off_t)sizeof( channel_t ) )
+    {
+      void* mapped = mmap( NULL, sizeof( channel_t ), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0 );
+      if ( MAP_FAILED != mapped )
+      {
+        channel = static_cast<channel_t*>( mapped );
+        response.command = RET_SUCCESS;
+      }
+    }
+    close( fd );
+  }
+
+  cout << "Shared memory channel " << rec.name
+       << ( NULL != channel ? " attached" : " refused" ) << endl;
+
+  respond( incoming, &response, sizeof( response ) );
+  if ( NULL != channel )
+  {
+    incoming->channel = channel;
+  }
+}
+
+/**
+ * Agree on how the connection's batches are packed, picking the one
+ * codec there is if the client can unpack it.
+ *
+ * @param[in] rec - The request, its id holding the codecs offered.
+ * @param[in] incoming - The connection asking.
+ */
+void setPacking( record_t rec, sock_t* incoming )
+{
+  header_t response;
+  response.command = RET_SUCCESS;
+  response.length = rec.id & PACK_LZ;
+
+  cout << "Batches " << ( response.length ? "packed" : "not packed" ) << endl;
+
+  respond( incoming, &response, sizeof( response ) );
+  incoming->packing = response.length != 0;
+}
+
+/**
+ * Determine how many bytes the request at the front of a buffer
+ * occupies on the wire.
+ *
+ * @param[in] frame - The start of the request.
+ * @param[in] available - The number of bytes read so far.
+ *
+ * @return The request length, 0 if more bytes are needed to tell,
+ * or -1 if the request is not one we understand.
+ */
+int requestLength( const char* frame, int available )
+{
+  header_t header;
+  if ( available < (int)sizeof( header ) )
+  {
+    return 0;
+  }
+  memcpy( &header, frame, sizeof( header ) );
+
+  switch ( header.command )
+  {
+    case add_t:
+    case attach_t:
+      return sizeof( record_t );
+    case addttl_t:
+      return sizeof( record_t ) + sizeof( int );
+    case qname_t:
+    case qprefix_t:
+    case qage_t:
+      return sizeof( query_t );
+    case subscribe_t:
+      return sizeof( subscription_t );
+    case update_t:
+    case delete_t:
+    case cas_t:
+    case incr_t:
+      return sizeof( mutation_t );
+    case retrieve_t:
+    case stats_t:
+    case trace_t:
+    case snapshot_t:
+    case hot_t:
+    case compress_t:
+      return sizeof( header );
+    case mget_t:
+    case madd_t:
+      if ( header.length < 0 || header.length > MAX_BATCH )
+      {
+        return -1;
+      }
+      return sizeof( header ) + header.length
+             * ( header.command == mget_t ? sizeof( int ) : sizeof( record_t ) );
+    default:
+      return -1;
+  }
+}
+
+/**
+ * Reserve room in the global queue for a number of requests.
+ *
+ * @param[in] wanted - The number of requests waiting to be served.
+ *
+ * @return How many of them were admitted, the rest must be shed.
+ */
+int admitRequests( int wanted )
+{
+  counterMutex.lock();
+  int admitted = maxQueue - queuedRequests;
+  if ( admitted > wanted )
+  {
+    admitted = wanted;
+  }
+  if ( admitted < 0 )
+  {
+    admitted = 0;
+  }
+  queuedRequests += admitted;
+  requestsShed += wanted - admitted;
+  counterMutex.unlock();
+
+  return admitted;
+}
+
+/**
+ * Return a served request's slot to the global queue.
+ */
+void releaseRequest()
+{
+  counterMutex.lock();
+  queuedRequests--;
+  requestsServed++;
+  counterMutex.unlock();
+}
+
+/**
+ * Perform the actual action requested, then return the request's
+ * slot to the global queue.
+ *
+ * @param[in] request - The admitted request.
+ * @param[in] frame - The request as it arrived, for batches.
+ * @param[in] incoming - The connection to respond on.
+ */
+void serveRequest( record_t request, const char* frame, sock_t* incoming )
+{
+  switch ( request.command )
+  {
+    case add_t:
+      addRecord( request, records->defaultTtl(), incoming );
+      break;
+    case addttl_t:
+    {
+      int ttl;
+      memcpy( &ttl, frame + sizeof( record_t ), sizeof( ttl ) );
+      addRecord( request, ttl > 0 ? ttl : 0, incoming );
+      break;
+    }
+    case retrieve_t:
+      getRecord( request, incoming );
+      break;
+    case stats_t:
+      sendStats( incoming );
+      break;
+    case hot_t:
+      sendHotKeys( request, incoming );
+      break;
+    case trace_t:
+      setTracing( request, incoming );
+      break;
+    case snapshot_t:
+      takeSnapshot( incoming );
+      break;
+    case attach_t:
+      attachChannel( request, incoming );
+      break;
+    case compress_t:
+      setPacking( request, incoming );
+      break;
+    case mget_t:
+      getRecords( frame, incoming );
+      break;
+    case madd_t:
+      addRecords( frame, incoming );
+      break;
+    case update_t:
+    case delete_t:
+    case cas_t:
+    case incr_t:
+      mutateRecord( frame, incoming );
+      break;
+    case qname_t:
+    case qprefix_t:
+    case qage_t:
+      runQuery( frame, incoming );
+      break;
+    default:
+      break;
+  }
+
+  releaseRequest();
+}
+
+/**
+ * Serve up to 'maxInflight' complete requests from the front of the
+ * connection's buffer, admitting them against the global queue
+ * together.
+ *
+ * @param[in] incoming - The connection to serve.
+ * @param[out] waiting - The number of requests served or shed.
+ *
+ * @return False if the client sent something unintelligible, or the
+ * connection now streams changes.
+ */
+bool serveAdmitted( sock_t* incoming, int& waiting )
+{
+  //
+  // Count the complete requests which have been read so far
+  //
+  waiting = 0;
+  int offset = 0;
+  while ( offset < incoming->buffered && waiting < maxInflight )
+  {
+    int available = incoming->buffered - offset;
+    int length = requestLength( incoming->buffer + offset, available );
+    if ( length < 0 )
+    {
+      cerr << "Malformed request, closing." << endl;
+      return false;
+    }
+    if ( length == 0 || length > available )
+    {
+      break;
+    }
+    offset += length;
+    waiting++;
+  }
+
+  int admitted = admitRequests( waiting );
+
+  offset = 0;
+  for ( int i = 0; i < waiting; i++ )
+  {
+    //
+    // A batch's header lines up with a record's command and id, so
+    // the request's id is the batch size when logging and tracing.
+    //
+    const char* frame = incoming->buffer + offset;
+    int length = requestLength( frame, incoming->buffered - offset );
+    offset += length;
+
+    record_t request;
+    bzero( &request, sizeof( request ) );
+    memcpy( &request, frame,
+            length < (int)sizeof( request ) ? length : sizeof( request ) );
+
+    cout << "Command: " << request.command << endl;
+
+    if ( i >= admitted )
+    {
+      sendBusy( request, incoming );
+      continue;
+    }
+
+    if ( request.command == subscribe_t )
+    {
+      //
+      // The connection only streams changes from here on, holding no
+      // place in the queue, and whatever was sent after it is ignored.
+      //
+      counterMutex.lock();
+      queuedRequests -= admitted - i;
+      requestsServed++;
+      counterMutex.unlock();
+
+      streamChanges( frame, incoming );
+      return false;
+    }
+
+    if ( RequestTrace::sample( incoming->sampleCountdown ) )
+    {
+      RequestTrace trace( incoming->threadnum, request.command, request.id );
+      trace.record( "read", incoming->readBegin, incoming->readEnd );
+      serveRequest( request, frame, incoming );
+    }
+    else
+    {
+      serveRequest( request, frame, incoming );
+    }
+  }
+
+  incoming->buffered -= offset;
+  memmove( incoming->buffer, incoming->buffer + offset, incoming->buffered );
+  return true;
+}
+
+/**
+ * Serve every complete request sitting in the connection's buffer,
+ * leaving any trailing partial request for the next read. Requests
+ * are admitted 'maxInflight' at a time, however many small ones the
+ * buffer holds.
+ *
+ * @param[in] incoming - The connection to serve.
+ *
+ * @return False if the client sent something unintelligible.
+ */
+bool serveBuffered( sock_t* incoming )
+{
+  int waiting;
+  do
+  {
+    if ( not serveAdmitted( incoming, waiting ) )
+    {
+      return false;
+    }
+  }
+  while ( waiting == maxInflight );
+  return true;
+}
+
+/**
+ * @return The size of a connection's read buffer, which holds either
+ * 'maxInflight' full sized requests or the largest batch.
+ */
+int connectionCapacity()
+{
+  int capacity = maxInflight * sizeof( record_t );
+  return capacity > (int)BATCH_FRAME ? capacity : (int)BATCH_FRAME;
+}
+
+/**
+ * @return How many bytes to read next: enough for 'maxInflight' full
+ * sized requests in all, or to finish the batch at the front of the
+ * buffer, so that however large the buffer is a client which
+ * pipelines more is left waiting in the socket.
+ *
+ * @param[in] incoming - The connection, its complete requests served.
+ */
+int readRoom( const sock_t* incoming )
+{
+  int wanted = maxInflight * sizeof( record_t );
+  int length = requestLength( incoming->buffer, incoming->buffered );
+  wanted = length > wanted ? length : wanted;
+  wanted = wanted < incoming->capacity ? wanted : incoming->capacity;
+  return wanted - incoming->buffered;
+}
+
+/**
+ * Take a connection arena from the slab and lay out the connection's
+ * state and buffer in it, so accepting a client never calls malloc
+ * once the slab has warmed up.
+ *
+ * @return The new connection state, or NULL if out of memory.
+ */
+sock_t* newConnection()
+{
+  void* block = connectionSlab->allocate();
+  if ( NULL == block )
+  {
+    return NULL;
+  }
+
+  Arena arena( block, connectionSlab->blockSize() );
+
+  sock_t* incoming = static_cast<sock_t*>( arena.allocate( sizeof( sock_t ) ) );
+  bzero( incoming, sizeof( sock_t ) );
+  incoming->addressLen = sizeof( incoming->address );
+  incoming->capacity = connectionCapacity();
+  incoming->buffer = static_cast<char*>( arena.allocate( incoming->capacity ) );
+  incoming->buffered = 0;
+  incoming->output = static_cast<char*>( arena.allocate( BATCH_FRAME ) );
+  incoming->reader = -1;
+  if ( zeroCopyWanted )
+  {
+    incoming->standby = static_cast<char*>( arena.allocate( BATCH_FRAME ) );
+  }
+
+  return incoming;
+}
+
+/**
+ * Return a connection's arena to the slab.
+ *
+ * @param[in] incoming - The connection, which must not be used again.
+ */
+void freeConnection( sock_t* incoming )
+{
+  connectionSlab->release( incoming );
+}
+
+/**
+ * @return Who a connection is with, for logging.
+ */
+string describeClient( const sock_t* incoming )
+{
+  ostringstream out;
+  if ( incoming->local )
+  {
+    out << " Local client";
+  }
+  else
+  {
+    out << " Client IP: " << inet_ntoa( incoming->address.sin_addr )
+        << ", Port: " <<  ntohs( incoming->address.sin_port );
+  }
+  return out.str();
+}
+
+/**
+ * Have TCP probe a client which has been silent for 'keepaliveIdle'
+ * seconds, so that a connection whose client's host has gone away
+ * fails rather than being kept for ever.
+ *
+ * @param[in] sock - The client's socket.
+ */
+void keepAlive( int sock )
+{
+  if ( keepaliveIdle <= 0 )
+  {
+    return;
+  }
+
+  int on = 1;
+  setsockopt( sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof( on ) );
+
+#if defined( TCP_KEEPIDLE ) && defined( TCP_KEEPINTVL ) && defined( TCP_KEEPCNT )
+  int interval = keepaliveIdle / KEEPALIVE_PROBES;
+  interval = interval > 0 ? interval : 1;
+  int probes = KEEPALIVE_PROBES;
+  setsockopt( sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepaliveIdle,
+              sizeof( keepaliveIdle ) );
+  setsockopt( sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+              sizeof( interval ) );
+  setsockopt( sock, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof( probes ) );
+#endif
+}
+
+/**
+ * Wait for a client to send something, no longer than its connection
+ * may sit idle.
+ *
+ * @param[in] incoming - The connection.
+ * @param[in] idleSince - When the client last sent something.
+ * @param[in] parking - True if the connection may be left to
+ * watchIdle() once it has nothing to serve.
+ *
+ * @return What was found.
+ */
+awaited_t awaitClient( sock_t* incoming, uint64_t idleSince, bool parking )
+{
+  while ( true )
+  {
+    // Records it sent may only be freed once it unpins them
+    settleWire( incoming );
+
+    uint64_t idle = TimerWheel::clock() - idleSince;
+    int wait = -1;
+
+    if ( idleTimeout > 0 )
+    {
+      uint64_t limit = (uint64_t)idleTimeout * 1000;
+      if ( idle >= limit )
+      {
+        return AWAIT_EXPIRED;
+      }
+      wait = limit - idle;
+    }
+
+    // Only a connection with no partial request buffered can let go
+    if ( parking && 0 == incoming->buffered )
+    {
+      uint64_t delay = parkDelay;
+      if ( idle >= delay )
+      {
+        return AWAIT_PARK;
+      }
+      if ( wait < 0 || delay - idle < (uint64_t)wait )
+      {
+        wait = delay - idle;
+      }
+    }
+
+    struct pollfd ready;
+    ready.fd = incoming->sock;
+    ready.events = POLLIN;
+    ready.revents = 0;
+    int got = poll( &ready, 1, wait );
+
+    // Zero copy sends being let go of only show up as an error
+    if ( got > 0 && POLLERR == ready.revents && reapZeroCopy( incoming ) > 0 )
+    {
+      continue;
+    }
+    if ( got > 0 || ( got < 0 && errno != EINTR ) )
+    {
+      return AWAIT_SENT;
+    }
+  }
+}
+
+/**
+ * Leave a connection with nothing to serve to watchIdle(), copying
+ * out the little it needs to be taken up again. The connection's
+ * thread and arena are then free to go.
+ *
+ * @param[in] incoming - The connection.
+ * @param[in] idleSince - When the client last sent something.
+ *
+ * @return False if there was no room to keep it, and the thread must
+ * keep serving it.
+ */
+bool parkConnection( sock_t* incoming, uint64_t idleSince )
+{
+  // The kernel may still be sending from the arena about to be freed
+  if ( not waitZeroCopy( incoming, incoming->zeroCopySent, 0 ) )
+  {
+    return false;
+  }
+
+  idle_t* idle = static_cast<idle_t*>( idleSlab.allocate() );
+  if ( NULL == idle )
+  {
+    return false;
+  }
+
+  TimerWheel::init( &idle->timer, idle );
+  idle->slot = -1;
+  idle->sock = incoming->sock;
+  idle->threadnum = incoming->threadnum;
+  idle->local = incoming->local;
+  idle->packing = incoming->packing;
+  idle->zeroCopy = incoming->zeroCopy;
+  idle->sampleCountdown = incoming->sampleCountdown;
+  idle->address = incoming->address;
+  idle->closeAt = idleTimeout > 0 ? idleSince + (uint64_t)idleTimeout * 1000
+                                  : 0;
+
+  counterMutex.lock();
+  runingThreads--;
+  parkedConnections++;
+  connectionsParked++;
+  counterMutex.unlock();
+
+  idleMutex.lock();
+  idleArrivals.push_back( idle );
+  idleMutex.unlock();
+
+  // A full pipe has already woken it
+  char wake = 0;
+  write( idleWakeup[1], &wake, sizeof( wake ) );
+  return true;
+}
+
+/**
+ * Threading function to respond to a incoming client request.
+ *
+ * @param[in] arg - The socket information, casted to a void*
+ * in order to work with the threading library.
+ *
+ * @return EXIT_SUCCESS
+ */
+void* handleRequest( void* arg )
+{
+
+  sock_t* incoming = (sock_t*)arg;
+
+  cout << "Entering Thread # " << (int)incoming->threadnum
+       << describeClient( incoming ) << ":" << endl;
+  cout << "======================================================" << endl;
+
+  // Copied out as usual if every reader is taken, or without -W
+  incoming->reader = records->joinWire();
+
+  //
+  // Only 'maxInflight' full sized requests, or one batch, are read
+  // ahead, see readRoom(), so a client that pipelines more than that
+  // is left waiting in the socket until those are answered. A client
+  // on a shared memory channel is never parked or timed out.
+  //
+  int len;
+  uint64_t idleSince = TimerWheel::clock();
+  bool parking = parkDelay > 0;
+  while ( true )
+  {
+    if ( NULL == incoming->channel )
+    {
+      awaited_t awaited = awaitClient( incoming, idleSince, parking );
+      if ( AWAIT_PARK == awaited )
+      {
+        parking = parkConnection( incoming, idleSince );
+        if ( parking )
+        {
+          settleWire( incoming );
+          records->leaveWire( incoming->reader );
+          cout << "Parking Thread # " << incoming->threadnum
+               << describeClient( incoming ) << ": idle" << endl;
+          freeConnection( incoming );
+          pthread_exit( static_cast<void*>( EXIT_SUCCESS ) );
+        }
+        continue;
+      }
+      if ( AWAIT_EXPIRED == awaited )
+      {
+        cout << "Thread # " << incoming->threadnum << " idle too long" << endl;
+
+        counterMutex.lock();
+        connectionsReaped++;
+        counterMutex.unlock();
+        break;
+      }
+    }
+
+    incoming->readBegin = traceClock();
+    if ( NULL != incoming->channel )
+    {
+      len = ringRead( &incoming->channel->requests,
+                      incoming->buffer + incoming->buffered,
+                      readRoom( incoming ), incoming->sock );
+    }
+    else
+    {
+      len = read( incoming->sock, incoming->buffer + incoming->buffered,
+                  readRoom( incoming ) );
+    }
+    incoming->readEnd = traceClock();
+
+    if ( len <= 0 )
+    {
+      break;
+    }
+
+    cout << "Received " << len << " bytes from the socket " << endl;
+    incoming->buffered += len;
+    idleSince = TimerWheel::clock();
+
+    if ( not serveBuffered( incoming ) )
+    {
+      break;
+    }
+  }
+
+  //
+  // The arena must outlive any zero copy send the kernel still holds,
+  // failing which the connection is reset, so nothing is sent from it
+  //
+  if ( not waitZeroCopy( incoming, incoming->zeroCopySent,
+                         ZEROCOPY_PATIENCE ) )
+  {
+    struct linger reset;
+    reset.l_onoff = 1;
+    reset.l_linger = 0;
+    setsockopt( incoming->sock, SOL_SOCKET, SO_LINGER, &reset,
+                sizeof( reset ) );
+  }
+
+  // Reset or not, nothing more is sent from records it found
+  if ( incoming->pinned )
+  {
+    records->unpinWire( incoming->reader );
+  }
+  records->leaveWire( incoming->reader );
+
+  //
+  // Shutdown reads and writes to the socket
+  //
+  shutdown( incoming->sock, SHUT_RDWR );
+
+  //
+  // Close the socket and exit this thread
+  //
+  close( incoming->sock );
+
+  if ( NULL != incoming->channel )
+  {
+    munmap( incoming->channel, sizeof( channel_t ) );
+  }
+
+  cout << "Exiting Thread # " << incoming->threadnum
+       << describeClient( incoming ) << ":"
+       << " ... client closed the socket" << endl;
+  cout << "======================================================" << endl;
+
+  counterMutex.lock();
+
+  runingThreads--;
+  cout << "Total # of threads running at this time is " << runingThreads << endl;
+
+  counterMutex.unlock();
+
+  freeConnection( incoming );
+
+  pthread_exit( static_cast<void*>( EXIT_SUCCESS ) );
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Close a connection left to watchIdle().
+ *
+ * @param[in] idle - The connection, which must not be used again.
+ * @param[in] counter - What to count it as, NULL for nothing.
+ * @param[in] why - Why it was closed, for logging.
+ */
+void closeIdle( idle_t* idle, unsigned long* counter, const char* why )
+{
+  shutdown( idle->sock, SHUT_RDWR );
+  close( idle->sock );
+
+  cout << "Closing idle Thread # " << idle->threadnum << ": " << why << endl;
+
+  counterMutex.lock();
+  parkedConnections--;
+  if ( NULL != counter )
+  {
+    (*counter)++;
+  }
+  counterMutex.unlock();
+
+  idleSlab.release( idle );
+}
+
+/**
+ * Take up a connection left to watchIdle() whose client has sent
+ * something, giving it an arena and a thread once more.
+ *
+ * @param[in] idle - The connection, which must not be used again.
+ * @param[in] attributes - How to create its thread.
+ */
+void resumeConnection( idle_t* idle, pthread_attr_t* attributes )
+{
+  sock_t* incoming = newConnection();
+  if ( NULL == incoming )
+  {
+    closeIdle( idle, &connectionsShed, "out of memory" );
+    return;
+  }
+
+  incoming->sock = idle->sock;
+  incoming->threadnum = idle->threadnum;
+  incoming->local = idle->local;
+  incoming->packing = idle->packing;
+  incoming->zeroCopy = idle->zeroCopy;
+  incoming->sampleCountdown = idle->sampleCountdown;
+  incoming->address = idle->address;
+  idleSlab.release( idle );
+
+  counterMutex.lock();
+  parkedConnections--;
+  runingThreads++;
+  connectionsResumed++;
+  counterMutex.unlock();
+
+  pthread_t thread;
+  int error = pthread_create( &thread, attributes, handleRequest,
+                              (void*)incoming );
+  if ( error != 0 )
+  {
+    cerr << "pthread_create: " << strerror( error ) << endl;
+    close( incoming->sock );
+    freeConnection( incoming );
+
+    counterMutex.lock();
+    runingThreads--;
+    connectionsShed++;
+    counterMutex.unlock();
+  }
+}
+
+/**
+ * Stop watching an idle connection.
+ *
+ * @param[in] parked - The connections being watched.
+ * @param[in] idle - The one to stop watching.
+ */
+void unpark( vector< idle_t* >& parked, idle_t* idle )
+{
+  idle_t* last = parked.back();
+  parked[ idle->slot ] = last;
+  last->slot = idle->slot;
+  parked.pop_back();
+}
+
+/**
+ * Threading function which watches every connection with nothing to
+ * serve, so an idle client holds neither a thread nor buffers. A
+ * client which sends something has its connection taken up by a new
+ * thread, and one idle too long, gone or hung up is closed here. The
+ * timeouts are kept on a timer wheel, so pushing them back and closing
+ * connections never looks through the rest.
+ *
+ * @param[in] arg - Unused.
+ *
+ * @return Never returns.
+ */
+void* watchIdle( void* arg )
+{
+  (void)arg;
+
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes );
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+
+  TimerWheel wheel( IDLE_TICK );
+  vector< idle_t* > parked;
+  vector< idle_t* > arrived;
+  vector< idle_t* > ready;
+  vector< struct pollfd > polled;
+
+  while ( true )
+  {
+    idleMutex.lock();
+    arrived.swap( idleArrivals );
+    idleMutex.unlock();
+
+    uint64_t now = TimerWheel::clock();
+    for ( size_t i = 0; i < arrived.size(); i++ )
+    {
+      idle_t* idle = arrived[i];
+      idle->slot = parked.size();
+      parked.push_back( idle );
+      if ( idle->closeAt > 0 )
+      {
+        wheel.start( &idle->timer, now,
+                     idle->closeAt > now ? idle->closeAt - now : 0 );
+      }
+    }
+    arrived.clear();
+
+    polled.resize( parked.size() + 1 );
+    polled[0].fd = idleWakeup[0];
+    polled[0].events = POLLIN;
+    polled[0].revents = 0;
+    for ( size_t i = 0; i < parked.size(); i++ )
+    {
+      polled[ i + 1 ].fd = parked[i]->sock;
+      polled[ i + 1 ].events = POLLIN;
+      polled[ i + 1 ].revents = 0;
+    }
+
+    int got = poll( &polled[0], polled.size(), wheel.wait( now ) );
+
+    if ( got > 0 && ( polled[0].revents & POLLIN ) )
+    {
+      char drained[ 64 ];
+      while ( read( idleWakeup[0], drained, sizeof( drained ) ) > 0 )
+      {
+      }
+    }
+
+    ready.clear();
+    for ( size_t i = 1; got > 0 && i < polled.size(); i++ )
+    {
+      if ( 0 != polled[i].revents )
+      {
+        ready.push_back( parked[ i - 1 ] );
+      }
+    }
+
+    //
+    // A client which sent something is served again, while one which
+    // hung up, or which keepalive found gone, is closed without
+    // starting a thread only to find that out
+    //
+    for ( size_t i = 0; i < ready.size(); i++ )
+    {
+      idle_t* idle = ready[i];
+      unpark( parked, idle );
+      wheel.stop( &idle->timer );
+
+      char peeked;
+      ssize_t peek = recv( idle->sock, &peeked, sizeof( peeked ),
+                           MSG_PEEK | MSG_DONTWAIT );
+      if ( peek > 0 )
+      {
+        resumeConnection( idle, &attributes );
+      }
+      else if ( 0 == peek )
+      {
+        closeIdle( idle, NULL, "client closed the socket" );
+      }
+      else if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      {
+        resumeConnection( idle, &attributes );
+      }
+      else
+      {
+        closeIdle( idle, &connectionsDropped, strerror( errno ) );
+      }
+    }
+
+    TimerWheel::Timer* timer = wheel.expire( TimerWheel::clock() );
+    while ( NULL != timer )
+    {
+      idle_t* idle = static_cast<idle_t*>( timer->data );
+      timer = timer->next;
+      unpark( parked, idle );
+      closeIdle( idle, &connectionsReaped, "idle too long" );
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Send a datagram to a peer.
+ *
+ * @param[in] sock - The datagram socket.
+ * @param[in] peer - Where to send it.
+ * @param[in] type - The kind of datagram.
+ * @param[in] seq - The sequence number it carries.
+ * @param[in] data - What it carries, if anything.
+ * @param[in] size - The bytes of 'data', at most MAX_DATA.
+ */
+void sendDatagram( int sock, const sockaddr_in& peer, TYPE type,
+                   unsigned int seq, const void* data = NULL,
+                   size_t size = 0 )
+{
+  Datagram gram;
+  bzero( &gram, DATAGRAM_HEADER );
+  gram.type = type;
+  gram.seq = seq;
+  if ( size > 0 )
+  {
+    memcpy( gram.data, data, size );
+  }
+
+  sendto( sock, &gram, DATAGRAM_HEADER + size, 0,
+          (const struct sockaddr*)&peer, sizeof( peer ) );
+}
+
+/**
+ * Answer a datagram request, acknowledging it first unless the peer
+ * takes the reply as the acknowledgement.
+ *
+ * @param[in] sock - The datagram socket.
+ * @param[in] peer - Who sent the request.
+ * @param[in] seq - The request's sequence number.
+ * @param[in] reply - The reply.
+ * @param[in] piggyback - True if the peer's session piggybacks ACKs.
+ */
+void sendReply( int sock, const sockaddr_in& peer, unsigned int seq,
+                const record_t& reply, bool piggyback )
+{
+  if ( not piggyback )
+  {
+    sendDatagram( sock, peer, ACK, seq );
+  }
+  sendDatagram( sock, peer, DATA, seq, &reply, sizeof( reply ) );
+}
+
+/**
+ * Serve a request which arrived as a datagram and send its reply. A
+ * retransmitted request is answered from the reply cache, so it is
+ * never carried out twice.
+ *
+ * @param[in] sock - The datagram socket.
+ * @param[in] peer - Who sent the request.
+ * @param[in] gram - The request.
+ * @param[in] length - The bytes received.
+ */
+void serveDatagram( int sock, const sockaddr_in& peer, const Datagram& gram,
+                    size_t length )
+{
+  if ( length < DATAGRAM_HEADER + sizeof( record_t ) )
+  {
+    return;
+  }
+
+  record_t request;
+  memcpy( &request, gram.data, sizeof( request ) );
+  if ( request.command != add_t && request.command != retrieve_t )
+  {
+    return;
+  }
+
+  record_t reply;
+  bool piggyback;
+  switch ( replyCache.lookup( peer, gram.seq, reply, piggyback ) )
+  {
+    case ReplyCache::STALE:
+      return;
+    case ReplyCache::CACHED:
+      cout << "Request " << gram.seq << " retransmitted, resending reply"
+           << endl;
+      sendReply( sock, peer, gram.seq, reply, piggyback );
+      return;
+    case ReplyCache::FRESH:
+      break;
+  }
+
+  // A busy answer is not remembered, so a retransmit tries again
+  if ( admitRequests( 1 ) == 0 )
+  {
+    bzero( &reply, sizeof( reply ) );
+    reply.command = SRV_BUSY;
+    reply.id = request.id;
+    sendReply( sock, peer, gram.seq, reply, piggyback );
+    return;
+  }
+
+  reply = request.command == add_t
+        ? applyAdd( request, records->defaultTtl() ) : applyGet( request );
+  replyCache.remember( peer, gram.seq, reply );
+
+  sendReply( sock, peer, gram.seq, reply, piggyback );
+  releaseRequest();
+}
+
+/**
+ * Threading function which serves every datagram client.
+ *
+ * @param[in] arg - The datagram socket.
+ *
+ * @return Never returns.
+ */
+void* serveDatagrams( void* arg )
+{
+  int sock = (int)(intptr_t)arg;
+
+  while ( true )
+  {
+    Datagram gram;
+    sockaddr_in peer;
+    socklen_t peerLen = sizeof( peer );
+
+    ssize_t received = recvfrom( sock, &gram, sizeof( gram ), 0,
+                                 (struct sockaddr*)&peer, &peerLen );
+    if ( received < (ssize_t)DATAGRAM_HEADER )
+    {
+      continue;
+    }
+
+    switch ( gram.type )
+    {
+      case SYN:
+        //
+        // A client asking for an exchange is told the one agreed to,
+        // older clients expect a bare ACK.
+        //
+        if ( received >= (ssize_t)( DATAGRAM_HEADER + sizeof( int ) ) )
+        {
+          int exchange;
+          memcpy( &exchange, gram.data, sizeof( exchange ) );
+          if ( exchange != EXCHANGE_PIGGYBACK )
+          {
+            exchange = EXCHANGE_ACKED;
+          }
+          replyCache.open( peer, gram.seq, exchange == EXCHANGE_PIGGYBACK );
+          sendDatagram( sock, peer, ACK, gram.seq, &exchange,
+                        sizeof( exchange ) );
+        }
+        else
+        {
+          replyCache.open( peer, gram.seq );
+          sendDatagram( sock, peer, ACK, gram.seq );
+        }
+        break;
+      case ACK:
+        replyCache.acknowledge( peer, gram.seq );
+        break;
+      case FIN:
+        replyCache.close( peer );
+        break;
+      case DATA:
+        serveDatagram( sock, peer, gram, received );
+        break;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Setup a datagram socket bound to the given port.
+ *
+ * @param[in] port - The port number to receive on.
+ *
+ * @return The bound socket.
+ */
+int setupDatagramSocket( int port )
+{
+  int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+  if ( sock < 0 )
+  {
+    cerr << "Socket: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  struct sockaddr_in server;
+  bzero( &server, sizeof( server ) );
+  server.sin_family = AF_INET;
+  server.sin_port = htons( port );
+
+  if ( bind( sock, (struct sockaddr *)&server, sizeof( server ) ) < 0 )
+  {
+    cerr << "Bind: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  return sock;
+}
+
+/**
+ * Setup a socket, bind it to the local address then
+ * setup it up to listen for incoming connections.
+ *
+ * @param[in] port - The port number to listen on.
+ *
+ * @return The completely setup socket
+ */
+int setupSocket( int port )
+{
+  //
+  // Create a TCP socket.
+  //
+  int sock = socket( AF_INET, SOCK_STREAM, 0 );
+  if ( sock < 0 )
+  {
+    cerr << "Socket: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  //
+  // Fill in the struct with the port number given by the user.
+  //
+  struct sockaddr_in server;
+  bzero( &server, sizeof( server ) );
+  server.sin_family = AF_INET;
+  server.sin_port = htons( port );
+
+  //
+  // Bind this port number to this socket so that other programs can
+  // connect to this socket by specifying the port number.
+  //
+  if ( bind( sock, (struct sockaddr *)&server, sizeof( server ) ) < 0 )
+  {
+    cerr << "Bind: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  // Make this socket passive, that is, one that awaits connections
+  // rather than initiating them.
+  if ( listen( sock, 10 ) < 0 )
+  {
+    cerr << "Listen: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  return sock;
+}
+
+
+/**
+ * Accept clients on a listening socket for ever, handing each one to
+ * a thread of its own.
+ *
+ * @param[in] sock - The listening socket.
+ * @param[in] local - True if it is the unix socket.
+ */
+void acceptClients( int sock, bool local )
+{
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes );
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+
+  while ( true )
+  {
+
+    sock_t* incoming = newConnection();
+    if ( NULL == incoming )
+    {
+      cerr << "Server: out of memory for connections" << endl;
+      exit( EXIT_FAILURE );
+    }
+
+    // Wait for any new connections.
+    incoming->local = local;
+    incoming->sock = local ? accept( sock, NULL, NULL )
+                           : accept( sock, (struct sockaddr*)&incoming->address,
+                                     &(incoming->addressLen) );
+
+    if ( incoming->sock < 0 )
+    {
+      cerr << "Server: accept error" << endl;
+      exit( EXIT_FAILURE );
+    }
+
+    if ( not local )
+    {
+      keepAlive( incoming->sock );
+      enableZeroCopy( incoming );
+    }
+
+    //
+    // Turn the client away outright rather than letting every
+    // connection slow down together once we are at capacity.
+    //
+    counterMutex.lock();
+    bool full = runingThreads + parkedConnections >= maxConnections;
+    if ( full )
+    {
+      connectionsShed++;
+    }
+    else
+    {
+      incoming->threadnum = ++threadCount;
+      runingThreads++;
+    }
+    counterMutex.unlock();
+
+    if ( full )
+    {
+      cout << "MAIN THREAD - AT CONNECTION LIMIT, CLIENT SHED" << endl;
+
+      record_t busy;
+      bzero( &busy, sizeof( busy ) );
+      sendBusy( busy, incoming );
+      close( incoming->sock );
+      freeConnection( incoming );
+      continue;
+    }
+
+    cout << "NEW THREAD CREATED: NO. " << incoming->threadnum << endl;
+
+    // Create a detached thread to handle this connection, so its
+    // resources are returned as soon as the client goes away.
+    pthread_t thread;
+    int error = pthread_create( &thread, &attributes, handleRequest,
+                                (void*)incoming );
+    if ( error != 0 )
+    {
+      cerr << "pthread_create: " << strerror( error ) << endl;
+      close( incoming->sock );
+      freeConnection( incoming );
+
+      counterMutex.lock();
+      runingThreads--;
+      connectionsShed++;
+      counterMutex.unlock();
+    }
+
+    cout << "MAIN THREAD - "
+         << "WAITING FOR THE NEXT CONNECTION FROM CLIENT ..."
          << endl;
   }
+}
+
+/**
+ * Threading function accepting clients on the unix socket.
+ *
+ * @param[in] arg - The listening socket.
+ *
+ * @return Never returns.
+ */
+void* acceptLocalClients( void* arg )
+{
+  acceptClients( (int)(intptr_t)arg, true );
+  return EXIT_SUCCESS;
+}
+/**
+ * Setup a unix socket at the given path, replacing any left behind by
+ * an earlier server, and listen on it for clients on this host.
+ *
+ * @param[in] path - Where the socket lives.
+ *
+ * @return The completely setup socket
+ */
+int setupLocalSocket( const char* path )
+{
+  int sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( sock < 0 )
+  {
+    cerr << "Socket: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  struct sockaddr_un server;
+  bzero( &server, sizeof( server ) );
+  server.sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof( server.sun_path ) )
+  {
+    cerr << path << ": path too long for a unix socket" << endl;
+    exit( EXIT_FAILURE );
+  }
+  strcpy( server.sun_path, path );
+
+  unlink( path );
+  if ( bind( sock, (struct sockaddr *)&server, sizeof( server ) ) < 0 )
+  {
+    cerr << "Bind: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  if ( listen( sock, 10 ) < 0 )
+  {
+    cerr << "Listen: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  return sock;
+}
+
+//
+// Shared nothing serving, see serveCores().
+//
+
+#if defined( __linux__ )
+
+// Messages queued from one core to another before overflowing.
+#define CORE_QUEUE 512
+
+// Events taken from a core's epoll set at a time.
+#define CORE_EVENTS 64
+
+struct CoreClient;
+struct Pending;
+
+/**
+ * A request for a record in another core's partition, and on its way
+ * back the answer.
+ */
+typedef struct
+{
+  CoreClient* client;     // The connection the request came in on
+  Pending* pending;       // The response it is a part of
+  int index;              // Its place in a batch, -1 if alone
+  unsigned int ttl;       // Seconds an added record lives for
+  bool answered;          // Whether 'record' is now the answer
+  union
+  {
+    record_t record;
+    mutation_t mutation;  // For a change, whose fields begin alike
+  };
+} forward_t;
+
+typedef SpscQueue< forward_t, CORE_QUEUE > CoreQueue;
+
+/**
+ * A response being put together. It is sent once every part of it
+ * has come back from other cores and every response before it on its
+ * connection has been sent.
+ */
+struct Pending
+{
+  Pending* next;          // The next response on the connection
+  int waiting;            // Parts still out on other cores
+  size_t length;
+  const char* data;
+  char* batch;            // A block from the core's batch slab
+  bool packing;           // Whether 'batch' is packed as it is sent
+  union
+  {
+    record_t single;
+    mutation_t mutation;
+  };
+  string text;
+};
+
+/**
+ * A client connection, only ever touched by the core it was accepted
+ * on, though other cores hold on to it while answering its requests.
+ */
+struct CoreClient
+{
+  int sock;
+  bool closed;
+  bool reading;           // Whether the core polls it for requests
+  bool writing;           // Whether the core polls it for room to write
+  bool packing;           // Batches are packed, see pack.h
+  int forwarded;          // Requests out on other cores
+  int responses;          // Responses not yet sent
+  Pending* first;
+  Pending* last;
+  string unsent;          // Bytes the socket would not take yet
+  int buffered;
+  char* buffer;           // Only held while part of a request is
+  TimerWheel::Timer timer;    // Closes it once idle too long
+};
+
+/**
+ * A core's own state. Everything but 'asleep' and the counters, read
+ * for stats, is only ever touched by the core's thread.
+ */
+struct Core
+{
+  int index;
+  int epoll;
+  int listener;
+  int wakeup;             // An eventfd other cores write to wake us
+  uint32_t asleep;        // Set while waiting in epoll_wait()
+
+  RecordStore* partition; // The records whose ids hash to this core
+  Slab* batches;          // Blocks for batch responses
+  Slab* buffers;          // Buffers for clients part way through a request
+  char* scratch;          // Where every other client's requests are read
+  TimerWheel* wheel;      // Idle timeouts, NULL if there are none
+  Pending* spare;         // Responses to reuse
+  int clients;
+  int queued;             // Responses not yet sent, over all clients
+
+  deque< forward_t > overflow[ MAX_CORES ];
+  bool pushed[ MAX_CORES ];
+
+  // Written by the core alone, with plain stores
+  unsigned long accepted;
+  unsigned long shed;
+  unsigned long served;
+  unsigned long busy;
+  unsigned long sent;
+  unsigned long received;
+  unsigned long reaped;
+  unsigned long writes;   // Writes to clients
+  unsigned long gathered; // Responses they carried
+  unsigned long framesPacked;
+  unsigned long bytesBeforePacking;
+  unsigned long bytesAfterPacking;
+  unsigned long buffersTaken;
+  unsigned long buffersReturned;
+
+  char pad[ SPSC_LINE ];
+};
+
+// The cores, and the queue from each to each at [ from * coreCount + to ]
+Core* cores = NULL;
+int coreCount = 0;
+CoreQueue* coreQueues = NULL;
+
+// Limits per core, each core's share of the global ones.
+int coreConnections = 0;
+int coreQueueLimit = 0;
+
+/**
+ * Count more of something, on the core which owns the counter,
+ * without the locked instruction an increment others may read needs.
+ */
+inline void bump( unsigned long& counter, unsigned long by = 1 )
+{
+  __atomic_store_n( &counter, counter + by, __ATOMIC_RELAXED );
+}
+
+inline unsigned long peek( const unsigned long& counter )
+{
+  return __atomic_load_n( &counter, __ATOMIC_RELAXED );
+}
+
+/**
+ * @param[in] id - A record id.
+ *
+ * @return The core whose partition holds it, spreading sequential ids
+ * evenly (Fibonacci hashing) without a division.
+ */
+inline int coreOf( int id )
+{
+  uint32_t hashed = (uint32_t)id * 2654435769u;
+  return (int)( ( (uint64_t)hashed * coreCount ) >> 32 );
+}
+
+inline CoreQueue& coreQueue( int from, int to )
+{
+  return coreQueues[ from * coreCount + to ];
+}
+
+/**
+ * Start a response at the back of a client's queue of them.
+ *
+ * @return The response, complete until parts are sent elsewhere.
+ */
+Pending* newPending( Core* core, CoreClient* client )
+{
+  Pending* pending = core->spare;
+  if ( NULL != pending )
+  {
+    core->spare = pending->next;
+  }
+  else
+  {
+    pending = new Pending();
+  }
+
+  pending->next = NULL;
+  pending->waiting = 0;
+  pending->length = 0;
+  pending->data = NULL;
+  pending->batch = NULL;
+  pending->packing = client->packing;
+  bzero( &pending->mutation, sizeof( pending->mutation ) );
+
+  if ( NULL == client->last )
+  {
+    client->first = pending;
+  }
+  else
+  {
+    client->last->next = pending;
+  }
+  client->last = pending;
+  client->responses++;
+  core->queued++;
+  return pending;
+}
+
+/**
+ * Take a response off the front of a client's queue and keep it for
+ * reuse.
+ */
+void dropPending( Core* core, CoreClient* client )
+{
+  Pending* pending = client->first;
+  client->first = pending->next;
+  if ( NULL == client->first )
+  {
+    client->last = NULL;
+  }
+  client->responses--;
+  core->queued--;
+
+  if ( NULL != pending->batch )
+  {
+    core->batches->release( pending->batch );
+  }
+  pending->text.clear();
+  pending->next = core->spare;
+  core->spare = pending;
+}
+
+/**
+ * Free a closed client, once no other core holds on to it.
+ */
+void destroyClient( Core* core, CoreClient* client )
+{
+  while ( NULL != client->first )
+  {
+    dropPending( core, client );
+  }
+  if ( NULL != client->buffer && client->buffer != core->scratch )
+  {
+    core->buffers->release( client->buffer );
+    bump( core->buffersReturned );
+  }
+  delete client;
+}
+
+/**
+ * Stop serving a client, freeing it once every request it has out on
+ * other cores has come back.
+ */
+void closeClient( Core* core, CoreClient* client )
+{
+  if ( NULL != core->wheel )
+  {
+    core->wheel->stop( &client->timer );
+  }
+  epoll_ctl( core->epoll, EPOLL_CTL_DEL, client->sock, NULL );
+  close( client->sock );
+  client->closed = true;
+  core->clients--;
+
+  if ( 0 == client->forwarded )
+  {
+    destroyClient( core, client );
+  }
+}
+
+/**
+ * Send a request to the core which owns its record, or hold on to it
+ * if that core's queue is full.
+ */
+void forward( Core* core, int target, const forward_t& message )
+{
+  deque< forward_t >& overflow = core->overflow[ target ];
+  if ( not overflow.empty()
+       || not coreQueue( core->index, target ).push( message ) )
+  {
+    overflow.push_back( message );
+  }
+  core->pushed[ target ] = true;
+}
+
+/**
+ * Look a record up in the core's own partition.
+ *
+ * @param[in] id - The id to look for.
+ * @param[out] rec - The record found, or a response saying it was not.
+ */
+void fetch( Core* core, int id, record_t& rec )
+{
+  HotKeys::count( HotKeys::GET, id );
+  bzero( &rec, sizeof( rec ) );
+  if ( core->partition->get( id, rec ) )
+  {
+    rec.command = RET_SUCCESS;
+  }
+  else
+  {
+    rec.command = RET_FAILURE;
+    rec.id = id;
+  }
+}
+
+/**
+ * Carry out a request on the core's own partition, leaving the answer
+ * in its place.
+ */
+void execute( Core* core, forward_t& message )
+{
+  record_t& rec = message.record;
+  if ( rec.command == update_t || rec.command == delete_t
+       || rec.command == cas_t || rec.command == incr_t )
+  {
+    mutation_t result;
+    result.command = core->partition->mutate( message.mutation, result );
+    message.mutation = result;
+  }
+  else if ( rec.command == add_t || rec.command == addttl_t )
+  {
+    HotKeys::count( HotKeys::ADD, rec.id );
+    int id = rec.id;
+    bool added = core->partition->add( rec, message.ttl );
+    bzero( &rec, sizeof( rec ) );
+    rec.command = added ? ADD_SUCCESS : ADD_FAILURE;
+    rec.id = id;
+  }
+  else
+  {
+    fetch( core, rec.id, rec );
+  }
+  message.answered = true;
+}
+
+/**
+ * Put an answer in its place in the response it belongs to.
+ */
+void place( const forward_t& message )
+{
+  Pending* pending = message.pending;
+  if ( message.index < 0 )
+  {
+    pending->mutation = message.mutation;
+  }
+  else
+  {
+    record_t* results = (record_t*)( pending->batch + sizeof( header_t ) );
+    results[ message.index ] = message.record;
+  }
+}
+
+void serveClient( Core* core, CoreClient* client );
+
+/**
+ * Note that a client is still there, pushing back when it is closed
+ * for being idle.
+ */
+void touchClient( Core* core, CoreClient* client )
+{
+  if ( NULL != core->wheel )
+  {
+    core->wheel->start( &client->timer, TimerWheel::clock(),
+                        (uint64_t)idleTimeout * 1000 );
+  }
+}
+
+/**
+ * Leave a client holding a buffer only while part of a request is
+ * buffered, taking one for what is left in the core's scratch buffer
+ * and giving its own back once it is empty, so an idle client holds
+ * none.
+ *
+ * @return False if the client had to be closed.
+ */
+bool settleBuffer( Core* core, CoreClient* client )
+{
+  if ( client->buffered > 0 && client->buffer == core->scratch )
+  {
+    char* own = (char*)core->buffers->allocate();
+    if ( NULL == own )
+    {
+      closeClient( core, client );
+      return false;
+    }
+    memcpy( own, client->buffer, client->buffered );
+    client->buffer = own;
+    bump( core->buffersTaken );
+  }
+  else if ( 0 == client->buffered && NULL != client->buffer )
+  {
+    if ( client->buffer != core->scratch )
+    {
+      core->buffers->release( client->buffer );
+      bump( core->buffersReturned );
+    }
+    client->buffer = NULL;
+  }
+  return true;
+}
+
+/**
+ * Change what a client is polled for, only making the system call
+ * when it changes.
+ */
+void pollClient( Core* core, CoreClient* client, bool reading, bool writing )
+{
+  if ( reading == client->reading && writing == client->writing )
+  {
+    return;
+  }
+  client->reading = reading;
+  client->writing = writing;
+
+  struct epoll_event event;
+  event.events = ( reading ? (uint32_t)EPOLLIN : 0 )
+                 | ( writing ? (uint32_t)EPOLLOUT : 0 );
+  event.data.ptr = client;
+  epoll_ctl( core->epoll, EPOLL_CTL_MOD, client->sock, &event );
+}
+
+/**
+ * Write out every complete response at the front of a client's queue,
+ * gathered into one write straight from where each was put together,
+ * and poll the client for whichever it needs. Only what the socket
+ * will not take is copied aside, to be sent once it has room.
+ *
+ * @return False if the client had to be closed.
+ */
+bool flushClient( Core* core, CoreClient* client )
+{
+  while ( true )
+  {
+    struct iovec parts[ FLUSH_IOVECS ];
+    int count = 0;
+    if ( not client->unsent.empty() )
+    {
+      parts[ count ].iov_base = (void*)client->unsent.data();
+      parts[ count ].iov_len = client->unsent.size();
+      count++;
+    }
+    int gathered = 0;
+    for ( Pending* pending = client->first;
+          NULL != pending && 0 == pending->waiting && count < FLUSH_IOVECS;
+          pending = pending->next )
+    {
+      if ( pending->packing && NULL != pending->batch )
+      {
+        char packed[ PACKED_FRAME ];
+        size_t unpacked;
+        size_t length = packFrame( PACK_RECORDS, pending->batch, packed,
+                                   unpacked );
+        pending->text.assign( packed, length );
+        bump( core->framesPacked );
+        bump( core->bytesBeforePacking, unpacked );
+        bump( core->bytesAfterPacking, length - sizeof( header_t ) );
+        pending->data = pending->text.data();
+        pending->length = pending->text.size();
+      }
+      parts[ count ].iov_base = (void*)pending->data;
+      parts[ count ].iov_len = pending->length;
+      count++;
+      gathered++;
+    }
+
+    if ( 0 == count )
+    {
+      break;
+    }
+
+    ssize_t written = writev( client->sock, parts, count );
+    if ( written < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+    {
+      closeClient( core, client );
+      return false;
+    }
+    if ( written > 0 )
+    {
+      touchClient( core, client );
+      bump( core->writes );
+    }
+
+    size_t taken = written > 0 ? written : 0;
+    if ( count > gathered )
+    {
+      size_t done = taken < parts[0].iov_len ? taken : parts[0].iov_len;
+      client->unsent.erase( 0, done );
+      taken -= done;
+    }
+    for ( int i = count - gathered; i < count; i++ )
+    {
+      size_t done = taken < parts[i].iov_len ? taken : parts[i].iov_len;
+      taken -= done;
+      if ( done < parts[i].iov_len )
+      {
+        client->unsent.append( (const char*)parts[i].iov_base + done,
+                               parts[i].iov_len - done );
+      }
+      dropPending( core, client );
+    }
+    bump( core->gathered, gathered );
+
+    // Whatever is left waits for the socket to have room
+    if ( not client->unsent.empty() || count < FLUSH_IOVECS )
+    {
+      break;
+    }
+  }
+
+  // Read no more until the client has taken what it has been sent
+  bool waiting = not client->unsent.empty();
+  pollClient( core, client,
+              not waiting && client->responses < maxInflight, waiting );
+  return true;
+}
+
+/**
+ * Note that an answer has come back for a client, sending what can be
+ * sent and going on with requests held back for want of room.
+ */
+void answered( Core* core, const forward_t& message )
+{
+  CoreClient* client = message.client;
+  place( message );
+  message.pending->waiting--;
+  client->forwarded--;
+
+  if ( client->closed )
+  {
+    if ( 0 == client->forwarded )
+    {
+      destroyClient( core, client );
+    }
+    return;
+  }
+
+  if ( 0 == message.pending->waiting && message.pending == client->first
+       && flushClient( core, client ) && client->reading
+       && client->buffered > 0 )
+  {
+    serveClient( core, client );
+  }
+}
+
+/**
+ * Send a request to the core that owns its record, carrying it out at
+ * once if that is this core.
+ */
+void dispatch( Core* core, CoreClient* client, Pending* pending,
+               forward_t& message )
+{
+  int owner = coreOf( message.record.id );
+  if ( owner == core->index )
+  {
+    // A record of a batch found here goes straight into its place
+    if ( message.index >= 0 && message.record.command == retrieve_t )
+    {
+      record_t* results = (record_t*)( pending->batch + sizeof( header_t ) );
+      fetch( core, message.record.id, results[ message.index ] );
+      return;
+    }
+    execute( core, message );
+    place( message );
+    return;
+  }
+
+  pending->waiting++;
+  client->forwarded++;
+  bump( core->sent );
+  forward( core, owner, message );
+}
+
+/**
+ * Route one record of a request to the core that owns it.
+ */
+void route( Core* core, CoreClient* client, Pending* pending, int index,
+            const record_t& rec, unsigned int ttl )
+{
+  forward_t message;
+  message.client = client;
+  message.pending = pending;
+  message.index = index;
+  message.ttl = ttl;
+  message.answered = false;
+  message.record = rec;
+  dispatch( core, client, pending, message );
+}
+
+/**
+ * Lay out the per core statistics and those of every partition.
+ */
+void coreStats( std::ostream& out )
+{
+  out << "cores " << coreCount << "\n";
+  for ( int i = 0; i < coreCount; i++ )
+  {
+    Core& core = cores[i];
+    out << "core " << i
+        << " accepted " << peek( core.accepted )
+        << " shed_connections " << peek( core.shed )
+        << " served " << peek( core.served )
+        << " shed_requests " << peek( core.busy )
+        << " forwarded " << peek( core.sent )
+        << " answered_for_others " << peek( core.received )
+        << " reaped " << peek( core.reaped )
+        << " writes " << peek( core.writes )
+        << " gathered " << peek( core.gathered )
+        << " buffers " << peek( core.buffersTaken )
+                          - peek( core.buffersReturned ) << "\n";
+  }
+
+  unsigned long frames = 0;
+  unsigned long before = 0;
+  unsigned long after = 0;
+  for ( int i = 0; i < coreCount; i++ )
+  {
+    frames += peek( cores[i].framesPacked );
+    before += peek( cores[i].bytesBeforePacking );
+    after += peek( cores[i].bytesAfterPacking );
+  }
+  out << "packed_frames " << frames
+      << " bytes_before " << before
+      << " bytes_after " << after << "\n";
+  for ( int i = 0; i < coreCount; i++ )
+  {
+    cores[i].partition->report( out );
+  }
+  Slab::report( out );
+  ProfiledMutex::report( out );
+}
+
+/**
+ * Start answering one request from a client.
+ *
+ * @param[in] frame - The request as it arrived.
+ * @param[in] length - The bytes of the request.
+ */
+void coreRequest( Core* core, CoreClient* client, const char* frame,
+                  int length )
+{
+  header_t header;
+  memcpy( &header, frame, sizeof( header ) );
+
+  // A batch's header lines up with a record's command and id
+  record_t request;
+  bzero( &request, sizeof( request ) );
+  memcpy( &request, frame,
+          length < (int)sizeof( request ) ? length : sizeof( request ) );
+
+  Pending* pending = newPending( core, client );
+  pending->data = (const char*)&pending->single;
+  pending->length = sizeof( record_t );
+
+  if ( core->queued > coreQueueLimit )
+  {
+    pending->length = busyResponse( request, (char*)&pending->mutation );
+    bump( core->busy );
+    return;
+  }
+  bump( core->served );
+
+  switch ( request.command )
+  {
+    case add_t:
+      route( core, client, pending, -1, request,
+             core->partition->defaultTtl() );
+      break;
+    case addttl_t:
+    {
+      int ttl;
+      memcpy( &ttl, frame + sizeof( record_t ), sizeof( ttl ) );
+      route( core, client, pending, -1, request, ttl > 0 ? ttl : 0 );
+      break;
+    }
+    case retrieve_t:
+      route( core, client, pending, -1, request, 0 );
+      break;
+    case update_t:
+    case delete_t:
+    case cas_t:
+    case incr_t:
+    {
+      forward_t message;
+      message.client = client;
+      message.pending = pending;
+      message.index = -1;
+      message.ttl = 0;
+      message.answered = false;
+      memcpy( &message.mutation, frame, sizeof( message.mutation ) );
+      pending->length = sizeof( mutation_t );
+      dispatch( core, client, pending, message );
+      break;
+    }
+    case mget_t:
+    case madd_t:
+    {
+      pending->batch = (char*)core->batches->allocate();
+      if ( NULL == pending->batch )
+      {
+        pending->length = busyResponse( request, (char*)&pending->single );
+        break;
+      }
+      pending->data = pending->batch;
+      pending->length = sizeof( header ) + header.length * sizeof( record_t );
+      header_t response;
+      response.command = RET_SUCCESS;
+      response.length = header.length;
+      memcpy( pending->batch, &response, sizeof( response ) );
+
+      const char* items = frame + sizeof( header );
+      for ( int i = 0; i < header.length; i++ )
+      {
+        record_t rec;
+        if ( header.command == madd_t )
+        {
+          memcpy( &rec, items + i * sizeof( record_t ), sizeof( rec ) );
+          rec.command = add_t;
+        }
+        else
+        {
+          bzero( &rec, sizeof( rec ) );
+          rec.command = retrieve_t;
+          memcpy( &rec.id, items + i * sizeof( int ), sizeof( int ) );
+        }
+        route( core, client, pending, i, rec,
+               core->partition->defaultTtl() );
+      }
+      break;
+    }
+    case stats_t:
+    case hot_t:
+    {
+      ostringstream out;
+      if ( request.command == stats_t )
+      {
+        coreStats( out );
+      }
+      else
+      {
+        HotKeys::report( out, request.id > 0 ? request.id : 0 );
+      }
+
+      header_t response;
+      response.command = RET_SUCCESS;
+      response.length = out.str().size();
+      pending->text.assign( (const char*)&response, sizeof( response ) );
+      pending->text += out.str();
+      pending->data = pending->text.data();
+      pending->length = pending->text.size();
+      break;
+    }
+    case compress_t:
+    {
+      header_t response;
+      response.command = RET_SUCCESS;
+      response.length = request.id & PACK_LZ;
+      memcpy( &pending->single, &response, sizeof( response ) );
+      pending->length = sizeof( response );
+      client->packing = response.length != 0;
+      break;
+    }
+    case trace_t:
+    {
+      record_t& response = pending->single;
+      response.id = traceSampling( request.id );
+      response.command = response.id < 0 ? RET_FAILURE : RET_SUCCESS;
+      break;
+    }
+    case qname_t:
+    case qprefix_t:
+    case qage_t:
+    {
+      // Answered as by a server without indexes
+      header_t response;
+      response.command = RET_FAILURE;
+      response.length = 0;
+      memcpy( &pending->single, &response, sizeof( response ) );
+      pending->length = sizeof( response );
+      break;
+    }
+    case subscribe_t:
+      pending->length = busyResponse( request, (char*)&pending->single );
+      break;
+    default:
+      // Snapshots and shared memory channels are refused
+      pending->single.command = RET_FAILURE;
+      break;
+  }
+}
+
+/**
+ * Serve every complete request in a client's buffer, as far as it
+ * has room for responses. Answers made here are sent before going on,
+ * as the rest of the buffer is already off the socket and polling
+ * would never come back for it.
+ */
+void serveClient( Core* core, CoreClient* client )
+{
+  int served;
+  do
+  {
+    int offset = 0;
+    served = 0;
+    while ( client->responses < maxInflight )
+    {
+      int available = client->buffered - offset;
+      int length = requestLength( client->buffer + offset, available );
+      if ( length < 0 )
+      {
+        closeClient( core, client );
+        return;
+      }
+      if ( length == 0 || length > available )
+      {
+        break;
+      }
+
+      coreRequest( core, client, client->buffer + offset, length );
+      offset += length;
+      served++;
+    }
+
+    client->buffered -= offset;
+    memmove( client->buffer, client->buffer + offset, client->buffered );
+    if ( not flushClient( core, client ) )
+    {
+      return;
+    }
+  }
+  while ( served > 0 && client->reading && client->buffered > 0 );
+
+  settleBuffer( core, client );
+}
+
+/**
+ * Read whatever a client has sent and serve it.
+ */
+void readClient( Core* core, CoreClient* client )
+{
+  // Only a client part way through a request has a buffer of its own
+  if ( NULL == client->buffer )
+  {
+    client->buffer = core->scratch;
+  }
+
+  int capacity = connectionCapacity();
+  ssize_t got = read( client->sock, client->buffer + client->buffered,
+                      capacity - client->buffered );
+  if ( got == 0 || ( got < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) )
+  {
+    closeClient( core, client );
+    return;
+  }
+  if ( got > 0 )
+  {
+    touchClient( core, client );
+    client->buffered += got;
+    serveClient( core, client );
+  }
+  else
+  {
+    settleBuffer( core, client );
+  }
+}
+
+/**
+ * Accept every client waiting on the core's listener.
+ */
+void acceptCoreClients( Core* core )
+{
+  while ( true )
+  {
+    int sock = accept( core->listener, NULL, NULL );
+    if ( sock < 0 )
+    {
+      return;
+    }
+
+    bump( core->accepted );
+    if ( core->clients >= coreConnections )
+    {
+      record_t busy;
+      bzero( &busy, sizeof( busy ) );
+      busy.command = SRV_BUSY;
+      write( sock, &busy, sizeof( busy ) );
+      close( sock );
+      bump( core->shed );
+      continue;
+    }
+
+    fcntl( sock, F_SETFL, fcntl( sock, F_GETFL ) | O_NONBLOCK );
+    keepAlive( sock );
+
+    CoreClient* client = new CoreClient();
+    client->sock = sock;
+    client->closed = false;
+    client->reading = true;
+    client->writing = false;
+    client->packing = false;
+    client->forwarded = 0;
+    client->responses = 0;
+    client->first = NULL;
+    client->last = NULL;
+    client->buffered = 0;
+    client->buffer = NULL;
+    TimerWheel::init( &client->timer, client );
+    touchClient( core, client );
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl( core->epoll, EPOLL_CTL_ADD, sock, &event );
+    core->clients++;
+  }
+}
+
+/**
+ * Carry out or take back every message other cores have queued for
+ * this one.
+ *
+ * @return True if there were any.
+ */
+bool drainCore( Core* core )
+{
+  bool any = false;
+  forward_t message;
+  for ( int from = 0; from < coreCount; from++ )
+  {
+    if ( from == core->index )
+    {
+      continue;
+    }
+
+    CoreQueue& queue = coreQueue( from, core->index );
+    while ( queue.pop( message ) )
+    {
+      any = true;
+      if ( message.answered )
+      {
+        answered( core, message );
+      }
+      else
+      {
+        execute( core, message );
+        bump( core->received );
+        forward( core, from, message );
+      }
+    }
+  }
+  return any;
+}
+
+/**
+ * Move messages held back for want of room onto their queues, and
+ * wake any core which was pushed to while it waits for events.
+ *
+ * @return True if messages are still held back.
+ */
+bool pushCore( Core* core )
+{
+  bool held = false;
+  bool pushed = false;
+  for ( int to = 0; to < coreCount; to++ )
+  {
+    deque< forward_t >& overflow = core->overflow[ to ];
+    // A core which has emptied its queue and gone to sleep needs waking
+    while ( not overflow.empty()
+            && coreQueue( core->index, to ).push( overflow.front() ) )
+    {
+      overflow.pop_front();
+      core->pushed[ to ] = true;
+    }
+    held = held || not overflow.empty();
+    pushed = pushed || core->pushed[ to ];
+  }
+
+  if ( pushed )
+  {
+    // Pairs with the fence a core makes before going to sleep
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    for ( int to = 0; to < coreCount; to++ )
+    {
+      if ( core->pushed[ to ]
+           && __atomic_load_n( &cores[ to ].asleep, __ATOMIC_RELAXED ) )
+      {
+        uint64_t one = 1;
+        write( cores[ to ].wakeup, &one, sizeof( one ) );
+      }
+      core->pushed[ to ] = false;
+    }
+  }
+  return held;
+}
+
+/**
+ * @return True if another core has queued anything for this one.
+ */
+bool coreHasMail( Core* core )
+{
+  for ( int from = 0; from < coreCount; from++ )
+  {
+    if ( from != core->index && not coreQueue( from, core->index ).empty() )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Threading function running one core's event loop for ever.
+ *
+ * @param[in] arg - The core.
+ *
+ * @return Never returns.
+ */
+void* runCore( void* arg )
+{
+  Core* core = (Core*)arg;
+
+  cpu_set_t cpus;
+  CPU_ZERO( &cpus );
+  CPU_SET( core->index % sysconf( _SC_NPROCESSORS_ONLN ), &cpus );
+  pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+
+  struct epoll_event events[ CORE_EVENTS ];
+  while ( true )
+  {
+    drainCore( core );
+    int due = core->partition->expire();
+    int timeout = pushCore( core ) ? 0 : -1;
+
+    // Woken for the next tick of the idle timeouts, if any are running
+    if ( timeout < 0 && NULL != core->wheel )
+    {
+      timeout = core->wheel->wait( TimerWheel::clock() );
+    }
+
+    // And for the partition's next sweep
+    if ( timeout < 0 || due < timeout )
+    {
+      timeout = due;
+    }
+
+    if ( timeout != 0 )
+    {
+      // Said before looking again, so no other core can miss it
+      __atomic_store_n( &core->asleep, 1, __ATOMIC_RELAXED );
+      __atomic_thread_fence( __ATOMIC_SEQ_CST );
+      if ( coreHasMail( core ) )
+      {
+        timeout = 0;
+      }
+    }
+
+    int ready = epoll_wait( core->epoll, events, CORE_EVENTS, timeout );
+    __atomic_store_n( &core->asleep, 0, __ATOMIC_RELAXED );
+
+    for ( int i = 0; i < ready; i++ )
+    {
+      void* source = events[i].data.ptr;
+      if ( NULL == source )
+      {
+        acceptCoreClients( core );
+      }
+      else if ( source == core )
+      {
+        uint64_t count;
+        read( core->wakeup, &count, sizeof( count ) );
+      }
+      else
+      {
+        CoreClient* client = (CoreClient*)source;
+        if ( client->closed )
+        {
+          continue;
+        }
+        if ( events[i].events & ( EPOLLERR | EPOLLHUP ) )
+        {
+          closeClient( core, client );
+        }
+        else if ( events[i].events & EPOLLIN )
+        {
+          readClient( core, client );
+        }
+        else if ( events[i].events & EPOLLOUT )
+        {
+          if ( flushClient( core, client ) && client->reading
+               && client->buffered > 0 )
+          {
+            serveClient( core, client );
+          }
+        }
+      }
+    }
+
+    if ( NULL != core->wheel )
+    {
+      TimerWheel::Timer* timer = core->wheel->expire( TimerWheel::clock() );
+      while ( NULL != timer )
+      {
+        CoreClient* client = static_cast<CoreClient*>( timer->data );
+        timer = timer->next;
+        closeClient( core, client );
+        bump( core->reaped );
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Setup a listening TCP socket sharing the port with every other
+ * core's, the kernel spreading new connections over them.
+ *
+ * @param[in] port - The port number to listen on.
+ *
+ * @return The completely setup, non-blocking socket.
+ */
+int setupCoreSocket( int port )
+{
+  int sock = socket( AF_INET, SOCK_STREAM, 0 );
+  if ( sock < 0 )
+  {
+    cerr << "Socket: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  int on = 1;
+  if ( setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof( on ) ) < 0 )
+  {
+    cerr << "SO_REUSEPORT: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  struct sockaddr_in server;
+  bzero( &server, sizeof( server ) );
+  server.sin_family = AF_INET;
+  server.sin_port = htons( port );
+
+  if ( bind( sock, (struct sockaddr *)&server, sizeof( server ) ) < 0 )
+  {
+    cerr << "Bind: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  if ( listen( sock, 128 ) < 0 )
+  {
+    cerr << "Listen: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  fcntl( sock, F_SETFL, fcntl( sock, F_GETFL ) | O_NONBLOCK );
+  return sock;
+}
+
+/**
+ * Serve TCP clients shared nothing, with a thread pinned to each of
+ * 'count' cores. Each core owns the records whose ids hash to it and
+ * the connections the kernel hands its listener, and serves them from
+ * an event loop of its own. A request for a record another core owns
+ * is passed to that core, and its answer passed back, through
+ * single producer, single consumer queues. Partitions and the core's
+ * slabs are unlocked, and each core sweeps its own partition between
+ * events, so serving a request never takes a lock another core takes
+ * or a locked instruction. The map engine's tree nodes come from a
+ * slab every map shares, see MapTable, so it cannot be served so.
+ *
+ * Records cannot be queried or subscribed to, snapshots cannot be
+ * taken, evicted records cannot be kept on disk, and the admission
+ * limits apply to each core in proportion.
+ *
+ * Requests are read into a buffer each core shares between its
+ * clients, a client only taking one of its own while part of a
+ * request is left, and clients idle past -I are closed.
+ *
+ * @param[in] port - The port number to listen on.
+ * @param[in] count - The number of cores.
+ * @param[in] options - How to set up the store, split over the cores.
+ */
+void serveCores( int port, int count, StoreOptions options )
+{
+  coreCount = count;
+  coreConnections = ( maxConnections + count - 1 ) / count;
+  coreQueueLimit = ( maxQueue + count - 1 ) / count;
+  options.bytes /= count;
+  options.shared = false;
+
+  cores = new Core[ count ];
+  coreQueues = new CoreQueue[ count * count ];
+
+  for ( int i = 0; i < count; i++ )
+  {
+    Core& core = cores[i];
+    core.index = i;
+    core.asleep = 0;
+    core.partition = new RecordStore( options );
+    core.batches = new Slab( "batch", BATCH_FRAME );
+    core.batches->share( false );
+    core.buffers = new Slab( "buffer", connectionCapacity() );
+    core.buffers->share( false );
+    core.scratch = new char[ connectionCapacity() ];
+    core.wheel = idleTimeout > 0 ? new TimerWheel( IDLE_TICK ) : NULL;
+    core.spare = NULL;
+    core.clients = 0;
+    core.queued = 0;
+    core.accepted = core.shed = core.served = core.busy = 0;
+    core.sent = core.received = 0;
+    core.reaped = core.writes = core.gathered = 0;
+    core.framesPacked = core.bytesBeforePacking = core.bytesAfterPacking = 0;
+    core.buffersTaken = core.buffersReturned = 0;
+    for ( int to = 0; to < MAX_CORES; to++ )
+    {
+      core.pushed[ to ] = false;
+    }
+
+    core.epoll = epoll_create( CORE_EVENTS );
+    core.listener = setupCoreSocket( port );
+    core.wakeup = eventfd( 0, EFD_NONBLOCK );
+    if ( core.epoll < 0 || core.wakeup < 0 )
+    {
+      cerr << "Core " << i << ": " << strerror( errno ) << endl;
+      exit( EXIT_FAILURE );
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl( core.epoll, EPOLL_CTL_ADD, core.listener, &event );
+    event.data.ptr = &core;
+    epoll_ctl( core.epoll, EPOLL_CTL_ADD, core.wakeup, &event );
+  }
+
+  cout << "Serving on " << count << " cores, "
+       << RecordStore::engine() << " partitions" << endl;
+
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes );
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+  for ( int i = 1; i < count; i++ )
+  {
+    pthread_t thread;
+    pthread_create( &thread, &attributes, runCore, &cores[i] );
+  }
+
+  runCore( &cores[0] );
+}
+
+#endif // __linux__
+
+/**
+ * Print the usage statement for the server application and exit.
+ *
+ * @param[in] binary - The name of the binary being executed.
+ */
+void usage( char* binary )
+{
+  cerr << "Usage: " << binary
+       << " [-c connections] [-i inflight] [-q queue]"
+       << " [-T tracefile] [-s every] [-m megabytes] [-e seconds] [-n] [-x]"
+       << " [-S snapshot] [-D directory] [-u] [-U path] [-P cores]"
+       << " [-I seconds] [-k seconds] [-p milliseconds] [-Z] [-W] port"
+       << endl;
+  exit( EXIT_FAILURE );
+}
+
+/**
+ * Program entry point.
+ *
+ * @param[in] argc - The number of command line arguments.
+ * @param[in] argv - The actual command line arguments.
+ *
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int main( int argc, char **argv )
+{
+  //
+  // Pick up any admission limits given ahead of the port
+  //
+  const char* traceFile = DEFAULT_TRACE_FILE;
+  int traceEvery = 0;
+  int megabytes = 0;
+  int expiry = 0;
+  StoreOptions options;
+  bool restore = false;
+  bool datagrams = false;
+  const char* localPath = NULL;
+  int coreThreads = 0;
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "c:i:q:T:s:m:e:nxS:D:uU:P:I:k:p:ZW" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'c':
+        maxConnections = atoi( optarg );
+        break;
+      case 'i':
+        maxInflight = atoi( optarg );
+        break;
+      case 'q':
+        maxQueue = atoi( optarg );
+        break;
+      case 'T':
+        traceFile = optarg;
+        break;
+      case 's':
+        traceEvery = atoi( optarg );
+        break;
+      case 'm':
+        megabytes = atoi( optarg );
+        break;
+      case 'e':
+        expiry = atoi( optarg );
+        break;
+      case 'n':
+        options.intern = true;
+        break;
+      case 'x':
+        options.index = true;
+        break;
+      case 'S':
+        options.snapshot = optarg;
+        restore = true;
+        break;
+      case 'D':
+        options.tier = optarg;
+        break;
+      case 'u':
+        datagrams = true;
+        break;
+      case 'U':
+        localPath = optarg;
+        break;
+      case 'P':
+        coreThreads = atoi( optarg );
+        break;
+      case 'I':
+        idleTimeout = atoi( optarg );
+        break;
+      case 'k':
+        keepaliveIdle = atoi( optarg );
+        break;
+      case 'p':
+        parkDelay = atoi( optarg );
+        break;
+      case 'Z':
+        zeroCopyWanted = true;
+        break;
+      case 'W':
+        options.wire = true;
+        break;
+      default:
+        usage( argv[0] );
+    }
+  }
+
+  //
+  // Make sure that the port argument was given
+  //
+  if ( argc - optind != 1 || maxConnections < 1 || maxInflight < 1
+       || maxQueue < 1 || megabytes < 0 || expiry < 0 || coreThreads < 0
+       || coreThreads > MAX_CORES || idleTimeout < 0 || keepaliveIdle < 0
+       || parkDelay < 0 )
+  {
+    usage( argv[0] );
+  }
+
+  // Cold records are only spilled past a memory limit, and not indexed
+  if ( NULL != options.tier
+       && ( 0 == megabytes || options.index
+            || access( options.tier, W_OK | X_OK ) != 0 ) )
+  {
+    cerr << "-D needs -m, cannot be used with -x, and must name a writable"
+         << " directory" << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  if ( coreThreads > 0 && ( datagrams || NULL != localPath || restore
+                          || options.index || zeroCopyWanted || options.wire
+                          || NULL != options.tier || parkDelay > 0 ) )
+  {
+    cerr << "-P serves TCP clients alone, without -u, -U, -S, -x, -Z, -W,"
+         << " -D or -p" << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  // A core's partition must take no lock, see serveCores()
+  if ( coreThreads > 0 && not RecordStore::ownable() )
+  {
+    cerr << "-P needs the hash or flat engine, not the "
+         << RecordStore::engine() << " engine" << endl;
+    exit( EXIT_FAILURE );
+  }
+
+#if !defined( HAVE_ZEROCOPY )
+  if ( zeroCopyWanted )
+  {
+    cerr << "-Z needs MSG_ZEROCOPY, which this system lacks" << endl;
+    exit( EXIT_FAILURE );
+  }
+#endif
+
+  //
+  // Get the port number, and make sure that it is legitimate
+  //
+  int port = atoi( argv[ optind ] );
+  if ( port < PORT_MIN || port > PORT_MAX )
+  {
+    cerr << port << ": invalid port number" << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  // A client gone mid write, such as a subscriber, is noticed by the
+  // write failing rather than by the signal ending the server
+  signal( SIGPIPE, SIG_IGN );
+
+  traceInit( traceFile );
+  HotKeys::start();
+  if ( traceEvery > 0 && traceSampling( traceEvery ) < 0 )
+  {
+    cerr << traceFile << ": " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  options.bytes = (size_t)megabytes * 1024 * 1024;
+  options.ttl = expiry;
+
+  if ( coreThreads > 0 )
+  {
+#if defined( __linux__ )
+    serveCores( port, coreThreads, options );
+#else
+    cerr << "-P needs epoll, which this system lacks" << endl;
+    exit( EXIT_FAILURE );
+#endif
+  }
+
+  records = new RecordStore( options );
+
+  //
+  // Pick up where the last snapshot left off, if there is one
+  //
+  if ( restore )
+  {
+    long loaded = records->restore();
+    if ( loaded < 0 && errno != ENOENT )
+    {
+      cerr << options.snapshot << ": " << strerror( errno ) << endl;
+      exit( EXIT_FAILURE );
+    }
+    if ( loaded >= 0 )
+    {
+      cout << "Loaded " << loaded << " records from " << options.snapshot
+           << endl;
+    }
+  }
+
+  // Only changes made from here on are streamed, not the restored records
+  records->log( &changes );
+
+  // Setup a TCP socket to listen for connections.
+  int sock = setupSocket( port );
+
+  cout << "MAIN THREAD - "
+       << "WAITING FOR THE FIRST CONNECTION FROM CLIENT ..."
+       << endl;
+
+  threadCount = 0;
+  runingThreads = 0;
+
+  // Every connection arena holds its state followed by its buffers.
+  connectionSlab = new Slab( "connection",
+                   Arena::footprint( sizeof( sock_t ) )
+                   + Arena::footprint( connectionCapacity() )
+                   + ( zeroCopyWanted ? 2 : 1 )
+                     * Arena::footprint( BATCH_FRAME ) );
+
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes );
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+  pthread_attr_getstacksize( &attributes, &threadStack );
+
+  // Connections with nothing to serve wait here without a thread
+  if ( parkDelay > 0 )
+  {
+    if ( pipe( idleWakeup ) < 0 )
+    {
+      cerr << "pipe: " << strerror( errno ) << endl;
+      exit( EXIT_FAILURE );
+    }
+    fcntl( idleWakeup[0], F_SETFL,
+           fcntl( idleWakeup[0], F_GETFL ) | O_NONBLOCK );
+    fcntl( idleWakeup[1], F_SETFL,
+           fcntl( idleWakeup[1], F_GETFL ) | O_NONBLOCK );
+
+    pthread_t idleWatcher;
+    pthread_create( &idleWatcher, &attributes, watchIdle, NULL );
+  }
+
+  if ( datagrams )
+  {
+    pthread_t datagramServer;
+    pthread_create( &datagramServer, &attributes, serveDatagrams,
+                    (void*)(intptr_t)setupDatagramSocket( port ) );
+  }
+
+  if ( NULL != localPath )
+  {
+    pthread_t localServer;
+    pthread_create( &localServer, &attributes, acceptLocalClients,
+                    (void*)(intptr_t)setupLocalSocket( localPath ) );
+  }
+
+  acceptClients( sock, false );
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,194 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the slab and arena allocators,
+ * see slab.h for more details.
+ */
+
+#include "slab.h"
+
+#include <stdlib.h>
+
+// Alignment of every block and arena allocation, enough for any
+// pointer or integer, and no more so small records pack tightly
+#define SLAB_ALIGN 8
+
+/**
+ * Round a size up to the next multiple of SLAB_ALIGN.
+ *
+ * @param[in] bytes - The size to round.
+ *
+ * @return The rounded size.
+ */
+static size_t align( size_t bytes )
+{
+  return ( bytes + SLAB_ALIGN - 1 ) & ~( (size_t)SLAB_ALIGN - 1 );
+}
+
+Slab* Slab::slabs = NULL;
+pthread_mutex_t Slab::slabsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+Slab::Slab( const char* name, size_t blockSize )
+  : name( name ),
+    size( align( blockSize < sizeof( FreeBlock ) ? sizeof( FreeBlock )
+                                                 : blockSize ) ),
+    perChunk( SLAB_CHUNK_SIZE / size > 0 ? SLAB_CHUNK_SIZE / size : 1 ),
+    freeList( NULL ),
+    chunkList( NULL ),
+    inUse( 0 ),
+    available( 0 ),
+    chunks( 0 ),
+    locking( true )
+{
+  pthread_mutex_init( &mutex, NULL );
+
+  pthread_mutex_lock( &slabsMutex );
+  nextSlab = slabs;
+  slabs = this;
+  pthread_mutex_unlock( &slabsMutex );
+}
+
+Slab::~Slab()
+{
+  pthread_mutex_lock( &slabsMutex );
+  Slab** link = &slabs;
+  while ( *link != this )
+  {
+    link = &( *link )->nextSlab;
+  }
+  *link = nextSlab;
+  pthread_mutex_unlock( &slabsMutex );
+
+  while ( NULL != chunkList )
+  {
+    Chunk* chunk = chunkList;
+    chunkList = chunk->next;
+    free( chunk );
+  }
+
+  pthread_mutex_destroy( &mutex );
+}
+
+/**
+ * Carve a new chunk into blocks and push them on the freelist.
+ * Called with the slab's mutex held.
+ *
+ * @return False if the system is out of memory.
+ */
+bool Slab::grow()
+{
+  size_t header = align( sizeof( Chunk ) );
+  char* chunk = static_cast<char*>( malloc( header + perChunk * size ) );
+  if ( NULL == chunk )
+  {
+    return false;
+  }
+
+  Chunk* head = reinterpret_cast<Chunk*>( chunk );
+  head->next = chunkList;
+  chunkList = head;
+  chunk += header;
+
+  for ( size_t i = 0; i < perChunk; i++ )
+  {
+    FreeBlock* block = reinterpret_cast<FreeBlock*>( chunk + i * size );
+    block->next = freeList;
+    freeList = block;
+  }
+
+  available += perChunk;
+  chunks++;
+  return true;
+}
+
+void* Slab::allocate()
+{
+  if ( locking )
+  {
+    pthread_mutex_lock( &mutex );
+  }
+
+  if ( NULL == freeList && not grow() )
+  {
+    if ( locking )
+    {
+      pthread_mutex_unlock( &mutex );
+    }
+    return NULL;
+  }
+
+  FreeBlock* block = freeList;
+  freeList = block->next;
+  available--;
+  inUse++;
+
+  if ( locking )
+  {
+    pthread_mutex_unlock( &mutex );
+  }
+  return block;
+}
+
+void Slab::release( void* memory )
+{
+  if ( NULL == memory )
+  {
+    return;
+  }
+
+  FreeBlock* block = static_cast<FreeBlock*>( memory );
+
+  if ( locking )
+  {
+    pthread_mutex_lock( &mutex );
+  }
+  block->next = freeList;
+  freeList = block;
+  available++;
+  inUse--;
+  if ( locking )
+  {
+    pthread_mutex_unlock( &mutex );
+  }
+}
+
+void Slab::report( std::ostream& out )
+{
+  pthread_mutex_lock( &slabsMutex );
+  for ( Slab* slab = slabs; slab != NULL; slab = slab->nextSlab )
+  {
+    pthread_mutex_lock( &slab->mutex );
+    out << "slab_" << slab->name << "_" << slab->size
+        << " used " << slab->inUse
+        << " free " << slab->available
+        << " bytes " << slab->chunks * slab->perChunk * slab->size
+        << "\n";
+    pthread_mutex_unlock( &slab->mutex );
+  }
+  pthread_mutex_unlock( &slabsMutex );
+}
+
+Arena::Arena( void* base, size_t size )
+  : start( static_cast<char*>( base ) ),
+    size( size ),
+    offset( 0 )
+{
+}
+
+size_t Arena::footprint( size_t bytes )
+{
+  return align( bytes );
+}
+
+void* Arena::allocate( size_t bytes )
+{
+  size_t wanted = align( bytes );
+  if ( offset + wanted > size )
+  {
+    return NULL;
+  }
+
+  void* memory = start + offset;
+  offset += wanted;
+  return memory;
+}
@@ -0,0 +1,228 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Fixed size slab allocation and per-connection arenas,
+ * used so that serving requests does not go through the global
+ * malloc once the server has warmed up.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+#include <new>
+#include <ostream>
+
+#include <pthread.h>
+
+// Number of bytes requested from the system each time a slab grows.
+#define SLAB_CHUNK_SIZE ( 64 * 1024 )
+
+/**
+ * Hands out fixed size blocks carved from large chunks, and keeps
+ * released blocks on a freelist for reuse. Every slab registers
+ * itself so its statistics can be reported by the server.
+ */
+class Slab
+{
+public:
+
+  /**
+   * @param[in] name - The name to report statistics under.
+   * @param[in] blockSize - The size of every block handed out.
+   */
+  Slab( const char* name, size_t blockSize );
+
+  /**
+   * Return every chunk to the system and stop reporting the slab.
+   * Blocks still handed out must no longer be in use.
+   */
+  ~Slab();
+
+  /**
+   * @return A block of 'blockSize' bytes, or NULL if out of memory.
+   */
+  void* allocate();
+
+  /**
+   * @param[in] block - A block previously returned by allocate().
+   */
+  void release( void* block );
+
+  size_t blockSize() const { return size; }
+
+  /**
+   * Choose whether the slab takes its lock, which a slab only one
+   * thread ever uses can go without. Must be called before it is used.
+   *
+   * @param[in] shared - False if only one thread uses the slab.
+   */
+  void share( bool shared ) { locking = shared; }
+
+  /**
+   * Write one line of statistics for every slab to the stream.
+   *
+   * @param[in] out - The stream to write to.
+   */
+  static void report( std::ostream& out );
+
+private:
+
+  // Chained through the first bytes of every free block
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  // Heads every chunk, so they can be freed with the slab
+  struct Chunk
+  {
+    Chunk* next;
+  };
+
+  bool grow();
+
+  const char* name;
+  size_t size;
+  size_t perChunk;
+  FreeBlock* freeList;
+  Chunk* chunkList;
+  unsigned long inUse;
+  unsigned long available;
+  unsigned long chunks;
+  bool locking;
+  pthread_mutex_t mutex;
+
+  // Registry of every slab, for reporting
+  Slab* nextSlab;
+  static Slab* slabs;
+  static pthread_mutex_t slabsMutex;
+
+  // Not copyable
+  Slab( const Slab& );
+  Slab& operator=( const Slab& );
+};
+
+/**
+ * A bump allocator over a single block, used to lay out everything
+ * a connection needs in one allocation. Nothing is freed on its own,
+ * the whole block goes back to its slab when the connection ends.
+ */
+class Arena
+{
+public:
+
+  /**
+   * @param[in] base - The start of the block to carve up.
+   * @param[in] size - The number of bytes in the block.
+   */
+  Arena( void* base, size_t size );
+
+  /**
+   * @param[in] bytes - The number of bytes wanted.
+   *
+   * @return Suitably aligned memory, or NULL if the arena is full.
+   */
+  void* allocate( size_t bytes );
+
+  void* base() const { return start; }
+  size_t used() const { return offset; }
+
+  /**
+   * @param[in] bytes - The size of an allocation.
+   *
+   * @return The arena space the allocation will take up.
+   */
+  static size_t footprint( size_t bytes );
+
+private:
+
+  char* start;
+  size_t size;
+  size_t offset;
+};
+
+/**
+ * A standard allocator which takes single objects from a slab shared
+ * by every container of the same element type, so that tree nodes
+ * never go through the global malloc. Arrays fall back to new.
+ */
+template <class T>
+class SlabAllocator
+{
+public:
+
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind
+  {
+    typedef SlabAllocator<U> other;
+  };
+
+  SlabAllocator() {}
+
+  template <class U>
+  SlabAllocator( const SlabAllocator<U>& ) {}
+
+  pointer address( reference value ) const { return &value; }
+  const_pointer address( const_reference value ) const { return &value; }
+
+  pointer allocate( size_type count, const void* = 0 )
+  {
+    void* memory = count == 1 ? slab().allocate()
+                              : ::operator new( count * sizeof( T ) );
+    if ( NULL == memory )
+    {
+      throw std::bad_alloc();
+    }
+    return static_cast<pointer>( memory );
+  }
+
+  void deallocate( pointer memory, size_type count )
+  {
+    if ( count == 1 )
+    {
+      slab().release( memory );
+    }
+    else
+    {
+      ::operator delete( memory );
+    }
+  }
+
+  size_type max_size() const { return size_t( -1 ) / sizeof( T ); }
+
+  void construct( pointer memory, const T& value ) { new ( memory ) T( value ); }
+  void destroy( pointer memory ) { memory->~T(); }
+
+  /**
+   * @return The slab shared by all allocators of this type, which is
+   * never destroyed as nodes may be in use until the process exits.
+   */
+  static Slab& slab()
+  {
+    static Slab* instance = new Slab( "node", sizeof( T ) );
+    return *instance;
+  }
+};
+
+template <class T, class U>
+bool operator==( const SlabAllocator<T>&, const SlabAllocator<U>& )
+{
+  return true;
+}
+
+template <class T, class U>
+bool operator!=( const SlabAllocator<T>&, const SlabAllocator<U>& )
+{
+  return false;
+}
+
+#endif // _SLAB_H_
@@ -0,0 +1,251 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of snapshot files, see snapshot.h for
+ * more details.
+ */
+
+#include "snapshot.h"
+
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// First bytes of every snapshot file
+static const char SNAPSHOT_MAGIC[ 8 ] = { 'R', 'E', 'C', 'S', 'N', 'A', 'P', '1' };
+
+// Bytes before the first block: the magic, records and blocks
+#define SNAPSHOT_HEADER ( sizeof( SNAPSHOT_MAGIC ) + 2 * sizeof( uint64_t ) )
+
+// Bytes before each block's records: its size and count
+#define BLOCK_HEADER ( 2 * sizeof( uint32_t ) )
+
+// Bytes of a record before its name
+#define RECORD_HEADER ( 3 * sizeof( uint32_t ) + 1 )
+
+/**
+ * Write all of a buffer, retrying short writes.
+ *
+ * @return False if the write failed.
+ */
+static bool writeAll( int fd, const char* data, size_t length )
+{
+  while ( length > 0 )
+  {
+    ssize_t written = write( fd, data, length );
+    if ( written < 0 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+SnapshotWriter::SnapshotWriter( int fd )
+  : fd( fd ),
+    failed( false ),
+    records( 0 ),
+    blocks( 0 ),
+    count( 0 ),
+    used( BLOCK_HEADER )
+{
+  // Room for the header, written once the totals are known
+  char header[ SNAPSHOT_HEADER ];
+  memset( header, 0, sizeof( header ) );
+  failed = not writeAll( fd, header, sizeof( header ) );
+}
+
+void SnapshotWriter::operator()( const record_t& rec, unsigned int ttl )
+{
+  const char* end =
+    static_cast<const char*>( memchr( rec.name, '\0', MAX_LEN ) );
+  unsigned char length = NULL != end ? end - rec.name : MAX_LEN;
+
+  if ( used + RECORD_HEADER + length > sizeof( block ) || count == MAX_BATCH )
+  {
+    flush();
+  }
+
+  uint32_t fields[ 3 ] = { (uint32_t)rec.id, (uint32_t)rec.age, ttl };
+  memcpy( block + used, fields, sizeof( fields ) );
+  used += sizeof( fields );
+  block[ used++ ] = length;
+  memcpy( block + used, rec.name, length );
+  used += length;
+
+  count++;
+  records++;
+}
+
+/**
+ * Write out the block being filled, if it holds any records.
+ *
+ * @return False if the write failed.
+ */
+bool SnapshotWriter::flush()
+{
+  if ( count > 0 )
+  {
+    uint32_t header[ 2 ] = { (uint32_t)( used - BLOCK_HEADER ), count };
+    memcpy( block, header, sizeof( header ) );
+    failed = failed || not writeAll( fd, block, used );
+    blocks++;
+  }
+  count = 0;
+  used = BLOCK_HEADER;
+  return not failed;
+}
+
+bool SnapshotWriter::finish()
+{
+  if ( not flush() )
+  {
+    return false;
+  }
+
+  char header[ SNAPSHOT_HEADER ];
+  memcpy( header, SNAPSHOT_MAGIC, sizeof( SNAPSHOT_MAGIC ) );
+  memcpy( header + sizeof( SNAPSHOT_MAGIC ), &records, sizeof( records ) );
+  memcpy( header + sizeof( SNAPSHOT_MAGIC ) + sizeof( records ), &blocks,
+          sizeof( blocks ) );
+  return pwrite( fd, header, sizeof( header ), 0 ) == (ssize_t)sizeof( header );
+}
+
+SnapshotReader::SnapshotReader()
+  : data( NULL ),
+    size( 0 )
+{
+}
+
+SnapshotReader::~SnapshotReader()
+{
+  unmap();
+}
+
+bool SnapshotReader::open( const char* path )
+{
+  int fd = ::open( path, O_RDONLY );
+  if ( fd < 0 )
+  {
+    return false;
+  }
+
+  struct stat status;
+  if ( fstat( fd, &status ) < 0 )
+  {
+    close( fd );
+    return false;
+  }
+
+  size = status.st_size;
+  if ( size < SNAPSHOT_HEADER )
+  {
+    close( fd );
+    errno = EINVAL;
+    return false;
+  }
+
+  void* mapped = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( MAP_FAILED == mapped )
+  {
+    return false;
+  }
+  data = static_cast<const char*>( mapped );
+
+  //
+  // Every block takes at least its header, so a count the file is too
+  // small to hold is corrupt, and must not size anything
+  //
+  uint64_t blocks;
+  memcpy( &blocks, data + sizeof( SNAPSHOT_MAGIC ) + sizeof( uint64_t ),
+          sizeof( blocks ) );
+  if ( memcmp( data, SNAPSHOT_MAGIC, sizeof( SNAPSHOT_MAGIC ) ) != 0
+       || blocks > ( size - SNAPSHOT_HEADER ) / BLOCK_HEADER )
+  {
+    unmap();
+    errno = EINVAL;
+    return false;
+  }
+
+  //
+  // Find where every block starts, so they can be decoded in any order
+  //
+  size_t offset = SNAPSHOT_HEADER;
+  offsets.reserve( blocks );
+  while ( offset + BLOCK_HEADER <= size )
+  {
+    uint32_t bytes;
+    memcpy( &bytes, data + offset, sizeof( bytes ) );
+    if ( offset + BLOCK_HEADER + bytes > size )
+    {
+      break;
+    }
+    offsets.push_back( offset );
+    offset += BLOCK_HEADER + bytes;
+  }
+
+  if ( offset != size || offsets.size() != blocks )
+  {
+    offsets.clear();
+    unmap();
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+void SnapshotReader::unmap()
+{
+  if ( NULL != data )
+  {
+    munmap( const_cast<char*>( data ), size );
+    data = NULL;
+  }
+}
+
+int SnapshotReader::decode( size_t block, record_t* recs,
+                            unsigned int* ttls ) const
+{
+  uint32_t header[ 2 ];
+  memcpy( header, data + offsets[ block ], sizeof( header ) );
+  if ( header[1] > MAX_BATCH )
+  {
+    return -1;
+  }
+
+  const char* next = data + offsets[ block ] + BLOCK_HEADER;
+  const char* end = next + header[0];
+  for ( uint32_t i = 0; i < header[1]; i++ )
+  {
+    if ( next + RECORD_HEADER > end )
+    {
+      return -1;
+    }
+
+    uint32_t fields[ 3 ];
+    memcpy( fields, next, sizeof( fields ) );
+    unsigned char length = next[ sizeof( fields ) ];
+    next += RECORD_HEADER;
+    if ( length > MAX_LEN || next + length > end )
+    {
+      return -1;
+    }
+
+    memset( &recs[i], 0, sizeof( record_t ) );
+    recs[i].command = add_t;
+    recs[i].id = fields[0];
+    recs[i].age = fields[1];
+    memcpy( recs[i].name, next, length );
+    ttls[i] = fields[2];
+    next += length;
+  }
+  return next == end ? (int)header[1] : -1;
+}
@@ -0,0 +1,286 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Point in time snapshots of a Store, written to and
+ * loaded from a compact binary file.
+ *
+ * A snapshot is taken by forking the server with every shard locked,
+ * see Store::fork(), so the child holds a consistent copy-on-write
+ * image of the store. The child writes the image out while the
+ * parent carries on serving, writers only ever waiting for the fork.
+ *
+ * The file is a header followed by blocks of up to MAX_BATCH records,
+ * each block prefixed with its size so a loader can hand blocks to
+ * several threads. Integers are stored in the host's byte order.
+ *
+ *   header:  "RECSNAP1", uint64 records, uint64 blocks
+ *   block:   uint32 bytes, uint32 count, then 'count' records
+ *   record:  int32 id, int32 age, uint32 ttl, uint8 length, name
+ *
+ * where 'ttl' is the seconds the record had left to live, 0 for ever.
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "common.h"
+
+// Bytes of records buffered before a block is written
+#define SNAPSHOT_BLOCK ( MAX_BATCH * ( 13 + MAX_LEN ) )
+
+// Most threads used to load a snapshot
+#define SNAPSHOT_LOADERS 8
+
+/**
+ * Writes a snapshot file a record at a time. It never allocates, so
+ * it is safe to use in the child of a multithreaded fork.
+ */
+class SnapshotWriter
+{
+public:
+
+  /**
+   * @param[in] fd - The file to write to, positioned at its start.
+   */
+  SnapshotWriter( int fd );
+
+  /**
+   * Append a record to the snapshot, called once per record.
+   *
+   * @param[in] rec - The record.
+   * @param[in] ttl - Seconds it has left to live, 0 for ever.
+   */
+  void operator()( const record_t& rec, unsigned int ttl );
+
+  /**
+   * Write the final block and the header.
+   *
+   * @return False if any write failed.
+   */
+  bool finish();
+
+private:
+
+  bool flush();
+
+  int fd;
+  bool failed;
+  uint64_t records;
+  uint64_t blocks;
+  uint32_t count;
+  size_t used;
+  char block[ 2 * sizeof( uint32_t ) + SNAPSHOT_BLOCK ];
+};
+
+/**
+ * Reads a snapshot file mapped into memory, whose blocks may then be
+ * decoded from several threads at once.
+ */
+class SnapshotReader
+{
+public:
+
+  SnapshotReader();
+  ~SnapshotReader();
+
+  /**
+   * @param[in] path - The snapshot file.
+   *
+   * @return False if the file is missing or not a valid snapshot,
+   * with errno describing why.
+   */
+  bool open( const char* path );
+
+  /**
+   * @return The number of blocks in the snapshot.
+   */
+  size_t blocks() const { return offsets.size(); }
+
+  /**
+   * Decode one block's records.
+   *
+   * @param[in] block - The block, less than blocks().
+   * @param[out] recs - Where to decode up to MAX_BATCH records.
+   * @param[out] ttls - The seconds each record has left, 0 for ever.
+   *
+   * @return The number of records decoded, or -1 if the block is
+   * corrupt.
+   */
+  int decode( size_t block, record_t* recs, unsigned int* ttls ) const;
+
+private:
+
+  void unmap();
+
+  const char* data;
+  size_t size;
+  std::vector<size_t> offsets;
+
+  // Not copyable
+  SnapshotReader( const SnapshotReader& );
+  SnapshotReader& operator=( const SnapshotReader& );
+};
+
+/**
+ * Write a store's records to a snapshot file, replacing it only once
+ * the new snapshot is complete. Run in the child of Store::fork().
+ *
+ * @param[in] store - The store, which is read without locking.
+ * @param[in] path - The snapshot file.
+ *
+ * @return True if the snapshot was written.
+ */
+template <class Store>
+bool writeSnapshot( Store& store, const char* path )
+{
+  char partial[ PATH_MAX ];
+  if ( snprintf( partial, sizeof( partial ), "%s.tmp", path )
+       >= (int)sizeof( partial ) )
+  {
+    return false;
+  }
+
+  int fd = ::open( partial, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 )
+  {
+    return false;
+  }
+
+  SnapshotWriter writer( fd );
+  bool complete = store.scanImage( writer );
+
+  bool written = writer.finish() && complete && fsync( fd ) == 0;
+  written = close( fd ) == 0 && written;
+  return written && rename( partial, path ) == 0;
+}
+
+/**
+ * What each loading thread needs, the blocks it loads being those
+ * numbered 'first', 'first' + 'step' and so on.
+ */
+template <class Store>
+struct SnapshotLoad
+{
+  Store* store;
+  const SnapshotReader* reader;
+  size_t first;
+  size_t step;
+  unsigned long loaded;
+  bool corrupt;
+};
+
+/**
+ * Thread body loading a share of a snapshot's blocks.
+ *
+ * @param[in] arg - The thread's SnapshotLoad.
+ */
+template <class Store>
+void* loadBlocks( void* arg )
+{
+  SnapshotLoad<Store>* load = static_cast<SnapshotLoad<Store>*>( arg );
+
+  record_t recs[ MAX_BATCH ];
+  unsigned int ttls[ MAX_BATCH ];
+  bool added[ MAX_BATCH ];
+
+  for ( size_t i = load->first; i < load->reader->blocks(); i += load->step )
+  {
+    int count = load->reader->decode( i, recs, ttls );
+    if ( count < 0 )
+    {
+      load->corrupt = true;
+      break;
+    }
+    load->loaded += load->store->insertBatch( recs, count, ttls, added );
+  }
+  return NULL;
+}
+
+/**
+ * Load a snapshot into a store, several blocks at a time.
+ *
+ * @param[in] store - The store to add the records to.
+ * @param[in] path - The snapshot file.
+ *
+ * @return The number of records loaded, or -1 if the file could not
+ * be read or is corrupt, with errno describing why.
+ */
+template <class Store>
+long loadSnapshot( Store& store, const char* path )
+{
+  SnapshotReader reader;
+  if ( not reader.open( path ) )
+  {
+    return -1;
+  }
+
+  long online = sysconf( _SC_NPROCESSORS_ONLN );
+  size_t threads = online < 1 ? 1 : online > SNAPSHOT_LOADERS
+                                  ? SNAPSHOT_LOADERS : online;
+  if ( threads > reader.blocks() )
+  {
+    threads = reader.blocks() > 0 ? reader.blocks() : 1;
+  }
+
+  SnapshotLoad<Store> loads[ SNAPSHOT_LOADERS ];
+  pthread_t loaders[ SNAPSHOT_LOADERS ];
+  for ( size_t i = 0; i < threads; i++ )
+  {
+    loads[i].store = &store;
+    loads[i].reader = &reader;
+    loads[i].first = i;
+    loads[i].step = threads;
+    loads[i].loaded = 0;
+    loads[i].corrupt = false;
+  }
+
+  // The first share is loaded on the calling thread
+  size_t started = 1;
+  for ( ; started < threads; started++ )
+  {
+    if ( pthread_create( &loaders[ started ], NULL, loadBlocks<Store>,
+                         &loads[ started ] ) != 0 )
+    {
+      break;
+    }
+  }
+
+  // Shares whose thread could not be started are loaded here too
+  loadBlocks<Store>( &loads[0] );
+  for ( size_t i = started; i < threads; i++ )
+  {
+    loadBlocks<Store>( &loads[i] );
+  }
+
+  long total = 0;
+  bool corrupt = false;
+  for ( size_t i = 0; i < threads; i++ )
+  {
+    if ( i > 0 && i < started )
+    {
+      pthread_join( loaders[i], NULL );
+    }
+    total += loads[i].loaded;
+    corrupt = corrupt || loads[i].corrupt;
+  }
+
+  if ( corrupt )
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  return total;
+}
+
+#endif // _SNAPSHOT_H_
@@ -0,0 +1,106 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: A bounded queue between exactly one producing and one
+ * consuming thread, which passes items with plain loads and stores
+ * alone, never a locked instruction. Each side keeps its own index on
+ * a cache line of its own, along with its last look at the other
+ * side's, so the lines only move when a side finds the queue looking
+ * full or empty.
+ */
+
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+#include <stdint.h>
+
+// Bytes between the fields the two sides write
+#define SPSC_LINE 64
+
+/**
+ * @param T - The items queued, copied in and out whole.
+ * @param SIZE - The most items queued at once, a power of two.
+ */
+template <class T, uint32_t SIZE>
+class SpscQueue
+{
+public:
+
+  SpscQueue()
+    : head( 0 ),
+      tailSeen( 0 ),
+      tail( 0 ),
+      headSeen( 0 )
+  {
+  }
+
+  /**
+   * Queue an item, from the producing thread only.
+   *
+   * @return False if the queue is full.
+   */
+  bool push( const T& item )
+  {
+    if ( head - tailSeen == SIZE )
+    {
+      tailSeen = __atomic_load_n( &tail, __ATOMIC_ACQUIRE );
+      if ( head - tailSeen == SIZE )
+      {
+        return false;
+      }
+    }
+
+    slots[ head % SIZE ] = item;
+    __atomic_store_n( &head, head + 1, __ATOMIC_RELEASE );
+    return true;
+  }
+
+  /**
+   * Take the oldest item, from the consuming thread only.
+   *
+   * @return False if the queue is empty.
+   */
+  bool pop( T& item )
+  {
+    if ( tail == headSeen )
+    {
+      headSeen = __atomic_load_n( &head, __ATOMIC_ACQUIRE );
+      if ( tail == headSeen )
+      {
+        return false;
+      }
+    }
+
+    item = slots[ tail % SIZE ];
+    __atomic_store_n( &tail, tail + 1, __ATOMIC_RELEASE );
+    return true;
+  }
+
+  /**
+   * @return True if nothing is queued, from the consuming thread only.
+   */
+  bool empty()
+  {
+    return tail == __atomic_load_n( &head, __ATOMIC_ACQUIRE );
+  }
+
+private:
+
+  // The producer's
+  uint32_t head;
+  uint32_t tailSeen;
+  char producerPad[ SPSC_LINE - 2 * sizeof( uint32_t ) ];
+
+  // The consumer's
+  uint32_t tail;
+  uint32_t headSeen;
+  char consumerPad[ SPSC_LINE - 2 * sizeof( uint32_t ) ];
+
+  T slots[ SIZE ];
+
+  // Not copyable
+  SpscQueue( const SpscQueue& );
+  SpscQueue& operator=( const SpscQueue& );
+};
+
+#endif // _SPSC_H_
@@ -0,0 +1,1374 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: The record store, built at compile time over one of
+ * the tables in tables.h. Ids are spread over a fixed number of
+ * shards, each holding its own table and lock, so the store never
+ * goes through a virtual call or a single global mutex.
+ *
+ * Records may be given a time to live, and the store may be given a
+ * memory limit. Expired records are dropped when next touched and by
+ * an incremental sweep, and once a shard reaches its share of the
+ * limit a CLOCK hand evicts records which have not been used since
+ * it last passed them, approximating least recently used. Given a
+ * directory, evicted records go to each shard's cold tier on disk
+ * instead of being dropped, see tier.h, and come back into memory the
+ * next time they are looked up.
+ *
+ * Records are kept in the compact form of entry.h and only ever
+ * copied in and out whole, so callers never see how they are stored,
+ * unless kept in wire form as well, see wire.h, when lookups and
+ * queries may point at them as they are sent instead.
+ * They may also be changed in place, see mutate(), each change under
+ * the shard's lock and giving the record a new version. Given a
+ * change log, every add and change is numbered before that lock is let
+ * go, so changes to a record are logged in the order they were made,
+ * and only written to the log after, see changelog.h.
+ * When asked to, every shard also indexes its records by name and
+ * age, see indexes.h, and can be queried on either.
+ */
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <ostream>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "changelog.h"
+#include "common.h"
+#include "indexes.h"
+#include "tables.h"
+#include "tier.h"
+#include "trace.h"
+
+// Bytes reserved per shard so neighbouring locks never share a line
+#define CACHE_LINE 64
+
+/**
+ * A thread safe record store, unless told only one thread uses it,
+ * see share().
+ *
+ * @param Table - The table policy holding each shard's records.
+ * @param SHARDS - The number of independently locked shards.
+ */
+template <class Table, int SHARDS>
+class Store
+{
+public:
+
+  Store()
+    : limit( 0 ),
+      indexing( false ),
+      tiering( false ),
+      locking( true ),
+      changes( NULL ),
+      epochs( NULL )
+  {
+    tick();
+  }
+
+  static const char* name() { return Table::name(); }
+  static bool ownable() { return Table::ownable(); }
+
+  /**
+   * Bound the memory the store may use, evicting records to stay
+   * within it. Must be called before the store is shared.
+   *
+   * @param[in] bytes - The memory limit, 0 for none.
+   */
+  void configure( size_t bytes )
+  {
+    limit = bytes / SHARDS;
+  }
+
+  /**
+   * Move records evicted to stay within the memory limit to disk,
+   * rather than dropping them. Cold records are not indexed, so this
+   * must not be combined with index(). Must be called before the store
+   * is shared, and maintain() called periodically from then on.
+   *
+   * @param[in] directory - Where the cold tier's files are made.
+   */
+  void tier( const char* directory )
+  {
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      shards[i].tier.open( directory );
+    }
+    tiering = true;
+  }
+
+  /**
+   * Write out and merge the cold tier's segments, see Tier::maintain().
+   * Only ever called by one thread at a time, and never holding a lock.
+   */
+  void maintain()
+  {
+    for ( int i = 0; tiering && i < SHARDS; i++ )
+    {
+      shards[i].tier.maintain( now );
+    }
+  }
+
+  /**
+   * Keep indexes on record names and ages, so the store can be
+   * queried on them. Must be called before any record is added.
+   *
+   * @param[in] enabled - True to maintain the indexes.
+   */
+  void index( bool enabled )
+  {
+    indexing = enabled;
+  }
+
+  /**
+   * @return True if the store keeps name and age indexes.
+   */
+  bool indexed() const { return indexing; }
+
+  /**
+   * Choose whether the shards are locked, which a store only one
+   * thread ever uses can go without. Must be called before the store
+   * is used.
+   *
+   * @param[in] shared - False if only one thread uses the store.
+   */
+  void share( bool shared )
+  {
+    locking = shared;
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      shards[i].table.share( shared );
+      shards[i].names.share( shared );
+    }
+  }
+
+  /**
+   * Log every record added or changed from now on, with the shard's
+   * lock held. Must be called before the store is shared.
+   *
+   * @param[in] to - Where to log them, NULL to stop logging.
+   */
+  void log( ChangeLog* to )
+  {
+    changes = to;
+  }
+
+  /**
+   * Keep one counted copy of each long name shared by many records,
+   * see NamePool::intern(). Must be called before any record is added.
+   *
+   * @param[in] enabled - True to intern names.
+   */
+  void intern( bool enabled )
+  {
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      shards[i].names.intern( enabled );
+    }
+  }
+
+  /**
+   * Keep every record in wire form as well, see wire.h, so lookups
+   * and queries can point at records as they are sent instead of
+   * copying them out. Must be called before any record is added.
+   *
+   * @param[in] epochs - The epochs readers pin, see WireEpochs.
+   */
+  void wire( WireEpochs* with )
+  {
+    epochs = with;
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      shards[i].names.wire( epochs );
+    }
+  }
+
+  /**
+   * Add a record unless one with the same id is already stored.
+   *
+   * @param[in] rec - The record to add.
+   * @param[in] ttl - Seconds the record lives for, 0 for ever.
+   *
+   * @return True if the record was added, false if it exists.
+   */
+  bool insert( const record_t& rec, unsigned int ttl )
+  {
+    Shard& shard = shardOf( rec.id );
+
+    lock( shard );
+    bool added;
+    {
+      TraceStage stage( "insert" );
+      added = insertLocked( shard, rec, ttl );
+    }
+    uint64_t seq = 0;
+    if ( added && NULL != changes )
+    {
+      seq = changes->stamp( 1 );
+    }
+    unlock( shard );
+
+    if ( 0 != seq )
+    {
+      changes->publish( seq, add_t, &rec, 1 );
+    }
+
+    return added;
+  }
+
+  /**
+   * Copy out the record with the given id.
+   *
+   * @param[in] id - The id to look for.
+   * @param[out] rec - Where to copy the record, if found.
+   *
+   * @return True if the record was found.
+   */
+  bool lookup( int id, record_t& rec )
+  {
+    Shard& shard = shardOf( id );
+
+    lock( shard );
+    entry_t* found;
+    {
+      TraceStage stage( "lookup" );
+      found = findLocked( shard, id );
+      if ( NULL != found )
+      {
+        unpackEntry( *found, rec );
+      }
+    }
+    unlock( shard );
+
+    return NULL != found;
+  }
+
+  /**
+   * Change a record in place, as asked by a mutation_t: replace its
+   * name and age, delete it, replace them only if it has the version
+   * expected, or add to its age.
+   *
+   * @param[in] request - The change, its command saying which.
+   * @param[out] result - The record as it now is, or was if deleted,
+   * and its version. Only its command is left for the caller.
+   *
+   * @return RET_SUCCESS, RET_FAILURE if no live record has the id,
+   * or RET_CONFLICT if the change was refused, see common.h.
+   */
+  int mutate( const mutation_t& request, mutation_t& result )
+  {
+    Shard& shard = shardOf( request.id );
+
+    lock( shard );
+    int status;
+    {
+      TraceStage stage( "mutate" );
+      status = mutateLocked( shard, request, result );
+    }
+    uint64_t seq = 0;
+    if ( status == RET_SUCCESS && NULL != changes )
+    {
+      seq = changes->stamp( 1 );
+    }
+    unlock( shard );
+
+    if ( 0 != seq )
+    {
+      record_t rec;
+      memset( &rec, 0, sizeof( rec ) );
+      rec.id = result.id;
+      memcpy( rec.name, result.name, MAX_LEN );
+      rec.age = result.age;
+      changes->publish( seq, request.command, &rec, 1 );
+    }
+
+    return status;
+  }
+
+  /**
+   * Add a batch of records, taking each shard's lock only once.
+   *
+   * @param[in] recs - The records to add.
+   * @param[in] count - The number of records, at most MAX_BATCH.
+   * @param[in] ttls - Seconds each record lives for, 0 for ever.
+   * @param[out] added - Whether each record was added.
+   *
+   * @return The number of records added.
+   */
+  int insertBatch( const record_t* recs, int count, const unsigned int* ttls,
+                   bool* added )
+  {
+    unsigned char owner[ MAX_BATCH ];
+    bool used[ SHARDS ];
+    for ( int s = 0; s < SHARDS; s++ )
+    {
+      used[s] = false;
+    }
+    for ( int i = 0; i < count; i++ )
+    {
+      owner[i] = shardIndex( recs[i].id );
+      used[ owner[i] ] = true;
+    }
+
+    int total = 0;
+    for ( int s = 0; s < SHARDS; s++ )
+    {
+      if ( not used[s] )
+      {
+        continue;
+      }
+
+      lock( shards[s] );
+      {
+        TraceStage stage( "insert_batch" );
+        for ( int i = 0; i < count; i++ )
+        {
+          if ( owner[i] == s )
+          {
+            added[i] = insertLocked( shards[s], recs[i], ttls[i] );
+            total += added[i];
+          }
+        }
+      }
+      bool logged[ MAX_BATCH ];
+      uint64_t seq = 0;
+      if ( NULL != changes )
+      {
+        int made = 0;
+        for ( int i = 0; i < count; i++ )
+        {
+          logged[i] = owner[i] == s && added[i];
+          made += logged[i];
+        }
+        seq = changes->stamp( made );
+      }
+      unlock( shards[s] );
+
+      if ( 0 != seq )
+      {
+        changes->publish( seq, add_t, recs, count, logged );
+      }
+    }
+    return total;
+  }
+
+  /**
+   * Look up a batch of ids, taking each shard's lock only once.
+   *
+   * @param[in] ids - The ids to look for.
+   * @param[in] count - The number of ids, at most MAX_BATCH.
+   * @param[out] recs - Where to copy each record found.
+   * @param[out] found - Whether each id was found.
+   *
+   * @return The number of ids found.
+   */
+  int lookupBatch( const int* ids, int count, record_t* recs, bool* found )
+  {
+    CopyOut out( recs, found );
+    return lookupInto( ids, count, out );
+  }
+
+  /**
+   * Look up a batch of ids in a store keeping records in wire form,
+   * see wire(), without copying any out.
+   *
+   * @param[in] ids - The ids to look for.
+   * @param[in] count - The number of ids, at most MAX_BATCH.
+   * @param[out] images - Each record found as it is sent, NULL for an
+   * id not found, left as it is for as long as the caller's reader
+   * stays pinned.
+   *
+   * @return The number of ids found.
+   */
+  int lookupBatch( const int* ids, int count, const record_t** images )
+  {
+    WireOut out( images );
+    return lookupInto( ids, count, out );
+  }
+
+  /**
+   * Copy out live records with the given name, or whose names start
+   * with it, resuming where the cursor left off. Records come back in
+   * name order within a shard, one shard after another, and no lock
+   * is held between calls. The store must be indexed.
+   *
+   * @param[in] name - The name or prefix, which need not be terminated.
+   * @param[in] prefix - True to match names starting with 'name'.
+   * @param[in,out] cursor - Where to resume, advanced past the results.
+   * @param[out] recs - Where to copy the records found.
+   * @param[in] max - The most records to copy.
+   *
+   * @return The number of records copied, less than 'max' only once
+   * every shard has been searched.
+   */
+  int findByName( const char* name, bool prefix, QueryCursor& cursor,
+                  record_t* recs, int max )
+  {
+    CopyOut out( recs, NULL );
+    return findNameInto( name, prefix, cursor, out, max );
+  }
+
+  /**
+   * Find records by name in a store keeping records in wire form, see
+   * findByName() and lookupBatch(), without copying any out.
+   */
+  int findByName( const char* name, bool prefix, QueryCursor& cursor,
+                  const record_t** images, int max )
+  {
+    WireOut out( images );
+    return findNameInto( name, prefix, cursor, out, max );
+  }
+
+  /**
+   * Copy out live records aged between two bounds, resuming where
+   * the cursor left off. Records come back in age order within a
+   * shard, one shard after another. The store must be indexed.
+   *
+   * @param[in] low - The youngest age wanted.
+   * @param[in] high - The oldest age wanted.
+   * @param[in,out] cursor - Where to resume, advanced past the results.
+   * @param[out] recs - Where to copy the records found.
+   * @param[in] max - The most records to copy.
+   *
+   * @return The number of records copied, less than 'max' only once
+   * every shard has been searched.
+   */
+  int findByAge( int low, int high, QueryCursor& cursor,
+                 record_t* recs, int max )
+  {
+    CopyOut out( recs, NULL );
+    return findAgeInto( low, high, cursor, out, max );
+  }
+
+  /**
+   * Find records by age in a store keeping records in wire form, see
+   * findByAge() and lookupBatch(), without copying any out.
+   */
+  int findByAge( int low, int high, QueryCursor& cursor,
+                 const record_t** images, int max )
+  {
+    WireOut out( images );
+    return findAgeInto( low, high, cursor, out, max );
+  }
+
+  /**
+   * Call visit( rec ) for every live record. Shards are visited one
+   * at a time under their own lock, so the visitor sees each shard
+   * consistently but not the store as a whole.
+   *
+   * @param[in] visit - The visitor, which must not call the store.
+   */
+  template <class Visitor>
+  void scan( Visitor& visit )
+  {
+    LiveVisitor<Visitor> live( visit, now );
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      lock( shards[i] );
+      shards[i].table.scan( live );
+      if ( tiering )
+      {
+        shards[i].tier.lock();
+        scanCold( shards[i], live );
+        shards[i].tier.unlock();
+      }
+      unlock( shards[i] );
+    }
+  }
+
+  /**
+   * Fork the process with every shard locked, so the child starts
+   * with a consistent copy-on-write image of the store while writers
+   * in the parent wait only for the fork itself. The child must only
+   * read the store, through scanImage(), and must leave with _exit().
+   *
+   * @return As fork().
+   */
+  pid_t fork()
+  {
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      lock( shards[i] );
+      shards[i].tier.lock();
+    }
+
+    pid_t pid = ::fork();
+
+    if ( pid != 0 )
+    {
+      for ( int i = SHARDS - 1; i >= 0; i-- )
+      {
+        shards[i].tier.unlock();
+        unlock( shards[i] );
+      }
+    }
+    return pid;
+  }
+
+  /**
+   * Call visit( rec, ttl ) for every live record, 'ttl' being the
+   * seconds it has left or 0 for ever, without taking any lock. Only
+   * for the child of fork(), whose image no other thread can change.
+   *
+   * @param[in] visit - The visitor.
+   *
+   * @return False if the cold tier could not be read in full.
+   */
+  template <class Visitor>
+  bool scanImage( Visitor& visit )
+  {
+    ImageVisitor<Visitor> image( visit, now );
+    bool complete = true;
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      shards[i].table.scan( image );
+      complete = ( not tiering || scanCold( shards[i], image ) ) && complete;
+    }
+    return complete;
+  }
+
+  /**
+   * Advance the store's clock, then drop expired records found in
+   * the next few entries of every shard. Called periodically, it
+   * walks the whole store without ever holding a lock for long.
+   *
+   * @param[in] budget - Most entries to examine per shard.
+   */
+  void sweep( int budget )
+  {
+    tick();
+
+    for ( int s = 0; s < SHARDS; s++ )
+    {
+      Shard& shard = shards[s];
+
+      lock( shard );
+      for ( int i = 0; i < budget; i++ )
+      {
+        entry_t* entry = shard.table.advance( shard.sweep );
+        if ( NULL == entry )
+        {
+          break;
+        }
+        if ( not live( *entry ) )
+        {
+          eraseLocked( shard, entry );
+          shard.expired++;
+        }
+      }
+      unlock( shard );
+    }
+  }
+
+  /**
+   * @return The number of records stored.
+   */
+  size_t size()
+  {
+    size_t total = 0;
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      lock( shards[i] );
+      total += shards[i].table.size();
+      unlock( shards[i] );
+    }
+    return total;
+  }
+
+  /**
+   * @return The number of bytes held by the tables, names and indexes.
+   */
+  size_t memoryUsage()
+  {
+    size_t total = sizeof( *this );
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      lock( shards[i] );
+      total += usageLocked( shards[i] );
+      unlock( shards[i] );
+    }
+    return total;
+  }
+
+  /**
+   * Write a line of statistics about the store to the stream.
+   *
+   * @param[in] out - The stream to write to.
+   */
+  void report( std::ostream& out )
+  {
+    size_t records = 0;
+    size_t bytes = sizeof( *this );
+    unsigned long evicted = 0;
+    unsigned long expired = 0;
+    unsigned long changed = 0;
+    unsigned long deleted = 0;
+    size_t retired = 0;
+
+    for ( int i = 0; i < SHARDS; i++ )
+    {
+      lock( shards[i] );
+      records += shards[i].table.size();
+      retired += shards[i].names.retired();
+      bytes += usageLocked( shards[i] );
+      evicted += shards[i].evicted;
+      expired += shards[i].expired;
+      changed += shards[i].changed;
+      deleted += shards[i].deleted;
+      unlock( shards[i] );
+    }
+
+    out << "store " << name()
+        << " records " << records
+        << " bytes " << bytes
+        << " limit " << limit * SHARDS
+        << " evicted " << evicted
+        << " expired " << expired
+        << " changed " << changed
+        << " deleted " << deleted << "\n";
+
+    if ( NULL != epochs )
+    {
+      out << "wire retired " << retired
+          << " readers_pinned " << epochs->pinned() << "\n";
+    }
+
+    if ( tiering )
+    {
+      TierStats cold;
+      unsigned long promoted = 0;
+      for ( int i = 0; i < SHARDS; i++ )
+      {
+        shards[i].tier.stats( cold );
+        lock( shards[i] );
+        promoted += shards[i].promoted;
+        unlock( shards[i] );
+      }
+
+      out << "tier segments " << cold.segments
+          << " records " << cold.records
+          << " disk_bytes " << cold.diskBytes
+          << " memory_bytes " << cold.memoryBytes
+          << " spilled " << cold.spilled
+          << " promoted " << promoted
+          << " hits " << cold.hits
+          << " rejected " << cold.rejected
+          << " reads " << cold.reads
+          << " false_positives " << cold.falsePositives
+          << " compactions " << cold.compactions
+          << " failures " << cold.failures << "\n";
+    }
+  }
+
+private:
+
+  struct Shard
+  {
+    Shard()
+      : mutex( "shard" ),
+        hand( typename Table::cursor_t() ),
+        sweep( typename Table::cursor_t() ),
+        bytes( 0 ),
+        evicted( 0 ),
+        expired( 0 ),
+        changed( 0 ),
+        deleted( 0 ),
+        promoted( 0 )
+    {
+    }
+
+    ProfiledMutex mutex;
+    Table table;
+    NamePool names;
+    name_index_t byName;
+    age_index_t byAge;
+    typename Table::cursor_t hand;
+    typename Table::cursor_t sweep;
+    size_t bytes;             // Charged for entries, names are extra
+    unsigned long evicted;
+    unsigned long expired;
+    unsigned long changed;    // Updated in place, deletes aside
+    unsigned long deleted;
+    unsigned long promoted;   // Brought back from the cold tier
+    Tier tier;
+    char padding[ CACHE_LINE ];
+  };
+
+  /**
+   * Hands live records to a visitor, skipping expired ones.
+   */
+  template <class Visitor>
+  struct LiveVisitor
+  {
+    LiveVisitor( Visitor& visit, unsigned int now )
+      : visit( visit ), now( now ) {}
+
+    void operator()( const entry_t& entry )
+    {
+      if ( entry.expires == 0 || entry.expires > now )
+      {
+        record_t rec;
+        unpackEntry( entry, rec );
+        visit( rec );
+      }
+    }
+
+    void operator()( const cold_t& cold )
+    {
+      if ( cold.expires == 0 || cold.expires > now )
+      {
+        record_t rec;
+        unpackCold( cold, rec );
+        visit( rec );
+      }
+    }
+
+    Visitor& visit;
+    unsigned int now;
+  };
+
+  /**
+   * Hands live records and the time they have left to a visitor.
+   */
+  template <class Visitor>
+  struct ImageVisitor
+  {
+    ImageVisitor( Visitor& visit, unsigned int now )
+      : visit( visit ), now( now ) {}
+
+    void operator()( const entry_t& entry )
+    {
+      if ( entry.expires == 0 || entry.expires > now )
+      {
+        record_t rec;
+        unpackEntry( entry, rec );
+        visit( rec, entry.expires == 0 ? 0 : entry.expires - now );
+      }
+    }
+
+    void operator()( const cold_t& cold )
+    {
+      if ( cold.expires == 0 || cold.expires > now )
+      {
+        record_t rec;
+        unpackCold( cold, rec );
+        visit( rec, cold.expires == 0 ? 0 : cold.expires - now );
+      }
+    }
+
+    Visitor& visit;
+    unsigned int now;
+  };
+
+  /**
+   * Refresh the store's clock, in whole seconds.
+   */
+  void tick()
+  {
+    struct timespec clock;
+    clock_gettime( CLOCK_MONOTONIC, &clock );
+    now = clock.tv_sec;
+  }
+
+  bool live( const entry_t& entry ) const
+  {
+    return entry.expires == 0 || entry.expires > now;
+  }
+
+  /**
+   * Find a live entry, dropping it if it has expired. Called with
+   * the shard's lock held, which is let go while the cold tier is
+   * read, see findCold().
+   */
+  entry_t* findLocked( Shard& shard, int id )
+  {
+    entry_t* entry = shard.table.find( id );
+    if ( NULL == entry && tiering )
+    {
+      entry = promoteLocked( shard, id );
+    }
+    if ( NULL == entry )
+    {
+      return NULL;
+    }
+    if ( not live( *entry ) )
+    {
+      eraseLocked( shard, entry );
+      shard.expired++;
+      return NULL;
+    }
+    entry->flags |= ENTRY_REFERENCED;
+    return entry;
+  }
+
+  /**
+   * Hand an indexed record to 'out' if it is live, leaving an expired
+   * one for the sweep so the caller's index iterator stays valid.
+   * Called with the shard's lock held.
+   *
+   * @return 1 if the record was handed over, otherwise 0.
+   */
+  template <class Out>
+  int copyLive( Shard& shard, int id, Out& out, int index )
+  {
+    const entry_t* entry = shard.table.find( id );
+    if ( NULL == entry || not live( *entry ) )
+    {
+      return 0;
+    }
+    out.hit( index, *entry );
+    return 1;
+  }
+
+  /**
+   * Where lookups copy records out to.
+   */
+  struct CopyOut
+  {
+    CopyOut( record_t* recs, bool* found ) : recs( recs ), found( found ) {}
+
+    void hit( int i, const entry_t& entry )
+    {
+      unpackEntry( entry, recs[i] );
+      if ( NULL != found )
+      {
+        found[i] = true;
+      }
+    }
+
+    void miss( int i )
+    {
+      found[i] = false;
+    }
+
+    record_t* recs;
+    bool* found;
+  };
+
+  /**
+   * Where lookups point at records kept in wire form.
+   */
+  struct WireOut
+  {
+    WireOut( const record_t** images ) : images( images ) {}
+
+    void hit( int i, const entry_t& entry )
+    {
+      images[i] = wireImage( entry );
+    }
+
+    void miss( int i )
+    {
+      images[i] = NULL;
+    }
+
+    const record_t** images;
+  };
+
+  /**
+   * Look up a batch of ids, see lookupBatch(), handing each to 'out'.
+   */
+  template <class Out>
+  int lookupInto( const int* ids, int count, Out& out )
+  {
+    unsigned char owner[ MAX_BATCH ];
+    bool used[ SHARDS ];
+    for ( int s = 0; s < SHARDS; s++ )
+    {
+      used[s] = false;
+    }
+    for ( int i = 0; i < count; i++ )
+    {
+      owner[i] = shardIndex( ids[i] );
+      used[ owner[i] ] = true;
+    }
+
+    int total = 0;
+    for ( int s = 0; s < SHARDS; s++ )
+    {
+      if ( not used[s] )
+      {
+        continue;
+      }
+
+      lock( shards[s] );
+      {
+        TraceStage stage( "lookup_batch" );
+        for ( int i = 0; i < count; i++ )
+        {
+          if ( owner[i] == s )
+          {
+            entry_t* entry = findLocked( shards[s], ids[i] );
+            if ( NULL != entry )
+            {
+              out.hit( i, *entry );
+              total++;
+            }
+            else
+            {
+              out.miss( i );
+            }
+          }
+        }
+      }
+      unlock( shards[s] );
+    }
+    return total;
+  }
+
+  /**
+   * Find records by name, see findByName(), handing each to 'out'.
+   */
+  template <class Out>
+  int findNameInto( const char* name, bool prefix, QueryCursor& cursor,
+                    Out& out, int max )
+  {
+    name_key_t first;
+    memset( first.name, 0, MAX_LEN );
+    memcpy( first.name, name, strnlen( name, MAX_LEN ) );
+    first.id = INT_MIN;
+
+    // An exact match compares the padding as well
+    const char* end = static_cast<const char*>( memchr( first.name, '\0',
+                                                        MAX_LEN ) );
+    size_t length = prefix && NULL != end ? end - first.name : MAX_LEN;
+
+    int found = 0;
+    while ( found < max && cursor.shard < SHARDS )
+    {
+      Shard& shard = shards[ cursor.shard ];
+
+      lock( shard );
+      bool finished;
+      {
+        TraceStage stage( "query_name" );
+        name_index_t::iterator it =
+          cursor.started ? shard.byName.upper_bound( cursor.name )
+                         : shard.byName.lower_bound( first );
+        for ( ; found < max && it != shard.byName.end()
+                && memcmp( it->name, first.name, length ) == 0; ++it )
+        {
+          cursor.name = *it;
+          cursor.started = true;
+          found += copyLive( shard, it->id, out, found );
+        }
+        finished = it == shard.byName.end()
+                   || memcmp( it->name, first.name, length ) != 0;
+      }
+      unlock( shard );
+
+      if ( finished )
+      {
+        cursor.shard++;
+        cursor.started = false;
+      }
+    }
+    return found;
+  }
+
+  /**
+   * Find records by age, see findByAge(), handing each to 'out'.
+   */
+  template <class Out>
+  int findAgeInto( int low, int high, QueryCursor& cursor, Out& out,
+                   int max )
+  {
+    int found = 0;
+    while ( found < max && cursor.shard < SHARDS )
+    {
+      Shard& shard = shards[ cursor.shard ];
+
+      lock( shard );
+      bool finished;
+      {
+        TraceStage stage( "query_age" );
+        age_index_t::iterator it =
+          cursor.started ? shard.byAge.upper_bound( cursor.age )
+                         : shard.byAge.lower_bound( age_key_t( low, INT_MIN ) );
+        for ( ; found < max && it != shard.byAge.end() && it->first <= high;
+              ++it )
+        {
+          cursor.age = *it;
+          cursor.started = true;
+          found += copyLive( shard, it->second, out, found );
+        }
+        finished = it == shard.byAge.end() || it->first > high;
+      }
+      unlock( shard );
+
+      if ( finished )
+      {
+        cursor.shard++;
+        cursor.started = false;
+      }
+    }
+    return found;
+  }
+
+
+  /**
+   * @return The bytes held by a shard's table, names and indexes.
+   * Called with the shard's lock held.
+   */
+  size_t usageLocked( const Shard& shard ) const
+  {
+    size_t indexes = indexing ? shard.byName.size() * indexCost() : 0;
+    return shard.table.memoryUsage() + shard.names.bytes() + indexes;
+  }
+
+  /**
+   * @return The bytes each entry is charged against the limit.
+   */
+  size_t entryCost() const
+  {
+    return Table::entryCost() + ( indexing ? indexCost() : 0 );
+  }
+
+  /**
+   * Add a record to, or remove one from, the shard's indexes. Called
+   * with the shard's lock held.
+   */
+  void indexLocked( Shard& shard, const record_t& rec )
+  {
+    if ( indexing )
+    {
+      shard.byName.insert( nameKey( rec ) );
+      shard.byAge.insert( age_key_t( rec.age, rec.id ) );
+    }
+  }
+
+  void unindexLocked( Shard& shard, const entry_t& entry )
+  {
+    if ( indexing )
+    {
+      record_t rec;
+      unpackEntry( entry, rec );
+      shard.byName.erase( nameKey( rec ) );
+      shard.byAge.erase( age_key_t( rec.age, rec.id ) );
+    }
+  }
+
+  /**
+   * Add a record unless a live one has its id, evicting others
+   * first if the shard is at its memory limit. Called with the
+   * shard's lock held, which is let go while the cold tier is read,
+   * see findCold().
+   */
+  bool insertLocked( Shard& shard, const record_t& rec, unsigned int ttl )
+  {
+    entry_t* entry = shard.table.find( rec.id );
+    if ( NULL == entry && tiering )
+    {
+      // The Bloom filters spare a new id any read from disk
+      cold_t cold;
+      if ( findCold( shard, rec.id, cold ) )
+      {
+        return false;
+      }
+      entry = shard.table.find( rec.id );
+    }
+
+    if ( NULL != entry )
+    {
+      if ( live( *entry ) )
+      {
+        return false;
+      }
+      unindexLocked( shard, *entry );
+      releaseEntry( *entry, shard.names );
+      shard.expired++;
+    }
+    else
+    {
+      entry = makeLocked( shard, rec.id );
+    }
+
+    packEntry( *entry, rec, shard.names );
+    indexLocked( shard, rec );
+    entry->expires = ttl > 0 ? now + ttl : 0;
+    entry->flags |= ENTRY_REFERENCED;
+    entry->version = 1;
+    return true;
+  }
+
+  /**
+   * Make the change a mutation_t asks for, see mutate(). Called with
+   * the shard's lock held.
+   */
+  int mutateLocked( Shard& shard, const mutation_t& request,
+                    mutation_t& result )
+  {
+    memset( &result, 0, sizeof( result ) );
+    result.id = request.id;
+
+    entry_t* entry = findLocked( shard, request.id );
+    if ( NULL == entry )
+    {
+      return RET_FAILURE;
+    }
+
+    record_t rec;
+    unpackEntry( *entry, rec );
+    record_t changed = rec;
+    bool allowed = true;
+
+    switch ( request.command )
+    {
+      case update_t:
+      case cas_t:
+        allowed = request.command == update_t
+                  || request.version == entry->version;
+        memcpy( changed.name, request.name, MAX_LEN );
+        changed.age = request.age;
+        break;
+      case incr_t:
+        allowed = request.age >= 0 ? rec.age <= INT_MAX - request.age
+                                   : rec.age >= INT_MIN - request.age;
+        changed.age = allowed ? rec.age + request.age : rec.age;
+        break;
+      case delete_t:
+        break;
+      default:
+        allowed = false;
+        break;
+    }
+
+    if ( not allowed || request.command == delete_t )
+    {
+      memcpy( result.name, rec.name, MAX_LEN );
+      result.age = rec.age;
+      result.version = entry->version;
+      if ( allowed )
+      {
+        // The tier may still hold a copy from before it was promoted
+        if ( tiering && shard.tier.mayHold( request.id ) )
+        {
+          shard.tier.bury( request.id );
+        }
+        eraseLocked( shard, entry );
+        shard.deleted++;
+      }
+      return allowed ? RET_SUCCESS : RET_CONFLICT;
+    }
+
+    unindexLocked( shard, *entry );
+    releaseEntry( *entry, shard.names );
+    packEntry( *entry, changed, shard.names );
+    unpackEntry( *entry, changed );
+    indexLocked( shard, changed );
+
+    // Versions wrap round past 0, which is never a record's
+    entry->version = entry->version == USHRT_MAX ? 1 : entry->version + 1;
+    shard.changed++;
+
+    memcpy( result.name, changed.name, MAX_LEN );
+    result.age = changed.age;
+    result.version = entry->version;
+    return RET_SUCCESS;
+  }
+
+  /**
+   * Make an entry for an id the table lacks, evicting others first if
+   * the shard is at its memory limit. Called with the shard's lock
+   * held.
+   */
+  entry_t* makeLocked( Shard& shard, int id )
+  {
+    while ( limit > 0
+            && shard.bytes + shard.names.bytes() + entryCost() > limit
+            && evictLocked( shard ) )
+    {
+    }
+
+    bool added;
+    entry_t* entry = shard.table.insert( id, added );
+    shard.bytes += entryCost();
+    return entry;
+  }
+
+  bool liveCold( const cold_t& cold ) const
+  {
+    return not ( cold.flags & COLD_DELETED )
+           && ( cold.expires == 0 || cold.expires > now );
+  }
+
+  /**
+   * Look for a live cold copy of an id the table lacks. The shard's
+   * lock is let go while blocks are read from disk, see Tier::find(),
+   * so the table may have the id by the time it is taken back. Called
+   * with the shard's lock held.
+   *
+   * @return True if the table still lacks the id and the tier holds a
+   * live copy.
+   */
+  bool findCold( Shard& shard, int id, cold_t& cold )
+  {
+    TierLookup lookup;
+    int found;
+    while ( ( found = shard.tier.find( id, cold, lookup ) ) < 0 )
+    {
+      unlock( shard );
+      shard.tier.read( id, lookup );
+      lock( shard );
+      if ( NULL != shard.table.find( id ) )
+      {
+        return false;
+      }
+    }
+    return found > 0 && liveCold( cold );
+  }
+
+  /**
+   * Bring a record back into memory from the cold tier, where its
+   * copy stays until merged away. Called with the shard's lock held,
+   * see findCold().
+   *
+   * @return The record's entry, or NULL if the tier has no live copy.
+   * The entry may instead be one made while the lock was let go.
+   */
+  entry_t* promoteLocked( Shard& shard, int id )
+  {
+    cold_t cold;
+    if ( not findCold( shard, id, cold ) )
+    {
+      return shard.table.find( id );
+    }
+
+    record_t rec;
+    unpackCold( cold, rec );
+
+    entry_t* entry = makeLocked( shard, id );
+    packEntry( *entry, rec, shard.names );
+    entry->expires = cold.expires;
+    entry->flags |= ENTRY_REFERENCED;
+    entry->version = cold.version;
+    shard.promoted++;
+    return entry;
+  }
+
+  /**
+   * Hand a visitor the shard's cold records which are not also in
+   * memory, where the newer copy is, nor deleted. Called with the
+   * shard and its tier locked, or in the child of fork().
+   *
+   * @return False if the tier could not be read in full.
+   */
+  template <class Visitor>
+  bool scanCold( Shard& shard, Visitor& visit )
+  {
+    TierCursor cursor( shard.tier );
+    cold_t cold;
+    while ( cursor.next( cold ) )
+    {
+      if ( not ( cold.flags & COLD_DELETED )
+           && NULL == shard.table.find( cold.id ) )
+      {
+        visit( cold );
+      }
+    }
+    return not cursor.failed();
+  }
+
+  /**
+   * Remove an entry and its name, crediting its memory back to the
+   * shard.
+   */
+  void eraseLocked( Shard& shard, entry_t* entry )
+  {
+    unindexLocked( shard, *entry );
+    releaseEntry( *entry, shard.names );
+    if ( shard.table.erase( entry->id ) )
+    {
+      shard.bytes -= entryCost();
+    }
+  }
+
+  /**
+   * Move the CLOCK hand until it finds an expired entry, or one not
+   * referenced since the hand last passed it, and remove that entry.
+   * Called with the shard's lock held.
+   *
+   * @return False if the shard is empty.
+   */
+  bool evictLocked( Shard& shard )
+  {
+    // Two passes always suffice, the first clears every reference
+    size_t steps = 2 * shard.table.size() + 2;
+    for ( size_t i = 0; i < steps; i++ )
+    {
+      entry_t* entry = shard.table.advance( shard.hand );
+      if ( NULL == entry )
+      {
+        continue;
+      }
+      if ( not live( *entry ) )
+      {
+        eraseLocked( shard, entry );
+        shard.expired++;
+        return true;
+      }
+      if ( entry->flags & ENTRY_REFERENCED )
+      {
+        entry->flags &= ~ENTRY_REFERENCED;
+        continue;
+      }
+      if ( tiering )
+      {
+        record_t rec;
+        unpackEntry( *entry, rec );
+        shard.tier.spill( rec, entry->expires, entry->version );
+      }
+      eraseLocked( shard, entry );
+      shard.evicted++;
+      return true;
+    }
+    return false;
+  }
+
+  void lock( Shard& shard )
+  {
+    if ( locking )
+    {
+      shard.mutex.lock();
+    }
+  }
+
+  void unlock( Shard& shard )
+  {
+    if ( locking )
+    {
+      shard.mutex.unlock();
+    }
+  }
+
+  static int shardIndex( int id )
+  {
+    return ( hashId( id ) >> 16 ) % SHARDS;
+  }
+
+  Shard& shardOf( int id )
+  {
+    return shards[ shardIndex( id ) ];
+  }
+
+  Shard shards[ SHARDS ];
+  size_t limit;
+  bool indexing;
+  bool tiering;
+  bool locking;
+  ChangeLog* changes;
+  WireEpochs* epochs;       // NULL unless records are kept in wire form
+  volatile unsigned int now;
+
+  // Not copyable
+  Store( const Store& );
+  Store& operator=( const Store& );
+};
+
+#endif // _STORE_H_
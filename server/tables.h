@@ -0,0 +1,528 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: The tables a Store can be built over. Each table maps
+ * a record id to its entry, in the compact form of entry.h, and is
+ * not thread safe on its own, the Store guards every table with a
+ * lock of its own.
+ *
+ * Every table provides:
+ *
+ *   entry_t* find( int id )              - The stored entry or NULL.
+ *   entry_t* insert( int id, bool& added ) - The entry for the id,
+ *                                          which is new and must be
+ *                                          filled in if 'added'.
+ *   bool erase( int id )                 - Remove the id's entry.
+ *   entry_t* advance( cursor_t& cursor ) - The entry at the cursor,
+ *                                          moving the cursor past it,
+ *                                          or NULL and a rewound
+ *                                          cursor at the end.
+ *   void scan( Visitor& visit )          - Call visit( entry ) for all.
+ *   size_t size() const                  - The number of entries.
+ *   size_t memoryUsage() const           - Bytes held by the table.
+ *   void share( bool shared )            - False if only one thread
+ *                                          ever uses the table, so
+ *                                          its allocator need not
+ *                                          lock.
+ *   static size_t entryCost()            - Most bytes an entry can
+ *                                          cost, table overhead and
+ *                                          all, used for budgeting.
+ *   static const char* name()            - Name used in statistics.
+ *   static bool ownable()                - True if a table share( false )
+ *                                          is called on takes no lock
+ *                                          at all, so one thread can
+ *                                          own it outright.
+ *
+ * Pointers to entries are only good until the table is next changed.
+ */
+
+#ifndef _TABLES_H_
+#define _TABLES_H_
+
+#include <limits.h>
+#include <map>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "entry.h"
+#include "slab.h"
+
+// Entries a hash table bucket holds on average before the table grows
+#define HASH_LOAD 2
+
+/**
+ * Scramble a record id so that sequential ids spread evenly over
+ * shards and buckets (Fibonacci hashing).
+ *
+ * @param[in] id - The record id.
+ *
+ * @return The hashed id.
+ */
+inline unsigned int hashId( int id )
+{
+  return (unsigned int)id * 2654435769u;
+}
+
+/**
+ * The original ordered map, with tree nodes taken from a slab. The
+ * least dense engine, a record costing 72 bytes against the hash
+ * table's 48.
+ */
+class MapTable
+{
+  typedef std::map<int, entry_t, std::less<int>,
+                   SlabAllocator<std::pair<const int, entry_t> > > map_t;
+
+public:
+
+  // The next id the cursor will visit
+  typedef int64_t cursor_t;
+
+  static const char* name() { return "map"; }
+  static bool ownable() { return false; }
+
+  // Every node carries a red-black tree header of four words
+  static size_t entryCost()
+  {
+    return sizeof( map_t::value_type ) + 4 * sizeof( void* );
+  }
+
+  MapTable() {}
+
+  // Nodes come from the slab every map table shares, which must lock
+  void share( bool ) {}
+
+  entry_t* find( int id )
+  {
+    map_t::iterator found = records.find( id );
+    return found == records.end() ? NULL : &found->second;
+  }
+
+  entry_t* insert( int id, bool& added )
+  {
+    std::pair<map_t::iterator, bool> result =
+      records.insert( map_t::value_type( id, entry_t() ) );
+    added = result.second;
+    result.first->second.id = id;
+    return &result.first->second;
+  }
+
+  bool erase( int id )
+  {
+    return records.erase( id ) > 0;
+  }
+
+  entry_t* advance( cursor_t& cursor )
+  {
+    map_t::iterator it = cursor > INT_MAX ? records.end()
+                                          : records.lower_bound( (int)cursor );
+    if ( it == records.end() )
+    {
+      cursor = INT_MIN;
+      return NULL;
+    }
+    cursor = (cursor_t)it->first + 1;
+    return &it->second;
+  }
+
+  template <class Visitor>
+  void scan( Visitor& visit )
+  {
+    for ( map_t::iterator it = records.begin(); it != records.end(); ++it )
+    {
+      visit( it->second );
+    }
+  }
+
+  size_t size() const { return records.size(); }
+
+  size_t memoryUsage() const { return records.size() * entryCost(); }
+
+private:
+
+  map_t records;
+
+  // Not copyable
+  MapTable( const MapTable& );
+  MapTable& operator=( const MapTable& );
+};
+
+/**
+ * A chained hash table whose nodes come from a slab private to the
+ * table, so shards never contend on the allocator. The default engine,
+ * chains averaging between one and two entries so a record costs at
+ * most 48 bytes.
+ */
+class HashTable
+{
+public:
+
+  // The bucket, and the position within its chain, to visit next
+  typedef struct
+  {
+    size_t bucket;
+    size_t depth;
+  } cursor_t;
+
+  static const char* name() { return "hash"; }
+  static bool ownable() { return true; }
+
+  // A node plus at most one bucket pointer, as buckets never outnumber
+  // nodes once the table has grown
+  static size_t entryCost() { return sizeof( Node ) + sizeof( Node* ); }
+
+  HashTable()
+    : nodes( "hash", sizeof( Node ) ),
+      buckets( NULL ),
+      mask( 0 ),
+      count( 0 )
+  {
+    resize( 64 );
+  }
+
+  ~HashTable()
+  {
+    free( buckets );
+  }
+
+  void share( bool shared ) { nodes.share( shared ); }
+
+  entry_t* find( int id )
+  {
+    for ( Node* node = buckets[ hashId( id ) & mask ]; node != NULL;
+          node = node->next )
+    {
+      if ( node->entry.id == id )
+      {
+        return &node->entry;
+      }
+    }
+    return NULL;
+  }
+
+  entry_t* insert( int id, bool& added )
+  {
+    entry_t* found = find( id );
+    added = NULL == found;
+    if ( not added )
+    {
+      return found;
+    }
+
+    if ( count + 1 > ( mask + 1 ) * HASH_LOAD )
+    {
+      resize( ( mask + 1 ) * 2 );
+    }
+
+    Node* node = static_cast<Node*>( nodes.allocate() );
+    if ( NULL == node )
+    {
+      throw std::bad_alloc();
+    }
+
+    Node** bucket = &buckets[ hashId( id ) & mask ];
+    node->entry.id = id;
+    node->entry.flags = 0;
+    node->next = *bucket;
+    *bucket = node;
+    count++;
+    return &node->entry;
+  }
+
+  bool erase( int id )
+  {
+    for ( Node** link = &buckets[ hashId( id ) & mask ]; *link != NULL;
+          link = &(*link)->next )
+    {
+      Node* node = *link;
+      if ( node->entry.id == id )
+      {
+        *link = node->next;
+        nodes.release( node );
+        count--;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  entry_t* advance( cursor_t& cursor )
+  {
+    for ( ; cursor.bucket <= mask; cursor.bucket++, cursor.depth = 0 )
+    {
+      Node* node = buckets[ cursor.bucket ];
+      for ( size_t i = 0; node != NULL && i < cursor.depth; i++ )
+      {
+        node = node->next;
+      }
+      if ( NULL != node )
+      {
+        cursor.depth++;
+        return &node->entry;
+      }
+    }
+    cursor.bucket = 0;
+    cursor.depth = 0;
+    return NULL;
+  }
+
+  template <class Visitor>
+  void scan( Visitor& visit )
+  {
+    for ( size_t i = 0; i <= mask; i++ )
+    {
+      for ( Node* node = buckets[i]; node != NULL; node = node->next )
+      {
+        visit( node->entry );
+      }
+    }
+  }
+
+  size_t size() const { return count; }
+
+  size_t memoryUsage() const
+  {
+    return ( mask + 1 ) * sizeof( Node* ) + count * nodes.blockSize();
+  }
+
+private:
+
+  struct Node
+  {
+    Node* next;
+    entry_t entry;
+  };
+
+  /**
+   * Rehash every node into a bucket array of the given size.
+   *
+   * @param[in] size - The new number of buckets, a power of two.
+   */
+  void resize( size_t size )
+  {
+    Node** grown = static_cast<Node**>( calloc( size, sizeof( Node* ) ) );
+    if ( NULL == grown )
+    {
+      throw std::bad_alloc();
+    }
+
+    if ( NULL != buckets )
+    {
+      for ( size_t i = 0; i <= mask; i++ )
+      {
+        Node* node = buckets[i];
+        while ( node != NULL )
+        {
+          Node* next = node->next;
+          Node** bucket = &grown[ hashId( node->entry.id ) & ( size - 1 ) ];
+          node->next = *bucket;
+          *bucket = node;
+          node = next;
+        }
+      }
+      free( buckets );
+    }
+
+    buckets = grown;
+    mask = size - 1;
+  }
+
+  Slab nodes;
+  Node** buckets;
+  size_t mask;
+  size_t count;
+
+  // Not copyable
+  HashTable( const HashTable& );
+  HashTable& operator=( const HashTable& );
+};
+
+/**
+ * An open addressing table storing entries directly in one flat
+ * array, probed linearly, with no per-record allocation at all.
+ */
+class FlatTable
+{
+public:
+
+  // The slot to visit next
+  typedef size_t cursor_t;
+
+  static const char* name() { return "flat"; }
+  static bool ownable() { return true; }
+
+  // Tables run between 3/8 and 3/4 full, so a slot and then some
+  static size_t entryCost() { return sizeof( entry_t ) * 8 / 3; }
+
+  FlatTable()
+    : slots( NULL ),
+      mask( 0 ),
+      count( 0 )
+  {
+    resize( 64 );
+  }
+
+  ~FlatTable()
+  {
+    free( slots );
+  }
+
+  // Slots are allocated with the table, nothing is shared
+  void share( bool ) {}
+
+  entry_t* find( int id )
+  {
+    for ( size_t i = hashId( id ) & mask; used( slots[i] );
+          i = ( i + 1 ) & mask )
+    {
+      if ( slots[i].id == id )
+      {
+        return &slots[i];
+      }
+    }
+    return NULL;
+  }
+
+  entry_t* insert( int id, bool& added )
+  {
+    // Keep the table at most 3/4 full so probe chains stay short
+    if ( ( count + 1 ) * 4 > ( mask + 1 ) * 3 )
+    {
+      resize( ( mask + 1 ) * 2 );
+    }
+
+    size_t i = hashId( id ) & mask;
+    for ( ; used( slots[i] ); i = ( i + 1 ) & mask )
+    {
+      if ( slots[i].id == id )
+      {
+        added = false;
+        return &slots[i];
+      }
+    }
+
+    slots[i].flags = ENTRY_USED;
+    slots[i].id = id;
+    count++;
+    added = true;
+    return &slots[i];
+  }
+
+  bool erase( int id )
+  {
+    size_t i = hashId( id ) & mask;
+    for ( ; used( slots[i] ); i = ( i + 1 ) & mask )
+    {
+      if ( slots[i].id == id )
+      {
+        break;
+      }
+    }
+    if ( not used( slots[i] ) )
+    {
+      return false;
+    }
+
+    //
+    // Shift later members of the probe chain back over the hole, so
+    // lookups never need tombstones.
+    //
+    for ( size_t j = ( i + 1 ) & mask; used( slots[j] );
+          j = ( j + 1 ) & mask )
+    {
+      size_t home = hashId( slots[j].id ) & mask;
+      bool movable = i <= j ? ( home <= i || home > j )
+                            : ( home <= i && home > j );
+      if ( movable )
+      {
+        slots[i] = slots[j];
+        i = j;
+      }
+    }
+
+    slots[i].flags = 0;
+    count--;
+    return true;
+  }
+
+  entry_t* advance( cursor_t& cursor )
+  {
+    for ( ; cursor <= mask; cursor++ )
+    {
+      if ( used( slots[ cursor ] ) )
+      {
+        return &slots[ cursor++ ];
+      }
+    }
+    cursor = 0;
+    return NULL;
+  }
+
+  template <class Visitor>
+  void scan( Visitor& visit )
+  {
+    for ( size_t i = 0; i <= mask; i++ )
+    {
+      if ( used( slots[i] ) )
+      {
+        visit( slots[i] );
+      }
+    }
+  }
+
+  size_t size() const { return count; }
+
+  size_t memoryUsage() const { return ( mask + 1 ) * sizeof( entry_t ); }
+
+private:
+
+  // Slots hold entries directly, marked ENTRY_USED when occupied
+  static bool used( const entry_t& slot ) { return slot.flags & ENTRY_USED; }
+
+  /**
+   * Move every entry into a slot array of the given size.
+   *
+   * @param[in] size - The new number of slots, a power of two.
+   */
+  void resize( size_t size )
+  {
+    entry_t* grown =
+      static_cast<entry_t*>( calloc( size, sizeof( entry_t ) ) );
+    if ( NULL == grown )
+    {
+      throw std::bad_alloc();
+    }
+
+    if ( NULL != slots )
+    {
+      for ( size_t i = 0; i <= mask; i++ )
+      {
+        if ( used( slots[i] ) )
+        {
+          size_t j = hashId( slots[i].id ) & ( size - 1 );
+          while ( used( grown[j] ) )
+          {
+            j = ( j + 1 ) & ( size - 1 );
+          }
+          grown[j] = slots[i];
+        }
+      }
+      free( slots );
+    }
+
+    slots = grown;
+    mask = size - 1;
+  }
+
+  entry_t* slots;
+  size_t mask;
+  size_t count;
+
+  // Not copyable
+  FlatTable( const FlatTable& );
+  FlatTable& operator=( const FlatTable& );
+};
+
+#endif // _TABLES_H_
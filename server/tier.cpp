@@ -0,0 +1,785 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the cold tier, see tier.h for more
+ * details.
+ */
+
+#include "tier.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+
+// Blocks buffered before a segment being made is written to
+#define TIER_WRITE_BLOCKS 16
+
+/**
+ * A segment file, its records sorted by id and never changed, along
+ * with what is kept in memory to find records in it.
+ */
+struct Segment
+{
+  int fd;
+  int level;                    // Times its records have been merged
+  size_t count;
+  int highest;
+  std::vector< int > firsts;    // The first id in each block
+  std::vector< uint32_t > bloom;
+  size_t bits;
+  int readers;                  // Lookups reading it without the lock
+  bool retired;                 // Merged away, closed by its last reader
+};
+
+/**
+ * Mix an id's bits thoroughly, as the Bloom filter's probes need
+ * every bit of the hash to depend on every bit of the id.
+ */
+static inline uint32_t mixId( uint32_t hash )
+{
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/**
+ * Call probe( bit ) for each of an id's bits in a filter, derived from
+ * two hashes so only two are computed.
+ */
+template <class Probe>
+static inline bool probeBloom( int id, size_t bits, Probe& probe )
+{
+  uint32_t first = mixId( (uint32_t)id );
+  uint32_t step = mixId( first ^ 0x9e3779b9u ) | 1;
+  for ( int i = 0; i < TIER_BLOOM_PROBES; i++ )
+  {
+    uint32_t hash = first + i * step;
+    if ( not probe( (size_t)( ( (uint64_t)hash * bits ) >> 32 ) ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct BloomSet
+{
+  BloomSet( std::vector< uint32_t >& bloom ) : bloom( bloom ) {}
+
+  bool operator()( size_t bit )
+  {
+    bloom[ bit / 32 ] |= 1u << ( bit % 32 );
+    return true;
+  }
+
+  std::vector< uint32_t >& bloom;
+};
+
+struct BloomTest
+{
+  BloomTest( const std::vector< uint32_t >& bloom ) : bloom( bloom ) {}
+
+  bool operator()( size_t bit )
+  {
+    return bloom[ bit / 32 ] & ( 1u << ( bit % 32 ) );
+  }
+
+  const std::vector< uint32_t >& bloom;
+};
+
+/**
+ * @return True if a segment may hold an id, false if it surely
+ * does not.
+ */
+static bool mayHold( const Segment& segment, int id )
+{
+  if ( 0 == segment.count || id < segment.firsts[0] || id > segment.highest )
+  {
+    return false;
+  }
+  BloomTest test( segment.bloom );
+  return probeBloom( id, segment.bits, test );
+}
+
+/**
+ * Read a segment's records from 'first' on into a buffer.
+ *
+ * @return The records read, or -1 if the file could not be read.
+ */
+static long readRecords( const Segment& segment, size_t first, cold_t* into,
+                         size_t most )
+{
+  size_t wanted = segment.count - first < most ? segment.count - first : most;
+  size_t bytes = wanted * sizeof( cold_t );
+  off_t offset = (off_t)first * sizeof( cold_t );
+
+  size_t done = 0;
+  while ( done < bytes )
+  {
+    ssize_t got = pread( segment.fd, (char*)into + done, bytes - done,
+                         offset + done );
+    if ( got < 0 && errno == EINTR )
+    {
+      continue;
+    }
+    if ( got <= 0 )
+    {
+      return -1;
+    }
+    done += got;
+  }
+  return wanted;
+}
+
+static void closeSegment( Segment* segment )
+{
+  close( segment->fd );
+  delete segment;
+}
+
+/**
+ * Writes a new segment a record at a time, in id order.
+ */
+class SegmentBuilder
+{
+public:
+
+  /**
+   * @param[in] directory - Where to make the file.
+   * @param[in] expected - The most records it will hold.
+   * @param[in] level - Times its records have been merged.
+   */
+  SegmentBuilder( const std::string& directory, size_t expected, int level )
+    : segment( new Segment ),
+      buffered( 0 ),
+      ok( true )
+  {
+    static unsigned int made = 0;
+
+    char path[ 4096 ];
+    snprintf( path, sizeof( path ), "%s/records-%d-%u.seg",
+              directory.c_str(), (int)getpid(),
+              __atomic_add_fetch( &made, 1, __ATOMIC_RELAXED ) );
+
+    // Only the descriptor keeps the file, so a crash leaves nothing
+    segment->fd = ::open( path, O_RDWR | O_CREAT | O_EXCL, 0600 );
+    if ( segment->fd >= 0 )
+    {
+      unlink( path );
+    }
+    ok = segment->fd >= 0;
+
+    segment->level = level;
+    segment->readers = 0;
+    segment->retired = false;
+    segment->count = 0;
+    segment->highest = 0;
+    segment->bits = std::max( (size_t)64, expected * TIER_BLOOM_BITS );
+    segment->bloom.assign( ( segment->bits + 31 ) / 32, 0 );
+    segment->firsts.reserve( expected / TIER_BLOCK + 1 );
+  }
+
+  ~SegmentBuilder()
+  {
+    if ( NULL != segment )
+    {
+      closeSegment( segment );
+    }
+  }
+
+  void add( const cold_t& cold )
+  {
+    if ( segment->count % TIER_BLOCK == 0 )
+    {
+      segment->firsts.push_back( cold.id );
+    }
+    segment->highest = cold.id;
+    segment->count++;
+
+    BloomSet set( segment->bloom );
+    probeBloom( cold.id, segment->bits, set );
+
+    buffer[ buffered++ ] = cold;
+    if ( buffered == TIER_BLOCK * TIER_WRITE_BLOCKS )
+    {
+      write();
+    }
+  }
+
+  /**
+   * @return The segment, or NULL if it could not be written. An empty
+   * segment is made and handed back like any other.
+   */
+  Segment* finish()
+  {
+    write();
+    Segment* made = ok ? segment : NULL;
+    if ( ok )
+    {
+      segment = NULL;
+    }
+    return made;
+  }
+
+private:
+
+  void write()
+  {
+    size_t bytes = buffered * sizeof( cold_t );
+    size_t done = 0;
+    while ( ok && done < bytes )
+    {
+      ssize_t wrote = ::write( segment->fd, (char*)buffer + done,
+                               bytes - done );
+      if ( wrote < 0 && errno == EINTR )
+      {
+        continue;
+      }
+      ok = wrote > 0;
+      done += ok ? wrote : 0;
+    }
+    buffered = 0;
+  }
+
+  Segment* segment;
+  cold_t buffer[ TIER_BLOCK * TIER_WRITE_BLOCKS ];
+  size_t buffered;
+  bool ok;
+};
+
+static bool byId( const cold_t& one, const cold_t& other )
+{
+  return one.id < other.id;
+}
+
+TierStats::TierStats()
+  : segments( 0 ),
+    records( 0 ),
+    diskBytes( 0 ),
+    memoryBytes( 0 ),
+    spilled( 0 ),
+    hits( 0 ),
+    rejected( 0 ),
+    reads( 0 ),
+    falsePositives( 0 ),
+    compactions( 0 ),
+    failures( 0 )
+{
+}
+
+void TierStats::add( const TierStats& other )
+{
+  segments += other.segments;
+  records += other.records;
+  diskBytes += other.diskBytes;
+  memoryBytes += other.memoryBytes;
+  spilled += other.spilled;
+  hits += other.hits;
+  rejected += other.rejected;
+  reads += other.reads;
+  falsePositives += other.falsePositives;
+  compactions += other.compactions;
+  failures += other.failures;
+}
+
+Tier::Tier()
+  : mutex( "tier" ),
+    written( 0 )
+{
+}
+
+Tier::~Tier()
+{
+  for ( size_t i = 0; i < segments.size(); i++ )
+  {
+    closeSegment( segments[i] );
+  }
+}
+
+void Tier::open( const char* path )
+{
+  directory = path;
+}
+
+void Tier::spill( const record_t& rec, unsigned int expires,
+                  unsigned short version )
+{
+  cold_t cold;
+  cold.id = rec.id;
+  cold.age = rec.age;
+  cold.expires = expires;
+  cold.version = version;
+  cold.flags = 0;
+  memcpy( cold.name, rec.name, MAX_LEN );
+
+  mutex.lock();
+  spilled[ rec.id ] = cold;
+  counters.spilled++;
+  mutex.unlock();
+}
+
+void Tier::bury( int id )
+{
+  cold_t cold;
+  memset( &cold, 0, sizeof( cold ) );
+  cold.id = id;
+  cold.flags = COLD_DELETED;
+
+  mutex.lock();
+  spilled[ id ] = cold;
+  mutex.unlock();
+}
+
+int Tier::find( int id, cold_t& cold, TierLookup& lookup )
+{
+  mutex.lock();
+  int found = 0;
+
+  // Anything in memory is newer than what any segment holds
+  std::map< int, cold_t >::const_iterator it = spilled.find( id );
+  if ( it != spilled.end() )
+  {
+    cold = it->second;
+    found = 1;
+  }
+
+  if ( 0 == found && not flushing.empty() )
+  {
+    cold_t key;
+    key.id = id;
+    std::vector< cold_t >::const_iterator at =
+      std::lower_bound( flushing.begin(), flushing.end(), key, byId );
+    if ( at != flushing.end() && at->id == id )
+    {
+      cold = *at;
+      found = 1;
+    }
+  }
+
+  if ( 0 == found && lookup.done && lookup.written == written )
+  {
+    // Nothing newer was written while the segments were read
+    cold = lookup.cold;
+    found = lookup.found ? 1 : 0;
+  }
+  else if ( 0 == found )
+  {
+    lookup.count = 0;
+    lookup.written = written;
+    lookup.done = false;
+    for ( size_t i = 0; i < segments.size(); i++ )
+    {
+      if ( ::mayHold( *segments[i], id ) )
+      {
+        segments[i]->readers++;
+        lookup.segments[ lookup.count++ ] = segments[i];
+      }
+    }
+    found = lookup.count > 0 ? -1 : 0;
+    if ( 0 == found )
+    {
+      counters.rejected++;
+    }
+  }
+
+  if ( found > 0 )
+  {
+    counters.hits++;
+  }
+  mutex.unlock();
+
+  return found;
+}
+
+void Tier::read( int id, TierLookup& lookup )
+{
+  unsigned long reads = 0;
+  unsigned long failures = 0;
+  unsigned long falsePositives = 0;
+
+  lookup.found = false;
+  for ( int i = 0; not lookup.found && i < lookup.count; i++ )
+  {
+    const Segment& segment = *lookup.segments[i];
+
+    // The block is the last whose first id is no greater
+    size_t index = std::upper_bound( segment.firsts.begin(),
+                                     segment.firsts.end(), id )
+                   - segment.firsts.begin() - 1;
+
+    cold_t block[ TIER_BLOCK ];
+    long got = readRecords( segment, index * TIER_BLOCK, block, TIER_BLOCK );
+    reads++;
+    if ( got < 0 )
+    {
+      failures++;
+      continue;
+    }
+
+    cold_t key;
+    key.id = id;
+    cold_t* at = std::lower_bound( block, block + got, key, byId );
+    if ( at != block + got && at->id == id )
+    {
+      lookup.cold = *at;
+      lookup.found = true;
+    }
+    else
+    {
+      falsePositives++;
+    }
+  }
+  lookup.done = true;
+
+  // Close any segment merged away while it was being read
+  Segment* closing[ TIER_MAX_SEGMENTS ];
+  int closed = 0;
+
+  mutex.lock();
+  counters.reads += reads;
+  counters.failures += failures;
+  counters.falsePositives += falsePositives;
+  for ( int i = 0; i < lookup.count; i++ )
+  {
+    Segment* segment = lookup.segments[i];
+    if ( 0 == --segment->readers && segment->retired )
+    {
+      closing[ closed++ ] = segment;
+    }
+  }
+  mutex.unlock();
+
+  lookup.count = 0;
+  for ( int i = 0; i < closed; i++ )
+  {
+    closeSegment( closing[i] );
+  }
+}
+
+bool Tier::mayHold( int id )
+{
+  mutex.lock();
+  cold_t key;
+  key.id = id;
+  bool may = spilled.count( id ) > 0
+             || std::binary_search( flushing.begin(), flushing.end(), key,
+                                    byId );
+  for ( size_t i = 0; not may && i < segments.size(); i++ )
+  {
+    may = ::mayHold( *segments[i], id );
+  }
+  mutex.unlock();
+
+  return may;
+}
+
+/**
+ * Write the spilled records out as the newest segment, once there
+ * are enough of them.
+ *
+ * @return True if a segment was written.
+ */
+bool Tier::flush()
+{
+  mutex.lock();
+  bool due = spilled.size() >= TIER_SPILL
+             && segments.size() < TIER_MAX_SEGMENTS;
+  if ( due )
+  {
+    // Still found by lookups while being written, which see the map
+    // first as it holds anything spilled since
+    flushing.reserve( spilled.size() );
+    for ( std::map< int, cold_t >::const_iterator it = spilled.begin();
+          it != spilled.end(); ++it )
+    {
+      flushing.push_back( it->second );
+    }
+    spilled.clear();
+  }
+  mutex.unlock();
+
+  if ( not due )
+  {
+    return false;
+  }
+
+  SegmentBuilder builder( directory, flushing.size(), 0 );
+  for ( size_t i = 0; i < flushing.size(); i++ )
+  {
+    builder.add( flushing[i] );
+  }
+  Segment* made = builder.finish();
+
+  mutex.lock();
+  if ( NULL != made )
+  {
+    segments.insert( segments.begin(), made );
+    written++;
+  }
+  else
+  {
+    // Keep them in memory, behind whatever has been spilled since
+    for ( size_t i = 0; i < flushing.size(); i++ )
+    {
+      spilled.insert( std::make_pair( flushing[i].id, flushing[i] ) );
+    }
+    counters.failures++;
+  }
+  std::vector< cold_t >().swap( flushing );
+  mutex.unlock();
+
+  return NULL != made;
+}
+
+/**
+ * Merge the segments of the smallest size which has TIER_FANIN or
+ * more. Segments of a size are always next to each other, newer ones
+ * being smaller, and the merged segment takes their place.
+ *
+ * @return True if segments were merged.
+ */
+bool Tier::compact( unsigned int now )
+{
+  // Only this thread adds or removes segments, so they may be read
+  // without the lock, which is only needed to change the list
+  mutex.lock();
+  std::vector< Segment* > current( segments );
+  mutex.unlock();
+
+  size_t first = 0;
+  size_t last = 0;
+  for ( size_t i = 0; i < current.size(); i = last )
+  {
+    first = i;
+    last = i + 1;
+    while ( last < current.size()
+            && current[ last ]->level == current[ first ]->level )
+    {
+      last++;
+    }
+    if ( last - first >= TIER_FANIN )
+    {
+      break;
+    }
+  }
+  if ( last - first < TIER_FANIN )
+  {
+    return false;
+  }
+
+  // An expired or deleted record still hides older copies, unless
+  // there are none
+  bool oldest = last == current.size();
+
+  size_t expected = 0;
+  for ( size_t i = first; i < last; i++ )
+  {
+    expected += current[i]->count;
+  }
+
+  TierCursor cursor( &current[ first ], last - first );
+  SegmentBuilder builder( directory, expected, current[ first ]->level + 1 );
+  cold_t cold;
+  while ( cursor.next( cold ) )
+  {
+    bool dead = ( cold.flags & COLD_DELETED )
+                || ( 0 != cold.expires && cold.expires <= now );
+    if ( not oldest || not dead )
+    {
+      builder.add( cold );
+    }
+  }
+  Segment* made = cursor.failed() ? NULL : builder.finish();
+
+  mutex.lock();
+  if ( NULL == made )
+  {
+    counters.failures++;
+    mutex.unlock();
+    return false;
+  }
+
+  segments.erase( segments.begin() + first, segments.begin() + last );
+  if ( made->count > 0 )
+  {
+    segments.insert( segments.begin() + first, made );
+  }
+  counters.compactions++;
+
+  // A segment a lookup is still reading is closed by the lookup
+  std::vector< Segment* > closing;
+  for ( size_t i = first; i < last; i++ )
+  {
+    current[i]->retired = true;
+    if ( 0 == current[i]->readers )
+    {
+      closing.push_back( current[i] );
+    }
+  }
+  mutex.unlock();
+
+  if ( 0 == made->count )
+  {
+    closeSegment( made );
+  }
+  for ( size_t i = 0; i < closing.size(); i++ )
+  {
+    closeSegment( closing[i] );
+  }
+  return true;
+}
+
+void Tier::maintain( unsigned int now )
+{
+  if ( directory.empty() )
+  {
+    return;
+  }
+
+  flush();
+  while ( compact( now ) )
+  {
+  }
+}
+
+void Tier::stats( TierStats& total )
+{
+  mutex.lock();
+  TierStats mine = counters;
+  mine.segments = segments.size();
+  mine.memoryBytes = ( spilled.size() + flushing.size() )
+                     * ( sizeof( cold_t ) + 4 * sizeof( void* ) );
+  for ( size_t i = 0; i < segments.size(); i++ )
+  {
+    mine.records += segments[i]->count;
+    mine.memoryBytes += sizeof( Segment )
+                        + segments[i]->firsts.size() * sizeof( int )
+                        + segments[i]->bloom.size() * sizeof( uint32_t );
+  }
+  mine.diskBytes = mine.records * sizeof( cold_t );
+  mutex.unlock();
+
+  total.add( mine );
+}
+
+TierCursor::TierCursor( Tier& tier )
+  : count( 0 ),
+    broken( false )
+{
+  Run& spilled = runs[ count++ ];
+  spilled.segment = NULL;
+  spilled.array = NULL;
+  spilled.at = tier.spilled.begin();
+  spilled.end = tier.spilled.end();
+  start( spilled );
+
+  Run& flushing = runs[ count++ ];
+  flushing.segment = NULL;
+  flushing.array = tier.flushing.empty() ? NULL : &tier.flushing[0];
+  flushing.size = tier.flushing.size();
+  flushing.at = flushing.end = tier.spilled.end();
+  start( flushing );
+
+  for ( size_t i = 0; i < tier.segments.size(); i++ )
+  {
+    Run& run = runs[ count++ ];
+    run.segment = tier.segments[i];
+    start( run );
+  }
+}
+
+TierCursor::TierCursor( Segment* const* segments, int number )
+  : count( 0 ),
+    broken( false )
+{
+  for ( int i = 0; i < number && i < TIER_MAX_SEGMENTS; i++ )
+  {
+    Run& run = runs[ count++ ];
+    run.segment = segments[i];
+    start( run );
+  }
+}
+
+void TierCursor::start( Run& run )
+{
+  run.next = 0;
+  run.inBlock = 0;
+  run.blockSize = 0;
+  run.live = true;
+  advance( run );
+}
+
+void TierCursor::advance( Run& run )
+{
+  if ( NULL != run.segment )
+  {
+    if ( run.inBlock == run.blockSize )
+    {
+      long got = readRecords( *run.segment, run.next, run.block, TIER_BLOCK );
+      if ( got <= 0 )
+      {
+        broken = broken || got < 0;
+        run.live = false;
+        return;
+      }
+      run.next += got;
+      run.inBlock = 0;
+      run.blockSize = got;
+    }
+    run.head = run.block[ run.inBlock++ ];
+  }
+  else if ( NULL != run.array )
+  {
+    if ( run.next == run.size )
+    {
+      run.live = false;
+      return;
+    }
+    run.head = run.array[ run.next++ ];
+  }
+  else
+  {
+    if ( run.at == run.end )
+    {
+      run.live = false;
+      return;
+    }
+    run.head = run.at->second;
+    ++run.at;
+  }
+}
+
+bool TierCursor::next( cold_t& cold )
+{
+  // The newest run holding the lowest id wins, older copies are passed
+  int lowest = -1;
+  for ( int i = 0; i < count; i++ )
+  {
+    if ( runs[i].live
+         && ( lowest < 0 || runs[i].head.id < runs[ lowest ].head.id ) )
+    {
+      lowest = i;
+    }
+  }
+  if ( lowest < 0 || broken )
+  {
+    return false;
+  }
+
+  cold = runs[ lowest ].head;
+  for ( int i = lowest; i < count; i++ )
+  {
+    while ( runs[i].live && runs[i].head.id == cold.id )
+    {
+      advance( runs[i] );
+    }
+  }
+  return true;
+}
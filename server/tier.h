@@ -0,0 +1,311 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: A cold tier for one shard of the store, so a store
+ * with a memory limit moves the records its CLOCK hand evicts to disk
+ * instead of dropping them.
+ *
+ * Evicted records gather in memory until there are enough to write
+ * out as a segment, a file of records sorted by id in fixed size
+ * blocks. A segment is never changed once written. For each one the
+ * tier keeps the first id of every block, a sparse index, and a Bloom
+ * filter of every id in it, so an id no segment holds is turned away
+ * without touching the disk, and one a segment does hold is read with
+ * a single block read. Segments are merged in the background, four of
+ * the same size at a time, the newest copy of a record winning, so a
+ * lookup only ever has a few to look through.
+ *
+ * A lookup is split so no lock is held across a read from disk: the
+ * tier picks the segments which may hold the id with the shard locked,
+ * the shard's lock is let go while their blocks are read, and the
+ * tier is asked again once it is taken back, answering from what was
+ * read unless a segment was written meanwhile.
+ *
+ * Segment files are removed as soon as they are opened and live only
+ * as long as the process, which reaches them through their descriptors,
+ * so a crash leaves nothing behind. Records outlive a restart through
+ * snapshots, which include the tier.
+ */
+
+#ifndef _TIER_H_
+#define _TIER_H_
+
+#include <map>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "trace.h"
+
+// Records gathered in memory before they are written as a segment
+#define TIER_SPILL 1024
+
+// Records per block, the most one lookup reads
+#define TIER_BLOCK 64
+
+// Bits of Bloom filter per record, and bits probed per lookup, for
+// about one false positive in a hundred
+#define TIER_BLOOM_BITS 10
+#define TIER_BLOOM_PROBES 7
+
+// Segments of a size merged at once, and the most a tier holds
+#define TIER_FANIN 4
+#define TIER_MAX_SEGMENTS 32
+
+// Bits of cold_t::flags
+#define COLD_DELETED 0x01   // Hides older copies of a deleted record
+
+/**
+ * A record as kept on disk.
+ */
+typedef struct
+{
+  int id;
+  int age;
+  unsigned int expires;   // Store clock second it expires, 0 never
+  unsigned short version;
+  unsigned short flags;
+  char name[ MAX_LEN ];
+} cold_t;
+
+/**
+ * Copy a cold record back out, in the form sent on the wire.
+ *
+ * @param[in] cold - The record as kept on disk.
+ * @param[out] rec - The record, its name zero padded.
+ */
+inline void unpackCold( const cold_t& cold, record_t& rec )
+{
+  memset( &rec, 0, sizeof( rec ) );
+  rec.id = cold.id;
+  rec.age = cold.age;
+  memcpy( rec.name, cold.name, MAX_LEN );
+}
+
+/**
+ * A segment file, see tier.cpp.
+ */
+struct Segment;
+
+/**
+ * Statistics summed over tiers.
+ */
+struct TierStats
+{
+  size_t segments;
+  size_t records;         // On disk, older copies included
+  size_t diskBytes;
+  size_t memoryBytes;     // Filters, indexes and records not yet written
+  unsigned long spilled;
+  unsigned long hits;     // Lookups answered by the tier
+  unsigned long rejected; // Lookups the tier turned away without a read
+  unsigned long reads;
+  unsigned long falsePositives;
+  unsigned long compactions;
+  unsigned long failures; // Segments which could not be written or read
+
+  TierStats();
+  void add( const TierStats& other );
+};
+
+/**
+ * The segments a lookup is to read, and what it found in them, see
+ * Tier::find().
+ */
+struct TierLookup
+{
+  Segment* segments[ TIER_MAX_SEGMENTS ];  // Held on to, newest first
+  int count;
+  uint64_t written;   // Segments the tier had written when picked
+  bool done;          // True once read() has read them
+  bool found;
+  cold_t cold;
+
+  TierLookup() : count( 0 ), written( 0 ), done( false ), found( false ) {}
+};
+
+/**
+ * One shard's cold records. Spilling and looking up are called with
+ * the shard's lock held, reading a lookup's segments without it, and
+ * maintain() by a single background thread without it.
+ */
+class Tier
+{
+public:
+
+  Tier();
+  ~Tier();
+
+  /**
+   * Start keeping records spilled to the tier, writing segments to
+   * the given directory. Must be called before the tier is used.
+   *
+   * @param[in] directory - Where segment files are made.
+   */
+  void open( const char* directory );
+
+  /**
+   * Keep a record evicted from memory.
+   *
+   * @param[in] rec - The record.
+   * @param[in] expires - The store clock second it expires, 0 never.
+   * @param[in] version - Its version.
+   */
+  void spill( const record_t& rec, unsigned int expires,
+              unsigned short version );
+
+  /**
+   * Keep a marker that a record was deleted, which hides any older
+   * copy until the oldest segment is merged and both are dropped.
+   *
+   * @param[in] id - The record's id.
+   */
+  void bury( int id );
+
+  /**
+   * Find the newest copy of a record, which may have expired or be
+   * the marker of its deletion, without reading the disk. If only a
+   * segment may hold it, the segments which may are held on to and
+   * left for read(), after which find() is called again.
+   *
+   * @param[in] id - The id to look for.
+   * @param[out] cold - The record, if found.
+   * @param[in,out] lookup - The segments to read, see TierLookup.
+   *
+   * @return 1 if the tier holds the id, 0 if it does not, or -1 if
+   * the lookup's segments must be read to tell.
+   */
+  int find( int id, cold_t& cold, TierLookup& lookup );
+
+  /**
+   * Read the blocks of a lookup's segments which may hold an id,
+   * newest first, without holding the shard's lock or the tier's
+   * while reading, then let the segments go.
+   *
+   * @param[in] id - The id to look for.
+   * @param[in,out] lookup - The segments find() held on to.
+   */
+  void read( int id, TierLookup& lookup );
+
+  /**
+   * @return False if the tier surely holds no copy of an id, telling
+   * without reading the disk, though sometimes wrongly true.
+   */
+  bool mayHold( int id );
+
+  /**
+   * Write out spilled records once there are enough of them, then
+   * merge segments until no size has too many.
+   *
+   * @param[in] now - The store clock, so the oldest records merged
+   * may be dropped once expired.
+   */
+  void maintain( unsigned int now );
+
+  /**
+   * Hold every other user off, so a TierCursor may walk the whole
+   * tier, or the process may be forked with the tier consistent.
+   */
+  void lock() { mutex.lock(); }
+  void unlock() { mutex.unlock(); }
+
+  /**
+   * Add the tier's statistics to a total.
+   *
+   * @param[in,out] total - The total.
+   */
+  void stats( TierStats& total );
+
+private:
+
+  friend class TierCursor;
+
+  bool flush();
+  bool compact( unsigned int now );
+
+  ProfiledMutex mutex;
+  std::string directory;            // Empty while the tier is unused
+
+  std::map< int, cold_t > spilled;  // Not yet being written
+  std::vector< cold_t > flushing;   // Being written, sorted by id
+  std::vector< Segment* > segments; // Newest first
+  uint64_t written;                 // Segments flushed, see TierLookup
+
+  TierStats counters;
+
+  // Not copyable
+  Tier( const Tier& );
+  Tier& operator=( const Tier& );
+};
+
+/**
+ * Walks records in id order, giving the newest copy of each id once.
+ * It never allocates, so it is safe in the child of a multithreaded
+ * fork, which is why it is sized for the most segments a tier holds.
+ */
+class TierCursor
+{
+public:
+
+  /**
+   * Walk every record a tier holds. The tier must be locked, or be an
+   * image in the child of a fork, for as long as the cursor is used.
+   *
+   * @param[in] tier - The tier.
+   */
+  TierCursor( Tier& tier );
+
+  /**
+   * Walk the records of some segments, newest first, which only the
+   * caller may remove.
+   *
+   * @param[in] segments - The segments.
+   * @param[in] count - The number of segments.
+   */
+  TierCursor( Segment* const* segments, int count );
+
+  /**
+   * @param[out] cold - The record with the next lowest id.
+   *
+   * @return False once every record has been walked, or a segment
+   * could not be read.
+   */
+  bool next( cold_t& cold );
+
+  /**
+   * @return True if a segment could not be read, so the walk ended
+   * early.
+   */
+  bool failed() const { return broken; }
+
+private:
+
+  // A source of records sorted by id
+  struct Run
+  {
+    const Segment* segment;
+    std::map< int, cold_t >::const_iterator at;
+    std::map< int, cold_t >::const_iterator end;
+    const cold_t* array;
+    size_t size;
+    size_t next;              // Of the segment or array
+    cold_t block[ TIER_BLOCK ];
+    size_t inBlock;
+    size_t blockSize;
+    cold_t head;
+    bool live;
+  };
+
+  void start( Run& run );
+  void advance( Run& run );
+
+  Run runs[ TIER_MAX_SEGMENTS + 2 ];
+  int count;
+  bool broken;
+};
+
+#endif // _TIER_H_
@@ -0,0 +1,117 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the timer wheel, see timerwheel.h
+ * for more details.
+ */
+
+#include "timerwheel.h"
+
+#include <time.h>
+
+TimerWheel::TimerWheel( unsigned int milliseconds )
+  : tick( milliseconds > 0 ? milliseconds : 1 ),
+    current( clock() / tick ),
+    count( 0 )
+{
+  for ( int i = 0; i < WHEEL_SLOTS; i++ )
+  {
+    slots[i].prev = slots[i].next = &slots[i];
+  }
+}
+
+void TimerWheel::init( Timer* timer, void* data )
+{
+  timer->prev = timer->next = NULL;
+  timer->due = 0;
+  timer->data = data;
+}
+
+void TimerWheel::start( Timer* timer, uint64_t now, uint64_t delay )
+{
+  stop( timer );
+
+  // Rounded up, so a timer never fires early
+  timer->due = ( now + delay + tick - 1 ) / tick;
+  if ( timer->due < current )
+  {
+    timer->due = current;
+  }
+
+  Timer* slot = &slots[ timer->due % WHEEL_SLOTS ];
+  timer->prev = slot->prev;
+  timer->next = slot;
+  slot->prev->next = timer;
+  slot->prev = timer;
+  count++;
+}
+
+void TimerWheel::stop( Timer* timer )
+{
+  if ( not running( timer ) )
+  {
+    return;
+  }
+
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = NULL;
+  count--;
+}
+
+TimerWheel::Timer* TimerWheel::expire( uint64_t now )
+{
+  uint64_t target = now / tick;
+  Timer* expired = NULL;
+
+  //
+  // Each slot need only be looked at once however many ticks have
+  // passed, as every timer in it is checked against the target
+  //
+  uint64_t ticks = target >= current ? target - current + 1 : 0;
+  if ( ticks > WHEEL_SLOTS )
+  {
+    ticks = WHEEL_SLOTS;
+  }
+
+  for ( uint64_t i = 0; i < ticks && count > 0; i++ )
+  {
+    Timer* slot = &slots[ ( current + i ) % WHEEL_SLOTS ];
+    Timer* timer = slot->next;
+    while ( timer != slot )
+    {
+      Timer* next = timer->next;
+      if ( timer->due <= target )
+      {
+        stop( timer );
+        timer->next = expired;
+        expired = timer;
+      }
+      timer = next;
+    }
+  }
+
+  if ( target >= current )
+  {
+    current = target + 1;
+  }
+  return expired;
+}
+
+int TimerWheel::wait( uint64_t now ) const
+{
+  if ( 0 == count )
+  {
+    return -1;
+  }
+
+  uint64_t next = current * tick;
+  return next > now ? (int)( next - now ) : 0;
+}
+
+uint64_t TimerWheel::clock()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,113 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: A hashed timer wheel, used to close connections which
+ * have been idle too long. Starting, stopping and restarting a timer
+ * take constant time however many are running, so a connection's
+ * timer can be pushed back on every request it sends. Timers fire on
+ * a tick, never early and at most a tick late.
+ */
+
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Slots around the wheel, timers further off than this many ticks
+// share a slot with nearer ones and are passed over until due
+#define WHEEL_SLOTS 256
+
+/**
+ * A wheel of timers, for use by a single thread.
+ */
+class TimerWheel
+{
+public:
+
+  /**
+   * A timer, kept in whatever it times so that running one never
+   * allocates. A timer must be stopped before it is freed.
+   */
+  struct Timer
+  {
+    Timer* prev;            // NULL while the timer is not running
+    Timer* next;
+    uint64_t due;           // The tick it fires on
+    void* data;             // Whatever the timer times
+  };
+
+  /**
+   * @param[in] milliseconds - Time between ticks.
+   */
+  TimerWheel( unsigned int milliseconds );
+
+  /**
+   * Get a timer ready for use, not running.
+   *
+   * @param[in] timer - The timer.
+   * @param[in] data - Whatever it times.
+   */
+  static void init( Timer* timer, void* data );
+
+  /**
+   * Start a timer, or restart it if it is already running.
+   *
+   * @param[in] timer - The timer.
+   * @param[in] now - The time, see clock().
+   * @param[in] delay - Milliseconds until it fires.
+   */
+  void start( Timer* timer, uint64_t now, uint64_t delay );
+
+  /**
+   * Stop a timer if it is running.
+   *
+   * @param[in] timer - The timer.
+   */
+  void stop( Timer* timer );
+
+  /**
+   * @return True if the timer is running.
+   */
+  static bool running( const Timer* timer ) { return NULL != timer->prev; }
+
+  /**
+   * Stop every timer which has come due.
+   *
+   * @param[in] now - The time, see clock().
+   *
+   * @return The timers stopped, chained through 'next', NULL if none.
+   */
+  Timer* expire( uint64_t now );
+
+  /**
+   * @param[in] now - The time, see clock().
+   *
+   * @return Milliseconds until the next tick, when a timer may come
+   * due, or -1 if no timer is running.
+   */
+  int wait( uint64_t now ) const;
+
+  /**
+   * @return The timers running.
+   */
+  size_t size() const { return count; }
+
+  /**
+   * @return Milliseconds since some time in the past, never going back.
+   */
+  static uint64_t clock();
+
+private:
+
+  unsigned int tick;
+  uint64_t current;         // The next tick to fire timers for
+  size_t count;
+  Timer slots[ WHEEL_SLOTS ];   // Each heads a circular list
+
+  // Not copyable
+  TimerWheel( const TimerWheel& );
+  TimerWheel& operator=( const TimerWheel& );
+};
+
+#endif // _TIMERWHEEL_H_
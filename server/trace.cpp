@@ -0,0 +1,312 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of request tracing and mutex
+ * profiling, see trace.h for more details.
+ */
+
+#include "trace.h"
+
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes of formatted events buffered before writing to the file
+#define TRACE_BUFFER ( 64 * 1024 )
+
+// Room needed to format a single event
+#define TRACE_EVENT_TEXT 256
+
+__thread RequestTrace* RequestTrace::active = NULL;
+
+// Trace one request in 'traceEvery', or none when 0
+static volatile int traceEvery = 0;
+
+// Clock ticks per microsecond, and the clock at startup
+static double ticksPerMicro = 1000.0;
+static uint64_t traceBase = 0;
+
+// Formatted events waiting to be written, guarded by traceMutex
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static const char* tracePath = NULL;
+static FILE* traceFile = NULL;
+static char traceBuffer[ TRACE_BUFFER ];
+static size_t traceUsed = 0;
+
+/**
+ * @return The monotonic clock in nanoseconds.
+ */
+static uint64_t monotonicNanos()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+uint64_t traceClock()
+{
+#if defined( __i386__ ) || defined( __x86_64__ )
+  uint32_t low, high;
+  __asm__ __volatile__ ( "rdtsc" : "=a" ( low ), "=d" ( high ) );
+  return ( (uint64_t)high << 32 ) | low;
+#else
+  return monotonicNanos();
+#endif
+}
+
+void traceInit( const char* path )
+{
+#if defined( __i386__ ) || defined( __x86_64__ )
+  //
+  // Measure the time stamp counter against the monotonic clock
+  //
+  uint64_t nanos = monotonicNanos();
+  uint64_t ticks = traceClock();
+  usleep( 20000 );
+  ticksPerMicro = ( traceClock() - ticks ) * 1000.0
+                  / ( monotonicNanos() - nanos );
+#endif
+  traceBase = traceClock();
+  tracePath = path;
+}
+
+/**
+ * Open the trace file if it is not already, with traceMutex held.
+ *
+ * @return False if the file could not be opened.
+ */
+static bool openLocked()
+{
+  if ( NULL == traceFile && NULL != tracePath )
+  {
+    traceFile = fopen( tracePath, "a" );
+
+    // A Chrome trace is an array of events, which may be left open
+    if ( NULL != traceFile && ftell( traceFile ) == 0 )
+    {
+      fputs( "[\n", traceFile );
+    }
+  }
+  return NULL != traceFile;
+}
+
+/**
+ * Write the buffered events to the file, with traceMutex held.
+ */
+static void flushLocked()
+{
+  if ( NULL != traceFile && traceUsed > 0 )
+  {
+    fwrite( traceBuffer, 1, traceUsed, traceFile );
+    fflush( traceFile );
+  }
+  traceUsed = 0;
+}
+
+void traceFlush()
+{
+  pthread_mutex_lock( &traceMutex );
+  flushLocked();
+  pthread_mutex_unlock( &traceMutex );
+}
+
+int traceSampling( int every )
+{
+  pthread_mutex_lock( &traceMutex );
+
+  int previous = traceEvery;
+  if ( every > 0 && not openLocked() )
+  {
+    previous = -1;
+  }
+  else
+  {
+    traceEvery = every < 0 ? 0 : every;
+    flushLocked();
+  }
+
+  pthread_mutex_unlock( &traceMutex );
+  return previous;
+}
+
+bool RequestTrace::sample( int& countdown )
+{
+  int every = traceEvery;
+  if ( every == 0 )
+  {
+    return false;
+  }
+  if ( countdown > every )
+  {
+    countdown = every;
+  }
+  if ( --countdown > 0 )
+  {
+    return false;
+  }
+  countdown = every;
+  return true;
+}
+
+RequestTrace::RequestTrace( int thread, int command, int id )
+  : thread( thread ),
+    command( command ),
+    id( id ),
+    start( traceClock() ),
+    count( 0 )
+{
+  active = this;
+}
+
+void RequestTrace::record( const char* name, uint64_t begin, uint64_t end,
+                           const char* category )
+{
+  if ( count < TRACE_EVENTS )
+  {
+    events[count].name = name;
+    events[count].category = category;
+    events[count].begin = begin;
+    events[count].end = end;
+    count++;
+  }
+}
+
+RequestTrace::~RequestTrace()
+{
+  active = NULL;
+  record( "request", start, traceClock(), "request" );
+
+  pthread_mutex_lock( &traceMutex );
+  for ( int i = 0; i < count; i++ )
+  {
+    if ( traceUsed + TRACE_EVENT_TEXT > TRACE_BUFFER )
+    {
+      flushLocked();
+    }
+
+    const Event& event = events[i];
+    traceUsed += snprintf( traceBuffer + traceUsed, TRACE_EVENT_TEXT,
+        "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"command\":%d,\"id\":%d}},\n",
+        event.name, event.category, thread,
+        ( event.begin - traceBase ) / ticksPerMicro,
+        ( event.end - event.begin ) / ticksPerMicro,
+        command, id );
+  }
+  pthread_mutex_unlock( &traceMutex );
+}
+
+ProfiledMutex* ProfiledMutex::mutexes = NULL;
+pthread_mutex_t ProfiledMutex::mutexesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+ProfiledMutex::ProfiledMutex( const char* name )
+  : name( name ),
+    holder( NULL ),
+    acquiredAt( 0 ),
+    acquisitions( 0 ),
+    contended( 0 ),
+    waitTicks( 0 ),
+    holdTicks( 0 )
+{
+  pthread_mutex_init( &mutex, NULL );
+
+  pthread_mutex_lock( &mutexesMutex );
+  nextMutex = mutexes;
+  mutexes = this;
+  pthread_mutex_unlock( &mutexesMutex );
+}
+
+ProfiledMutex::~ProfiledMutex()
+{
+  pthread_mutex_lock( &mutexesMutex );
+  ProfiledMutex** link = &mutexes;
+  while ( *link != this )
+  {
+    link = &( *link )->nextMutex;
+  }
+  *link = nextMutex;
+  pthread_mutex_unlock( &mutexesMutex );
+
+  pthread_mutex_destroy( &mutex );
+}
+
+void ProfiledMutex::lock()
+{
+  RequestTrace* trace = RequestTrace::current();
+
+  //
+  // An uncontended lock costs no more than before, only a sampled
+  // request that has to wait reads the clock.
+  //
+  bool waited = pthread_mutex_trylock( &mutex ) != 0;
+  if ( waited )
+  {
+    uint64_t begin = NULL != trace ? traceClock() : 0;
+    pthread_mutex_lock( &mutex );
+
+    if ( NULL != trace )
+    {
+      uint64_t end = traceClock();
+      waitTicks += end - begin;
+      trace->record( name, begin, end, "lock_wait" );
+    }
+    contended++;
+  }
+
+  acquisitions++;
+  holder = trace;
+  acquiredAt = NULL != trace ? traceClock() : 0;
+}
+
+void ProfiledMutex::unlock()
+{
+  if ( NULL != holder )
+  {
+    uint64_t end = traceClock();
+    holdTicks += end - acquiredAt;
+    holder->record( name, acquiredAt, end, "lock_hold" );
+    holder = NULL;
+  }
+  pthread_mutex_unlock( &mutex );
+}
+
+/**
+ * Profile of every mutex sharing a name, summed for reporting.
+ */
+struct MutexTotals
+{
+  unsigned long acquisitions;
+  unsigned long contended;
+  uint64_t waitTicks;
+  uint64_t holdTicks;
+};
+
+void ProfiledMutex::report( std::ostream& out )
+{
+  typedef std::map<std::string, MutexTotals> totals_t;
+  totals_t totals;
+
+  pthread_mutex_lock( &mutexesMutex );
+  for ( ProfiledMutex* mutex = mutexes; mutex != NULL; mutex = mutex->nextMutex )
+  {
+    MutexTotals& sum = totals[ mutex->name ];
+    sum.acquisitions += mutex->acquisitions;
+    sum.contended += mutex->contended;
+    sum.waitTicks += mutex->waitTicks;
+    sum.holdTicks += mutex->holdTicks;
+  }
+  pthread_mutex_unlock( &mutexesMutex );
+
+  for ( totals_t::iterator it = totals.begin(); it != totals.end(); ++it )
+  {
+    out << "mutex_" << it->first
+        << " acquired " << it->second.acquisitions
+        << " contended " << it->second.contended
+        << " sampled_wait_us " << (uint64_t)( it->second.waitTicks / ticksPerMicro )
+        << " sampled_hold_us " << (uint64_t)( it->second.holdTicks / ticksPerMicro )
+        << "\n";
+  }
+}
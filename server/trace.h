@@ -0,0 +1,202 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Sampled per-request tracing and mutex contention
+ * profiling. A sampled request records when each of its stages
+ * began and ended, including time spent waiting for and holding
+ * locks, and is appended to a Chrome trace (chrome://tracing) file.
+ * Requests which are not sampled only pay for a counter check.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <ostream>
+
+#include <pthread.h>
+
+// Most events a single sampled request can record
+#define TRACE_EVENTS 16
+
+/**
+ * @return The current time in clock ticks, from the time stamp
+ * counter where available and the monotonic clock otherwise.
+ */
+uint64_t traceClock();
+
+/**
+ * Calibrate the clock and name the file sampled requests go to,
+ * which is only opened once tracing is first enabled.
+ *
+ * @param[in] path - The trace file to append to.
+ */
+void traceInit( const char* path );
+
+/**
+ * Change how often requests are sampled, at runtime.
+ *
+ * @param[in] every - Trace one request in 'every', 0 disables tracing.
+ *
+ * @return The previous setting, or -1 if the trace file could not
+ * be opened.
+ */
+int traceSampling( int every );
+
+/**
+ * Write anything buffered out to the trace file.
+ */
+void traceFlush();
+
+/**
+ * The events recorded for one sampled request. It lives on the stack
+ * of the thread serving the request, and is the thread's current
+ * trace while that request is being served.
+ */
+class RequestTrace
+{
+public:
+
+  /**
+   * Decide whether the next request on this connection is sampled.
+   *
+   * @param[in,out] countdown - The connection's sampling countdown.
+   *
+   * @return True if the request should be traced.
+   */
+  static bool sample( int& countdown );
+
+  /**
+   * Start tracing a request and make it the thread's current trace.
+   *
+   * @param[in] thread - The number of the thread serving it.
+   * @param[in] command - The request's command.
+   * @param[in] id - The request's record id.
+   */
+  RequestTrace( int thread, int command, int id );
+
+  /**
+   * Stop tracing and queue the request's events for the trace file.
+   */
+  ~RequestTrace();
+
+  /**
+   * @return The thread's current trace, or NULL if not sampling.
+   */
+  static RequestTrace* current() { return active; }
+
+  /**
+   * Record that a stage ran between two clock readings.
+   *
+   * @param[in] name - The stage's name, which must be a literal.
+   * @param[in] begin - When the stage began.
+   * @param[in] end - When the stage ended.
+   * @param[in] category - The kind of stage, which must be a literal.
+   */
+  void record( const char* name, uint64_t begin, uint64_t end,
+               const char* category = "stage" );
+
+private:
+
+  struct Event
+  {
+    const char* name;
+    const char* category;
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  int thread;
+  int command;
+  int id;
+  uint64_t start;
+  int count;
+  Event events[ TRACE_EVENTS ];
+
+  static __thread RequestTrace* active;
+};
+
+/**
+ * Records a stage of the current request for as long as it is in
+ * scope, and costs nothing when the request is not being sampled.
+ */
+class TraceStage
+{
+public:
+
+  TraceStage( const char* name )
+    : name( name ),
+      trace( RequestTrace::current() ),
+      begin( trace != NULL ? traceClock() : 0 )
+  {
+  }
+
+  ~TraceStage()
+  {
+    if ( NULL != trace )
+    {
+      trace->record( name, begin, traceClock() );
+    }
+  }
+
+private:
+
+  const char* name;
+  RequestTrace* trace;
+  uint64_t begin;
+};
+
+/**
+ * A mutex which counts contended acquisitions, and for sampled
+ * requests measures how long it was waited for and held. Every
+ * profiled mutex registers itself so it can be reported by name.
+ */
+class ProfiledMutex
+{
+public:
+
+  /**
+   * @param[in] name - The name to report statistics under.
+   */
+  ProfiledMutex( const char* name );
+
+  /**
+   * Stop reporting the mutex, which must not be held.
+   */
+  ~ProfiledMutex();
+
+  void lock();
+  void unlock();
+
+  /**
+   * Write one line per mutex name, summed over every mutex sharing
+   * that name, to the stream.
+   *
+   * @param[in] out - The stream to write to.
+   */
+  static void report( std::ostream& out );
+
+private:
+
+  pthread_mutex_t mutex;
+  const char* name;
+  RequestTrace* holder;
+  uint64_t acquiredAt;
+
+  // Only updated with the mutex held
+  unsigned long acquisitions;
+  unsigned long contended;
+  uint64_t waitTicks;
+  uint64_t holdTicks;
+
+  // Registry of every profiled mutex, for reporting
+  ProfiledMutex* nextMutex;
+  static ProfiledMutex* mutexes;
+  static pthread_mutex_t mutexesMutex;
+
+  // Not copyable
+  ProfiledMutex( const ProfiledMutex& );
+  ProfiledMutex& operator=( const ProfiledMutex& );
+};
+
+#endif // _TRACE_H_
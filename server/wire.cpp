@@ -0,0 +1,91 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Implementation of the epochs records in wire form are
+ * freed by, see wire.h for more details.
+ */
+
+#include "wire.h"
+
+#include <string.h>
+
+WireEpochs::WireEpochs()
+  : epoch( 1 ),
+    highest( 0 )
+{
+  memset( slots, 0, sizeof( slots ) );
+}
+
+int WireEpochs::join()
+{
+  for ( int i = 0; i < WIRE_READERS; i++ )
+  {
+    int unused = 0;
+    if ( __atomic_compare_exchange_n( &slots[i].joined, &unused, 1, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) )
+    {
+      int seen = __atomic_load_n( &highest, __ATOMIC_RELAXED );
+      while ( seen < i + 1
+              && not __atomic_compare_exchange_n( &highest, &seen, i + 1,
+                                                  false, __ATOMIC_RELEASE,
+                                                  __ATOMIC_RELAXED ) )
+      {
+      }
+      return i;
+    }
+  }
+  return -1;
+}
+
+void WireEpochs::leave( int reader )
+{
+  __atomic_store_n( &slots[ reader ].joined, 0, __ATOMIC_RELEASE );
+}
+
+void WireEpochs::pin( int reader )
+{
+  Slot& slot = slots[ reader ];
+  if ( 0 == slot.epoch )
+  {
+    // Seen by anyone freeing a block this reader goes on to find, as
+    // both take the block's shard lock after
+    __atomic_store_n( &slot.epoch, current(), __ATOMIC_RELEASE );
+  }
+}
+
+void WireEpochs::unpin( int reader )
+{
+  // Everything sent from the blocks found is done with before
+  __atomic_store_n( &slots[ reader ].epoch, 0, __ATOMIC_RELEASE );
+}
+
+uint64_t WireEpochs::current() const
+{
+  return __atomic_load_n( &epoch, __ATOMIC_ACQUIRE );
+}
+
+uint64_t WireEpochs::oldest()
+{
+  uint64_t oldest = __atomic_add_fetch( &epoch, 1, __ATOMIC_ACQ_REL );
+  int readers = __atomic_load_n( &highest, __ATOMIC_ACQUIRE );
+  for ( int i = 0; i < readers; i++ )
+  {
+    uint64_t pinned = __atomic_load_n( &slots[i].epoch, __ATOMIC_ACQUIRE );
+    if ( 0 != pinned && pinned < oldest )
+    {
+      oldest = pinned;
+    }
+  }
+  return oldest;
+}
+
+int WireEpochs::pinned() const
+{
+  int count = 0;
+  int readers = __atomic_load_n( &highest, __ATOMIC_ACQUIRE );
+  for ( int i = 0; i < readers; i++ )
+  {
+    count += 0 != __atomic_load_n( &slots[i].epoch, __ATOMIC_RELAXED );
+  }
+  return count;
+}
@@ -0,0 +1,119 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Records kept in the very form they are sent in, for a
+ * store asked to, see StoreOptions::wire, so a response can be
+ * written straight from where each record is stored rather than from
+ * a copy of it. A record's wire form is a record_t answering
+ * RET_SUCCESS, in a block of its own. A block is never written to
+ * once made: a change makes a new one and retires the old.
+ *
+ * Retired blocks are only freed once no reader can still be sending
+ * them, which epochs tell. A reader pins the current epoch before it
+ * looks records up, and unpins once it has sent what it found, and a
+ * block retired in an epoch is freed once every pinned reader pinned
+ * a later one. Readers only find blocks, and blocks are only retired,
+ * with the shard's lock held, so a reader which found a block before
+ * it was retired pinned no later than the block was retired.
+ */
+
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Most readers of a store at once
+#define WIRE_READERS 1024
+
+// Blocks a shard retires before it first tries to free them
+#define WIRE_RECLAIM 64
+
+/**
+ * A record in wire form.
+ */
+struct WireRecord
+{
+  record_t image;         // Exactly as sent
+  WireRecord* next;       // The block retired after this one
+  uint64_t retired;       // The epoch it was retired in
+};
+
+/**
+ * The epochs of one store, and the readers pinning them.
+ */
+class WireEpochs
+{
+public:
+
+  WireEpochs();
+
+  /**
+   * Take a reader's slot, for a thread to pin epochs with.
+   *
+   * @return The reader, or -1 if WIRE_READERS are already reading.
+   */
+  int join();
+
+  /**
+   * Give a reader's slot back. It must be unpinned.
+   *
+   * @param[in] reader - The reader, from join().
+   */
+  void leave( int reader );
+
+  /**
+   * Pin the current epoch, unless the reader already has one pinned,
+   * before looking records up.
+   *
+   * @param[in] reader - The reader, from join().
+   */
+  void pin( int reader );
+
+  /**
+   * Unpin, once nothing the reader found is still being sent.
+   *
+   * @param[in] reader - The reader, from join().
+   */
+  void unpin( int reader );
+
+  /**
+   * @return The epoch a block retired now is retired in.
+   */
+  uint64_t current() const;
+
+  /**
+   * Move on to a new epoch.
+   *
+   * @return The oldest epoch a pinned reader may still be sending a
+   * block from, every block retired before it being free to reuse.
+   */
+  uint64_t oldest();
+
+  /**
+   * @return The number of readers with an epoch pinned.
+   */
+  int pinned() const;
+
+private:
+
+  // Padded so readers never share a line
+  struct Slot
+  {
+    uint64_t epoch;       // Pinned, or 0
+    int joined;
+    char pad[ 64 - sizeof( uint64_t ) - sizeof( int ) ];
+  };
+
+  Slot slots[ WIRE_READERS ];
+  uint64_t epoch;
+  int highest;            // Slots ever joined, the only ones looked at
+
+  // Not copyable
+  WireEpochs( const WireEpochs& );
+  WireEpochs& operator=( const WireEpochs& );
+};
+
+#endif // _WIRE_H_
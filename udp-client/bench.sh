@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+#
+# Description: Run the udp-client benchmark through lossy-proxy once
+# per network profile, against a server already started with -u.
+#
+# Usage: bench.sh [-n count] [-t milliseconds] [-w window] serverport
+#                 [profile ...]
+#
+# Where 'count' is the number of requests per profile, 'milliseconds'
+# the client's retransmission timeout and 'window' the most requests it
+# has unanswered at once. Every profile the proxy knows is run unless
+# some are named. The proxy listens on 'serverport' + 1.
+#
+
+count=2000
+timeout=200
+window=1
+
+while getopts "n:t:w:" opt; do
+  case $opt in
+    n) count=$OPTARG ;;
+    t) timeout=$OPTARG ;;
+    w) window=$OPTARG ;;
+    *) echo "Usage: $0 [-n count] [-t milliseconds] [-w window] serverport [profile ...]"
+       exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 [-n count] [-t milliseconds] [-w window] serverport [profile ...]"
+  exit 1
+fi
+
+port=$1
+shift
+profiles=${*:-"clean lossy reorder jitter slow hostile"}
+here=$(dirname "$0")
+
+for profile in $profiles; do
+  echo "== $profile"
+  "$here/lossy-proxy" -p "$profile" -s 1 $((port + 1)) localhost "$port" &
+  proxy=$!
+  sleep 0.2
+  "$here/udp-client" -t "$timeout" -b "$count" -w "$window" localhost $((port + 1))
+  kill -TERM "$proxy"
+  wait "$proxy"
+done
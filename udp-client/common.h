@@ -20,6 +20,9 @@
 #define RET_SUCCESS 0
 #define RET_FAILURE 1
 
+// Returned in place of any of the above when the server sheds load
+#define SRV_BUSY 2
+
 #define MAX_LEN 32
 
 /**
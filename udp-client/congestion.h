@@ -0,0 +1,285 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: Congestion control for the datagram client. Keeps an
+ * estimate of the round trip time, from which the retransmission
+ * timeout follows, a window of how many requests may be unanswered at
+ * once, and a token bucket which spreads the window's requests over
+ * the round trip rather than sending them in one burst.
+ *
+ * The window grows by one request a round trip while the round trips
+ * stay near the least seen, shrinks by one once they show more than a
+ * few requests queueing on the path, and halves when requests are lost
+ * while that many queue. Other losses are taken for noise, so a lossy
+ * but uncongested path is not left unused. A request which times out
+ * always halves the window.
+ */
+
+#ifndef _CONGESTION_H_
+#define _CONGESTION_H_
+
+#include <string.h>
+
+// The most requests ever unanswered at once, which must not exceed the
+// replies the server remembers for each client, see REPLY_WINDOW
+#define MAX_WINDOW 128
+
+// The window a client starts with, and the least it shrinks to
+#define INITIAL_WINDOW 2
+#define MIN_WINDOW 2
+
+// Requests queued on the path below which the window grows, and above
+// which it shrinks
+#define QUEUE_LOW 4
+#define QUEUE_HIGH 8
+
+// Bounds on the retransmission timeout, in milliseconds
+#define MIN_RTO 20
+#define MAX_RTO 60000
+
+// How much faster than the window's rate the pacer lets requests
+// through, while the window doubles and once it has settled
+#define START_GAIN 2.0
+#define PACING_GAIN 1.25
+
+// Requests the pacer lets through back to back
+#define PACING_BURST 2
+
+/**
+ * The state of one client's congestion control, all times being in
+ * milliseconds.
+ */
+typedef struct
+{
+  double window;        // Requests which may be unanswered at once
+  double threshold;     // The window at which doubling stops
+  double srtt;          // Smoothed round trip, 0 until the first sample
+  double rttvar;        // Its mean deviation
+  double rto;           // How long to wait before sending again
+  double ceiling;       // The most a timeout backs off to
+  double minRtt;        // The least round trip seen, the path when idle
+  double roundMin;      // The least round trip seen this round
+  double queued;        // Requests queued on the path last round
+  int growth;           // Requests the window changes by each round
+  unsigned int roundEnd;    // The request which ends this round
+  unsigned int recover;     // No more halving until this one is answered
+  double tokens;        // Requests the pacer will let through now
+  double refilled;      // When the tokens were last counted
+  unsigned long losses;     // Requests lost, timed out or not
+  unsigned long timeouts;   // Requests which timed out
+  unsigned long halvings;   // Times the window was halved
+} congestion_t;
+
+/**
+ * Compare sequence numbers, allowing for them wrapping around.
+ *
+ * @return True if 'seq' comes before 'other'.
+ */
+inline bool seqBefore( unsigned int seq, unsigned int other )
+{
+  return (int)( seq - other ) < 0;
+}
+
+/**
+ * @return The retransmission timeout the round trips measured so far
+ * call for, before any backing off.
+ *
+ * @param[in] c - The congestion control state.
+ */
+inline double congestionTimeout( const congestion_t& c )
+{
+  if ( c.srtt == 0 )
+  {
+    return c.ceiling;
+  }
+
+  //
+  // Replies at a steady rate leave little deviation, so the timeout
+  // never comes sooner than half a round trip late, by when a request
+  // sent after a lost one has usually been answered
+  //
+  double rto = c.srtt + ( 4 * c.rttvar > c.srtt / 2 ? 4 * c.rttvar
+                                                     : c.srtt / 2 );
+  return rto < MIN_RTO ? MIN_RTO : rto > MAX_RTO ? MAX_RTO : rto;
+}
+
+/**
+ * Start congestion control afresh.
+ *
+ * @param[out] c - The state to start.
+ * @param[in] timeout - The retransmission timeout until a round trip
+ * has been measured, and the most it backs off to unless round trips
+ * call for more.
+ * @param[in] seq - The first request's sequence number.
+ */
+inline void congestionStart( congestion_t& c, double timeout,
+                             unsigned int seq )
+{
+  memset( &c, 0, sizeof( c ) );
+  c.window = INITIAL_WINDOW;
+  c.threshold = MAX_WINDOW;
+  c.rto = timeout;
+  c.ceiling = timeout;
+  c.growth = 1;
+  c.roundEnd = seq;
+  c.recover = seq;
+  c.tokens = PACING_BURST;
+}
+
+/**
+ * Note that a request was answered, growing or shrinking the window
+ * once a round trip has passed.
+ *
+ * @param[in] c - The congestion control state.
+ * @param[in] seq - The request answered.
+ * @param[in] next - The sequence number the next new request will use.
+ * @param[in] rtt - How long it took, or less than 0 if the request was
+ * sent more than once, so that which send was answered is unknown.
+ */
+inline void congestionAnswered( congestion_t& c, unsigned int seq,
+                                unsigned int next, double rtt )
+{
+  if ( rtt >= 0 )
+  {
+    // The estimator of RFC 6298
+    if ( c.srtt == 0 )
+    {
+      c.srtt = rtt;
+      c.rttvar = rtt / 2;
+    }
+    else
+    {
+      double error = rtt > c.srtt ? rtt - c.srtt : c.srtt - rtt;
+      c.rttvar = 0.75 * c.rttvar + 0.25 * error;
+      c.srtt = 0.875 * c.srtt + 0.125 * rtt;
+    }
+    c.rto = congestionTimeout( c );
+
+    c.minRtt = c.minRtt == 0 || rtt < c.minRtt ? rtt : c.minRtt;
+    c.roundMin = c.roundMin == 0 || rtt < c.roundMin ? rtt : c.roundMin;
+  }
+
+  if ( c.window < c.threshold )
+  {
+    c.window += 1;
+  }
+  else
+  {
+    c.window += c.growth / c.window;
+  }
+
+  //
+  // Once a round trip has passed, the least round trip of the round
+  // beyond the least ever seen is the time requests spent queued, and
+  // so the window's share of it the requests queued. The least of the
+  // round rather than the smoothed round trip keeps jitter from
+  // passing for queueing.
+  //
+  if ( not seqBefore( seq, c.roundEnd ) )
+  {
+    if ( c.roundMin > 0 )
+    {
+      c.queued = c.window * ( c.roundMin - c.minRtt ) / c.roundMin;
+      if ( c.queued > QUEUE_HIGH )
+      {
+        c.threshold = c.window;
+        c.growth = -1;
+      }
+      else
+      {
+        c.growth = c.queued < QUEUE_LOW ? 1 : 0;
+      }
+    }
+    c.roundEnd = next;
+    c.roundMin = 0;
+  }
+
+  c.window = c.window < MIN_WINDOW ? MIN_WINDOW
+           : c.window > MAX_WINDOW ? MAX_WINDOW : c.window;
+}
+
+/**
+ * Note that a request was lost, halving the window at most once a
+ * round trip.
+ *
+ * @param[in] c - The congestion control state.
+ * @param[in] seq - The request lost.
+ * @param[in] next - The sequence number the next new request will use.
+ * @param[in] timedOut - True if its timeout passed, false if requests
+ * sent after it were answered first.
+ */
+inline void congestionLost( congestion_t& c, unsigned int seq,
+                            unsigned int next, bool timedOut )
+{
+  c.losses++;
+  if ( timedOut )
+  {
+    c.timeouts++;
+
+    // Doubling, though never past the timeout the client was given
+    double ceiling = congestionTimeout( c );
+    ceiling = ceiling > c.ceiling ? ceiling : c.ceiling;
+    c.rto = c.rto * 2 > ceiling ? ceiling : c.rto * 2;
+  }
+  else if ( c.queued <= QUEUE_HIGH )
+  {
+    return;
+  }
+
+  if ( seqBefore( seq, c.recover ) )
+  {
+    return;
+  }
+
+  c.window = c.window / 2 < MIN_WINDOW ? MIN_WINDOW : c.window / 2;
+  c.threshold = c.window;
+  c.recover = next;
+  c.halvings++;
+}
+
+/**
+ * @return True if the window has room for another request.
+ *
+ * @param[in] c - The congestion control state.
+ * @param[in] unanswered - The requests sent and not yet answered.
+ */
+inline bool congestionOpen( const congestion_t& c, int unanswered )
+{
+  return unanswered < (int)c.window;
+}
+
+/**
+ * @return Milliseconds until the pacer lets the next request through,
+ * 0 if it may be sent now.
+ *
+ * @param[in] c - The congestion control state.
+ * @param[in] now - The time.
+ */
+inline double congestionPace( congestion_t& c, double now )
+{
+  // Unpaced until a round trip gives the window a rate
+  if ( c.srtt == 0 )
+  {
+    return 0;
+  }
+
+  double rate = ( c.window < c.threshold ? START_GAIN : PACING_GAIN )
+              * c.window / c.srtt;
+  c.tokens += ( now - c.refilled ) * rate;
+  c.tokens = c.tokens > PACING_BURST ? PACING_BURST : c.tokens;
+  c.refilled = now;
+
+  return c.tokens >= 1 ? 0 : ( 1 - c.tokens ) / rate;
+}
+
+/**
+ * Note that a request was sent, spending one of the pacer's tokens.
+ *
+ * @param[in] c - The congestion control state.
+ */
+inline void congestionSent( congestion_t& c )
+{
+  c.tokens -= 1;
+}
+
+#endif // _CONGESTION_H_
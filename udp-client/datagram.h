@@ -25,6 +25,24 @@ typedef struct {
         char data[ MAX_DATA ];  // The data itself (if any).
 } Datagram;
 
+//
+// Name:        Exchanges
+//
+//              A client may ask for an exchange by sending it as an int
+//              in the data of its SYN, and the server echoes the one it
+//              agrees to in the data of its ACK. A server which echoes
+//              nothing only knows EXCHANGE_ACKED.
+//
+//              EXCHANGE_ACKED: the server ACKs each request then sends
+//              its reply, which the client ACKs, four datagrams in all.
+//
+//              EXCHANGE_PIGGYBACK: the reply doubles as the request's
+//              ACK, and each request ACKs every reply before it, so a
+//              client only sends an ACK of its own once it falls idle.
+//
+#define EXCHANGE_ACKED          0
+#define EXCHANGE_PIGGYBACK      1
+
 #endif  // _DATAGRAM_H
 
 
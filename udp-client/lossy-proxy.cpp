@@ -0,0 +1,472 @@
+/**
+ * Author: Brian Gianforcaro ( bjg1955@cs.rit.edu )
+ *
+ * Description: A UDP proxy which sits between udp-client and the
+ * server and behaves like a bad network, so the client's
+ * retransmissions can be measured on a single machine.
+ *
+ * Usage: lossy-proxy [-p profile] [-l loss] [-d duplicate] [-r reorder]
+ *                    [-D delay] [-j jitter] [-b kbits] [-q queue]
+ *                    [-s seed] port hostname serverport
+ *
+ * Where 'port' is the port clients send to, and 'hostname' and
+ * 'serverport' are where the server listens. Every datagram in either
+ * direction is dropped with probability 'loss' percent, sent twice
+ * with probability 'duplicate' percent, and held back long enough for
+ * later datagrams to overtake it with probability 'reorder' percent.
+ * Each is delayed by 'delay' milliseconds plus up to 'jitter' more,
+ * and each direction carries at most 'kbits' kilobits a second,
+ * dropping datagrams which would wait more than 'queue' milliseconds
+ * for those before them to be sent, as a router's full buffer would.
+ *
+ * A profile, see PROFILES below, sets all of these at once, and any
+ * given after it override it. Counters are printed on SIGINT or SIGTERM.
+ */
+
+// Stream stdout/stderr IO
+#include <iostream>
+  using std::cout;
+  using std::cerr;
+  using std::endl;
+
+#include <map>
+  using std::map;
+  using std::multimap;
+  using std::make_pair;
+
+// Utilities, IO and Error checking
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // for bzero(..)
+#include <time.h>
+#include <unistd.h>
+
+// Networking and sockets
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+// Largest datagram forwarded
+#define MAX_DATAGRAM 65536
+
+// Milliseconds a reordered datagram is held back beyond the others
+#define REORDER_HOLD 20
+
+/**
+ * How badly the network behaves.
+ */
+typedef struct
+{
+  const char* name;
+  int loss;             // Percent of datagrams dropped
+  int duplicate;        // Percent of datagrams sent twice
+  int reorder;          // Percent of datagrams held back
+  int delay;            // Milliseconds every datagram is delayed
+  int jitter;           // Up to this many milliseconds more
+  int kbits;            // Kilobits a second each way, 0 for no limit
+  int queue;            // Milliseconds queued at most, 0 for no limit
+} profile_t;
+
+// Named sets of impairments, the first being the default
+static const profile_t PROFILES[] =
+{
+  { "clean",   0,  0,  0,   0,  0,    0,   0 },
+  { "lossy",   5,  0,  0,   1,  1,    0,   0 },
+  { "reorder", 0,  0, 20,   1,  5,    0,   0 },
+  { "jitter",  0,  1,  0,  20, 30,    0,   0 },
+  { "slow",    1,  0,  0,  50, 10,  256, 200 },
+  { "hostile", 20, 5, 10,  10, 20, 1024, 100 }
+};
+
+#define PROFILE_COUNT ( sizeof( PROFILES ) / sizeof( PROFILES[0] ) )
+
+/**
+ * A datagram waiting for its time to be sent.
+ */
+typedef struct
+{
+  int sock;                     // The socket to send it from
+  struct sockaddr_in to;        // Where to send it
+  size_t length;
+  char* data;
+} packet_t;
+
+/**
+ * One direction of the emulated link.
+ */
+typedef struct
+{
+  uint64_t idleAt;              // When the link has sent all it was given
+  unsigned long received;
+  unsigned long dropped;
+  unsigned long duplicated;
+  unsigned long reordered;
+  unsigned long overflowed;     // Dropped by the queue limit
+} link_t;
+
+// Datagrams waiting to be sent, by the microsecond they go
+typedef multimap<uint64_t, packet_t> schedule_t;
+
+// Each client gets its own socket to the server, so the server sees
+// them as different peers, keyed by address and port
+typedef map<uint64_t, int> flows_t;
+
+// Set by the signal handler once it is time to stop
+static volatile sig_atomic_t stopping = 0;
+
+/**
+ * Note that we have been asked to stop.
+ */
+void stop( int signal )
+{
+  (void)signal;
+  stopping = 1;
+}
+
+/**
+ * @return The time in microseconds.
+ */
+uint64_t now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @return True with the given percent chance.
+ */
+bool chance( int percent, unsigned int& seed )
+{
+  return percent > 0 && (int)( rand_r( &seed ) % 100 ) < percent;
+}
+
+/**
+ * @return The key a client's flow is filed under.
+ */
+uint64_t flowKey( const struct sockaddr_in& address )
+{
+  return ( (uint64_t)address.sin_addr.s_addr << 16 ) | address.sin_port;
+}
+
+/**
+ * Put a datagram through the emulated link, scheduling the copies of
+ * it which survive.
+ *
+ * @param[in] profile - How the link behaves.
+ * @param[in] link - The direction it travels.
+ * @param[in] schedule - Where to schedule it.
+ * @param[in] sock - The socket to send it from.
+ * @param[in] to - Where to send it.
+ * @param[in] data - The datagram.
+ * @param[in] length - Its length.
+ * @param[in] seed - The random number state.
+ */
+void impair( const profile_t& profile, link_t& link, schedule_t& schedule,
+             int sock, const struct sockaddr_in& to, const char* data,
+             size_t length, unsigned int& seed )
+{
+  if ( chance( profile.loss, seed ) )
+  {
+    link.dropped++;
+    return;
+  }
+
+  int copies = 1;
+  if ( chance( profile.duplicate, seed ) )
+  {
+    copies = 2;
+    link.duplicated++;
+  }
+
+  uint64_t arrived = now();
+  for ( int i = 0; i < copies; i++ )
+  {
+    uint64_t at = arrived + (uint64_t)profile.delay * 1000;
+    if ( profile.jitter > 0 )
+    {
+      at += rand_r( &seed ) % ( (unsigned int)profile.jitter * 1000 );
+    }
+    if ( chance( profile.reorder, seed ) )
+    {
+      at += REORDER_HOLD * 1000;
+      link.reordered++;
+    }
+
+    //
+    // The link sends one datagram at a time, so each waits for the
+    // last to be sent before taking its own time on the wire.
+    //
+    if ( profile.kbits > 0 )
+    {
+      if ( at < link.idleAt )
+      {
+        if ( profile.queue > 0
+             && link.idleAt - at > (uint64_t)profile.queue * 1000 )
+        {
+          link.overflowed++;
+          continue;
+        }
+        at = link.idleAt;
+      }
+      link.idleAt = at + (uint64_t)length * 8 * 1000 / profile.kbits;
+      at = link.idleAt;
+    }
+
+    packet_t packet;
+    packet.sock = sock;
+    packet.to = to;
+    packet.length = length;
+    packet.data = new char[ length ];
+    memcpy( packet.data, data, length );
+    schedule.insert( make_pair( at, packet ) );
+  }
+}
+
+/**
+ * Send every datagram whose time has come.
+ *
+ * @param[in] schedule - The datagrams waiting.
+ *
+ * @return Microseconds until the next is due, or -1 if none is waiting.
+ */
+long sendDue( schedule_t& schedule )
+{
+  uint64_t time = now();
+  while ( not schedule.empty() && schedule.begin()->first <= time )
+  {
+    packet_t& packet = schedule.begin()->second;
+    sendto( packet.sock, packet.data, packet.length, 0,
+            (struct sockaddr*)&packet.to, sizeof( packet.to ) );
+    delete[] packet.data;
+    schedule.erase( schedule.begin() );
+  }
+  return schedule.empty() ? -1 : (long)( schedule.begin()->first - time );
+}
+
+/**
+ * @return A socket bound to the given port, any if 0.
+ */
+int setupSocket( int port )
+{
+  int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+  if ( sock < 0 )
+  {
+    cerr << "socket: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  struct sockaddr_in address;
+  bzero( &address, sizeof( address ) );
+  address.sin_family = AF_INET;
+  address.sin_port = htons( port );
+
+  if ( bind( sock, (struct sockaddr*)&address, sizeof( address ) ) < 0 )
+  {
+    cerr << "bind: " << strerror( errno ) << endl;
+    exit( EXIT_FAILURE );
+  }
+  return sock;
+}
+
+/**
+ * Print the usage statement for the proxy and exit.
+ *
+ * @param[in] binary - The name of the binary being executed.
+ */
+void usage( char* binary )
+{
+  cerr << "Usage: " << binary << " [-p profile] [-l loss] [-d duplicate]"
+       << " [-r reorder] [-D delay] [-j jitter] [-b kbits] [-q queue]"
+       << " [-s seed]"
+       << " port hostname serverport" << endl;
+  cerr << "Profiles:";
+  for ( size_t i = 0; i < PROFILE_COUNT; i++ )
+  {
+    cerr << " " << PROFILES[i].name;
+  }
+  cerr << endl;
+  exit( EXIT_FAILURE );
+}
+
+/**
+ * Print how many datagrams one direction received and impaired.
+ */
+void report( const char* direction, const link_t& link )
+{
+  cout << direction << " received " << link.received
+       << " dropped " << link.dropped
+       << " duplicated " << link.duplicated
+       << " reordered " << link.reordered
+       << " overflowed " << link.overflowed << endl;
+}
+
+/**
+ * Proxy entry point.
+ *
+ * @param[in] argc - The number of command line arguments.
+ * @param[in] argv - The actual command line arguments.
+ */
+int main( int argc, char** argv )
+{
+  profile_t profile = PROFILES[0];
+  unsigned int seed = time( NULL );
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "p:l:d:r:D:j:b:q:s:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'p':
+      {
+        size_t i = 0;
+        while ( i < PROFILE_COUNT && strcmp( PROFILES[i].name, optarg ) != 0 )
+        {
+          i++;
+        }
+        if ( i == PROFILE_COUNT )
+        {
+          usage( argv[0] );
+        }
+        profile = PROFILES[i];
+        break;
+      }
+      case 'l':
+        profile.loss = atoi( optarg );
+        break;
+      case 'd':
+        profile.duplicate = atoi( optarg );
+        break;
+      case 'r':
+        profile.reorder = atoi( optarg );
+        break;
+      case 'D':
+        profile.delay = atoi( optarg );
+        break;
+      case 'j':
+        profile.jitter = atoi( optarg );
+        break;
+      case 'b':
+        profile.kbits = atoi( optarg );
+        break;
+      case 'q':
+        profile.queue = atoi( optarg );
+        break;
+      case 's':
+        seed = atoi( optarg );
+        break;
+      default:
+        usage( argv[0] );
+    }
+  }
+
+  if ( argc - optind != 3 )
+  {
+    usage( argv[0] );
+  }
+
+  struct hostent* hostent = gethostbyname( argv[ optind + 1 ] );
+  if ( NULL == hostent )
+  {
+    cerr << "gethostbyname: error code " << h_errno << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  struct sockaddr_in server;
+  bzero( &server, sizeof( server ) );
+  server.sin_family = AF_INET;
+  server.sin_port = htons( atoi( argv[ optind + 2 ] ) );
+  memcpy( &server.sin_addr, hostent->h_addr, sizeof( server.sin_addr ) );
+
+  int listener = setupSocket( atoi( argv[ optind ] ) );
+
+  signal( SIGINT, stop );
+  signal( SIGTERM, stop );
+
+  cout << "Proxying with loss " << profile.loss << "% duplicate "
+       << profile.duplicate << "% reorder " << profile.reorder
+       << "% delay " << profile.delay << "+" << profile.jitter
+       << "ms limit " << profile.kbits << "kbit/s queue "
+       << profile.queue << "ms" << endl;
+
+  flows_t flows;
+  map<int, struct sockaddr_in> clients;
+  schedule_t schedule;
+  link_t upstream, downstream;
+  bzero( &upstream, sizeof( upstream ) );
+  bzero( &downstream, sizeof( downstream ) );
+
+  char buffer[ MAX_DATAGRAM ];
+  while ( not stopping )
+  {
+    long wait = sendDue( schedule );
+
+    fd_set readable;
+    FD_ZERO( &readable );
+    FD_SET( listener, &readable );
+    int highest = listener;
+    for ( flows_t::iterator it = flows.begin(); it != flows.end(); ++it )
+    {
+      FD_SET( it->second, &readable );
+      highest = it->second > highest ? it->second : highest;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = wait < 0 ? 1 : wait / 1000000;
+    timeout.tv_usec = wait < 0 ? 0 : wait % 1000000;
+    if ( select( highest + 1, &readable, NULL, NULL, &timeout ) <= 0 )
+    {
+      continue;
+    }
+
+    //
+    // From a client, on to the server through the client's own socket
+    //
+    if ( FD_ISSET( listener, &readable ) )
+    {
+      struct sockaddr_in from;
+      socklen_t len = sizeof( from );
+      ssize_t got = recvfrom( listener, buffer, sizeof( buffer ), 0,
+                              (struct sockaddr*)&from, &len );
+      if ( got >= 0 )
+      {
+        flows_t::iterator flow = flows.find( flowKey( from ) );
+        if ( flow == flows.end() )
+        {
+          int sock = setupSocket( 0 );
+          flow = flows.insert( make_pair( flowKey( from ), sock ) ).first;
+          clients[ sock ] = from;
+        }
+        upstream.received++;
+        impair( profile, upstream, schedule, flow->second, server, buffer,
+                got, seed );
+      }
+    }
+
+    //
+    // From the server, back to whichever client the socket belongs to
+    //
+    for ( flows_t::iterator it = flows.begin(); it != flows.end(); ++it )
+    {
+      if ( FD_ISSET( it->second, &readable ) )
+      {
+        ssize_t got = recv( it->second, buffer, sizeof( buffer ), 0 );
+        if ( got >= 0 )
+        {
+          downstream.received++;
+          impair( profile, downstream, schedule, listener,
+                  clients[ it->second ], buffer, got, seed );
+        }
+      }
+    }
+  }
+
+  report( "to server", upstream );
+  report( "to client", downstream );
+  return EXIT_SUCCESS;
+}
@@ -4,10 +4,25 @@
  * Description: A client appiication that can add, retrive
  * records from a remote database server. 
  *
- * Usage: udp-project3 hostname port
+ * Usage: udp-project3 [-t milliseconds] [-b count] [-w window] hostname port
  *                              
  * Where 'hostname' is the name of the remote host on which
  * the server is running and 'port' is the port number it is using.
+ * A request is sent again after 'milliseconds' without a reply, until
+ * round trips have been measured to set the timeout by. With -b the
+ * client adds and retrieves 'count' records of its own rather than
+ * asking the user what to do, and reports how that went, see
+ * lossy-proxy.cpp for putting a bad network in the way. With -w it
+ * keeps up to 'window' of them unanswered at once, as many as
+ * congestion control allows, see congestion.h.
+ *
+ * Servers which agree to it take each reply as the acknowledgement of
+ * the request, and each request as the acknowledgement of the replies
+ * before it, see datagram.h. The last reply is acknowledged on its own
+ * once the user has been idle for a while. With more than one request
+ * unanswered a reply no longer answers every request before it, so
+ * the client asks for replies to be ACKed on their own, and ACKs every
+ * few of them at once.
  */
 
 // Stream stdout/stderr IO
@@ -20,6 +35,8 @@
         using std::string;
 
 // Utilities, IO and Error checking
+#include <stdio.h>
+#include <stddef.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -33,11 +50,16 @@
 #include <netdb.h>
 #include <sys/select.h>
 #include <fcntl.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+  using std::vector;
 
 // Project specific header
-#include "Timer.h"
 #include "common.h"
 #include "datagram.h"
+#include "congestion.h"
 
 typedef struct
 { 
@@ -45,19 +67,74 @@ typedef struct
   unsigned int seq;
   struct sockaddr_in address;
   socklen_t addrlen; 
+  bool piggyback;       // Replies and requests double as ACKs
+  bool unacked;         // The last reply has not been acknowledged yet
+  int timeout;          // Milliseconds to wait for the server to agree
+  congestion_t congestion;  // Round trips, timeout, window and pacing
+  bool quiet;           // Keep retransmissions to ourselves
+  unsigned long retransmits;
 } sock_t;
 
 #define TIME_OUT 3
 
+// Bytes of a datagram before its data
+#define DATAGRAM_HEADER offsetof( Datagram, data )
+
+// Milliseconds idle before the last reply is acknowledged on its own
+#define DELAYED_ACK 200
+
+// Retransmissions of a request before giving up on the server
+#define MAX_TIME_OUTS 5
+
+// Replies a benchmark with several requests unanswered lets arrive
+// before acknowledging them all at once
+#define ACK_EVERY 16
+
+/**
+ * @return The time in milliseconds.
+ */
+double milliseconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Wait for a datagram to arrive on the socket.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] milliseconds - How long to wait.
+ *
+ * @return True if a datagram is waiting, false on timeout.
+ */
+bool waitForDatagram( int sock, double milliseconds )
+{
+  int micros = milliseconds > 0 ? (int)( milliseconds * 1000 ) : 0;
+
+  fd_set readable;
+  FD_ZERO( &readable );
+  FD_SET( sock, &readable );
+
+  struct timeval timeout;
+  timeout.tv_sec = micros / 1000000;
+  timeout.tv_usec = micros % 1000000;
+
+  return select( sock + 1, &readable, NULL, NULL, &timeout ) > 0;
+}
+
 /**
  * Setup the connection to the server and return the sockets file descriptor.
  *
  * @param[in] hostname - The hostname to use when connecting.
  * @param[in] port - The port number to use when connecting.
+ * @param[in] timeout - Milliseconds to wait for each reply.
+ * @param[in] piggyback - True to ask for replies and requests to
+ * double as ACKs.
  *
  * @return A file descriptor to the setup and connected socket. 
  */
-sock_t setupSocket( char* hostname, int port )
+sock_t setupSocket( char* hostname, int port, int timeout, bool piggyback )
 {
   sock_t s;
   bzero( &s, sizeof( sock_t ) );
@@ -84,40 +161,48 @@ sock_t setupSocket( char* hostname, int port )
   s.address.sin_addr.s_addr = *(u_long *)hostent->h_addr;
   s.addrlen = sizeof( struct sockaddr );
   s.seq = 0;
+  s.timeout = timeout;
 
   Datagram gram;
   bzero( &gram, sizeof( gram ) );
   gram.type = SYN;
 
-  bool timedOut;
+  // Ask for the piggybacked exchange, which older servers ignore
+  int exchange = piggyback ? EXCHANGE_PIGGYBACK : EXCHANGE_ACKED;
+  memcpy( gram.data, &exchange, sizeof( exchange ) );
+
   int timeOuts = 0;
+  ssize_t received = -1;
   struct sockaddr_in address;
   struct sockaddr* addr = (struct sockaddr*) &address;
-  socklen_t len = sizeof( address );
-
-
-  do {
-    sendto( s.sock, (char *)&gram, 8, 0, (struct sockaddr *)&s.address, s.addrlen );
-
-    timedOut = false;
+  socklen_t len;
+  Datagram reply;
 
-    start_timer( TIME_OUT, timedOut );
-    trySynAck:
-      recvfrom( s.sock, (char *)&gram, sizeof( gram ), 0, addr, &len );
+  // Waits with select(), as a timer's signal does not interrupt a
+  // recvfrom() which the C library restarts
+  while ( received < 0 )
+  {
+    sendto( s.sock, (char *)&gram, DATAGRAM_HEADER + sizeof( exchange ), 0,
+            (struct sockaddr *)&s.address, s.addrlen );
 
-      if ( sock.address.sin_addr.s_addr != address.sin_addr.s_addr
-           || sock.address.sin_port != address.sin_port )
+    while ( received < 0 and waitForDatagram( s.sock, s.timeout ) )
+    {
+      len = sizeof( address );
+      received = recvfrom( s.sock, (char *)&reply, sizeof( reply ), 0, addr,
+                           &len );
+      if ( received >= 0
+           && ( s.address.sin_addr.s_addr != address.sin_addr.s_addr
+                || s.address.sin_port != address.sin_port ) )
       {
         cout << "Packet arrived fom an unexpected source, discarding." << endl;
-        goto trySynAck;
+        received = -1;
       }
+    }
 
-    stop_timer();
-
-    if ( timedOut )
+    if ( received < 0 )
     {
       cout << "Connection time out #" << ++timeOuts << endl;
-      if ( timeOuts > 5 ) 
+      if ( timeOuts > MAX_TIME_OUTS )
       {
         cout << "Connection failed. Exiting..." << endl;
         close( s.sock );
@@ -125,8 +210,15 @@ sock_t setupSocket( char* hostname, int port )
       }
     }
   }
-  while ( timedOut );
 
+  // The server echoes the exchange it agreed to
+  if ( received >= (ssize_t)( DATAGRAM_HEADER + sizeof( exchange ) ) )
+  {
+    memcpy( &exchange, reply.data, sizeof( exchange ) );
+    s.piggyback = exchange == EXCHANGE_PIGGYBACK;
+  }
+
+  congestionStart( s.congestion, timeout, s.seq );
   return s;
 }
 
@@ -137,7 +229,8 @@ sock_t setupSocket( char* hostname, int port )
  */
 void usage( char* binary )
 {
-  cerr << "Usage: " << binary << " hostname port " << endl;
+  cerr << "Usage: " << binary << " [-t milliseconds] [-b count] [-w window]"
+       << " hostname port " << endl;
 }
 
 
@@ -161,121 +254,215 @@ int obtainInt( string msg )
 }
 
 /**
- * Attempt to add a new record to the remote database.
+ * Acknowledge every reply up to and including one.
  *
  * @param[in] sock - The socket's file descriptor
+ * @param[in] seq - The last reply to acknowledge.
  */
-void addRecord( sock_t& sock )
+void acknowledge( sock_t& sock, unsigned int seq )
 {
   Datagram gram;
-  record_t newRecord;
-  newRecord.command = add_t;
+  bzero( &gram, DATAGRAM_HEADER );
+  gram.type = ACK;
+  gram.seq = seq;
+  sendto( sock.sock, (char *)&gram, DATAGRAM_HEADER, 0,
+          (struct sockaddr *)&sock.address, sock.addrlen );
+  sock.unacked = false;
+}
 
-  cout << "Enter id (interger):";
-  newRecord.id = obtainInt( "ID should be a non-zero integer):" );
+/**
+ * Wait for the user to type something, acknowledging the last reply
+ * if they take long enough that no request would do it sooner.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void awaitInput( sock_t& sock )
+{
+  if ( not sock.unacked )
+  {
+    return;
+  }
 
-  cout << "Enter name (up to 32 char):";
-  scanf( "%32s", newRecord.name );
+  fd_set readable;
+  FD_ZERO( &readable );
+  FD_SET( STDIN_FILENO, &readable );
 
-  cout << "Enter age (integer):";
-  newRecord.age = obtainInt( "Age should be a non-zero integer):" );
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = DELAYED_ACK * 1000;
 
-  bzero( &gram, sizeof( Datagram ) );
+  if ( select( STDIN_FILENO + 1, &readable, NULL, NULL, &timeout ) == 0 )
+  {
+    acknowledge( sock, sock.seq - 1 );
+  }
+}
+
+/**
+ * Send a request to the server, once.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] seq - The request's sequence number.
+ * @param[in] request - The request to send.
+ */
+void sendRequest( sock_t& sock, unsigned int seq, const record_t& request )
+{
+  Datagram gram;
+  bzero( &gram, DATAGRAM_HEADER );
   gram.type = DATA;
-  gram.seq = sock.seq;
-  memcpy( gram.data, &newRecord, sizeof( record_t ) );
-        
-  record_t resultRec;
+  gram.seq = seq;
+  memcpy( gram.data, &request, sizeof( record_t ) );
+  sendto( sock.sock, (char *)&gram, DATAGRAM_HEADER + sizeof( record_t ), 0,
+          (struct sockaddr *)&sock.address, sock.addrlen );
+}
 
-  bool timedOut;
-  int timeOuts = 0;
+/**
+ * Send a request to the server and wait for its reply, sending the
+ * request again each time the wait times out. Each timeout waits twice
+ * as long as the last, and the round trip of a request answered first
+ * time sets how long the next request waits. The server answers a
+ * request it has already carried out from its reply cache, so losing
+ * the request, its acknowledgement or the reply is always safe.
+ *
+ * With a piggybacking server the reply is the only answer, and it is
+ * left for the next request, or awaitInput(), to acknowledge.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] request - The request to send.
+ * @param[out] reply - The server's reply.
+ *
+ * @return True if a reply arrived, false if the server never answered.
+ */
+bool exchange( sock_t& sock, const record_t& request, record_t& reply )
+{
   struct sockaddr_in address;
   struct sockaddr* addr = (struct sockaddr*) &address;
-  socklen_t len = sizeof( address );
 
-  do
+  int timeOuts = 0;
+  while ( timeOuts <= MAX_TIME_OUTS )
   {
-    // Send add request
-    sendto( sock.sock, (char *)&gram, sizeof( Datagram ), 0,
-                       (struct sockaddr *)&sock.address, sock.addrlen );
-    timedOut = false;
-    start_timer( TIME_OUT, timedOut );
-    unsigned int seqCheck;
-    bool finished = false;
-    do
+    sock.retransmits += timeOuts > 0;
+    sendRequest( sock, sock.seq, request );
+
+    double sent = milliseconds();
+    bool replied = false;
+    while ( not replied
+            and waitForDatagram( sock.sock, sent + sock.congestion.rto
+                                            - milliseconds() ) )
     {
-      // Receive ACK
-      recvfrom( sock.sock, (char *)&gram, sizeof(Datagram),0,
-                addr, &len );
-
-      seqCheck = gram.seq;
-      if ( seqCheck != sock.seq )
+      Datagram response;
+      socklen_t len = sizeof( address );
+      ssize_t received = recvfrom( sock.sock, (char *)&response,
+                                   sizeof( response ), 0, addr, &len );
+      if ( received < (ssize_t)DATAGRAM_HEADER )
       {
-        cout << "Incorrect Seq number recieved." << endl;
+        continue;
       }
 
       if ( sock.address.sin_addr.s_addr != address.sin_addr.s_addr
            || sock.address.sin_port != address.sin_port )
       {
-        cout << "Packet arrived fom an unexpected source, discarding." << endl;
-        finished = false;
+        if ( not sock.quiet )
+        {
+          cout << "Packet arrived fom an unexpected source, discarding."
+               << endl;
+        }
+        continue;
       }
-      else
+
+      // Late and duplicated answers to earlier requests
+      if ( response.seq != sock.seq )
       {
-        finished = true;
+        if ( not sock.quiet )
+        {
+          cout << "Incorrect Seq number received." << endl;
+        }
+        continue;
       }
-    }
-    while ( seqCheck != sock.seq || not finished );
 
-    stop_timer();
+      // The server's ACK only says the request arrived, the reply follows
+      if ( response.type == DATA
+           && received >= (ssize_t)( DATAGRAM_HEADER + sizeof( record_t ) ) )
+      {
+        memcpy( &reply, response.data, sizeof( record_t ) );
+        replied = true;
+      }
+    }
 
-    if ( timedOut )
+    if ( replied )
     {
-      cout << "Add request time out #" << ++timeOuts << endl;
-    
-      if ( timeOuts > 5 )
+      congestionAnswered( sock.congestion, sock.seq, sock.seq + 1,
+                          timeOuts == 0 ? milliseconds() - sent : -1 );
+
+      // Update Sequence Number
+      ++(sock.seq);
+
+      // Send ACK, letting the server forget the reply, unless it waits
+      if ( sock.piggyback )
       {
-        cout << "Add request timed out..." << endl;
+        sock.unacked = true;
       }
-    } 
+      else
+      {
+        acknowledge( sock, sock.seq - 1 );
+      }
+      return true;
+    }
+
+    congestionLost( sock.congestion, sock.seq, sock.seq + 1, true );
+    ++timeOuts;
+    if ( not sock.quiet )
+    {
+      cout << "Request time out #" << timeOuts << endl;
+    }
   }
-  while( timedOut && timeOuts < 5 );
 
-  if ( not timedOut )
+  if ( not sock.quiet )
   {
-    tryAddAck:
+    cout << "Request timed out..." << endl;
+  }
 
-    // Receive success/failure
-    recvfrom( sock.sock, (char *)&gram, sizeof(gram), 0,
-                          addr, &len );
+  // Never reuse the number, the server may yet have answered it
+  ++(sock.seq);
+  return false;
+}
 
-    if ( sock.address.sin_addr.s_addr != address.sin_addr.s_addr
-         || sock.address.sin_port != address.sin_port )
-    {
-      cout << "Packet arrived fom an unexpected source, discarding." << endl;
-      goto tryAddAck;
-    }
+/**
+ * Attempt to add a new record to the remote database.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void addRecord( sock_t& sock )
+{
+  record_t newRecord;
+  bzero( &newRecord, sizeof( newRecord ) );
+  newRecord.command = add_t;
 
-    memcpy( &resultRec, gram.data, sizeof( record_t ) );
+  cout << "Enter id (interger):";
+  newRecord.id = obtainInt( "ID should be a non-zero integer):" );
 
-    if ( resultRec.command == ADD_SUCCESS )
-    {
-      cout << "ID " << newRecord.id << " added successfully" << endl;
-    }
-    else
-    {
-      cout << "ID " << newRecord.id << " already exists" << endl;
-    }
+  cout << "Enter name (up to 32 char):";
+  scanf( "%31s", newRecord.name );
 
-    // Send ACK
-    gram.type = ACK;
-    gram.seq = sock.seq;
-    sendto( sock.sock, (char *)&gram, 8, 0,
-            (struct sockaddr *)&sock.address,
-            sock.addrlen );
+  cout << "Enter age (integer):";
+  newRecord.age = obtainInt( "Age should be a non-zero integer):" );
 
-    // Update Sequence Number
-    ++(sock.seq);
+  record_t resultRec;
+  if ( not exchange( sock, newRecord, resultRec ) )
+  {
+    return;
+  }
+
+  if ( resultRec.command == ADD_SUCCESS )
+  {
+    cout << "ID " << newRecord.id << " added successfully" << endl;
+  }
+  else if ( resultRec.command == SRV_BUSY )
+  {
+    cout << "ID " << newRecord.id << " not added, server busy" << endl;
+  }
+  else
+  {
+    cout << "ID " << newRecord.id << " already exists" << endl;
   }
 }
 
@@ -295,111 +482,386 @@ void retriveRecord( sock_t& sock )
   cout << "Enter id (interger):";
   findRecord.id = obtainInt( "ID should be a non-zero integer):" );
 
+  record_t resultRec;
+  bzero( &resultRec, sizeof( resultRec ) );
+  if ( not exchange( sock, findRecord, resultRec ) )
+  {
+    return;
+  }
+
+  // Display our results
+  if ( resultRec.command == RET_SUCCESS )
+  {
+    cout << "ID: " << resultRec.id << endl;
+    cout << "Name: " << resultRec.name << endl;
+    cout << "Age: " << resultRec.age << endl;
+  }
+  else if ( resultRec.command == SRV_BUSY )
+  {
+    cout << "ID " << findRecord.id << " not retrieved, server busy" << endl;
+  }
+  else
+  {
+    cout << "ID " << findRecord.id << " does not exist" << endl;
+  }
+}
+
+
+/**
+ * Tell the server we are done and close the socket.
+ *
+ * @param[in] sock - The socket's file descriptor
+ */
+void finish( sock_t& sock )
+{
   Datagram gram;
   bzero( &gram, sizeof( Datagram ) );
-  gram.type = DATA;
+  gram.type = FIN;
   gram.seq = sock.seq;
-  memcpy( gram.data, &findRecord, sizeof( findRecord ) );
+  sendto( sock.sock, (char *)&gram, 8, 0, (struct sockaddr *)&sock.address, sock.addrlen );
+  close( sock.sock );
+}
 
-  record_t resultRec;
-  bzero( &resultRec, sizeof( resultRec ) );
+/**
+ * How the benchmark's requests fared.
+ */
+typedef struct
+{
+  int ids;                      // Where our own ids start
+  vector<double> latencies;     // Of every request answered
+  int failed;
+  int busy;
+  int wrong;
+} tally_t;
 
-  bool timedOut;
-  int timeOuts = 0;
-  struct sockaddr_in address;
-  struct sockaddr* addr = (struct sockaddr*) &address;
-  socklen_t len = sizeof( address );
+/**
+ * A benchmark request which has been sent and not yet given up on.
+ */
+typedef struct
+{
+  record_t request;
+  double first;         // When it was first sent
+  double last;          // When it was last sent
+  int sends;
+  bool lost;            // Presumed lost, to be sent again
+  bool done;            // Answered, or given up on
+} flight_t;
 
-  do
+/**
+ * Make one of the benchmark's requests, which add a block of records
+ * then retrieve them, a block at a time. A record is retrieved a block
+ * after it was added, so with no more than a block unanswered at once
+ * the add has always been answered first.
+ *
+ * @param[in] tally - How the benchmark is faring.
+ * @param[in] i - The request's number.
+ * @param[in] block - Records added before they are retrieved.
+ * @param[out] request - The request.
+ */
+void makeRequest( const tally_t& tally, int i, int block, record_t& request )
+{
+  int blocks = i / block;
+  int record = blocks / 2 * block + i % block;
+
+  bzero( &request, sizeof( request ) );
+  request.command = blocks % 2 == 0 ? add_t : retrive_t;
+  request.id = tally.ids + record + 1;
+  snprintf( request.name, MAX_LEN, "bench-%d", request.id );
+  request.age = record % 100 + 1;
+}
+
+/**
+ * Check a benchmark request's reply.
+ *
+ * @param[in] tally - How the benchmark is faring.
+ * @param[in] request - The request.
+ * @param[in] reply - Its reply.
+ * @param[in] latency - Milliseconds from first sending it to the reply.
+ */
+void checkReply( tally_t& tally, const record_t& request,
+                 const record_t& reply, double latency )
+{
+  tally.latencies.push_back( latency );
+
+  if ( reply.command == SRV_BUSY )
   {
-    // Send add request
-    sendto( sock.sock, &gram, sizeof( Datagram ), 0,
-                              (struct sockaddr *)&sock.address, sock.addrlen );
-    timedOut = false;
-    start_timer( TIME_OUT, timedOut );
-    unsigned int seqCheck;
-
-    bool finished = false;
-    do
+    tally.busy++;
+  }
+  else if ( request.command == add_t ? reply.command != ADD_SUCCESS
+            : reply.command != RET_SUCCESS || reply.id != request.id
+              || strncmp( reply.name, request.name, MAX_LEN ) != 0 )
+  {
+    tally.wrong++;
+  }
+}
+
+/**
+ * Make the benchmark's requests one at a time.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] count - The number of requests to make.
+ * @param[in] tally - How the benchmark is faring.
+ */
+void stopAndWait( sock_t& sock, int count, tally_t& tally )
+{
+  for ( int i = 0; i < count; i++ )
+  {
+    record_t request;
+    makeRequest( tally, i, 1, request );
+
+    record_t reply;
+    double sent = milliseconds();
+    if ( not exchange( sock, request, reply ) )
+    {
+      tally.failed++;
+      continue;
+    }
+    checkReply( tally, request, reply, milliseconds() - sent );
+  }
+}
+
+/**
+ * Make the benchmark's requests with as many unanswered at once as
+ * congestion control allows, up to a window. A request is sent again
+ * once its timeout passes, or once a request sent well after it has
+ * been answered, as reordering alone would not keep it so long.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] count - The number of requests to make.
+ * @param[in] window - The most requests to have unanswered at once.
+ * @param[in] tally - How the benchmark is faring.
+ */
+void pipeline( sock_t& sock, int count, int window, tally_t& tally )
+{
+  congestion_t& c = sock.congestion;
+  vector<flight_t> flights( MAX_WINDOW );
+  unsigned int oldest = sock.seq;   // Every request before it is done
+  unsigned int acked = sock.seq;    // Every reply before it is ACKed
+  int issued = 0;
+
+  window = window < MAX_WINDOW ? window : MAX_WINDOW;
+
+  while ( issued < count || oldest != sock.seq )
+  {
+    double now = milliseconds();
+    double wake = now + c.rto;
+
+    //
+    // Requests whose timeout passed are presumed lost, once they have
+    // been sent too often given up on. The timeout only backs off once
+    // however many pass together.
+    //
+    int unanswered = 0;
+    bool timedOut = false;
+    for ( unsigned int seq = oldest; seq != sock.seq; seq++ )
+    {
+      flight_t& f = flights[ seq % MAX_WINDOW ];
+      if ( not f.done && not f.lost && now - f.last >= c.rto )
+      {
+        if ( f.sends > MAX_TIME_OUTS )
+        {
+          f.done = true;
+          tally.failed++;
+          continue;
+        }
+        f.lost = true;
+        sock.retransmits++;
+        if ( not timedOut )
+        {
+          congestionLost( c, seq, sock.seq, true );
+          timedOut = true;
+        }
+      }
+      if ( not f.done && not f.lost )
+      {
+        unanswered++;
+        wake = std::min( wake, f.last + c.rto );
+      }
+    }
+    while ( oldest != sock.seq && flights[ oldest % MAX_WINDOW ].done )
     {
-      // Receive ACK
-      recvfrom( sock.sock, (char *)&gram, sizeof(gram),0,
-                      addr, &len );
+      oldest++;
+    }
 
-      seqCheck = gram.seq;
-      if ( seqCheck != sock.seq )
+    //
+    // Lost requests go again before any new one is sent, and both wait
+    // for the pacer
+    //
+    while ( true )
+    {
+      unsigned int seq = oldest;
+      while ( seq != sock.seq && ( flights[ seq % MAX_WINDOW ].done
+                                   || not flights[ seq % MAX_WINDOW ].lost ) )
       {
-        cout << "Incorrect Seq number received." << endl;
+        seq++;
       }
 
-      if ( sock.address.sin_addr.s_addr != address.sin_addr.s_addr
-           || sock.address.sin_port != address.sin_port )
+      bool fresh = seq == sock.seq;
+      if ( fresh && ( issued == count || sock.seq - oldest >= MAX_WINDOW
+                      || unanswered >= window
+                      || not congestionOpen( c, unanswered ) ) )
       {
-        cout << "Packet arrived fom an unexpected source, discarding." << endl;
-        finished = false;
+        break;
       }
-      else
+
+      double pace = congestionPace( c, now );
+      if ( pace > 0 )
+      {
+        wake = std::min( wake, now + pace );
+        break;
+      }
+
+      flight_t& f = flights[ seq % MAX_WINDOW ];
+      if ( fresh )
       {
-        finished = true;
+        makeRequest( tally, issued++, MAX_WINDOW, f.request );
+        f.first = now;
+        f.sends = 0;
+        f.done = false;
+        sock.seq++;
       }
+      f.lost = false;
+      f.last = now;
+      f.sends++;
+      sendRequest( sock, seq, f.request );
+      congestionSent( c );
+      unanswered++;
+    }
 
+    if ( not waitForDatagram( sock.sock, wake - now ) )
+    {
+      continue;
     }
-    while( seqCheck != sock.seq || not finished );
-    stop_timer();
 
-    if ( timedOut )
+    //
+    // Every reply waiting, late and duplicated ones included
+    //
+    do
     {
-            cout << "Retrieve request time out #" << ++timeOuts << endl;
+      Datagram response;
+      struct sockaddr_in address;
+      socklen_t len = sizeof( address );
+      ssize_t received = recvfrom( sock.sock, (char *)&response,
+                                   sizeof( response ), 0,
+                                   (struct sockaddr*)&address, &len );
+      if ( received < (ssize_t)( DATAGRAM_HEADER + sizeof( record_t ) )
+           || response.type != DATA
+           || sock.address.sin_addr.s_addr != address.sin_addr.s_addr
+           || sock.address.sin_port != address.sin_port
+           || seqBefore( response.seq, oldest )
+           || not seqBefore( response.seq, sock.seq ) )
+      {
+        continue;
+      }
 
-            if ( timeOuts > 5 )
-            {
-                    cout << "Retrieve request timed out..." << endl;
-            }
-    } 
+      flight_t& f = flights[ response.seq % MAX_WINDOW ];
+      if ( f.done )
+      {
+        continue;
+      }
+
+      record_t reply;
+      memcpy( &reply, response.data, sizeof( record_t ) );
+      now = milliseconds();
+      f.done = true;
+      checkReply( tally, f.request, reply, now - f.first );
+
+      // Which send was answered is only known for a request sent once
+      congestionAnswered( c, response.seq, sock.seq,
+                          f.sends == 1 ? now - f.last : -1 );
+      if ( f.sends > 1 )
+      {
+        continue;
+      }
+
+      double reorder = c.srtt / 4;
+      for ( unsigned int seq = oldest; seq != sock.seq; seq++ )
+      {
+        flight_t& g = flights[ seq % MAX_WINDOW ];
+        if ( not g.done && not g.lost && g.last < f.last - reorder )
+        {
+          g.lost = true;
+          sock.retransmits++;
+          congestionLost( c, seq, sock.seq, false );
+        }
+      }
+    }
+    while ( waitForDatagram( sock.sock, 0 ) );
+
+    while ( oldest != sock.seq && flights[ oldest % MAX_WINDOW ].done )
+    {
+      oldest++;
+    }
+    if ( oldest - acked >= ACK_EVERY )
+    {
+      acknowledge( sock, oldest - 1 );
+      acked = oldest;
+    }
   }
-  while( timedOut && timeOuts < 5 );
-
-   if ( not timedOut )
-   {
-     retryGet:
-     // Receive success/failure
-     recvfrom( sock.sock, (char *)&gram, sizeof(gram), 0,
-                     addr, &len );
-
-     if ( sock.address.sin_addr.s_addr != address.sin_addr.s_addr
-                      || sock.address.sin_port != address.sin_port )
-     {
-       cout << "Packet arrived fom an unexpected source, discarding." << endl;
-       goto retryGet;
-     }
-
-     memcpy( &resultRec, gram.data, sizeof( record_t ) );
-
-     // Display our results
-     if ( resultRec.command == RET_SUCCESS )
-     {
-       cout << "ID: " << resultRec.id << endl;
-       cout << "Name: " << resultRec.name << endl;
-       cout << "Age: " << resultRec.age << endl;
-     }
-     else
-     {
-       cout << "ID " << findRecord.id << " does not exist" << endl;
-     }
-
-     // Send ACK
-     gram.type = ACK;
-     gram.seq = sock.seq;
-     sendto( sock.sock, (char *)&gram, 8, 0,
-             (struct sockaddr *)&sock.address,
-             sock.addrlen );
-
-     // Update Sequence Number
-     ++(sock.seq);
+
+  if ( oldest != acked )
+  {
+    acknowledge( sock, oldest - 1 );
   }
 }
 
+/**
+ * Add and retrieve records of our own as fast as the server answers,
+ * checking every answer, then report how many requests got through,
+ * how many times they were sent again and how long they took.
+ *
+ * @param[in] sock - The socket's file descriptor
+ * @param[in] count - The number of requests to make.
+ * @param[in] window - The most requests to have unanswered at once.
+ */
+void benchmark( sock_t& sock, int count, int window )
+{
+  sock.quiet = true;
+
+  tally_t tally;
+  tally.latencies.reserve( count );
+  tally.failed = tally.busy = tally.wrong = 0;
+
+  // Ids of our own, so runs against the same server never collide
+  tally.ids = ( getpid() % 20000 ) * 100000;
 
+  double began = milliseconds();
+  if ( window > 1 )
+  {
+    pipeline( sock, count, window, tally );
+  }
+  else
+  {
+    stopAndWait( sock, count, tally );
+  }
+  double elapsed = ( milliseconds() - began ) / 1000.0;
+
+  vector<double>& latencies = tally.latencies;
+  std::sort( latencies.begin(), latencies.end() );
+  size_t answered = latencies.size();
+
+  cout << "requests " << count << " answered " << answered
+       << " failed " << tally.failed << " busy " << tally.busy
+       << " wrong " << tally.wrong << endl;
+  cout << "retransmits " << sock.retransmits << " per_request "
+       << (double)sock.retransmits / count << endl;
+  cout << "goodput " << answered / elapsed << " requests/s "
+       << answered * 2 * sizeof( record_t ) / elapsed / 1024
+       << " KB/s over " << elapsed << "s" << endl;
+  if ( answered > 0 )
+  {
+    cout << "latency_ms p50 " << latencies[ answered / 2 ]
+         << " p90 " << latencies[ answered * 9 / 10 ]
+         << " p99 " << latencies[ answered * 99 / 100 ]
+         << " max " << latencies[ answered - 1 ] << endl;
+  }
+
+  const congestion_t& c = sock.congestion;
+  cout << "window " << c.window << " srtt_ms " << c.srtt
+       << " min_rtt_ms " << c.minRtt << " rto_ms " << c.rto
+       << " losses " << c.losses << " timeouts " << c.timeouts
+       << " halvings " << c.halvings << endl;
+}
 /**
  * Client main function
  *
@@ -408,16 +870,39 @@ void retriveRecord( sock_t& sock )
  */
 int main( int argc, char** argv )
 {
+  int timeout = TIME_OUT * 1000;
+  int count = 0;
+  int window = 1;
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "t:b:w:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 't':
+        timeout = atoi( optarg );
+        break;
+      case 'b':
+        count = atoi( optarg );
+        break;
+      case 'w':
+        window = atoi( optarg );
+        break;
+      default:
+        usage( argv[0] );
+        return EXIT_FAILURE;
+    }
+  }
 
-  if ( argc != 3 )
+  if ( argc - optind != 2 || timeout < 1 || count < 0 || window < 1 )
   {     
     usage( argv[0] );
     return EXIT_FAILURE;
   }
   else
   {
-    char* hostname = argv[HOSTNAME];
-    int port = atoi( argv[PORTNUM] );
+    char* hostname = argv[ optind + HOSTNAME - 1 ];
+    int port = atoi( argv[ optind + PORTNUM - 1 ] );
 
     // Validate the given port number
     if ( port < PORT_MIN or port > PORT_MAX )
@@ -426,7 +911,16 @@ int main( int argc, char** argv )
       exit( EXIT_FAILURE );
     }
     
-    sock_t sock = setupSocket( hostname, port );
+    // Only one request at a time may leave its reply to the next
+    bool pipelined = count > 0 && window > 1;
+    sock_t sock = setupSocket( hostname, port, timeout, not pipelined );
+
+    if ( count > 0 )
+    {
+      benchmark( sock, count, window );
+      finish( sock );
+      return EXIT_SUCCESS;
+    }
 
     while ( true )      
     {
@@ -435,6 +929,7 @@ int main( int argc, char** argv )
            << " for Retrive, " << quit_t << " to quit):"; 
 
       int cmd = 100; 
+      awaitInput( sock );
       scanf( "%d", &cmd );
       
       if ( cmd == add_t )
@@ -447,12 +942,7 @@ int main( int argc, char** argv )
       }
       else if ( cmd == quit_t )
       {
-        Datagram gram;
-        bzero( &gram, sizeof( Datagram ) );
-        gram.type = FIN;
-        gram.seq = sock.seq;
-        sendto( sock.sock, (char *)&gram, 8, 0, (struct sockaddr *)&sock.address, sock.addrlen );
-        close( sock.sock );
+        finish( sock );
         break;
       }
       else